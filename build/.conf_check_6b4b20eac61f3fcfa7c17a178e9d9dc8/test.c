@@ -0,0 +1,5 @@
+#include <linux/io_uring.h>
+
+int main() {
+	return 0;
+}
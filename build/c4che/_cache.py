@@ -0,0 +1,51 @@
+AR = '/usr/bin/ar'
+ARFLAGS = 'rcs'
+BINDIR = '/usr/local/bin'
+CC = ['/usr/bin/gcc']
+CCLNK_SRC_F = []
+CCLNK_TGT_F = ['-o']
+CC_NAME = 'gcc'
+CC_SRC_F = []
+CC_TGT_F = ['-c', '-o']
+CC_VERSION = ('12', '2', '0')
+CFLAGS = ['-I/root/miniconda/include', '-Wno-implicit-fallthrough', '-std=gnu99', '-Wall', '-Wextra', '-Werror', '-Wno-unused-parameter', '-Wno-strict-aliasing', '-O0', '-g']
+CFLAGS_MACBUNDLE = ['-fPIC']
+CFLAGS_cshlib = ['-fPIC']
+COMPILER_CC = 'gcc'
+CPPPATH_ST = '-I%s'
+DEFINES = ['HAVE_IO_URING=1']
+DEFINES_ST = '-D%s'
+DEST_BINFMT = 'elf'
+DEST_CPU = 'x86_64'
+DEST_OS = 'linux'
+HAVE_IO_URING = 1
+LIBDIR = '/usr/local/lib'
+LIBPATH_ST = '-L%s'
+LIB_CRYPTO = ['crypto']
+LIB_DL = ['dl']
+LIB_EV = ['ev']
+LIB_EXPAT = ['expat']
+LIB_M = ['m']
+LIB_PTHREAD = ['pthread']
+LIB_SSL = ['ssl']
+LIB_ST = '-l%s'
+LIB_UUID = ['uuid']
+LINKFLAGS = ['-L/root/miniconda/lib', '-Wl,-rpath,/root/miniconda/lib']
+LINKFLAGS_DYNAMIC = ['-export-dynamic']
+LINKFLAGS_MACBUNDLE = ['-bundle', '-undefined', 'dynamic_lookup']
+LINKFLAGS_cshlib = ['-shared']
+LINKFLAGS_cstlib = ['-Wl,-Bstatic']
+LINK_CC = ['/usr/bin/gcc']
+PREFIX = '/usr/local'
+RPATH_ST = '-Wl,-rpath,%s'
+SHLIB_MARKER = '-Wl,-Bdynamic'
+SONAME_ST = '-Wl,-h,%s'
+STLIBPATH_ST = '-L%s'
+STLIB_MARKER = '-Wl,-Bstatic'
+STLIB_ST = '-l%s'
+cprogram_PATTERN = '%s'
+cshlib_PATTERN = 'lib%s.so'
+cstlib_PATTERN = 'lib%s.a'
+define_key = ['HAVE_IO_URING']
+macbundle_PATTERN = '%s.bundle'
+muc_module = None
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file arena.c
+ * A bump allocator for memory that is all freed at once.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#include "arena.h"
+
+/** Allocations are rounded up to this, enough for pointers and longs. */
+#define ARENA_ALIGN (sizeof(void*) > sizeof(long) ? sizeof(void*) : sizeof(long))
+
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct block {
+    /** The next oldest block. */
+    struct block *next;
+
+    /** Number of bytes in data. */
+    size_t size;
+
+    /** Number of bytes of data handed out. */
+    size_t used;
+
+    /** The memory handed out. */
+    char data[];
+};
+
+struct arena {
+    /** Blocks in the arena, newest (the one being allocated from) first. */
+    struct block *blocks;
+
+    /** Size of a normal block. */
+    size_t block_size;
+
+    /** The last allocation, which can grow in place. */
+    char *last;
+};
+
+static struct block* block_new(struct arena *arena, size_t size);
+
+struct arena* arena_new(size_t block_size) {
+    struct arena *arena = calloc(1, sizeof(*arena));
+    check_mem(arena);
+    arena->block_size = block_size;
+    return arena;
+}
+
+void arena_del(struct arena *arena) {
+    arena_release(arena);
+    free(arena);
+}
+
+void* arena_alloc(struct arena *arena, size_t size) {
+    size = ALIGN_UP(size);
+    struct block *block = arena->blocks;
+    if (block == NULL || block->size - block->used < size) {
+        block = block_new(arena, size);
+    }
+    arena->last = block->data + block->used;
+    block->used += size;
+    return arena->last;
+}
+
+void* arena_calloc(struct arena *arena, size_t size) {
+    void *ptr = arena_alloc(arena, size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+char* arena_strndup(struct arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void* arena_grow(struct arena *arena, void *ptr, size_t old_size,
+                 size_t new_size) {
+    struct block *block = arena->blocks;
+    if (ptr != NULL && ptr == arena->last) {
+        size_t start = arena->last - block->data;
+        if (block->size - start >= ALIGN_UP(new_size)) {
+            block->used = start + ALIGN_UP(new_size);
+            return ptr;
+        }
+    }
+
+    void *new_ptr = arena_alloc(arena, new_size);
+    if (ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return new_ptr;
+}
+
+void arena_reset(struct arena *arena) {
+    if (arena->blocks == NULL) {
+        return;
+    }
+
+    /* Keep the oldest block, it is the only one sized for normal use (the
+     * rest may be oversized ones for big allocations). */
+    struct block *block = arena->blocks;
+    while (block->next != NULL) {
+        struct block *next = block->next;
+        free(block);
+        block = next;
+    }
+    block->used = 0;
+    arena->blocks = block;
+    arena->last = NULL;
+}
+
+void arena_release(struct arena *arena) {
+    struct block *block = arena->blocks;
+    while (block != NULL) {
+        struct block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->last = NULL;
+}
+
+/** Adds a new block to the arena, with room for at least size bytes. */
+static struct block* block_new(struct arena *arena, size_t size) {
+    if (size < arena->block_size) {
+        size = arena->block_size;
+    }
+    struct block *block = malloc(sizeof(*block) + size);
+    check_mem(block);
+    block->size = size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return block;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file arena.h
+ * A bump allocator for memory that is all freed at once.
+ *
+ * Allocating is just moving a pointer through a block, and nothing is freed
+ * on its own: arena_reset() makes the whole arena available again in one
+ * step, keeping its first block so the next round doesn't touch malloc at
+ * all.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* Forward declarations. */
+struct arena;
+
+/** Creates an empty arena, that allocates blocks of block_size bytes. */
+struct arena* arena_new(size_t block_size);
+
+/** Frees an arena and everything allocated from it. */
+void arena_del(struct arena *arena);
+
+/** Allocates size bytes (uninitialized, aligned for any pointer or long). */
+void* arena_alloc(struct arena *arena, size_t size);
+
+/** Allocates size zeroed bytes. */
+void* arena_calloc(struct arena *arena, size_t size);
+
+/** Copies len bytes of a string into the arena, adding a null terminator. */
+char* arena_strndup(struct arena *arena, const char *str, size_t len);
+
+/**
+ * Makes an allocation bigger.
+ *
+ * If ptr was the last thing allocated and there is room after it, it just
+ * grows in place, otherwise the contents are copied somewhere new.
+ *
+ * @param ptr      An allocation from this arena (or NULL).
+ * @param old_size Its current size.
+ * @param new_size The size it should be.
+ */
+void* arena_grow(struct arena *arena, void *ptr, size_t old_size,
+                 size_t new_size);
+
+/** Frees everything allocated from the arena, keeping one block around. */
+void arena_reset(struct arena *arena);
+
+/** Frees everything allocated from the arena, and all of its blocks. */
+void arena_release(struct arena *arena);
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file atom.c
+ * Interned strings for the XMPP vocabulary.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "atom.h"
+
+/** Slots in the hash table, a power of two well over ATOM_COUNT. */
+#define TABLE_SIZE 256
+
+/* Atoms are stored in the table as bytes, and it must stay sparse. */
+typedef char atom_table_fits[ATOM_COUNT * 2 <= TABLE_SIZE ? 1 : -1];
+
+/** All the strings back to back, so atom_owns() is a range check. */
+static const char pool[] =
+#define X(id, str) str "\0"
+    ATOM_LIST(X)
+#undef X
+    ;
+
+/** Where each atom's string starts in the pool. */
+static const char *strs[ATOM_COUNT];
+static size_t lens[ATOM_COUNT];
+
+/** Open addressed hash table of atoms, ATOM_NONE marks an empty slot. */
+static uint8_t table[TABLE_SIZE];
+
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void table_init(void);
+static uint32_t hash(const char *str, size_t len);
+
+enum atom atom_find(const char *str, size_t len) {
+    pthread_once(&table_once, table_init);
+
+    uint32_t slot = hash(str, len) & (TABLE_SIZE - 1);
+    while (table[slot] != ATOM_NONE) {
+        enum atom atom = table[slot];
+        if (lens[atom] == len && memcmp(strs[atom], str, len) == 0) {
+            return atom;
+        }
+        slot = (slot + 1) & (TABLE_SIZE - 1);
+    }
+    return ATOM_NONE;
+}
+
+enum atom atom_lookup(const char *str) {
+    return atom_find(str, strlen(str));
+}
+
+const char* atom_str(enum atom atom) {
+    pthread_once(&table_once, table_init);
+    return strs[atom];
+}
+
+size_t atom_len(enum atom atom) {
+    pthread_once(&table_once, table_init);
+    return lens[atom];
+}
+
+bool atom_owns(const char *str) {
+    return str >= pool && str < pool + sizeof(pool);
+}
+
+/** Splits up the pool and fills in the hash table, once per process. */
+static void table_init(void) {
+    const char *str = pool;
+    for (int atom = ATOM_NONE + 1; atom < ATOM_COUNT; atom++) {
+        strs[atom] = str;
+        lens[atom] = strlen(str);
+        str += lens[atom] + 1;
+
+        uint32_t slot = hash(strs[atom], lens[atom]) & (TABLE_SIZE - 1);
+        while (table[slot] != ATOM_NONE) {
+            slot = (slot + 1) & (TABLE_SIZE - 1);
+        }
+        table[slot] = atom;
+    }
+}
+
+/** FNV-1a, names are short enough that anything fancier doesn't pay. */
+static uint32_t hash(const char *str, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file atom.h
+ * Interned strings for the XMPP vocabulary.
+ *
+ * Element names, namespace URIs and attribute names that XMPP uses all the
+ * time are kept once, in a fixed table, and given a small integer.  Stanzas
+ * built by the parser point at the table's copy and carry the integer, so
+ * checking what a stanza is becomes an integer comparison.
+ *
+ * The table is fixed when the server is built.  Anything not in it is
+ * ATOM_NONE and keeps a string of its own, so a client sending made up names
+ * can't make the table grow.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Every interned string: the atom's name, and the string itself. */
+#define ATOM_LIST(X) \
+    /* Namespaces. */ \
+    X(NS_CLIENT,        "jabber:client") \
+    X(NS_SERVER,        "jabber:server") \
+    X(NS_STREAM,        "http://etherx.jabber.org/streams") \
+    X(NS_STREAMS,       "urn:ietf:params:xml:ns:xmpp-streams") \
+    X(NS_STANZAS,       "urn:ietf:params:xml:ns:xmpp-stanzas") \
+    X(NS_TLS,           "urn:ietf:params:xml:ns:xmpp-tls") \
+    X(NS_SASL,          "urn:ietf:params:xml:ns:xmpp-sasl") \
+    X(NS_BIND,          "urn:ietf:params:xml:ns:xmpp-bind") \
+    X(NS_SESSION,       "urn:ietf:params:xml:ns:xmpp-session") \
+    X(NS_DISCO_ITEMS,   "http://jabber.org/protocol/disco#items") \
+    X(NS_DISCO_INFO,    "http://jabber.org/protocol/disco#info") \
+    X(NS_MUC,           "http://jabber.org/protocol/muc") \
+    X(NS_MUC_USER,      "http://jabber.org/protocol/muc#user") \
+    X(NS_ROSTER,        "jabber:iq:roster") \
+    X(NS_PING,          "urn:xmpp:ping") \
+    X(NS_DELAY,         "urn:xmpp:delay") \
+    X(NS_VCARD_TEMP,    "vcard-temp") \
+    X(NS_XML,           "http://www.w3.org/XML/1998/namespace") \
+    /* Element names. */ \
+    X(STREAM,           "stream") \
+    X(FEATURES,         "features") \
+    X(MESSAGE,          "message") \
+    X(PRESENCE,         "presence") \
+    X(IQ,               "iq") \
+    X(BODY,             "body") \
+    X(SUBJECT,          "subject") \
+    X(THREAD,           "thread") \
+    X(SHOW,             "show") \
+    X(STATUS,           "status") \
+    X(PRIORITY,         "priority") \
+    X(ERROR,            "error") \
+    X(TEXT,             "text") \
+    X(STARTTLS,         "starttls") \
+    X(PROCEED,          "proceed") \
+    X(AUTH,             "auth") \
+    X(SUCCESS,          "success") \
+    X(FAILURE,          "failure") \
+    X(BIND,             "bind") \
+    X(RESOURCE,         "resource") \
+    X(SESSION,          "session") \
+    X(QUERY,            "query") \
+    X(ITEM,             "item") \
+    X(IDENTITY,         "identity") \
+    X(FEATURE,          "feature") \
+    X(PING,             "ping") \
+    X(VCARD,            "vCard") \
+    X(DELAY,            "delay") \
+    X(X,                "x") \
+    /* Attribute names. */ \
+    X(TO,               "to") \
+    X(FROM,             "from") \
+    X(ID,               "id") \
+    X(TYPE,             "type") \
+    X(LANG,             "lang") \
+    X(VERSION,          "version") \
+    X(MECHANISM,        "mechanism") \
+    X(JID,              "jid") \
+    X(NAME,             "name") \
+    X(NODE,             "node") \
+    X(VAR,              "var") \
+    X(CATEGORY,         "category") \
+    X(CODE,             "code") \
+    X(NICK,             "nick") \
+    X(AFFILIATION,      "affiliation") \
+    X(ROLE,             "role") \
+    X(STAMP,            "stamp")
+
+/** The interned strings, ATOM_NONE for anything else. */
+enum atom {
+    ATOM_NONE = 0,
+#define X(id, str) ATOM_ ## id,
+    ATOM_LIST(X)
+#undef X
+    ATOM_COUNT
+};
+
+/**
+ * Looks up a string in the table.
+ *
+ * @param str The string, which doesn't need to be null-terminated.
+ * @param len The length of str.
+ * @returns The string's atom, or ATOM_NONE if it isn't interned.
+ */
+enum atom atom_find(const char *str, size_t len);
+
+/** Looks up a null-terminated string. */
+enum atom atom_lookup(const char *str);
+
+/** Returns the table's copy of an atom's string (NULL for ATOM_NONE). */
+const char* atom_str(enum atom atom);
+
+/** Returns the length of an atom's string (0 for ATOM_NONE). */
+size_t atom_len(enum atom atom);
+
+/**
+ * Returns whether a string is the table's own copy of an atom.
+ *
+ * Those must never be freed or written to.
+ */
+bool atom_owns(const char *str);
@@ -27,10 +27,16 @@
  * Abstracts basic socket interactions.
  */
 
+/* For IOV_MAX. */
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <openssl/ssl.h>
@@ -62,16 +68,30 @@ static void fd_close(struct client_socket *socket);
 static int fd_fd(struct client_socket *socket);
 static ssize_t fd_send(struct client_socket *socket, const void *buf,
                        size_t len);
+static ssize_t fd_sendv(struct client_socket *socket, const struct iovec *iov,
+                        int iovcnt);
 static ssize_t fd_recv(struct client_socket *socket, void *buf, size_t len);
 static char* fd_str(struct client_socket *socket);
+static enum client_socket_handshake_status fd_handshake(
+        struct client_socket *socket);
+static bool fd_handshaking(struct client_socket *socket);
+static bool fd_resumed(struct client_socket *socket);
+static void fd_release(struct client_socket *socket);
 
 static void ssl_del(struct client_socket *socket);
 static void ssl_close(struct client_socket *socket);
 static int ssl_fd(struct client_socket *socket);
 static ssize_t ssl_send(struct client_socket *socket, const void *buf,
                         size_t len);
+static ssize_t ssl_sendv(struct client_socket *socket, const struct iovec *iov,
+                         int iovcnt);
 static ssize_t ssl_recv(struct client_socket *socket, void *buf, size_t len);
 static char* ssl_str(struct client_socket *socket);
+static enum client_socket_handshake_status ssl_handshake(
+        struct client_socket *socket);
+static bool ssl_handshaking(struct client_socket *socket);
+static bool ssl_resumed(struct client_socket *socket);
+static void ssl_release(struct client_socket *socket);
 
 struct client_socket* client_socket_new(int fd, struct sockaddr_in addr) {
     struct client_socket *socket = calloc(1, sizeof(*socket));
@@ -87,8 +107,13 @@ struct client_socket* client_socket_new(int fd, struct sockaddr_in addr) {
     socket->close_func = fd_close;
     socket->fd_func = fd_fd;
     socket->send_func = fd_send;
+    socket->sendv_func = fd_sendv;
     socket->recv_func = fd_recv;
     socket->str_func = fd_str;
+    socket->handshake_func = fd_handshake;
+    socket->handshaking_func = fd_handshaking;
+    socket->resumed_func = fd_resumed;
+    socket->release_func = fd_release;
 
     return socket;
 }
@@ -104,25 +129,28 @@ struct client_socket* client_socket_ssl_new(struct client_socket *socket,
     check(self->ssl != NULL, "Cannot create new SSL structure.");
     check(SSL_set_fd(self->ssl, self->fd_socket->fd) != 0,
           "Unable to attach original socket to SSL structure.");
-    /* TODO: This should be done elsewhere, since it could block for awhile. */
-    check(SSL_accept(self->ssl) == 1, "SSL_accept failed.");
+    /* The handshake itself happens later, in client_socket_handshake(). */
+    SSL_set_accept_state(self->ssl);
 
     socket->self = self;
     socket->del_func = ssl_del;
     socket->close_func = ssl_close;
     socket->fd_func = ssl_fd;
     socket->send_func = ssl_send;
+    socket->sendv_func = ssl_sendv;
     socket->recv_func = ssl_recv;
     socket->str_func = ssl_str;
+    socket->handshake_func = ssl_handshake;
+    socket->handshaking_func = ssl_handshaking;
+    socket->resumed_func = ssl_resumed;
+    socket->release_func = ssl_release;
 
     return socket;
 
 error:
     ERR_print_errors_fp(stderr);
     SSL_free(self->ssl);
-    free(self->fd_socket);
     free(self);
-    free(socket);
     return NULL;
 }
 
@@ -144,29 +172,35 @@ ssize_t client_socket_send(struct client_socket *socket, const void *buf,
     return socket->send_func(socket, buf, len);
 }
 
+ssize_t client_socket_sendv(struct client_socket *socket,
+                            const struct iovec *iov, int iovcnt) {
+    return socket->sendv_func(socket, iov, iovcnt);
+}
+
 ssize_t client_socket_recv(struct client_socket *socket, void *buf,
                            size_t len) {
     return socket->recv_func(socket, buf, len);
 }
 
-ssize_t client_socket_sendall(struct client_socket *socket, const void *buf,
-                              size_t len) {
-    /* Keep track of how much we've sent so far. */
-    size_t numsent = 0;
-    do {
-        ssize_t newsent = client_socket_send(socket, buf + numsent,
-                                             len - numsent);
-        check(newsent != -1, "Error sending data");
-        numsent += newsent;
-    } while (numsent < len);
+char* client_socket_addr_str(struct client_socket *socket) {
+    return socket->str_func(socket);
+}
+
+enum client_socket_handshake_status client_socket_handshake(
+        struct client_socket *socket) {
+    return socket->handshake_func(socket);
+}
 
-    return numsent;
-error:
-    return -1;
+bool client_socket_handshaking(struct client_socket *socket) {
+    return socket->handshaking_func(socket);
 }
 
-char* client_socket_addr_str(struct client_socket *socket) {
-    return socket->str_func(socket);
+bool client_socket_resumed(struct client_socket *socket) {
+    return socket->resumed_func(socket);
+}
+
+void client_socket_release(struct client_socket *socket) {
+    socket->release_func(socket);
 }
 
 static void fd_del(struct client_socket *socket) {
@@ -191,7 +225,21 @@ static int fd_fd(struct client_socket *socket) {
 static ssize_t fd_send(struct client_socket *socket, const void *buf,
                        size_t len) {
     struct fd_socket *self = (struct fd_socket*)socket->self;
-    return send(self->fd, buf, len, 0);
+    /* A client that went away is reported as EPIPE, not a signal. */
+    return send(self->fd, buf, len, MSG_NOSIGNAL);
+}
+
+static ssize_t fd_sendv(struct client_socket *socket, const struct iovec *iov,
+                        int iovcnt) {
+    struct fd_socket *self = (struct fd_socket*)socket->self;
+    /* Longer lists are rejected by the kernel, the caller sees a short write
+     * and sends the rest later. */
+    struct msghdr msg = {
+        .msg_iov = (struct iovec*)iov,
+        .msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX,
+    };
+    /* sendmsg rather than writev, only the former takes MSG_NOSIGNAL. */
+    return sendmsg(self->fd, &msg, MSG_NOSIGNAL);
 }
 
 static ssize_t fd_recv(struct client_socket *socket, void *buf, size_t len) {
@@ -208,6 +256,22 @@ static char* fd_str(struct client_socket *socket) {
     return utstring_body(&s);
 }
 
+static enum client_socket_handshake_status fd_handshake(
+        struct client_socket *socket) {
+    return CLIENT_SOCKET_HANDSHAKE_DONE;
+}
+
+static bool fd_handshaking(struct client_socket *socket) {
+    return false;
+}
+
+static bool fd_resumed(struct client_socket *socket) {
+    return false;
+}
+
+static void fd_release(struct client_socket *socket) {
+}
+
 static void ssl_del(struct client_socket *socket) {
     struct ssl_socket *self = (struct ssl_socket*)socket->self;
     SSL_free(self->ssl);
@@ -244,15 +308,54 @@ static int ssl_fd(struct client_socket *socket) {
     return self->fd_socket->fd;
 }
 
+/**
+ * Maps the result of an SSL_read/SSL_write to what send/recv would return.
+ *
+ * In particular, when OpenSSL needs the socket to become readable or writable
+ * before it can continue, -1 is returned with errno set to EAGAIN.
+ */
+static ssize_t ssl_result(struct ssl_socket *self, int rv) {
+    if (rv > 0) {
+        return rv;
+    }
+    switch (SSL_get_error(self->ssl, rv)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            return -1;
+        default:
+            ERR_print_errors_fp(stderr);
+            errno = EIO;
+            return -1;
+    }
+}
+
 static ssize_t ssl_send(struct client_socket *socket, const void *buf,
                         size_t len) {
     struct ssl_socket *self = (struct ssl_socket*)socket->self;
-    return SSL_write(self->ssl, buf, len);
+    return ssl_result(self, SSL_write(self->ssl, buf, len));
+}
+
+static ssize_t ssl_sendv(struct client_socket *socket, const struct iovec *iov,
+                         int iovcnt) {
+    /* OpenSSL has no gather write, and encrypting copies the data anyway. */
+    UT_string buf;
+    utstring_init(&buf);
+    for (int i = 0; i < iovcnt; i++) {
+        utstring_bincpy(&buf, iov[i].iov_base, iov[i].iov_len);
+    }
+    ssize_t rv = ssl_send(socket, utstring_body(&buf), utstring_len(&buf));
+    utstring_done(&buf);
+    return rv;
 }
 
 static ssize_t ssl_recv(struct client_socket *socket, void *buf, size_t len) {
     struct ssl_socket *self = (struct ssl_socket*)socket->self;
-    return SSL_read(self->ssl, buf, len);
+    return ssl_result(self, SSL_read(self->ssl, buf, len));
 }
 
 static char* ssl_str(struct client_socket *socket) {
@@ -262,3 +365,43 @@ static char* ssl_str(struct client_socket *socket) {
     socket->self = self;
     return addrstr;
 }
+
+static enum client_socket_handshake_status ssl_handshake(
+        struct client_socket *socket) {
+    struct ssl_socket *self = (struct ssl_socket*)socket->self;
+
+    int rv = SSL_do_handshake(self->ssl);
+    if (rv == 1) {
+        return CLIENT_SOCKET_HANDSHAKE_DONE;
+    }
+
+    switch (SSL_get_error(self->ssl, rv)) {
+        case SSL_ERROR_WANT_READ:
+            return CLIENT_SOCKET_HANDSHAKE_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return CLIENT_SOCKET_HANDSHAKE_WANT_WRITE;
+        default:
+            ERR_print_errors_fp(stderr);
+            return CLIENT_SOCKET_HANDSHAKE_ERROR;
+    }
+}
+
+static bool ssl_handshaking(struct client_socket *socket) {
+    struct ssl_socket *self = (struct ssl_socket*)socket->self;
+    return !SSL_is_init_finished(self->ssl);
+}
+
+static bool ssl_resumed(struct client_socket *socket) {
+    struct ssl_socket *self = (struct ssl_socket*)socket->self;
+    return SSL_session_reused(self->ssl) == 1;
+}
+
+static void ssl_release(struct client_socket *socket) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    /* The record buffers are the bulk of an idle connection's memory.  This
+     * does nothing if they still hold data, and OpenSSL allocates them again
+     * on the next read or write. */
+    struct ssl_socket *self = (struct ssl_socket*)socket->self;
+    SSL_free_buffers(self->ssl);
+#endif
+}
@@ -35,23 +35,52 @@
 #include <openssl/ssl.h>
 
 struct client_socket;
+struct iovec;
+
+/** Progress of a (non-blocking) handshake on a client socket. */
+enum client_socket_handshake_status {
+    /** The handshake is complete, application data can flow. */
+    CLIENT_SOCKET_HANDSHAKE_DONE,
+
+    /** Call again once the socket is readable. */
+    CLIENT_SOCKET_HANDSHAKE_WANT_READ,
+
+    /** Call again once the socket is writable. */
+    CLIENT_SOCKET_HANDSHAKE_WANT_WRITE,
+
+    /** The handshake failed, the connection should be dropped. */
+    CLIENT_SOCKET_HANDSHAKE_ERROR,
+};
 
 typedef void (*client_socket_del_func)(struct client_socket *socket);
 typedef void (*client_socket_close_func)(struct client_socket *socket);
 typedef int (*client_socket_fd_func)(struct client_socket *socket);
 typedef ssize_t (*client_socket_send_func)(struct client_socket *socket,
                                            const void *buffer, size_t length);
+typedef ssize_t (*client_socket_sendv_func)(struct client_socket *socket,
+                                            const struct iovec *iov,
+                                            int iovcnt);
 typedef ssize_t (*client_socket_recv_func)(struct client_socket *socket,
                                            void *buffer, size_t length);
 typedef char* (*client_socket_str_func)(struct client_socket *socket);
+typedef enum client_socket_handshake_status (*client_socket_handshake_func)(
+        struct client_socket *socket);
+typedef bool (*client_socket_handshaking_func)(struct client_socket *socket);
+typedef bool (*client_socket_resumed_func)(struct client_socket *socket);
+typedef void (*client_socket_release_func)(struct client_socket *socket);
 
 struct client_socket {
     client_socket_del_func del_func;
     client_socket_close_func close_func;
     client_socket_fd_func fd_func;
     client_socket_send_func send_func;
+    client_socket_sendv_func sendv_func;
     client_socket_recv_func recv_func;
     client_socket_str_func str_func;
+    client_socket_handshake_func handshake_func;
+    client_socket_handshaking_func handshaking_func;
+    client_socket_resumed_func resumed_func;
+    client_socket_release_func release_func;
 
     void *self;
 };
@@ -70,11 +99,14 @@ struct client_socket* client_socket_new(int fd, struct sockaddr_in addr);
 /**
  * Creates a SSL client socket from an existing normal client socket.
  *
- * The original socket is modified to support SSL.
+ * The original socket is modified to support SSL.  No handshake is done here,
+ * the caller drives it with client_socket_handshake() as the socket becomes
+ * readable/writable.
  *
  * @param socket The socket to convert to SSL.
  * @param ssl_context The OpenSSL context.
- * @returns A pointer to the same input socket, which has been modified.
+ * @returns A pointer to the same input socket, which has been modified, or
+ *          NULL on error (the socket is left unmodified).
  */
 struct client_socket* client_socket_ssl_new(struct client_socket *socket,
                                             SSL_CTX *ssl_context);
@@ -98,6 +130,21 @@ int client_socket_fd(struct client_socket *socket);
 ssize_t client_socket_send(struct client_socket *socket, const void *buf,
                            size_t len);
 
+/**
+ * Send a list of buffers to a client_socket, as with writev.
+ *
+ * Plain sockets hand the whole list to the kernel in one call, TLS sockets
+ * join it up first (so it still becomes as few records as possible).  Like
+ * send, this may write less than everything.
+ *
+ * @param socket The client socket to send data to.
+ * @param iov    The buffers to send.
+ * @param iovcnt The number of buffers in iov.
+ * @return The number of bytes written, <= 0 on error.
+ */
+ssize_t client_socket_sendv(struct client_socket *socket,
+                            const struct iovec *iov, int iovcnt);
+
 /**
  * Receive some data from a client_socket.
  *
@@ -110,18 +157,26 @@ ssize_t client_socket_recv(struct client_socket *socket, void *buf,
                            size_t len);
 
 /**
- * Send all data in a buffer to the connected socket.
+ * Make progress on the socket's handshake, without blocking.
  *
- * This will keep trying until all data is sent.  This should later be
- * rewritten to add a write callback using a non-blocking socket.
+ * Plain sockets have no handshake, and are always done.
+ */
+enum client_socket_handshake_status client_socket_handshake(
+        struct client_socket *socket);
+
+/** Returns true if the socket's handshake has not completed yet. */
+bool client_socket_handshaking(struct client_socket *socket);
+
+/** Returns true if the handshake resumed a previous (TLS) session. */
+bool client_socket_resumed(struct client_socket *socket);
+
+/**
+ * Frees any buffers the socket only needs while data is moving.
  *
- * @param fd     File descriptor to send to.
- * @param buffer Buffer to read data from.
- * @param len    Length of the buffer to send.
- * @return Number of bytes sent, or -1 on error.
+ * For idle connections.  The buffers are set up again when they are next
+ * needed.
  */
-ssize_t client_socket_sendall(struct client_socket *socket, const void *buf,
-                              size_t len);
+void client_socket_release(struct client_socket *socket);
 
 /**
  * Returns a string version of the address of this client.
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file expat_pool.c
+ * Recycles Expat parsers, and gives them memory from size-classed pools.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "expat_pool.h"
+
+/** The smallest size class is 2^CLASS_SHIFT bytes. */
+#define CLASS_SHIFT 4
+
+/** Number of size classes, 16 bytes to 16KiB, anything bigger is malloc'd. */
+#define NUM_CLASSES 11
+
+/** Most bytes a thread keeps on its free lists, the rest goes to free(). */
+#define MAX_CACHED_BYTES (512 * 1024)
+
+/** Most parsers a thread keeps in its pool. */
+#define MAX_POOLED 32
+
+/** Sits in front of each block handed to Expat. */
+struct block {
+    /** Bytes usable after this header. */
+    size_t size;
+
+    /** Size class, or NUM_CLASSES for blocks too big for one. */
+    size_t cls;
+};
+
+/** The calling thread's pool. */
+struct pool {
+    /** Free blocks of each class, linked through their first bytes. */
+    void *free[NUM_CLASSES];
+
+    /** Bytes on the free lists. */
+    size_t cached;
+
+    /** Parsers ready to go. */
+    XML_Parser parsers[MAX_POOLED];
+    int num_parsers;
+};
+
+static __thread struct pool pool;
+
+/** Process wide counters, only ever touched atomically. */
+static struct expat_pool_stats totals;
+
+static void* pool_malloc(size_t size);
+static void* pool_realloc(void *ptr, size_t size);
+static void pool_free(void *ptr);
+static size_t size_class(size_t size);
+
+static const XML_Memory_Handling_Suite SUITE = {
+    pool_malloc,
+    pool_realloc,
+    pool_free,
+};
+
+XML_Parser expat_pool_get(XML_Char separator) {
+    if (pool.num_parsers > 0) {
+        __atomic_add_fetch(&totals.parsers_reused, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&totals.parsers_pooled, 1, __ATOMIC_RELAXED);
+        return pool.parsers[--pool.num_parsers];
+    }
+
+    XML_Parser parser = XML_ParserCreate_MM(NULL, &SUITE, &separator);
+    if (parser != NULL) {
+        __atomic_add_fetch(&totals.parsers_created, 1, __ATOMIC_RELAXED);
+    }
+    return parser;
+}
+
+void expat_pool_put(XML_Parser parser) {
+    if (pool.num_parsers < MAX_POOLED
+            && XML_ParserReset(parser, NULL) == XML_TRUE) {
+        pool.parsers[pool.num_parsers++] = parser;
+        __atomic_add_fetch(&totals.parsers_pooled, 1, __ATOMIC_RELAXED);
+    } else {
+        XML_ParserFree(parser);
+    }
+}
+
+void expat_pool_trim(void) {
+    while (pool.num_parsers > 0) {
+        XML_ParserFree(pool.parsers[--pool.num_parsers]);
+        __atomic_sub_fetch(&totals.parsers_pooled, 1, __ATOMIC_RELAXED);
+    }
+
+    for (int cls = 0; cls < NUM_CLASSES; cls++) {
+        while (pool.free[cls] != NULL) {
+            void *ptr = pool.free[cls];
+            pool.free[cls] = *(void**)ptr;
+            free((struct block*)ptr - 1);
+        }
+    }
+    __atomic_sub_fetch(&totals.bytes_cached, pool.cached, __ATOMIC_RELAXED);
+    pool.cached = 0;
+}
+
+void expat_pool_stats(struct expat_pool_stats *stats) {
+    stats->parsers_created = __atomic_load_n(&totals.parsers_created,
+                                             __ATOMIC_RELAXED);
+    stats->parsers_reused = __atomic_load_n(&totals.parsers_reused,
+                                            __ATOMIC_RELAXED);
+    stats->parsers_pooled = __atomic_load_n(&totals.parsers_pooled,
+                                            __ATOMIC_RELAXED);
+    stats->bytes_in_use = __atomic_load_n(&totals.bytes_in_use,
+                                          __ATOMIC_RELAXED);
+    stats->bytes_cached = __atomic_load_n(&totals.bytes_cached,
+                                          __ATOMIC_RELAXED);
+}
+
+/** Expat's malloc, returns NULL when out of memory (Expat copes). */
+static void* pool_malloc(size_t size) {
+    size_t cls = size_class(size);
+    struct block *block;
+
+    if (cls < NUM_CLASSES && pool.free[cls] != NULL) {
+        void *ptr = pool.free[cls];
+        pool.free[cls] = *(void**)ptr;
+        block = (struct block*)ptr - 1;
+        pool.cached -= block->size;
+        __atomic_sub_fetch(&totals.bytes_cached, block->size,
+                           __ATOMIC_RELAXED);
+    } else {
+        size_t bytes = cls < NUM_CLASSES ? (size_t)1 << (cls + CLASS_SHIFT)
+                                         : size;
+        block = malloc(sizeof(*block) + bytes);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->size = bytes;
+        block->cls = cls;
+    }
+
+    __atomic_add_fetch(&totals.bytes_in_use, block->size, __ATOMIC_RELAXED);
+    return block + 1;
+}
+
+/** Expat's realloc, blocks only move when they outgrow their class. */
+static void* pool_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return pool_malloc(size);
+    }
+
+    struct block *block = (struct block*)ptr - 1;
+    if (size <= block->size) {
+        return ptr;
+    }
+
+    void *new_ptr = pool_malloc(size);
+    if (new_ptr != NULL) {
+        memcpy(new_ptr, ptr, block->size);
+        pool_free(ptr);
+    }
+    return new_ptr;
+}
+
+/** Expat's free, keeps the block for reuse if there is room. */
+static void pool_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    struct block *block = (struct block*)ptr - 1;
+    __atomic_sub_fetch(&totals.bytes_in_use, block->size, __ATOMIC_RELAXED);
+
+    if (block->cls < NUM_CLASSES
+            && pool.cached + block->size <= MAX_CACHED_BYTES) {
+        *(void**)ptr = pool.free[block->cls];
+        pool.free[block->cls] = ptr;
+        pool.cached += block->size;
+        __atomic_add_fetch(&totals.bytes_cached, block->size,
+                           __ATOMIC_RELAXED);
+    } else {
+        free(block);
+    }
+}
+
+/** Returns the smallest class that fits size, NUM_CLASSES if none does. */
+static size_t size_class(size_t size) {
+    size_t cls = 0;
+    while (cls < NUM_CLASSES && ((size_t)1 << (cls + CLASS_SHIFT)) < size) {
+        cls++;
+    }
+    return cls;
+}
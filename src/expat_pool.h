@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file expat_pool.h
+ * Recycles Expat parsers, and gives them memory from size-classed pools.
+ *
+ * Creating an Expat parser costs a few dozen allocations, and a running one
+ * keeps growing and shrinking its buffers and hash tables.  Parsers handed
+ * back here are reset with XML_ParserReset() and kept, still holding their
+ * grown buffers, for the next connection or stream to pick up.  All of their
+ * memory comes from power of two size classes (XML_ParserCreate_MM()), with
+ * freed blocks kept on a free list for reuse instead of going back to
+ * malloc, which keeps the heap from fragmenting over a long uptime and lets
+ * us count exactly how much memory Expat is holding.
+ *
+ * Pools and free lists belong to the calling thread, so nothing here takes
+ * a lock.  A parser (or block) may still be handed back on a different
+ * thread than it came from.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <expat.h>
+
+/** Counters for the whole process (all threads). */
+struct expat_pool_stats {
+    /** Parsers created from scratch. */
+    unsigned long parsers_created;
+
+    /** Parsers taken from a pool instead. */
+    unsigned long parsers_reused;
+
+    /** Parsers waiting in pools. */
+    unsigned long parsers_pooled;
+
+    /** Bytes Expat is holding, including parsers waiting in pools. */
+    size_t bytes_in_use;
+
+    /** Bytes sitting on free lists, for Expat to reuse. */
+    size_t bytes_cached;
+};
+
+/**
+ * Takes a namespace aware parser from the calling thread's pool, or creates
+ * a new one.
+ *
+ * Pooled parsers are shared by every caller, so all of them have to use the
+ * same namespace separator.
+ *
+ * @returns A parser in its initial state, or NULL if out of memory.
+ */
+XML_Parser expat_pool_get(XML_Char separator);
+
+/** Resets a parser and puts it in the calling thread's pool (or frees it). */
+void expat_pool_put(XML_Parser parser);
+
+/** Frees the calling thread's pooled parsers and free lists. */
+void expat_pool_trim(void);
+
+/** Copies the process wide counters into stats. */
+void expat_pool_stats(struct expat_pool_stats *stats);
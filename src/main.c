@@ -100,7 +100,10 @@
 #include "jid.h"
 #include "xmp3_module.h"
 #include "xmp3_options.h"
+#include "xmp3_upgrade.h"
+#include "xmp3_workers.h"
 #include "xmpp_client.h"
+#include "xmpp_parser.h"
 #include "xmpp_server.h"
 #include "xmpp_stanza.h"
 
@@ -112,6 +115,7 @@ static struct option long_options[] = {
     {"config",   required_argument, NULL, 'f'},
     {"addr",     required_argument, NULL, 'a'},
     {"port",     required_argument, NULL, 'p'},
+    {"workers",  required_argument, NULL, 'w'},
     {"no-ssl",   no_argument,       NULL, 'n'},
     {"ssl-key",  required_argument, NULL, 'k'},
     {"ssl-cert", required_argument, NULL, 'c'},
@@ -129,6 +133,8 @@ static void print_usage(void) {
            inet_ntoa(DEFAULT_ADDR));
     printf("  -p, --port     Port to listen for incoming XMPP client"
            " connections (Default: %d)\n", DEFAULT_PORT);
+    printf("  -w, --workers  Number of worker threads to handle client"
+           " connections (Default: %d)\n", DEFAULT_WORKERS);
     printf("  -n, --no-ssl   Disable SSL connection support\n");
     printf("  -k, --ssl-key  Path to the SSL private key to use"
            " (Default: %s)\n", DEFAULT_KEYFILE);
@@ -141,17 +147,36 @@ static void signal_handler(struct ev_loop *loop, ev_signal *w, int revents) {
     ev_break(loop, EVBREAK_ALL);
 }
 
+static void stats_handler(struct ev_loop *loop, ev_signal *w, int revents) {
+    xmp3_workers_log_stats(w->data);
+}
+
+/** What the upgrade signal handler needs to start a new process. */
+struct upgrade_data {
+    struct xmp3_workers *workers;
+    char *program;
+    char **argv;
+};
+
+static void upgrade_handler(struct ev_loop *loop, ev_signal *w, int revents) {
+    struct upgrade_data *data = w->data;
+    if (xmp3_upgrade_start(data->workers, data->program, data->argv)) {
+        ev_break(loop, EVBREAK_ALL);
+    }
+}
+
 int main(int argc, char *argv[]) {
     char *conffile = NULL;
     char *address = NULL;
     char *port = NULL;
+    char *workers = NULL;
     bool ssl = true;
     char *keyfile = NULL;
     char *certfile = NULL;
 
     int c = 0;
     while (true) {
-        c = getopt_long(argc, argv, "f:a:p:k:nc:h", long_options, NULL);
+        c = getopt_long(argc, argv, "f:a:p:w:k:nc:h", long_options, NULL);
 
         if (c < 0) {
             break;
@@ -167,6 +192,9 @@ int main(int argc, char *argv[]) {
             case 'p':
                 port = optarg;
                 break;
+            case 'w':
+                workers = optarg;
+                break;
             case 'n':
                 ssl = false;
                 break;
@@ -208,6 +236,10 @@ int main(int argc, char *argv[]) {
         check(xmp3_options_set_port_str(options, port),
               "Invalid client port \"%s\"", port);
     }
+    if (workers) {
+        check(xmp3_options_set_workers_str(options, workers),
+              "Invalid number of workers \"%s\"", workers);
+    }
     if (!ssl) {
         check(xmp3_options_set_ssl(options, false),
               "Failed to disable openssl.");
@@ -237,23 +269,73 @@ int main(int argc, char *argv[]) {
         SSL_library_init();
     }
 
-    struct xmpp_server *server = xmpp_server_new(loop, options);
-    check(server != NULL, "XMPP server initialization failed");
+    /* Every client's parser is made with this, so it has to be set before
+     * any workers start. */
+    xmpp_parser_set_default_backend(xmp3_options_get_xml_parser(options));
+
+    /* If we were started to take over from a running server, pick up its
+     * sockets instead of opening new ones. */
+    struct xmp3_upgrade *upgrade = NULL;
+    struct xmp3_workers *server_workers = NULL;
+    if (xmp3_upgrade_pending()) {
+        upgrade = xmp3_upgrade_receive();
+        check(upgrade != NULL, "Unable to take over from the old process.");
+
+        int num_fds = 0;
+        const int *fds = xmp3_upgrade_sockets(upgrade, &num_fds);
+        server_workers = xmp3_workers_new_from_sockets(loop, options, fds,
+                                                       num_fds);
+    } else {
+        server_workers = xmp3_workers_new(loop, options);
+    }
+    check(server_workers != NULL, "XMPP server initialization failed");
 
+    /* Modules only run alongside the primary worker. */
+    struct xmpp_server *server = xmp3_workers_primary(server_workers);
     xmp3_modules_start(xmp3_options_get_modules(options), server);
 
+    if (upgrade) {
+        bool finished = xmp3_upgrade_finish(upgrade, server_workers);
+        xmp3_upgrade_del(upgrade);
+        check(finished, "Unable to take over from the old process.");
+    }
+
+    check(xmp3_workers_start(server_workers), "Unable to start workers");
+
+    /* SIGUSR1 dumps the accept and parser counters. */
+    ev_signal stats_watcher;
+    ev_signal_init(&stats_watcher, stats_handler, SIGUSR1);
+    stats_watcher.data = server_workers;
+    ev_signal_start(loop, &stats_watcher);
+
+    /* SIGUSR2 hands everything over to a new copy of the program. */
+    struct upgrade_data upgrade_data = {
+        server_workers, xmp3_upgrade_program(), argv
+    };
+    ev_signal upgrade_watcher;
+    ev_signal_init(&upgrade_watcher, upgrade_handler, SIGUSR2);
+    upgrade_watcher.data = &upgrade_data;
+    if (upgrade_data.program != NULL) {
+        ev_signal_start(loop, &upgrade_watcher);
+    }
+
     log_info("Starting event loop...");
     ev_run(loop, 0);
     log_info("Event loop exited");
 
+    xmp3_workers_stop(server_workers);
+
     if (xmp3_options_get_ssl(options)) {
         ERR_free_strings();
     }
 
     xmp3_modules_stop(xmp3_options_get_modules(options));
 
+    /* Modules may still be listening for clients to disconnect, so the
+     * servers have to go before the modules do (with the options). */
+    xmp3_workers_del(server_workers);
     xmp3_options_del(options);
-    xmpp_server_del(server);
+    free(upgrade_data.program);
 
     ev_loop_destroy(loop);
 
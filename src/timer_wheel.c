@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file timer_wheel.c
+ * A hierarchical timing wheel, for large numbers of coarse timeouts.
+ */
+
+#include <stdlib.h>
+
+#include <utlist.h>
+
+#include "log.h"
+
+#include "timer_wheel.h"
+
+/** Bits of the tick each level of the wheel covers. */
+#define WHEEL_BITS 6
+
+/** Slots in each level of the wheel. */
+#define WHEEL_SLOTS (1UL << WHEEL_BITS)
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/** Levels of the wheel, the last one covers 2^24 ticks. */
+#define WHEEL_LEVELS 4
+
+const unsigned long TIMER_WHEEL_MAX_TICKS =
+    (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+struct timer_wheel_timer {
+    /** The wheel this timer runs on. */
+    struct timer_wheel *wheel;
+
+    /** Tick this timer expires on. */
+    unsigned long expires;
+
+    /** The slot this timer is in, NULL if it isn't running. */
+    struct timer_wheel_timer **slot;
+
+    /** Called when the timer expires. */
+    timer_wheel_callback cb;
+
+    /** Passed to the callback. */
+    void *data;
+
+    /** @{ Timers in a slot are kept in a doubly-linked list. */
+    struct timer_wheel_timer *prev;
+    struct timer_wheel_timer *next;
+    /** @} */
+};
+
+struct timer_wheel {
+    /** The current tick. */
+    unsigned long now;
+
+    /** Level 0 has a slot per tick, each level after is 64 times coarser. */
+    struct timer_wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static void insert(struct timer_wheel *wheel, struct timer_wheel_timer *timer);
+static void cascade(struct timer_wheel *wheel, int level);
+
+struct timer_wheel* timer_wheel_new(void) {
+    struct timer_wheel *wheel = calloc(1, sizeof(*wheel));
+    check_mem(wheel);
+    return wheel;
+}
+
+void timer_wheel_del(struct timer_wheel *wheel) {
+    free(wheel);
+}
+
+unsigned long timer_wheel_now(const struct timer_wheel *wheel) {
+    return wheel->now;
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, unsigned long now) {
+    while (wheel->now < now) {
+        wheel->now++;
+
+        /* Each time a level comes back around, the next slot of the level
+         * above holds the timers for the coming round. */
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (((wheel->now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK)
+                    != 0) {
+                break;
+            }
+            cascade(wheel, level);
+        }
+
+        /* Callbacks may stop (or delete) other timers in this slot, so take
+         * them one at a time. */
+        struct timer_wheel_timer **slot = &wheel->slots[0][wheel->now
+                                                           & WHEEL_MASK];
+        struct timer_wheel_timer *timer;
+        while ((timer = *slot) != NULL) {
+            DL_DELETE(*slot, timer);
+            timer->slot = NULL;
+            timer->cb(timer, timer->data);
+        }
+    }
+}
+
+struct timer_wheel_timer* timer_wheel_timer_new(struct timer_wheel *wheel,
+                                                timer_wheel_callback cb,
+                                                void *data) {
+    struct timer_wheel_timer *timer = calloc(1, sizeof(*timer));
+    check_mem(timer);
+    timer->wheel = wheel;
+    timer->cb = cb;
+    timer->data = data;
+    return timer;
+}
+
+void timer_wheel_timer_del(struct timer_wheel_timer *timer) {
+    timer_wheel_stop(timer);
+    free(timer);
+}
+
+void timer_wheel_start(struct timer_wheel_timer *timer, unsigned long ticks) {
+    timer_wheel_stop(timer);
+    if (ticks == 0) {
+        ticks = 1;
+    } else if (ticks > TIMER_WHEEL_MAX_TICKS) {
+        ticks = TIMER_WHEEL_MAX_TICKS;
+    }
+    timer->expires = timer->wheel->now + ticks;
+    insert(timer->wheel, timer);
+}
+
+void timer_wheel_stop(struct timer_wheel_timer *timer) {
+    if (timer->slot != NULL) {
+        DL_DELETE(*timer->slot, timer);
+        timer->slot = NULL;
+    }
+}
+
+bool timer_wheel_pending(const struct timer_wheel_timer *timer) {
+    return timer->slot != NULL;
+}
+
+/**
+ * Puts a timer in the finest level that reaches its expiry.
+ *
+ * Cascading timers can be due on the current tick, they go in the current
+ * slot, which runs right after.
+ */
+static void insert(struct timer_wheel *wheel, struct timer_wheel_timer *timer) {
+    unsigned long expires = timer->expires;
+    unsigned long delta = expires - wheel->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1
+            && delta >= 1UL << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    timer->slot = &wheel->slots[level][(expires >> (WHEEL_BITS * level))
+                                       & WHEEL_MASK];
+    DL_APPEND(*timer->slot, timer);
+}
+
+/** Moves the timers from the current slot of a level down to finer ones. */
+static void cascade(struct timer_wheel *wheel, int level) {
+    struct timer_wheel_timer **slot = &wheel->slots[level][
+        (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    struct timer_wheel_timer *list = *slot;
+    *slot = NULL;
+
+    struct timer_wheel_timer *timer, *tmp;
+    DL_FOREACH_SAFE(list, timer, tmp) {
+        DL_DELETE(list, timer);
+        insert(wheel, timer);
+    }
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file timer_wheel.h
+ * A hierarchical timing wheel, for large numbers of coarse timeouts.
+ *
+ * Each client needs a few timeouts (idle, ping, keepalive), and they are
+ * rescheduled all the time.  Giving each one its own ev_timer puts all of
+ * them in libev's heap, at O(log n) per change.  Here, starting, stopping
+ * and firing a timer are O(1): timers sit in a slot for the tick they expire
+ * on, and timers far in the future sit in coarser wheels until they get
+ * close enough to be moved into a finer one.
+ *
+ * The wheel has no clock of its own.  Whoever owns it calls
+ * timer_wheel_advance() with the current tick, usually from one repeating
+ * ev_timer.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/* Forward declarations. */
+struct timer_wheel;
+struct timer_wheel_timer;
+
+/** Called when a timer expires.  It may restart or delete any timer. */
+typedef void (*timer_wheel_callback)(struct timer_wheel_timer *timer,
+                                     void *data);
+
+/** Most ticks a timer can be set for, longer ones are shortened to this. */
+extern const unsigned long TIMER_WHEEL_MAX_TICKS;
+
+/** Creates an empty wheel, starting at tick 0. */
+struct timer_wheel* timer_wheel_new(void);
+
+/** Frees the wheel.  Its timers must already have been deleted. */
+void timer_wheel_del(struct timer_wheel *wheel);
+
+/** Returns the wheel's current tick. */
+unsigned long timer_wheel_now(const struct timer_wheel *wheel);
+
+/**
+ * Moves the wheel forward to a tick, running the callbacks of every timer
+ * that expires on the way, in order.
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, unsigned long now);
+
+/** Creates a timer on a wheel, it isn't started. */
+struct timer_wheel_timer* timer_wheel_timer_new(struct timer_wheel *wheel,
+                                                timer_wheel_callback cb,
+                                                void *data);
+
+/** Stops and frees a timer. */
+void timer_wheel_timer_del(struct timer_wheel_timer *timer);
+
+/**
+ * Starts a timer to expire a number of ticks from now, rescheduling it if it
+ * was already running.  0 ticks is the same as 1.
+ */
+void timer_wheel_start(struct timer_wheel_timer *timer, unsigned long ticks);
+
+/** Stops a timer, if it's running. */
+void timer_wheel_stop(struct timer_wheel_timer *timer);
+
+/** Returns true if the timer is running. */
+bool timer_wheel_pending(const struct timer_wheel_timer *timer);
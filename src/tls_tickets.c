@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file tls_tickets.c
+ * Rotating keys for TLS session tickets.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+typedef EVP_MAC_CTX ticket_mac_ctx;
+#else
+#include <openssl/hmac.h>
+typedef HMAC_CTX ticket_mac_ctx;
+#endif
+
+#include <ev.h>
+
+#include "log.h"
+
+#include "tls_tickets.h"
+
+/** Length of the key name that identifies which key encrypted a ticket. */
+#define TICKET_NAME_LEN 16
+
+/** Length of the AES-256 and HMAC-SHA256 keys. */
+#define TICKET_KEY_LEN 32
+
+/** Key material for encrypting and authenticating tickets. */
+struct ticket_key {
+    unsigned char name[TICKET_NAME_LEN];
+    unsigned char aes_key[TICKET_KEY_LEN];
+    unsigned char hmac_key[TICKET_KEY_LEN];
+};
+
+struct tls_tickets {
+    /** The context these keys are installed on. */
+    SSL_CTX *ssl_context;
+
+    /** Loop the rotation timer runs on, NULL if there is no timer. */
+    struct ev_loop *loop;
+
+    /** Periodically rotates the keys. */
+    struct ev_timer timer;
+
+    /**
+     * Handshakes may happen on other workers' threads while we rotate, so
+     * the keys are protected by this.
+     */
+    pthread_rwlock_t lock;
+
+    /** Issues new tickets. */
+    struct ticket_key current;
+
+    /** Only used to decrypt tickets issued before the last rotation. */
+    struct ticket_key previous;
+
+    /** False until the first rotation. */
+    bool has_previous;
+};
+
+/* Forward declarations. */
+static bool make_key(struct ticket_key *key);
+static void rotate_timer(struct ev_loop *loop, struct ev_timer *w,
+                         int revents);
+static int key_callback(SSL *ssl, unsigned char *name, unsigned char *iv,
+                        EVP_CIPHER_CTX *cipher, ticket_mac_ctx *mac,
+                        int enc);
+static bool init_mac(ticket_mac_ctx *mac, const struct ticket_key *key);
+
+struct tls_tickets* tls_tickets_new(SSL_CTX *ssl_context, struct ev_loop *loop,
+                                    double interval) {
+    struct tls_tickets *tickets = calloc(1, sizeof(*tickets));
+    check_mem(tickets);
+
+    check(pthread_rwlock_init(&tickets->lock, NULL) == 0,
+          "Unable to initialize ticket key lock.");
+
+    tickets->ssl_context = ssl_context;
+    check(make_key(&tickets->current), "Unable to create ticket key.");
+
+    SSL_CTX_set_app_data(ssl_context, tickets);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    check(SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_context,
+                                               key_callback) == 1,
+          "Unable to set ticket key callback.");
+#else
+    check(SSL_CTX_set_tlsext_ticket_key_cb(ssl_context, key_callback) == 1,
+          "Unable to set ticket key callback.");
+#endif
+
+    if (loop != NULL && interval > 0) {
+        tickets->loop = loop;
+        ev_timer_init(&tickets->timer, rotate_timer, interval, interval);
+        tickets->timer.data = tickets;
+        ev_timer_start(loop, &tickets->timer);
+    }
+
+    return tickets;
+
+error:
+    free(tickets);
+    return NULL;
+}
+
+void tls_tickets_del(struct tls_tickets *tickets) {
+    if (tickets->loop != NULL) {
+        ev_timer_stop(tickets->loop, &tickets->timer);
+    }
+    if (SSL_CTX_get_app_data(tickets->ssl_context) == tickets) {
+        SSL_CTX_set_app_data(tickets->ssl_context, NULL);
+    }
+    pthread_rwlock_destroy(&tickets->lock);
+    OPENSSL_cleanse(tickets, sizeof(*tickets));
+    free(tickets);
+}
+
+bool tls_tickets_rotate(struct tls_tickets *tickets) {
+    struct ticket_key key;
+    check(make_key(&key), "Unable to create ticket key.");
+
+    pthread_rwlock_wrlock(&tickets->lock);
+    tickets->previous = tickets->current;
+    tickets->current = key;
+    tickets->has_previous = true;
+    pthread_rwlock_unlock(&tickets->lock);
+
+    OPENSSL_cleanse(&key, sizeof(key));
+    debug("Rotated TLS session ticket keys");
+    return true;
+
+error:
+    return false;
+}
+
+_Static_assert(TLS_TICKETS_EXPORT_LEN == 1 + 2 * sizeof(struct ticket_key),
+               "TLS_TICKETS_EXPORT_LEN doesn't match the key size");
+
+void tls_tickets_export(struct tls_tickets *tickets,
+                        unsigned char buf[TLS_TICKETS_EXPORT_LEN]) {
+    pthread_rwlock_rdlock(&tickets->lock);
+    buf[0] = tickets->has_previous;
+    memcpy(buf + 1, &tickets->current, sizeof(tickets->current));
+    memcpy(buf + 1 + sizeof(tickets->current), &tickets->previous,
+           sizeof(tickets->previous));
+    pthread_rwlock_unlock(&tickets->lock);
+}
+
+void tls_tickets_import(struct tls_tickets *tickets,
+                        const unsigned char buf[TLS_TICKETS_EXPORT_LEN]) {
+    pthread_rwlock_wrlock(&tickets->lock);
+    tickets->has_previous = buf[0] != 0;
+    memcpy(&tickets->current, buf + 1, sizeof(tickets->current));
+    memcpy(&tickets->previous, buf + 1 + sizeof(tickets->current),
+           sizeof(tickets->previous));
+    pthread_rwlock_unlock(&tickets->lock);
+}
+
+/** Fills in a key with random data. */
+static bool make_key(struct ticket_key *key) {
+    return RAND_bytes(key->name, sizeof(key->name)) == 1
+        && RAND_bytes(key->aes_key, sizeof(key->aes_key)) == 1
+        && RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) == 1;
+}
+
+static void rotate_timer(struct ev_loop *loop, struct ev_timer *w,
+                         int revents) {
+    tls_tickets_rotate(w->data);
+}
+
+/**
+ * OpenSSL callback to set up ticket encryption/decryption.
+ *
+ * When encrypting (enc == 1), fills in the key name and IV, and always uses
+ * the current key.  When decrypting, looks the key up by name: returns 1 for
+ * the current key, 2 for the previous key (so OpenSSL issues a fresh ticket),
+ * and 0 for an unknown key (falls back to a full handshake).
+ */
+static int key_callback(SSL *ssl, unsigned char *name, unsigned char *iv,
+                        EVP_CIPHER_CTX *cipher, ticket_mac_ctx *mac,
+                        int enc) {
+    struct tls_tickets *tickets = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    if (tickets == NULL) {
+        return enc ? -1 : 0;
+    }
+
+    int rv = -1;
+    pthread_rwlock_rdlock(&tickets->lock);
+
+    if (enc) {
+        const struct ticket_key *key = &tickets->current;
+        memcpy(name, key->name, TICKET_NAME_LEN);
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) == 1
+                && EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL,
+                                      key->aes_key, iv) == 1
+                && init_mac(mac, key)) {
+            rv = 1;
+        }
+    } else {
+        const struct ticket_key *key = NULL;
+        rv = 0;
+        if (memcmp(name, tickets->current.name, TICKET_NAME_LEN) == 0) {
+            key = &tickets->current;
+            rv = 1;
+        } else if (tickets->has_previous
+                && memcmp(name, tickets->previous.name,
+                          TICKET_NAME_LEN) == 0) {
+            key = &tickets->previous;
+            rv = 2;
+        }
+
+        if (key != NULL
+                && (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL,
+                                       key->aes_key, iv) != 1
+                    || !init_mac(mac, key))) {
+            rv = -1;
+        }
+    }
+
+    pthread_rwlock_unlock(&tickets->lock);
+    return rv;
+}
+
+/** Sets up the ticket HMAC with a key. */
+static bool init_mac(ticket_mac_ctx *mac, const struct ticket_key *key) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                (void*)key->hmac_key, sizeof(key->hmac_key)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                         "sha256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+    return EVP_MAC_CTX_set_params(mac, params) == 1;
+#else
+    return HMAC_Init_ex(mac, key->hmac_key, sizeof(key->hmac_key),
+                        EVP_sha256(), NULL) == 1;
+#endif
+}
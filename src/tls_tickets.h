@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file tls_tickets.h
+ * Rotating keys for TLS session tickets.
+ *
+ * Session tickets let a reconnecting client resume its previous TLS session
+ * without the server keeping any state, as long as the server can still
+ * decrypt the ticket.  The keys are replaced periodically.  The previous key
+ * is kept around for one more period, so tickets it issued are still
+ * accepted (and renewed with the current key).
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include <openssl/ssl.h>
+
+/** Bytes needed to hold the keys saved by tls_tickets_export(). */
+#define TLS_TICKETS_EXPORT_LEN 161
+
+/* Forward declarations. */
+struct ev_loop;
+struct tls_tickets;
+
+/**
+ * Creates a set of ticket keys and installs them on an SSL context.
+ *
+ * @param ssl_context The context to issue/accept tickets for.
+ * @param loop        The loop to run the rotation timer on.  May be NULL, in
+ *                    which case keys are only rotated by tls_tickets_rotate().
+ * @param interval    Seconds between key rotations.
+ */
+struct tls_tickets* tls_tickets_new(SSL_CTX *ssl_context, struct ev_loop *loop,
+                                    double interval);
+
+/** Stops rotating keys and frees them. */
+void tls_tickets_del(struct tls_tickets *tickets);
+
+/** Replaces the current key, keeping the old one to decrypt with. */
+bool tls_tickets_rotate(struct tls_tickets *tickets);
+
+/**
+ * Saves the current and previous keys, so another process can take over
+ * issuing and accepting our tickets.
+ *
+ * @param buf Must hold TLS_TICKETS_EXPORT_LEN bytes.
+ */
+void tls_tickets_export(struct tls_tickets *tickets,
+                        unsigned char buf[TLS_TICKETS_EXPORT_LEN]);
+
+/** Replaces our keys with ones saved by tls_tickets_export(). */
+void tls_tickets_import(struct tls_tickets *tickets,
+                        const unsigned char buf[TLS_TICKETS_EXPORT_LEN]);
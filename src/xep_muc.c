@@ -131,6 +131,8 @@ static void send_nickname_conflict(struct xep_muc *muc,
 static void send_presence_broadcast(struct xep_muc *muc, struct room *room,
                                     const char *to, const char *from,
                                     const char *nickname);
+static void send_to_occupants(struct xep_muc *muc, struct room *room,
+                              struct xmpp_stanza *stanza);
 
 void* xep_muc_new(void) {
     struct xep_muc *muc = calloc(1, sizeof(*muc));
@@ -212,18 +214,19 @@ static bool stanza_handler(struct xmpp_stanza *stanza,
     const char *from = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_FROM);
     check(from != NULL, "MUC message without from attribute.");
 
-    if (strcmp(xmpp_stanza_name(stanza), XMPP_STANZA_MESSAGE) == 0) {
-        debug("MUC Message");
-        return handle_message(stanza, muc);
-    } else if (strcmp(xmpp_stanza_name(stanza), XMPP_STANZA_PRESENCE) == 0) {
-        debug("MUC Presence");
-        return handle_presence(stanza, muc);
-    } else if (strcmp(xmpp_stanza_name(stanza), XMPP_STANZA_IQ) == 0) {
-        debug("MUC IQ");
-        return handle_iq(stanza, muc);
-    } else {
-        log_warn("Unknown MUC stanza");
-        return false;
+    switch (xmpp_stanza_kind(stanza)) {
+        case XMPP_STANZA_KIND_MESSAGE:
+            debug("MUC Message");
+            return handle_message(stanza, muc);
+        case XMPP_STANZA_KIND_PRESENCE:
+            debug("MUC Presence");
+            return handle_presence(stanza, muc);
+        case XMPP_STANZA_KIND_IQ:
+            debug("MUC IQ");
+            return handle_iq(stanza, muc);
+        default:
+            log_warn("Unknown MUC stanza");
+            return false;
     }
 
 error:
@@ -235,9 +238,7 @@ static bool handle_message(struct xmpp_stanza *stanza, struct xep_muc *muc) {
     check(type != NULL && strcmp(type, XMPP_STANZA_TYPE_GROUPCHAT) == 0,
           "MUC message stanza type other than groupchat.");
 
-    char *to;
-    STRDUP_CHECK(to, xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_TO));
-
+    const char *to = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_TO);
     struct jid *to_jid = jid_new_from_str(to);
     struct room *room = NULL;
     HASH_FIND_STR(muc->rooms, jid_local(to_jid), room);
@@ -265,16 +266,9 @@ static bool handle_message(struct xmpp_stanza *stanza, struct xep_muc *muc) {
     jid_del(nick_jid);
 
     xmpp_stanza_set_attr(stanza, XMPP_STANZA_ATTR_FROM, nick_jid_str);
+    send_to_occupants(muc, room, stanza);
 
-    struct room_client *room_client_tmp;
-    DL_FOREACH_SAFE(room->clients, room_client, room_client_tmp) {
-        char *to_str = jid_to_str(room_client->client_jid);
-        xmpp_stanza_set_attr(stanza, XMPP_STANZA_ATTR_TO, to_str);
-        xmpp_server_route_stanza(muc->server, stanza);
-    }
-
-    /* Set the "to" and "from" back to their orignal values. */
-    xmpp_stanza_set_attr(stanza, XMPP_STANZA_ATTR_TO, to);
+    /* Set the "from" back to its orignal value, "to" already is. */
     xmpp_stanza_set_attr(stanza, XMPP_STANZA_ATTR_FROM, from);
     return true;
 
@@ -313,16 +307,16 @@ static bool handle_iq(struct xmpp_stanza *stanza, struct xep_muc *muc) {
     struct xmpp_stanza *child = xmpp_stanza_children(stanza);
     check(child != NULL, "MUC IQ with no child.");
 
-    const char *uri = xmpp_stanza_uri(child);
-    check(uri != NULL, "MUC IQ with no namespace URI.");
+    check(xmpp_stanza_uri(child) != NULL, "MUC IQ with no namespace URI.");
 
-    if (strcmp(uri, XMPP_IQ_DISCO_ITEMS_NS) == 0) {
-        return handle_items_query(stanza, muc);
-    } else if (strcmp(uri, XMPP_IQ_DISCO_INFO_NS) == 0) {
-        return handle_info_query(stanza, muc);
-    } else {
-        log_err("Unknown MUC IQ namespace URI");
-        return false;
+    switch (xmpp_stanza_uri_atom(child)) {
+        case ATOM_NS_DISCO_ITEMS:
+            return handle_items_query(stanza, muc);
+        case ATOM_NS_DISCO_INFO:
+            return handle_info_query(stanza, muc);
+        default:
+            log_err("Unknown MUC IQ namespace URI");
+            return false;
     }
 
 error:
@@ -464,12 +458,7 @@ static bool leave_room(struct xep_muc *muc, struct room *room,
     xmpp_stanza_del(status, true);
 
     /* Send the leave presence to other occupants in the room. */
-    struct room_client *other_client;
-    DL_FOREACH(room->clients, other_client) {
-        xmpp_stanza_set_attr(presence, XMPP_STANZA_ATTR_TO,
-                             jid_to_str(other_client->client_jid));
-        xmpp_server_route_stanza(muc->server, presence);
-    }
+    send_to_occupants(muc, room, presence);
     xmpp_stanza_del(presence, true);
 
     /* If the room is empty now, delete it. */
@@ -656,12 +645,8 @@ static void send_presence_broadcast(struct xep_muc *muc, struct room *room,
     jid_set_resource(tmp_jid, nickname);
     xmpp_stanza_set_attr(presence, XMPP_STANZA_ATTR_FROM, jid_to_str(tmp_jid));
 
-    DL_FOREACH(room->clients, room_client) {
-        xmpp_stanza_set_attr(presence, XMPP_STANZA_ATTR_ID, make_uuid());
-        xmpp_stanza_set_attr(presence, XMPP_STANZA_ATTR_TO,
-                             jid_to_str(room_client->client_jid));
-        xmpp_server_route_stanza(muc->server, presence);
-    }
+    xmpp_stanza_set_attr(presence, XMPP_STANZA_ATTR_ID, make_uuid());
+    send_to_occupants(muc, room, presence);
 
     /* Send the self-presence to the client. */
     xmpp_stanza_set_attr(presence, XMPP_STANZA_ATTR_ID, make_uuid());
@@ -677,3 +662,25 @@ static void send_presence_broadcast(struct xep_muc *muc, struct room *room,
     xmpp_stanza_del(presence, true);
     jid_del(tmp_jid);
 }
+
+/** Sends one stanza to everyone in a room, serializing it only once. */
+static void send_to_occupants(struct xep_muc *muc, struct room *room,
+                              struct xmpp_stanza *stanza) {
+    size_t count = 0;
+    struct room_client *room_client;
+    DL_FOREACH(room->clients, room_client) {
+        count++;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    const struct jid **to = malloc(count * sizeof(*to));
+    check_mem(to);
+    count = 0;
+    DL_FOREACH(room->clients, room_client) {
+        to[count++] = room_client->client_jid;
+    }
+    xmpp_server_route_stanza_multi(muc->server, stanza, to, count);
+    free(to);
+}
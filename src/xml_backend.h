@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file xml_backend.h
+ * The XML parsers an xmpp_parser can sit on top of.
+ *
+ * A backend turns bytes into namespace-aware start tag, end tag, character
+ * data and namespace declaration callbacks, the way Expat does with
+ * XML_SetReturnNSTriplet(): names come as "uri local prefix" (or "uri local",
+ * or just "local"), split by XMPP_PARSER_SEPARATOR.  Everything else about
+ * building stanzas is up to xmpp_parser.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+struct xml_backend;
+
+/** Callbacks a backend makes as it parses, all given the same data. */
+struct xml_backend_handlers {
+    void (*start)(void *data, const char *ns_name, const char **attrs);
+    void (*end)(void *data, const char *ns_name);
+    void (*chardata)(void *data, const char *s, int len);
+    void (*ns_start)(void *data, const char *prefix, const char *uri);
+};
+
+typedef void (*xml_backend_del_func)(struct xml_backend *backend);
+typedef bool (*xml_backend_reset_func)(struct xml_backend *backend);
+typedef bool (*xml_backend_parse_func)(struct xml_backend *backend,
+                                       const char *buf, int len);
+typedef void* (*xml_backend_buffer_func)(struct xml_backend *backend, int len);
+typedef bool (*xml_backend_parse_buffer_func)(struct xml_backend *backend,
+                                              int len);
+typedef void (*xml_backend_stop_func)(struct xml_backend *backend);
+typedef long long (*xml_backend_index_func)(struct xml_backend *backend);
+typedef int (*xml_backend_count_func)(struct xml_backend *backend);
+typedef const char* (*xml_backend_strerror_func)(struct xml_backend *backend);
+
+struct xml_backend {
+    /** Frees the backend (or gives it back to a pool). */
+    xml_backend_del_func del_func;
+
+    /** Starts a new document, keeping the handlers. */
+    xml_backend_reset_func reset_func;
+
+    /** Parses a chunk, false on error or if stopped. */
+    xml_backend_parse_func parse_func;
+
+    /** Returns a buffer to read up to len bytes into (NULL on error). */
+    xml_backend_buffer_func buffer_func;
+
+    /** Parses len bytes put into the last buffer. */
+    xml_backend_parse_buffer_func parse_buffer_func;
+
+    /**
+     * Stops parsing from inside a callback.  The chunk being parsed fails,
+     * and so does anything after it until a reset.
+     */
+    xml_backend_stop_func stop_func;
+
+    /**
+     * Where the event being called back for starts, counting from the first
+     * byte since the last reset.
+     */
+    xml_backend_index_func index_func;
+
+    /**
+     * How many bytes the event being called back for takes up (0 for the end
+     * of an empty element tag, which has no bytes of its own).
+     */
+    xml_backend_count_func count_func;
+
+    /** Describes the last error. */
+    xml_backend_strerror_func strerror_func;
+
+    void *self;
+};
+
+/**
+ * Gets a backend built on Expat, from the pool in expat_pool.h.
+ *
+ * @returns The backend, or NULL if out of memory.
+ */
+struct xml_backend* xml_backend_expat_new(
+        const struct xml_backend_handlers *handlers, void *data);
+
+/**
+ * Creates a backend built on the tokenizer in xml_tokenizer.c, which only
+ * takes what XMPP allows of XML.
+ */
+struct xml_backend* xml_backend_tokenizer_new(
+        const struct xml_backend_handlers *handlers, void *data);
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file xml_expat.c
+ * XML backend built on Expat.
+ */
+
+#include <stdlib.h>
+
+#include <expat.h>
+
+#include "expat_pool.h"
+#include "log.h"
+#include "xmpp_parser.h"
+
+#include "xml_backend.h"
+
+struct expat_backend {
+    struct xml_backend backend;
+
+    XML_Parser parser;
+    struct xml_backend_handlers handlers;
+    void *data;
+};
+
+static void set_handlers(struct expat_backend *expat);
+
+static void expat_del(struct xml_backend *backend);
+static bool expat_reset(struct xml_backend *backend);
+static bool expat_parse(struct xml_backend *backend, const char *buf,
+                        int len);
+static void* expat_buffer(struct xml_backend *backend, int len);
+static bool expat_parse_buffer(struct xml_backend *backend, int len);
+static void expat_stop(struct xml_backend *backend);
+static long long expat_index(struct xml_backend *backend);
+static int expat_count(struct xml_backend *backend);
+static const char* expat_strerror(struct xml_backend *backend);
+
+struct xml_backend* xml_backend_expat_new(
+        const struct xml_backend_handlers *handlers, void *data) {
+    struct expat_backend *expat = calloc(1, sizeof(*expat));
+    check_mem(expat);
+
+    expat->parser = expat_pool_get(XMPP_PARSER_SEPARATOR);
+    if (expat->parser == NULL) {
+        free(expat);
+        return NULL;
+    }
+    expat->handlers = *handlers;
+    expat->data = data;
+    set_handlers(expat);
+
+    struct xml_backend *backend = &expat->backend;
+    backend->del_func = expat_del;
+    backend->reset_func = expat_reset;
+    backend->parse_func = expat_parse;
+    backend->buffer_func = expat_buffer;
+    backend->parse_buffer_func = expat_parse_buffer;
+    backend->stop_func = expat_stop;
+    backend->index_func = expat_index;
+    backend->count_func = expat_count;
+    backend->strerror_func = expat_strerror;
+    backend->self = expat;
+    return backend;
+}
+
+/**
+ * Points Expat straight at the handlers, they have the same signatures as
+ * its own.
+ */
+static void set_handlers(struct expat_backend *expat) {
+    XML_SetReturnNSTriplet(expat->parser, true);
+    XML_SetElementHandler(expat->parser, expat->handlers.start,
+                          expat->handlers.end);
+    XML_SetCharacterDataHandler(expat->parser, expat->handlers.chardata);
+    XML_SetStartNamespaceDeclHandler(expat->parser, expat->handlers.ns_start);
+    XML_SetUserData(expat->parser, expat->data);
+
+    /* Inhibit the expansion of any external entities. */
+    XML_SetParamEntityParsing(expat->parser, XML_PARAM_ENTITY_PARSING_NEVER);
+}
+
+static void expat_del(struct xml_backend *backend) {
+    struct expat_backend *expat = backend->self;
+    expat_pool_put(expat->parser);
+    free(expat);
+}
+
+static bool expat_reset(struct xml_backend *backend) {
+    struct expat_backend *expat = backend->self;
+    if (XML_ParserReset(expat->parser, NULL) != XML_TRUE) {
+        return false;
+    }
+    set_handlers(expat);
+    return true;
+}
+
+static bool expat_parse(struct xml_backend *backend, const char *buf,
+                        int len) {
+    struct expat_backend *expat = backend->self;
+    return XML_Parse(expat->parser, buf, len, 0) == XML_STATUS_OK;
+}
+
+static void* expat_buffer(struct xml_backend *backend, int len) {
+    struct expat_backend *expat = backend->self;
+    return XML_GetBuffer(expat->parser, len);
+}
+
+static bool expat_parse_buffer(struct xml_backend *backend, int len) {
+    struct expat_backend *expat = backend->self;
+    return XML_ParseBuffer(expat->parser, len, 0) == XML_STATUS_OK;
+}
+
+static void expat_stop(struct xml_backend *backend) {
+    struct expat_backend *expat = backend->self;
+    XML_StopParser(expat->parser, false);
+}
+
+static long long expat_index(struct xml_backend *backend) {
+    struct expat_backend *expat = backend->self;
+    return XML_GetCurrentByteIndex(expat->parser);
+}
+
+static int expat_count(struct xml_backend *backend) {
+    struct expat_backend *expat = backend->self;
+    return XML_GetCurrentByteCount(expat->parser);
+}
+
+static const char* expat_strerror(struct xml_backend *backend) {
+    struct expat_backend *expat = backend->self;
+    return XML_ErrorString(XML_GetErrorCode(expat->parser));
+}
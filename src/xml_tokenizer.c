@@ -0,0 +1,1552 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file xml_tokenizer.c
+ * XML backend for just the subset of XML that XMPP uses.
+ *
+ * RFC 6120 section 11 keeps XMPP streams to a small part of XML: UTF-8 only,
+ * no DTDs, and no entities beyond the five predefined ones.  This handles
+ * that much and no more, which leaves little to do but find the markup.
+ * That is done 16 or 32 bytes at a time with SSE2 or AVX2 where the CPU has
+ * them, and text with nothing to decode is passed on straight from the
+ * input, without being copied.
+ *
+ * Tokens split across chunks are held on to until the rest of them arrives,
+ * text is passed on as it comes.  Callbacks are the same as Expat's (see
+ * xml_backend.h), down to where each event starts and how long it is.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN
+#endif
+
+#include <utstring.h>
+
+#include "log.h"
+#include "xmpp_parser.h"
+
+#include "xml_backend.h"
+
+/** The namespace the "xml" prefix is always bound to. */
+static const char *XML_NS = "http://www.w3.org/XML/1998/namespace";
+
+/** Tags longer than this are waited on without parsing them again. */
+#define LONG_TAG 1024
+
+/** Longest entity or character reference accepted, "&...;" included. */
+#define MAX_REF_LEN 32
+
+/* Error messages, worded like Expat's where there is one to match. */
+static const char *ERR_ABORTED = "parsing aborted";
+static const char *ERR_SYNTAX = "syntax error";
+static const char *ERR_INVALID = "not well-formed (invalid token)";
+static const char *ERR_MISMATCH = "mismatched tag";
+static const char *ERR_DUPLICATE = "duplicate attribute";
+static const char *ERR_JUNK = "junk after document element";
+static const char *ERR_ENTITY = "undefined entity";
+static const char *ERR_CHAR_REF = "reference to invalid character number";
+static const char *ERR_UNBOUND = "unbound prefix";
+static const char *ERR_RESERVED = "reserved prefix (xml) must not be undeclared "
+                                  "or bound to another namespace name";
+static const char *ERR_XML_DECL = "XML or text declaration not at start of "
+                                  "entity";
+static const char *ERR_DTD = "DTDs are not allowed in XMPP";
+
+/** Classes of bytes, so each can be told apart with one table lookup. */
+enum {
+    /** Can be in a name (non-ASCII is checked as UTF-8 afterwards). */
+    C_NAME = 1 << 0,
+
+    /** Can start a name. */
+    C_NAME_START = 1 << 1,
+
+    /** Can come right after a name in a tag. */
+    C_NAME_END = 1 << 2,
+
+    /** Whitespace. */
+    C_SPACE = 1 << 3,
+
+    /** Needs a closer look in an attribute value. */
+    C_ATTR = 1 << 4,
+};
+
+static unsigned char CLASS[256];
+
+/** An element that has been started but not ended. */
+struct element {
+    /** Length of names before anything of this element's was added. */
+    size_t mark;
+
+    /** Namespace bindings in scope before this element. */
+    int bindings;
+
+    /** The element's name as written, in names. */
+    size_t qname;
+    size_t qname_len;
+
+    /** The element's "uri local prefix" name, in names. */
+    size_t ns_name;
+};
+
+/** A namespace prefix in scope, strings are in names. */
+struct binding {
+    /** The prefix, with length 0 for the default namespace. */
+    size_t prefix;
+    size_t prefix_len;
+
+    size_t uri;
+    size_t uri_len;
+};
+
+/** An attribute of the start tag being handled. */
+struct raw_attr {
+    /** The name as written, in the input. */
+    const char *name;
+    size_t name_len;
+
+    /** The decoded value and the "uri local prefix" name, in scratch. */
+    size_t value;
+    size_t ns_name;
+
+    /** Whether this declares a namespace, rather than being an attribute. */
+    bool xmlns;
+};
+
+struct tokenizer {
+    struct xml_backend backend;
+
+    struct xml_backend_handlers handlers;
+    void *data;
+
+    /** Input held on to, from in_pos to in_len (the rest was parsed). */
+    char *in;
+    size_t in_pos;
+    size_t in_len;
+    size_t in_size;
+
+    /** Offset of in[0] in the document. */
+    long long offset;
+
+    /**
+     * How much of the incomplete token at the start of in has been looked
+     * through already, and the quote that was open at that point.
+     */
+    size_t resume;
+    char resume_quote;
+
+    /** The event being called back for. */
+    long long event_index;
+    int event_count;
+
+    /** Elements started but not ended. */
+    struct element *elements;
+    int depth;
+    int elements_size;
+
+    /** Whether the document element has ended. */
+    bool root_done;
+
+    /** Namespaces in scope. */
+    struct binding *bindings;
+    int num_bindings;
+    int bindings_size;
+
+    /** Strings for elements and bindings, kept as a stack. */
+    UT_string names;
+
+    /** Attributes of the start tag being handled. */
+    struct raw_attr *raw_attrs;
+    int num_attrs;
+    int attrs_size;
+
+    /** What is handed to the start callback. */
+    const char **attrs;
+    int attr_ptrs_size;
+
+    /**
+     * Open addressed hash table of indexes into attrs (or -1), used to spot
+     * duplicate attributes.  The size is a power of two.
+     */
+    int *attr_slots;
+    int attr_slots_size;
+
+    /** Decoded attribute values and names for the start tag being handled. */
+    UT_string scratch;
+
+    /** Decoded text. */
+    UT_string text;
+
+    /** Set on an error (or when stopped), until reset. */
+    const char *error;
+};
+
+/** Handles a tag, see start_tag(). */
+typedef const char* (*tag_func)(struct tokenizer *tok, const char *p,
+                                const char *end, long long index);
+
+typedef const char* (*scan_func)(const char *p, const char *end, char a,
+                                 char b, char c, signed char below);
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static scan_func scan;
+
+static void init(void);
+static const char* scan_scalar(const char *p, const char *end, char a,
+                               char b, char c, signed char below);
+#if defined(__SSE2__)
+static const char* scan_sse2(const char *p, const char *end, char a, char b,
+                             char c, signed char below);
+#endif
+#ifdef HAVE_AVX2_SCAN
+static const char* scan_avx2(const char *p, const char *end, char a, char b,
+                             char c, signed char below);
+#endif
+
+static void tok_del(struct xml_backend *backend);
+static bool tok_reset(struct xml_backend *backend);
+static bool tok_parse(struct xml_backend *backend, const char *buf, int len);
+static void* tok_buffer(struct xml_backend *backend, int len);
+static bool tok_parse_buffer(struct xml_backend *backend, int len);
+static void tok_stop(struct xml_backend *backend);
+static long long tok_index(struct xml_backend *backend);
+static int tok_count(struct xml_backend *backend);
+static const char* tok_strerror(struct xml_backend *backend);
+
+static void compact(struct tokenizer *tok);
+static void hold(struct tokenizer *tok, const char *data, size_t len);
+static size_t tokenize(struct tokenizer *tok, const char *data, size_t len,
+                       long long base);
+static const char* text(struct tokenizer *tok, const char *p,
+                        const char *end, long long index);
+static const char* markup(struct tokenizer *tok, const char *p,
+                          const char *end, long long index);
+static const char* tag(struct tokenizer *tok, const char *p, const char *end,
+                       long long index, tag_func parse);
+static const char* find_tag_end(struct tokenizer *tok, const char *p,
+                                const char *end);
+static const char* find_term(struct tokenizer *tok, const char *p,
+                             const char *end, size_t skip, const char *term);
+static const char* start_tag(struct tokenizer *tok, const char *p,
+                             const char *end, long long index);
+static const char* end_tag(struct tokenizer *tok, const char *p,
+                           const char *end, long long index);
+static void pop(struct tokenizer *tok);
+static bool chars(struct tokenizer *tok, const char *p, const char *end);
+static bool cdata(struct tokenizer *tok, const char *p, const char *end,
+                  long long index, int count);
+static const char* attr_value(struct tokenizer *tok, const char *p,
+                              const char *end, char quote);
+static bool declare(struct tokenizer *tok, struct raw_attr *attr);
+static bool lookup(struct tokenizer *tok, const char *prefix,
+                   size_t prefix_len, const char **uri, size_t *uri_len);
+static size_t append_ns_name(struct tokenizer *tok, UT_string *out,
+                             const char *qname, size_t len, bool element);
+static const char* name(struct tokenizer *tok, const char *p,
+                        const char *end);
+static int ref(struct tokenizer *tok, const char *p, const char *end,
+               char *out, int *out_len);
+static int utf8_char(const char *p, const char *end);
+static int utf8_encode(unsigned long c, char *out);
+static unsigned int name_hash(const char *name);
+static bool fail(struct tokenizer *tok, const char *error);
+static void event(struct tokenizer *tok, long long index, int count);
+
+struct xml_backend* xml_backend_tokenizer_new(
+        const struct xml_backend_handlers *handlers, void *data) {
+    pthread_once(&init_once, init);
+
+    struct tokenizer *tok = calloc(1, sizeof(*tok));
+    check_mem(tok);
+
+    tok->handlers = *handlers;
+    tok->data = data;
+    utstring_init(&tok->names);
+    utstring_init(&tok->scratch);
+    utstring_init(&tok->text);
+
+    struct xml_backend *backend = &tok->backend;
+    backend->del_func = tok_del;
+    backend->reset_func = tok_reset;
+    backend->parse_func = tok_parse;
+    backend->buffer_func = tok_buffer;
+    backend->parse_buffer_func = tok_parse_buffer;
+    backend->stop_func = tok_stop;
+    backend->index_func = tok_index;
+    backend->count_func = tok_count;
+    backend->strerror_func = tok_strerror;
+    backend->self = tok;
+    return backend;
+}
+
+static void tok_del(struct xml_backend *backend) {
+    struct tokenizer *tok = backend->self;
+    free(tok->in);
+    free(tok->elements);
+    free(tok->bindings);
+    free(tok->raw_attrs);
+    free(tok->attrs);
+    free(tok->attr_slots);
+    utstring_done(&tok->names);
+    utstring_done(&tok->scratch);
+    utstring_done(&tok->text);
+    free(tok);
+}
+
+static bool tok_reset(struct xml_backend *backend) {
+    struct tokenizer *tok = backend->self;
+    tok->in_pos = 0;
+    tok->in_len = 0;
+    tok->offset = 0;
+    tok->resume = 0;
+    tok->resume_quote = '\0';
+    tok->event_index = 0;
+    tok->event_count = 0;
+    tok->depth = 0;
+    tok->root_done = false;
+    tok->num_bindings = 0;
+    utstring_clear(&tok->names);
+    tok->error = NULL;
+    return true;
+}
+
+static bool tok_parse(struct xml_backend *backend, const char *buf, int len) {
+    struct tokenizer *tok = backend->self;
+    if (tok->error) {
+        return false;
+    }
+    compact(tok);
+
+    if (tok->in_len == 0) {
+        /* Nothing held on to, so straight from the caller's buffer. */
+        size_t used = tokenize(tok, buf, len, tok->offset);
+        tok->offset += used;
+        hold(tok, buf + used, len - used);
+    } else {
+        hold(tok, buf, len);
+        tok->in_pos = tokenize(tok, tok->in, tok->in_len, tok->offset);
+    }
+    return tok->error == NULL;
+}
+
+static void* tok_buffer(struct xml_backend *backend, int len) {
+    struct tokenizer *tok = backend->self;
+    compact(tok);
+    if (tok->in_len + len > tok->in_size) {
+        size_t size = tok->in_len + len;
+        char *in = realloc(tok->in, size);
+        if (in == NULL) {
+            return NULL;
+        }
+        tok->in = in;
+        tok->in_size = size;
+    }
+    return tok->in + tok->in_len;
+}
+
+static bool tok_parse_buffer(struct xml_backend *backend, int len) {
+    struct tokenizer *tok = backend->self;
+    tok->in_len += len;
+    if (tok->error) {
+        return false;
+    }
+    /* The buffer was just compacted, so it all starts at in[0]. */
+    tok->in_pos = tokenize(tok, tok->in, tok->in_len, tok->offset);
+    return tok->error == NULL;
+}
+
+static void tok_stop(struct xml_backend *backend) {
+    struct tokenizer *tok = backend->self;
+    fail(tok, ERR_ABORTED);
+}
+
+static long long tok_index(struct xml_backend *backend) {
+    struct tokenizer *tok = backend->self;
+    return tok->event_index;
+}
+
+static int tok_count(struct xml_backend *backend) {
+    struct tokenizer *tok = backend->self;
+    return tok->event_count;
+}
+
+static const char* tok_strerror(struct xml_backend *backend) {
+    struct tokenizer *tok = backend->self;
+    return tok->error;
+}
+
+/**
+ * Moves input held on to down to the front of the buffer.
+ *
+ * Only done when more input is about to come in, the caller may still be
+ * looking at the last input where it was until then.
+ */
+static void compact(struct tokenizer *tok) {
+    if (tok->in_pos == 0) {
+        return;
+    }
+    memmove(tok->in, tok->in + tok->in_pos, tok->in_len - tok->in_pos);
+    tok->in_len -= tok->in_pos;
+    tok->offset += tok->in_pos;
+    tok->in_pos = 0;
+}
+
+/** Holds on to input for later. */
+static void hold(struct tokenizer *tok, const char *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (tok->in_len + len > tok->in_size) {
+        tok->in_size = tok->in_len + len;
+        tok->in = realloc(tok->in, tok->in_size);
+        check_mem(tok->in);
+    }
+    memcpy(tok->in + tok->in_len, data, len);
+    tok->in_len += len;
+}
+
+/**
+ * Makes callbacks for all of the whole tokens in some input.
+ *
+ * @param base The offset of data in the document.
+ * @returns How much of the input was used up.
+ */
+static size_t tokenize(struct tokenizer *tok, const char *data, size_t len,
+                       long long base) {
+    const char *p = data;
+    const char *end = data + len;
+    while (p < end && tok->error == NULL) {
+        const char *next;
+        if (*p == '<') {
+            next = markup(tok, p, end, base + (p - data));
+            if (next == NULL) {
+                break;
+            }
+        } else {
+            next = text(tok, p, end, base + (p - data));
+            if (next == p) {
+                break;
+            }
+        }
+        p = next;
+    }
+    return p - data;
+}
+
+/**
+ * Handles character data, up to the next markup.
+ *
+ * @returns Where it stopped, at the next '<' or at something that isn't all
+ *          there yet (such as a reference or UTF-8 character cut off at the
+ *          end of the input).
+ */
+static const char* text(struct tokenizer *tok, const char *p,
+                        const char *end, long long index) {
+    const char *q = p;
+    bool decode = false;
+    char buf[4];
+    int buf_len;
+
+    while (q < end) {
+        q = scan(q, end, '<', '&', '&', 0x20);
+        if (q == end) {
+            break;
+        }
+        unsigned char c = *q;
+        if (c == '<') {
+            break;
+        } else if (c == '&') {
+            int len = ref(tok, q, end, buf, &buf_len);
+            if (len <= 0) {
+                break;
+            }
+            decode = true;
+            q += len;
+        } else if (c == '\r') {
+            /* Wait and see whether it's a "\r\n". */
+            if (q + 1 == end) {
+                break;
+            }
+            decode = true;
+            q++;
+        } else if (c == '\t' || c == '\n') {
+            q++;
+        } else if (c < 0x80) {
+            fail(tok, ERR_INVALID);
+            return p;
+        } else {
+            int len = utf8_char(q, end);
+            if (len < 0) {
+                break;
+            } else if (len == 0) {
+                fail(tok, ERR_INVALID);
+                return p;
+            }
+            q += len;
+        }
+    }
+    if (q == p || tok->error) {
+        return p;
+    }
+
+    if (tok->depth == 0) {
+        /* Only whitespace outside of the document element, and nobody is
+         * told about it. */
+        for (const char *c = p; c < q; c++) {
+            if (*c != ' ' && *c != '\t' && *c != '\n' && *c != '\r') {
+                fail(tok, tok->root_done ? ERR_JUNK : ERR_SYNTAX);
+                return p;
+            }
+        }
+        return q;
+    }
+
+    event(tok, index, q - p);
+    if (!decode) {
+        tok->handlers.chardata(tok->data, p, q - p);
+        return q;
+    }
+
+    /* References and line endings have to be turned into what they stand
+     * for. */
+    utstring_clear(&tok->text);
+    const char *c = p;
+    while (c < q) {
+        const char *special = c;
+        while (special < q && *special != '&' && *special != '\r') {
+            special++;
+        }
+        utstring_bincpy(&tok->text, c, special - c);
+        if (special == q) {
+            break;
+        }
+        if (*special == '&') {
+            c = special + ref(tok, special, q, buf, &buf_len);
+            utstring_bincpy(&tok->text, buf, buf_len);
+        } else {
+            c = special + 1;
+            if (c < q && *c == '\n') {
+                c++;
+            }
+            utstring_bincpy(&tok->text, "\n", 1);
+        }
+    }
+    tok->handlers.chardata(tok->data, utstring_body(&tok->text),
+                           utstring_len(&tok->text));
+    return q;
+}
+
+/**
+ * Handles a tag, comment, CDATA section or processing instruction.
+ *
+ * @returns Where it ended, or NULL if it isn't all there yet (or on error).
+ */
+static const char* markup(struct tokenizer *tok, const char *p,
+                          const char *end, long long index) {
+    static const char COMMENT[] = "<!--";
+    static const char CDATA[] = "<![CDATA[";
+    static const char DOCTYPE[] = "<!DOCTYPE";
+
+    if (end - p < 2) {
+        return NULL;
+    }
+
+    const char *gt;
+    const char *q;
+    size_t avail = end - p;
+    switch (p[1]) {
+        case '/':
+            return tag(tok, p, end, index, end_tag);
+
+        case '?':
+            /* The target has to be a name, which can be told right away. */
+            q = p + 2;
+            while (q < end && (CLASS[(unsigned char)*q] & C_NAME)) {
+                q++;
+            }
+            if (q < end && (q == p + 2 || (*q != '?'
+                    && !(CLASS[(unsigned char)*q] & C_SPACE)))) {
+                fail(tok, ERR_INVALID);
+                return NULL;
+            }
+            gt = find_term(tok, p, end, 2, "?>");
+            if (gt == NULL || !chars(tok, p + 2, gt - 2)) {
+                return NULL;
+            }
+            /* Processing instructions are ignored, but an XML declaration
+             * can only be at the very start. */
+            if (gt - p >= 6 && memcmp(p + 2, "xml", 3) == 0
+                    && (p[5] == ' ' || p[5] == '\t' || p[5] == '\n'
+                        || p[5] == '\r' || p[5] == '?') && index != 0) {
+                fail(tok, ERR_XML_DECL);
+                return NULL;
+            }
+            return gt;
+
+        case '!':
+            if (memcmp(p, COMMENT, avail < 4 ? avail : 4) == 0) {
+                if (avail < 4) {
+                    return NULL;
+                }
+                /* Comments are ignored. */
+                gt = find_term(tok, p, end, 4, "-->");
+                if (gt == NULL || !chars(tok, p + 4, gt - 3)) {
+                    return NULL;
+                }
+                return gt;
+            }
+            if (memcmp(p, CDATA, avail < 9 ? avail : 9) == 0) {
+                if (avail < 9) {
+                    return NULL;
+                }
+                gt = find_term(tok, p, end, 9, "]]>");
+                if (gt == NULL || !cdata(tok, p + 9, gt - 3, index, gt - p)) {
+                    return NULL;
+                }
+                return gt;
+            }
+            if (memcmp(p, DOCTYPE, avail < 9 ? avail : 9) == 0) {
+                if (avail < 9) {
+                    return NULL;
+                }
+                fail(tok, ERR_DTD);
+                return NULL;
+            }
+            fail(tok, ERR_SYNTAX);
+            return NULL;
+
+        default:
+            return tag(tok, p, end, index, start_tag);
+    }
+}
+
+/**
+ * Handles a start or end tag.
+ *
+ * Short tags that aren't all there yet are just parsed again when more
+ * comes in.  For long ones, how far through them has been looked is kept, so
+ * they aren't looked through again with every chunk.
+ */
+static const char* tag(struct tokenizer *tok, const char *p, const char *end,
+                       long long index, tag_func parse) {
+    if (tok->resume != 0 && find_tag_end(tok, p, end) == NULL) {
+        return NULL;
+    }
+    const char *next = parse(tok, p, end, index);
+    if (next == NULL && tok->error == NULL && end - p > LONG_TAG) {
+        find_tag_end(tok, p, end);
+    }
+    return next;
+}
+
+/**
+ * Finds the '>' that ends a tag, skipping over any in attribute values.
+ *
+ * @returns The '>', or NULL if it hasn't arrived yet.
+ */
+static const char* find_tag_end(struct tokenizer *tok, const char *p,
+                                const char *end) {
+    const char *q = p + (tok->resume ? tok->resume : 1);
+    char quote = tok->resume_quote;
+
+    while (q < end) {
+        if (quote) {
+            q = memchr(q, quote, end - q);
+            if (q == NULL) {
+                q = end;
+                break;
+            }
+            quote = '\0';
+            q++;
+            continue;
+        }
+        q = scan(q, end, '>', '\'', '"', -128);
+        if (q == end) {
+            break;
+        }
+        if (*q == '>') {
+            tok->resume = 0;
+            tok->resume_quote = '\0';
+            return q;
+        }
+        quote = *q++;
+    }
+
+    tok->resume = q - p;
+    tok->resume_quote = quote;
+    return NULL;
+}
+
+/**
+ * Finds the end of a comment, CDATA section or processing instruction.
+ *
+ * @param skip How much of the start to skip over.
+ * @param term What it ends with.
+ * @returns Just past the end, or NULL if it hasn't arrived yet.
+ */
+static const char* find_term(struct tokenizer *tok, const char *p,
+                             const char *end, size_t skip, const char *term) {
+    size_t term_len = strlen(term);
+    const char *q = p + (tok->resume > skip ? tok->resume : skip);
+    char last = term[term_len - 1];
+
+    while (q < end) {
+        q = memchr(q, last, end - q);
+        if (q == NULL) {
+            break;
+        }
+        q++;
+        if ((size_t)(q - p) >= skip + term_len - 1
+                && memcmp(q - term_len, term, term_len) == 0) {
+            tok->resume = 0;
+            return q;
+        }
+    }
+
+    /* The next look starts just early enough to catch a split up end. */
+    tok->resume = end - p > (long)term_len ? (size_t)(end - p) - term_len + 1
+                                           : skip;
+    if (tok->resume < skip) {
+        tok->resume = skip;
+    }
+    return NULL;
+}
+
+/** Handles a start tag (and an empty element tag's end). */
+static const char* start_tag(struct tokenizer *tok, const char *p,
+                             const char *end, long long index) {
+    if (tok->depth == 0 && tok->root_done) {
+        fail(tok, ERR_JUNK);
+        return NULL;
+    }
+
+    const char *qname = p + 1;
+    const char *q = name(tok, qname, end);
+    if (q == NULL || q == end) {
+        return NULL;
+    }
+    size_t qname_len = q - qname;
+
+    /* Attributes, decoded into scratch. */
+    utstring_clear(&tok->scratch);
+    tok->num_attrs = 0;
+    bool empty = false;
+    for (;;) {
+        const char *space = q;
+        while (q < end && (CLASS[(unsigned char)*q] & C_SPACE)) {
+            q++;
+        }
+        if (q == end) {
+            return NULL;
+        }
+        if (*q == '>') {
+            break;
+        }
+        if (*q == '/') {
+            if (q + 1 == end) {
+                return NULL;
+            } else if (q[1] != '>') {
+                fail(tok, ERR_INVALID);
+                return NULL;
+            }
+            empty = true;
+            q++;
+            break;
+        }
+        if (q == space) {
+            fail(tok, ERR_INVALID);
+            return NULL;
+        }
+
+        const char *attr_name = q;
+        q = name(tok, q, end);
+        if (q == NULL) {
+            return NULL;
+        }
+        size_t attr_name_len = q - attr_name;
+        while (q < end && (CLASS[(unsigned char)*q] & C_SPACE)) {
+            q++;
+        }
+        if (q == end) {
+            return NULL;
+        } else if (*q != '=') {
+            fail(tok, ERR_INVALID);
+            return NULL;
+        }
+        q++;
+        while (q < end && (CLASS[(unsigned char)*q] & C_SPACE)) {
+            q++;
+        }
+        if (q == end) {
+            return NULL;
+        } else if (*q != '\'' && *q != '"') {
+            fail(tok, ERR_INVALID);
+            return NULL;
+        }
+
+        if (tok->num_attrs == tok->attrs_size) {
+            tok->attrs_size = tok->attrs_size ? tok->attrs_size * 2 : 8;
+            tok->raw_attrs = realloc(tok->raw_attrs,
+                                     tok->attrs_size * sizeof(*tok->raw_attrs));
+            check_mem(tok->raw_attrs);
+        }
+        struct raw_attr *attr = &tok->raw_attrs[tok->num_attrs++];
+        attr->name = attr_name;
+        attr->name_len = attr_name_len;
+        attr->xmlns = attr_name_len >= 5
+                      && memcmp(attr_name, "xmlns", 5) == 0
+                      && (attr_name_len == 5 || attr_name[5] == ':');
+        attr->value = utstring_len(&tok->scratch);
+        q = attr_value(tok, q + 1, end, *q);
+        if (q == NULL) {
+            return NULL;
+        }
+    }
+    const char *gt = q;
+
+    /* Namespace declarations come first, and are in scope for the element's
+     * own name and attributes. */
+    struct element element = {
+        .mark = utstring_len(&tok->names),
+        .bindings = tok->num_bindings,
+    };
+    event(tok, index, gt + 1 - p);
+    for (int i = 0; i < tok->num_attrs; i++) {
+        if (tok->raw_attrs[i].xmlns && !declare(tok, &tok->raw_attrs[i])) {
+            return NULL;
+        }
+    }
+
+    element.qname = utstring_len(&tok->names);
+    element.qname_len = qname_len;
+    utstring_bincpy(&tok->names, qname, qname_len);
+    utstring_bincpy(&tok->names, "", 1);
+    element.ns_name = append_ns_name(tok, &tok->names, qname, qname_len, true);
+    if (element.ns_name == (size_t)-1) {
+        return NULL;
+    }
+
+    int num_attrs = 0;
+    for (int i = 0; i < tok->num_attrs; i++) {
+        struct raw_attr *attr = &tok->raw_attrs[i];
+        if (attr->xmlns) {
+            continue;
+        }
+        attr->ns_name = append_ns_name(tok, &tok->scratch, attr->name,
+                                       attr->name_len, false);
+        if (attr->ns_name == (size_t)-1) {
+            return NULL;
+        }
+        num_attrs++;
+    }
+
+    /* Now that scratch is done growing, point into it. */
+    if (num_attrs * 2 + 1 > tok->attr_ptrs_size) {
+        tok->attr_ptrs_size = num_attrs * 2 + 1;
+        tok->attrs = realloc(tok->attrs,
+                             tok->attr_ptrs_size * sizeof(*tok->attrs));
+        check_mem(tok->attrs);
+    }
+
+    /* Keep the table at most half full, so probes stay short. */
+    int slots = 8;
+    while (slots < num_attrs * 2) {
+        slots *= 2;
+    }
+    if (slots > tok->attr_slots_size) {
+        tok->attr_slots_size = slots;
+        tok->attr_slots = realloc(tok->attr_slots,
+                                  slots * sizeof(*tok->attr_slots));
+        check_mem(tok->attr_slots);
+    }
+    memset(tok->attr_slots, -1, slots * sizeof(*tok->attr_slots));
+
+    const char *scratch = utstring_body(&tok->scratch);
+    int n = 0;
+    for (int i = 0; i < tok->num_attrs; i++) {
+        struct raw_attr *attr = &tok->raw_attrs[i];
+        if (attr->xmlns) {
+            continue;
+        }
+        const char *attr_ns_name = scratch + attr->ns_name;
+        unsigned int slot = name_hash(attr_ns_name) & (slots - 1);
+        while (tok->attr_slots[slot] != -1) {
+            if (strcmp(tok->attrs[tok->attr_slots[slot]], attr_ns_name) == 0) {
+                fail(tok, ERR_DUPLICATE);
+                return NULL;
+            }
+            slot = (slot + 1) & (slots - 1);
+        }
+        tok->attr_slots[slot] = n;
+        tok->attrs[n++] = attr_ns_name;
+        tok->attrs[n++] = scratch + attr->value;
+    }
+    tok->attrs[n] = NULL;
+
+    if (tok->depth == tok->elements_size) {
+        tok->elements_size = tok->elements_size ? tok->elements_size * 2 : 16;
+        tok->elements = realloc(tok->elements,
+                                tok->elements_size * sizeof(*tok->elements));
+        check_mem(tok->elements);
+    }
+    tok->elements[tok->depth++] = element;
+
+    const char *ns_name = utstring_body(&tok->names) + element.ns_name;
+    event(tok, index, gt + 1 - p);
+    tok->handlers.start(tok->data, ns_name, tok->attrs);
+    if (tok->error) {
+        return NULL;
+    }
+    if (!empty) {
+        return gt + 1;
+    }
+
+    /* The end of an empty element tag has no bytes of its own. */
+    event(tok, index + (gt + 1 - p), 0);
+    tok->handlers.end(tok->data, ns_name);
+    pop(tok);
+    return tok->error ? NULL : gt + 1;
+}
+
+/** Handles an end tag. */
+static const char* end_tag(struct tokenizer *tok, const char *p,
+                           const char *end, long long index) {
+    const char *qname = p + 2;
+    const char *q = name(tok, qname, end);
+    if (q == NULL) {
+        return NULL;
+    }
+    size_t qname_len = q - qname;
+    while (q < end && (CLASS[(unsigned char)*q] & C_SPACE)) {
+        q++;
+    }
+    if (q == end) {
+        return NULL;
+    } else if (*q != '>') {
+        fail(tok, ERR_INVALID);
+        return NULL;
+    }
+
+    if (tok->depth == 0) {
+        fail(tok, tok->root_done ? ERR_JUNK : ERR_SYNTAX);
+        return NULL;
+    }
+    struct element *element = &tok->elements[tok->depth - 1];
+    const char *names = utstring_body(&tok->names);
+    if (element->qname_len != qname_len
+            || memcmp(names + element->qname, qname, qname_len) != 0) {
+        fail(tok, ERR_MISMATCH);
+        return NULL;
+    }
+
+    event(tok, index, q + 1 - p);
+    tok->handlers.end(tok->data, names + element->ns_name);
+    pop(tok);
+    return tok->error ? NULL : q + 1;
+}
+
+/** Ends the innermost element, and the namespaces declared on it. */
+static void pop(struct tokenizer *tok) {
+    struct element *element = &tok->elements[--tok->depth];
+    tok->num_bindings = element->bindings;
+    tok->names.i = element->mark;
+    tok->names.d[element->mark] = '\0';
+    if (tok->depth == 0) {
+        tok->root_done = true;
+    }
+}
+
+/** Checks that everything from p to end is a character XML allows. */
+static bool chars(struct tokenizer *tok, const char *p, const char *end) {
+    while (p < end) {
+        p = scan(p, end, '\0', '\0', '\0', 0x20);
+        if (p == end) {
+            break;
+        }
+        unsigned char c = *p;
+        if (c == '\t' || c == '\n' || c == '\r') {
+            p++;
+            continue;
+        }
+        int len = c >= 0x80 ? utf8_char(p, end) : 0;
+        if (len <= 0) {
+            return fail(tok, ERR_INVALID);
+        }
+        p += len;
+    }
+    return true;
+}
+
+/** Handles the contents of a CDATA section, which is text as it is. */
+static bool cdata(struct tokenizer *tok, const char *p, const char *end,
+                  long long index, int count) {
+    if (tok->depth == 0) {
+        return fail(tok, tok->root_done ? ERR_JUNK : ERR_SYNTAX);
+    }
+
+    /* Only line endings need changing. */
+    utstring_clear(&tok->text);
+    const char *q = p;
+    while (q < end) {
+        unsigned char c = *q;
+        if (c == '\r') {
+            utstring_bincpy(&tok->text, "\n", 1);
+            q += (q + 1 < end && q[1] == '\n') ? 2 : 1;
+            continue;
+        }
+        int len = 1;
+        if (c >= 0x80) {
+            len = utf8_char(q, end);
+            if (len <= 0) {
+                return fail(tok, ERR_INVALID);
+            }
+        } else if (c < 0x20 && c != '\t' && c != '\n') {
+            return fail(tok, ERR_INVALID);
+        }
+        utstring_bincpy(&tok->text, q, len);
+        q += len;
+    }
+    if (utstring_len(&tok->text) == 0) {
+        return true;
+    }
+
+    event(tok, index, count);
+    tok->handlers.chardata(tok->data, utstring_body(&tok->text),
+                           utstring_len(&tok->text));
+    return tok->error == NULL;
+}
+
+/**
+ * Decodes an attribute value into scratch, null-terminated.
+ *
+ * References are replaced, and whitespace characters (and line endings)
+ * become spaces, as XML normalizes attribute values.
+ *
+ * @param quote The quote the value ends with.
+ * @returns Just past the end of the value, or NULL if it isn't all there yet
+ *          (or on error).
+ */
+static const char* attr_value(struct tokenizer *tok, const char *p,
+                              const char *end, char quote) {
+    char buf[4];
+    int buf_len;
+    for (;;) {
+        /* Values are short, so a byte at a time. */
+        const char *q = p;
+        while (q < end && !(CLASS[(unsigned char)*q] & C_ATTR)) {
+            q++;
+        }
+        if (q == end) {
+            return NULL;
+        }
+        utstring_bincpy(&tok->scratch, p, q - p);
+
+        unsigned char c = *q;
+        if (c == quote) {
+            utstring_bincpy(&tok->scratch, "", 1);
+            return q + 1;
+        } else if (c == '\'' || c == '"') {
+            utstring_bincpy(&tok->scratch, q, 1);
+            p = q + 1;
+        } else if (c == '&') {
+            int len = ref(tok, q, end, buf, &buf_len);
+            if (len <= 0) {
+                return NULL;
+            }
+            utstring_bincpy(&tok->scratch, buf, buf_len);
+            p = q + len;
+        } else if (c == '\t' || c == '\n' || c == '\r') {
+            if (c == '\r' && q + 1 == end) {
+                return NULL;
+            }
+            utstring_bincpy(&tok->scratch, " ", 1);
+            p = q + (c == '\r' && q[1] == '\n' ? 2 : 1);
+        } else if (c >= 0x80) {
+            int len = utf8_char(q, end);
+            if (len < 0) {
+                return NULL;
+            } else if (len == 0) {
+                fail(tok, ERR_INVALID);
+                return NULL;
+            }
+            utstring_bincpy(&tok->scratch, q, len);
+            p = q + len;
+        } else {
+            /* '<' or a control character. */
+            fail(tok, ERR_INVALID);
+            return NULL;
+        }
+    }
+}
+
+/** Brings a namespace declaration into scope, and calls back for it. */
+static bool declare(struct tokenizer *tok, struct raw_attr *attr) {
+    const char *prefix = attr->name_len > 5 ? attr->name + 6 : NULL;
+    size_t prefix_len = prefix ? attr->name_len - 6 : 0;
+    const char *uri = utstring_body(&tok->scratch) + attr->value;
+    size_t uri_len = strlen(uri);
+
+    if (prefix != NULL) {
+        bool is_xml = prefix_len == 3 && memcmp(prefix, "xml", 3) == 0;
+        if ((prefix_len == 5 && memcmp(prefix, "xmlns", 5) == 0)
+                || is_xml != (strcmp(uri, XML_NS) == 0)) {
+            return fail(tok, ERR_RESERVED);
+        }
+        if (uri_len == 0) {
+            return fail(tok, ERR_UNBOUND);
+        }
+    }
+    if (memchr(uri, XMPP_PARSER_SEPARATOR, uri_len) != NULL) {
+        /* It would be mistaken for the end of the URI in names. */
+        return fail(tok, ERR_SYNTAX);
+    }
+
+    if (tok->num_bindings == tok->bindings_size) {
+        tok->bindings_size = tok->bindings_size ? tok->bindings_size * 2 : 16;
+        tok->bindings = realloc(tok->bindings,
+                                tok->bindings_size * sizeof(*tok->bindings));
+        check_mem(tok->bindings);
+    }
+    struct binding *binding = &tok->bindings[tok->num_bindings++];
+    binding->prefix = utstring_len(&tok->names);
+    binding->prefix_len = prefix_len;
+    utstring_bincpy(&tok->names, prefix ? prefix : "", prefix_len);
+    utstring_bincpy(&tok->names, "", 1);
+    binding->uri = utstring_len(&tok->names);
+    binding->uri_len = uri_len;
+    utstring_bincpy(&tok->names, uri, uri_len);
+    utstring_bincpy(&tok->names, "", 1);
+
+    const char *names = utstring_body(&tok->names);
+    tok->handlers.ns_start(tok->data, prefix ? names + binding->prefix : NULL,
+                           names + binding->uri);
+    return tok->error == NULL;
+}
+
+/**
+ * Finds the namespace a prefix is bound to.
+ *
+ * @param prefix_len 0 for the default namespace, which is "" if not
+ *                   declared.
+ * @returns false if the prefix isn't bound.
+ */
+static bool lookup(struct tokenizer *tok, const char *prefix,
+                   size_t prefix_len, const char **uri, size_t *uri_len) {
+    const char *names = utstring_body(&tok->names);
+    for (int i = tok->num_bindings - 1; i >= 0; i--) {
+        struct binding *binding = &tok->bindings[i];
+        if (binding->prefix_len == prefix_len
+                && memcmp(names + binding->prefix, prefix, prefix_len) == 0) {
+            *uri = names + binding->uri;
+            *uri_len = binding->uri_len;
+            return true;
+        }
+    }
+
+    if (prefix_len == 0) {
+        *uri = "";
+        *uri_len = 0;
+        return true;
+    }
+    if (prefix_len == 3 && memcmp(prefix, "xml", 3) == 0) {
+        *uri = XML_NS;
+        *uri_len = strlen(XML_NS);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Adds the "uri local prefix" form of a name to out, null-terminated.
+ *
+ * @param element Whether the name is an element's (the default namespace
+ *                only applies to those).
+ * @returns Where in out the name is, or (size_t)-1 on error.
+ */
+static size_t append_ns_name(struct tokenizer *tok, UT_string *out,
+                             const char *qname, size_t len, bool element) {
+    const char *colon = memchr(qname, ':', len);
+    const char *local = colon ? colon + 1 : qname;
+    size_t local_len = len - (local - qname);
+    size_t prefix_len = colon ? (size_t)(colon - qname) : 0;
+
+    const char *uri = "";
+    size_t uri_len = 0;
+    if (colon || element) {
+        /* Copied out first, as out may be where the URI is. */
+        const char *found;
+        if (!lookup(tok, qname, prefix_len, &found, &uri_len)) {
+            fail(tok, ERR_UNBOUND);
+            return (size_t)-1;
+        }
+        uri = found;
+    }
+
+    size_t start = utstring_len(out);
+    if (uri_len > 0) {
+        char sep = XMPP_PARSER_SEPARATOR;
+        if (out == &tok->names) {
+            /* The URI is in names too, and may move as it grows. */
+            size_t uri_at = uri - utstring_body(&tok->names);
+            utstring_reserve(out, uri_len + local_len + prefix_len + 3);
+            uri = utstring_body(&tok->names) + uri_at;
+        }
+        utstring_bincpy(out, uri, uri_len);
+        utstring_bincpy(out, &sep, 1);
+        utstring_bincpy(out, local, local_len);
+        if (colon) {
+            utstring_bincpy(out, &sep, 1);
+            utstring_bincpy(out, qname, prefix_len);
+        }
+    } else {
+        utstring_bincpy(out, local, local_len);
+    }
+    utstring_bincpy(out, "", 1);
+    return start;
+}
+
+/**
+ * Finds the end of a name at p.
+ *
+ * Names in a namespace aware document have at most one colon, with
+ * something on either side of it.
+ *
+ * @returns The end of the name (end if it may go on past there), or NULL if
+ *          it isn't a name.
+ */
+static const char* name(struct tokenizer *tok, const char *p,
+                        const char *end) {
+    const char *q = p;
+    unsigned char high = 0;
+    while (q < end && (CLASS[(unsigned char)*q] & C_NAME)) {
+        high |= *q++;
+    }
+    if (q == end) {
+        return q;
+    }
+
+    const char *colon = memchr(p, ':', q - p);
+    bool ok = q > p && (CLASS[(unsigned char)*p] & C_NAME_START)
+              && (CLASS[(unsigned char)*q] & C_NAME_END);
+    if (ok && colon != NULL) {
+        ok = colon + 1 < q && (CLASS[(unsigned char)colon[1]] & C_NAME_START)
+             && memchr(colon + 1, ':', q - colon - 1) == NULL;
+    }
+    for (const char *c = p; ok && (high & 0x80) && c < q; c++) {
+        if ((unsigned char)*c >= 0x80) {
+            int len = utf8_char(c, q);
+            ok = len > 0;
+            c += len - 1;
+        }
+    }
+    if (!ok) {
+        fail(tok, ERR_INVALID);
+        return NULL;
+    }
+    return q;
+}
+
+/**
+ * Decodes an entity or character reference.
+ *
+ * @param out     Filled in with the UTF-8 it stands for (up to 4 bytes).
+ * @param out_len Filled in with the length of out.
+ * @returns The length of the reference, -1 if it isn't all there yet, or 0
+ *          on error.
+ */
+static int ref(struct tokenizer *tok, const char *p, const char *end,
+               char *out, int *out_len) {
+    const char *semi = p + 1;
+    while (semi < end && *semi != ';') {
+        if (semi - p == MAX_REF_LEN
+                || !((CLASS[(unsigned char)*semi] & C_NAME) || *semi == '#')) {
+            fail(tok, ERR_INVALID);
+            return 0;
+        }
+        semi++;
+    }
+    if (semi == end) {
+        return -1;
+    }
+
+    const char *name = p + 1;
+    size_t len = semi - name;
+    int ref_len = semi + 1 - p;
+    if (len > 1 && name[0] == '#') {
+        unsigned long c = 0;
+        bool hex = name[1] == 'x';
+        const char *digit = name + (hex ? 2 : 1);
+        if (digit == semi) {
+            fail(tok, ERR_INVALID);
+            return 0;
+        }
+        for (; digit < semi; digit++) {
+            int value;
+            if (*digit >= '0' && *digit <= '9') {
+                value = *digit - '0';
+            } else if (hex && *digit >= 'a' && *digit <= 'f') {
+                value = *digit - 'a' + 10;
+            } else if (hex && *digit >= 'A' && *digit <= 'F') {
+                value = *digit - 'A' + 10;
+            } else {
+                fail(tok, ERR_INVALID);
+                return 0;
+            }
+            c = c * (hex ? 16 : 10) + value;
+            if (c > 0x10FFFF) {
+                break;
+            }
+        }
+        /* Only characters XML allows. */
+        if (!(c == 0x9 || c == 0xA || c == 0xD
+              || (c >= 0x20 && c <= 0xD7FF) || (c >= 0xE000 && c <= 0xFFFD)
+              || (c >= 0x10000 && c <= 0x10FFFF))) {
+            fail(tok, ERR_CHAR_REF);
+            return 0;
+        }
+        *out_len = utf8_encode(c, out);
+        return ref_len;
+    }
+
+    static const struct {
+        const char *name;
+        char c;
+    } ENTITIES[] = {
+        {"lt", '<'}, {"gt", '>'}, {"amp", '&'}, {"apos", '\''}, {"quot", '"'},
+    };
+    for (size_t i = 0; i < sizeof(ENTITIES) / sizeof(ENTITIES[0]); i++) {
+        if (strlen(ENTITIES[i].name) == len
+                && memcmp(ENTITIES[i].name, name, len) == 0) {
+            out[0] = ENTITIES[i].c;
+            *out_len = 1;
+            return ref_len;
+        }
+    }
+    fail(tok, ERR_ENTITY);
+    return 0;
+}
+
+/**
+ * Checks the UTF-8 character at p.
+ *
+ * @returns Its length, 0 if it isn't valid (overlong forms and surrogates
+ *          included), or -1 if it is cut off by end.
+ */
+static int utf8_char(const char *p, const char *end) {
+    const unsigned char *s = (const unsigned char*)p;
+    int len;
+    unsigned char min = 0x80, max = 0xBF;
+    if (s[0] < 0x80) {
+        return 1;
+    } else if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+        len = 2;
+    } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+        len = 3;
+        if (s[0] == 0xE0) {
+            min = 0xA0;
+        } else if (s[0] == 0xED) {
+            max = 0x9F;
+        }
+    } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+        len = 4;
+        if (s[0] == 0xF0) {
+            min = 0x90;
+        } else if (s[0] == 0xF4) {
+            max = 0x8F;
+        }
+    } else {
+        return 0;
+    }
+
+    /* The second byte has the tighter range, the rest any continuation. */
+    for (int i = 1; i < len; i++) {
+        if (p + i >= end) {
+            return -1;
+        }
+        if (s[i] < min || s[i] > max) {
+            return 0;
+        }
+        min = 0x80;
+        max = 0xBF;
+    }
+    return len;
+}
+
+/** Writes a character as UTF-8, returns its length. */
+static int utf8_encode(unsigned long c, char *out) {
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    } else if (c < 0x800) {
+        out[0] = 0xC0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3F);
+        return 2;
+    } else if (c < 0x10000) {
+        out[0] = 0xE0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3F);
+        out[2] = 0x80 | (c & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3F);
+    out[2] = 0x80 | ((c >> 6) & 0x3F);
+    out[3] = 0x80 | (c & 0x3F);
+    return 4;
+}
+
+/** FNV-1a hash of a name, for spotting duplicate attributes. */
+static unsigned int name_hash(const char *name) {
+    unsigned int hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+/** Stops tokenizing with an error (the first one sticks), returns false. */
+static bool fail(struct tokenizer *tok, const char *error) {
+    if (tok->error == NULL) {
+        tok->error = error;
+    }
+    return false;
+}
+
+/** Records the event about to be called back for. */
+static void event(struct tokenizer *tok, long long index, int count) {
+    tok->event_index = index;
+    tok->event_count = count;
+}
+
+/** Fills in the byte classes and picks the fastest scanner the CPU has. */
+static void init(void) {
+    for (int c = 0; c < 256; c++) {
+        bool start = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+                     || c == '_' || c >= 0x80;
+        if (start) {
+            CLASS[c] |= C_NAME_START;
+        }
+        if (start || (c >= '0' && c <= '9') || c == '-' || c == '.'
+                || c == ':') {
+            CLASS[c] |= C_NAME;
+        }
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            CLASS[c] |= C_SPACE | C_NAME_END;
+        }
+        if (c == '/' || c == '=' || c == '>') {
+            CLASS[c] |= C_NAME_END;
+        }
+        if (c < 0x20 || c >= 0x80 || c == '&' || c == '<' || c == '\''
+                || c == '"') {
+            CLASS[c] |= C_ATTR;
+        }
+    }
+
+    scan = scan_scalar;
+#if defined(__SSE2__)
+    scan = scan_sse2;
+#endif
+#ifdef HAVE_AVX2_SCAN
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan = scan_avx2;
+    }
+#endif
+}
+
+/**
+ * Finds the first byte that is a, b or c, or (as a signed char) is below
+ * below, which with 0x20 catches control characters and everything that
+ * isn't ASCII, and with -128 catches nothing.
+ *
+ * @returns The byte, or end if there isn't one.
+ */
+static const char* scan_scalar(const char *p, const char *end, char a,
+                               char b, char c, signed char below) {
+    for (; p < end; p++) {
+        if (*p == a || *p == b || *p == c || (signed char)*p < below) {
+            break;
+        }
+    }
+    return p;
+}
+
+#if defined(__SSE2__)
+/** scan_scalar(), 16 bytes at a time. */
+static const char* scan_sse2(const char *p, const char *end, char a, char b,
+                             char c, signed char below) {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vc = _mm_set1_epi8(c);
+    const __m128i vbelow = _mm_set1_epi8(below);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i match = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmplt_epi8(v, vbelow)));
+        int mask = _mm_movemask_epi8(match);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return scan_scalar(p, end, a, b, c, below);
+}
+#endif
+
+#ifdef HAVE_AVX2_SCAN
+/** scan_scalar(), 32 bytes at a time. */
+__attribute__((target("avx2")))
+static const char* scan_avx2(const char *p, const char *end, char a, char b,
+                             char c, signed char below) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+    const __m256i vbelow = _mm256_set1_epi8(below);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i match = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                _mm256_cmpeq_epi8(v, vb)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, vc),
+                                _mm256_cmpgt_epi8(vbelow, v)));
+        unsigned int mask = _mm256_movemask_epi8(match);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return scan_sse2(p, end, a, b, c, below);
+}
+#endif
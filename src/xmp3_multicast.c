@@ -294,6 +294,7 @@ static bool multicast_stop(void *data) {
                                  mcast);
     jid_del(jid);
 
+    xmpp_server_forget_source(mcast->server, &mcast->fd_readable);
     ev_io_stop(xmpp_server_loop(mcast->server), &mcast->fd_readable);
 
     struct ip_mreq req = {
@@ -323,7 +324,7 @@ static bool local_stanza_handler(struct xmpp_stanza *stanza,
                                  struct xmpp_server *server, void *data) {
     struct xmp3_multicast *mcast = data;
 
-    if (strcmp(xmpp_stanza_name(stanza), XMPP_STANZA_IQ) == 0) {
+    if (xmpp_stanza_kind(stanza) == XMPP_STANZA_KIND_IQ) {
         debug("Ignoring IQ stanza.");
         return false;
     }
@@ -381,9 +382,13 @@ static void socket_handler(struct ev_loop *loop, struct ev_io *w,
           mcast->buffer);
 
     /* Parse the XMPP stanza string we just received.  Reset the parser before
-     * to clear any state from previous stanzas. */
+     * to clear any state from previous stanzas.  If a local client can't
+     * keep up with what we hand the server, it stops our watcher until the
+     * client catches up (the kernel drops what doesn't fit meanwhile). */
     xmpp_parser_reset(mcast->parser, false);
+    xmpp_server_set_source(mcast->server, w);
     xmpp_parser_parse(mcast->parser, mcast->buffer, num_recv);
+    xmpp_server_set_source(mcast->server, NULL);
 
 error:
     return;
@@ -43,11 +43,40 @@
 /* Default address is loopback. */
 const struct in_addr DEFAULT_ADDR = { 0x0100007f };
 const uint16_t DEFAULT_PORT = 5222;
-const int DEFAULT_BACKLOG = 3;
+const int DEFAULT_BACKLOG = 1024;
+const int DEFAULT_ACCEPT_BUDGET = 64;
+const int DEFAULT_DEFER_ACCEPT = 0;
+const int DEFAULT_MAX_CLIENTS = 0;
+const int DEFAULT_WORKERS = 1;
 const size_t DEFAULT_BUFFER_SIZE = 2000;
+const size_t DEFAULT_MAX_BUFFER_SIZE = 65536;
+const size_t DEFAULT_READ_BUDGET = 65536;
+const int DEFAULT_READ_STANZA_BUDGET = 32;
+const size_t DEFAULT_MAX_STANZA_SIZE = 65536;
+const int DEFAULT_MAX_STANZA_DEPTH = 32;
+const int DEFAULT_MAX_ATTRIBUTES = 32;
+const int DEFAULT_MAX_NAMESPACES = 16;
+const size_t DEFAULT_MAX_TEXT_SIZE = 65536;
+const enum xmpp_parser_backend DEFAULT_XML_PARSER = XMPP_PARSER_BACKEND_EXPAT;
+const bool DEFAULT_IO_URING = false;
+const int DEFAULT_IO_URING_ENTRIES = 256;
+const long DEFAULT_HIBERNATE_TIMEOUT = 60;
+const long DEFAULT_IDLE_TIMEOUT = 300;
+const long DEFAULT_PING_INTERVAL = 120;
+const long DEFAULT_KEEPALIVE_INTERVAL = 0;
+const size_t DEFAULT_OUTBOUND_HIGH_WATERMARK = 262144;
+const size_t DEFAULT_OUTBOUND_LOW_WATERMARK = 65536;
+const enum xmp3_overflow_policy DEFAULT_PRESENCE_OVERFLOW =
+    XMP3_OVERFLOW_SUPERSEDE;
+const enum xmp3_overflow_policy DEFAULT_MESSAGE_OVERFLOW = XMP3_OVERFLOW_QUEUE;
+const enum xmp3_overflow_policy DEFAULT_IQ_OVERFLOW = XMP3_OVERFLOW_QUEUE;
 const bool DEFAULT_USE_SSL = true;
 const char *DEFAULT_KEYFILE = "server.pem";
 const char *DEFAULT_CERTFILE = "server.crt";
+const long DEFAULT_SSL_SESSION_CACHE = 20480;
+const long DEFAULT_SSL_SESSION_TIMEOUT = 3600;
+const bool DEFAULT_SSL_TICKETS = true;
+const long DEFAULT_SSL_TICKET_ROTATION = 3600;
 const char *DEFAULT_SERVER_NAME = "localhost";
 
 /** Hold all the options used to configure the XMP3 server. */
@@ -61,9 +90,76 @@ struct xmp3_options {
     /** Backlog of connections for the "listen" function. */
     int backlog;
 
-    /** Size of the incoming message buffer. */
+    /** Most connections to accept per listening socket event. */
+    int accept_budget;
+
+    /** TCP_DEFER_ACCEPT timeout in seconds, 0 if disabled. */
+    int defer_accept;
+
+    /** Maximum number of connected clients, 0 for no limit. */
+    int max_clients;
+
+    /** Number of worker threads, each with its own event loop. */
+    int workers;
+
+    /** Size of the first read from a client (and the smallest). */
     size_t buffer_size;
 
+    /** Largest a client's reads can grow to. */
+    size_t max_buffer_size;
+
+    /** Most bytes to read from a client per readiness event. */
+    size_t read_budget;
+
+    /** Most stanzas to parse from a client per readiness event. */
+    int read_stanza_budget;
+
+    /** Most bytes in a stanza from a client, 0 for no limit. */
+    size_t max_stanza_size;
+
+    /** Most levels of elements in a stanza, 0 for no limit. */
+    int max_stanza_depth;
+
+    /** Most attributes on an element, 0 for no limit. */
+    int max_attributes;
+
+    /** Most namespace declarations on an element, 0 for no limit. */
+    int max_namespaces;
+
+    /** Most bytes of text in a stanza, 0 for no limit. */
+    size_t max_text_size;
+    enum xmpp_parser_backend xml_parser;
+
+    /** Whether to batch socket I/O through io_uring. */
+    bool io_uring;
+
+    /** Most socket operations per io_uring submission. */
+    int io_uring_entries;
+
+    /** Seconds a client can be idle before it hibernates, 0 for never. */
+    long hibernate_timeout;
+
+    /** Seconds a client can be silent before it's disconnected, 0 for never. */
+    long idle_timeout;
+
+    /** Seconds a client can be silent before it's pinged, 0 for never. */
+    long ping_interval;
+
+    /** Seconds without output before sending a client a space, 0 for never. */
+    long keepalive_interval;
+
+    /** Queued output past which a client pushes back, 0 for no limit. */
+    size_t outbound_high_watermark;
+
+    /** Queued output under which a client stops pushing back. */
+    size_t outbound_low_watermark;
+
+    /** @{ What to do with each kind of stanza for a backed up client. */
+    enum xmp3_overflow_policy presence_overflow;
+    enum xmp3_overflow_policy message_overflow;
+    enum xmp3_overflow_policy iq_overflow;
+    /** @} */
+
     /** Whether or not to use SSL. */
     bool use_ssl;
 
@@ -73,6 +169,18 @@ struct xmp3_options {
     /** The path to the OpenSSL certificate file. */
     char *certfile;
 
+    /** Number of TLS sessions to cache, 0 to disable the cache. */
+    long ssl_session_cache;
+
+    /** Seconds a TLS session can be resumed for. */
+    long ssl_session_timeout;
+
+    /** Whether to issue TLS session tickets. */
+    bool ssl_tickets;
+
+    /** Seconds between rotating session ticket keys. */
+    long ssl_ticket_rotation;
+
     /**
      * The name of the server (domainpart of JID).
      *
@@ -99,9 +207,37 @@ struct xmp3_options* xmp3_options_new(void) {
     options->addr = DEFAULT_ADDR;
     options->port = DEFAULT_PORT;
     options->backlog = DEFAULT_BACKLOG;
+    options->accept_budget = DEFAULT_ACCEPT_BUDGET;
+    options->defer_accept = DEFAULT_DEFER_ACCEPT;
+    options->max_clients = DEFAULT_MAX_CLIENTS;
+    options->workers = DEFAULT_WORKERS;
     options->buffer_size = DEFAULT_BUFFER_SIZE;
+    options->max_buffer_size = DEFAULT_MAX_BUFFER_SIZE;
+    options->read_budget = DEFAULT_READ_BUDGET;
+    options->read_stanza_budget = DEFAULT_READ_STANZA_BUDGET;
+    options->max_stanza_size = DEFAULT_MAX_STANZA_SIZE;
+    options->max_stanza_depth = DEFAULT_MAX_STANZA_DEPTH;
+    options->max_attributes = DEFAULT_MAX_ATTRIBUTES;
+    options->max_namespaces = DEFAULT_MAX_NAMESPACES;
+    options->max_text_size = DEFAULT_MAX_TEXT_SIZE;
+    options->xml_parser = DEFAULT_XML_PARSER;
+    options->io_uring = DEFAULT_IO_URING;
+    options->io_uring_entries = DEFAULT_IO_URING_ENTRIES;
+    options->hibernate_timeout = DEFAULT_HIBERNATE_TIMEOUT;
+    options->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    options->ping_interval = DEFAULT_PING_INTERVAL;
+    options->keepalive_interval = DEFAULT_KEEPALIVE_INTERVAL;
+    options->outbound_high_watermark = DEFAULT_OUTBOUND_HIGH_WATERMARK;
+    options->outbound_low_watermark = DEFAULT_OUTBOUND_LOW_WATERMARK;
+    options->presence_overflow = DEFAULT_PRESENCE_OVERFLOW;
+    options->message_overflow = DEFAULT_MESSAGE_OVERFLOW;
+    options->iq_overflow = DEFAULT_IQ_OVERFLOW;
 
     options->use_ssl = DEFAULT_USE_SSL;
+    options->ssl_session_cache = DEFAULT_SSL_SESSION_CACHE;
+    options->ssl_session_timeout = DEFAULT_SSL_SESSION_TIMEOUT;
+    options->ssl_tickets = DEFAULT_SSL_TICKETS;
+    options->ssl_ticket_rotation = DEFAULT_SSL_TICKET_ROTATION;
 
     STRDUP_CHECK(options->keyfile, DEFAULT_KEYFILE);
     STRDUP_CHECK(options->certfile, DEFAULT_CERTFILE);
@@ -167,19 +303,532 @@ bool xmp3_options_set_backlog(struct xmp3_options *options, int backlog) {
     return true;
 }
 
+bool xmp3_options_set_backlog_str(struct xmp3_options *options,
+                                  const char *str) {
+    long int backlog;
+    if (!read_int(str, &backlog) || backlog < 1 || backlog > INT_MAX) {
+        return false;
+    }
+    return xmp3_options_set_backlog(options, backlog);
+}
+
 int xmp3_options_get_backlog(const struct xmp3_options *options) {
     return options->backlog;
 }
 
+bool xmp3_options_set_accept_budget(struct xmp3_options *options,
+                                    int budget) {
+    if (budget < 1) {
+        return false;
+    }
+    options->accept_budget = budget;
+    return true;
+}
+
+bool xmp3_options_set_accept_budget_str(struct xmp3_options *options,
+                                        const char *str) {
+    long int budget;
+    if (!read_int(str, &budget) || budget > INT_MAX) {
+        return false;
+    }
+    return xmp3_options_set_accept_budget(options, budget);
+}
+
+int xmp3_options_get_accept_budget(const struct xmp3_options *options) {
+    return options->accept_budget;
+}
+
+bool xmp3_options_set_defer_accept(struct xmp3_options *options,
+                                   int seconds) {
+    if (seconds < 0) {
+        return false;
+    }
+    options->defer_accept = seconds;
+    return true;
+}
+
+bool xmp3_options_set_defer_accept_str(struct xmp3_options *options,
+                                       const char *str) {
+    long int seconds;
+    if (!read_int(str, &seconds) || seconds > INT_MAX) {
+        return false;
+    }
+    return xmp3_options_set_defer_accept(options, seconds);
+}
+
+int xmp3_options_get_defer_accept(const struct xmp3_options *options) {
+    return options->defer_accept;
+}
+
+bool xmp3_options_set_max_clients(struct xmp3_options *options,
+                                  int max_clients) {
+    if (max_clients < 0) {
+        return false;
+    }
+    options->max_clients = max_clients;
+    return true;
+}
+
+bool xmp3_options_set_max_clients_str(struct xmp3_options *options,
+                                      const char *str) {
+    long int max_clients;
+    if (!read_int(str, &max_clients) || max_clients > INT_MAX) {
+        return false;
+    }
+    return xmp3_options_set_max_clients(options, max_clients);
+}
+
+int xmp3_options_get_max_clients(const struct xmp3_options *options) {
+    return options->max_clients;
+}
+
+bool xmp3_options_set_workers(struct xmp3_options *options, int workers) {
+    if (workers < 1) {
+        return false;
+    }
+    options->workers = workers;
+    return true;
+}
+
+bool xmp3_options_set_workers_str(struct xmp3_options *options,
+                                  const char *str) {
+    long int workers;
+    if (!read_int(str, &workers)) {
+        return false;
+    }
+
+    /* Not much point in more threads than this. */
+    if (workers > 1024) {
+        return false;
+    }
+
+    return xmp3_options_set_workers(options, workers);
+}
+
+int xmp3_options_get_workers(const struct xmp3_options *options) {
+    return options->workers;
+}
+
 bool xmp3_options_set_buffer_size(struct xmp3_options *options, size_t size) {
+    if (size < 1) {
+        return false;
+    }
     options->buffer_size = size;
     return true;
 }
 
+bool xmp3_options_set_buffer_size_str(struct xmp3_options *options,
+                                      const char *str) {
+    long int size;
+    if (!read_int(str, &size) || size < 0 || size > INT_MAX) {
+        return false;
+    }
+    return xmp3_options_set_buffer_size(options, size);
+}
+
 size_t xmp3_options_get_buffer_size(const struct xmp3_options *options) {
     return options->buffer_size;
 }
 
+bool xmp3_options_set_max_buffer_size(struct xmp3_options *options,
+                                      size_t size) {
+    if (size < 1) {
+        return false;
+    }
+    options->max_buffer_size = size;
+    return true;
+}
+
+bool xmp3_options_set_max_buffer_size_str(struct xmp3_options *options,
+                                          const char *str) {
+    long int size;
+    if (!read_int(str, &size) || size < 0 || size > INT_MAX) {
+        return false;
+    }
+    return xmp3_options_set_max_buffer_size(options, size);
+}
+
+size_t xmp3_options_get_max_buffer_size(const struct xmp3_options *options) {
+    return options->max_buffer_size;
+}
+
+bool xmp3_options_set_read_budget(struct xmp3_options *options,
+                                  size_t budget) {
+    if (budget < 1) {
+        return false;
+    }
+    options->read_budget = budget;
+    return true;
+}
+
+bool xmp3_options_set_read_budget_str(struct xmp3_options *options,
+                                      const char *str) {
+    long int budget;
+    if (!read_int(str, &budget) || budget < 0) {
+        return false;
+    }
+    return xmp3_options_set_read_budget(options, budget);
+}
+
+size_t xmp3_options_get_read_budget(const struct xmp3_options *options) {
+    return options->read_budget;
+}
+
+bool xmp3_options_set_read_stanza_budget(struct xmp3_options *options,
+                                         int budget) {
+    if (budget < 1) {
+        return false;
+    }
+    options->read_stanza_budget = budget;
+    return true;
+}
+
+bool xmp3_options_set_read_stanza_budget_str(struct xmp3_options *options,
+                                             const char *str) {
+    long int budget;
+    if (!read_int(str, &budget) || budget > INT_MAX) {
+        return false;
+    }
+    return xmp3_options_set_read_stanza_budget(options, budget);
+}
+
+int xmp3_options_get_read_stanza_budget(const struct xmp3_options *options) {
+    return options->read_stanza_budget;
+}
+
+bool xmp3_options_set_max_stanza_size(struct xmp3_options *options,
+                                      size_t size) {
+    options->max_stanza_size = size;
+    return true;
+}
+
+bool xmp3_options_set_max_stanza_size_str(struct xmp3_options *options,
+                                          const char *str) {
+    long int size;
+    if (!read_int(str, &size) || size < 0) {
+        return false;
+    }
+    return xmp3_options_set_max_stanza_size(options, size);
+}
+
+size_t xmp3_options_get_max_stanza_size(const struct xmp3_options *options) {
+    return options->max_stanza_size;
+}
+
+bool xmp3_options_set_max_stanza_depth(struct xmp3_options *options,
+                                       int limit) {
+    if (limit < 0) {
+        return false;
+    }
+    options->max_stanza_depth = limit;
+    return true;
+}
+
+bool xmp3_options_set_max_stanza_depth_str(struct xmp3_options *options,
+                                           const char *str) {
+    long int limit;
+    if (!read_int(str, &limit) || limit < 0 || limit > INT_MAX) {
+        return false;
+    }
+    return xmp3_options_set_max_stanza_depth(options, limit);
+}
+
+int xmp3_options_get_max_stanza_depth(const struct xmp3_options *options) {
+    return options->max_stanza_depth;
+}
+
+bool xmp3_options_set_max_attributes(struct xmp3_options *options, int limit) {
+    if (limit < 0) {
+        return false;
+    }
+    options->max_attributes = limit;
+    return true;
+}
+
+bool xmp3_options_set_max_attributes_str(struct xmp3_options *options,
+                                         const char *str) {
+    long int limit;
+    if (!read_int(str, &limit) || limit < 0 || limit > INT_MAX) {
+        return false;
+    }
+    return xmp3_options_set_max_attributes(options, limit);
+}
+
+int xmp3_options_get_max_attributes(const struct xmp3_options *options) {
+    return options->max_attributes;
+}
+
+bool xmp3_options_set_max_namespaces(struct xmp3_options *options, int limit) {
+    if (limit < 0) {
+        return false;
+    }
+    options->max_namespaces = limit;
+    return true;
+}
+
+bool xmp3_options_set_max_namespaces_str(struct xmp3_options *options,
+                                         const char *str) {
+    long int limit;
+    if (!read_int(str, &limit) || limit < 0 || limit > INT_MAX) {
+        return false;
+    }
+    return xmp3_options_set_max_namespaces(options, limit);
+}
+
+int xmp3_options_get_max_namespaces(const struct xmp3_options *options) {
+    return options->max_namespaces;
+}
+
+bool xmp3_options_set_max_text_size(struct xmp3_options *options, size_t size) {
+    options->max_text_size = size;
+    return true;
+}
+
+bool xmp3_options_set_max_text_size_str(struct xmp3_options *options,
+                                        const char *str) {
+    long int size;
+    if (!read_int(str, &size) || size < 0) {
+        return false;
+    }
+    return xmp3_options_set_max_text_size(options, size);
+}
+
+size_t xmp3_options_get_max_text_size(const struct xmp3_options *options) {
+    return options->max_text_size;
+}
+
+bool xmp3_options_set_xml_parser(struct xmp3_options *options,
+                                 enum xmpp_parser_backend backend) {
+    options->xml_parser = backend;
+    return true;
+}
+
+bool xmp3_options_set_xml_parser_str(struct xmp3_options *options,
+                                     const char *str) {
+    if (strcmp(str, "expat") == 0) {
+        return xmp3_options_set_xml_parser(options, XMPP_PARSER_BACKEND_EXPAT);
+    } else if (strcmp(str, "tokenizer") == 0) {
+        return xmp3_options_set_xml_parser(options,
+                                           XMPP_PARSER_BACKEND_TOKENIZER);
+    }
+    return false;
+}
+
+enum xmpp_parser_backend xmp3_options_get_xml_parser(
+        const struct xmp3_options *options) {
+    return options->xml_parser;
+}
+
+bool xmp3_options_set_io_uring(struct xmp3_options *options, bool io_uring) {
+    options->io_uring = io_uring;
+    return true;
+}
+
+bool xmp3_options_get_io_uring(const struct xmp3_options *options) {
+    return options->io_uring;
+}
+
+bool xmp3_options_set_io_uring_entries(struct xmp3_options *options,
+                                       int entries) {
+    if (entries < 1) {
+        return false;
+    }
+    options->io_uring_entries = entries;
+    return true;
+}
+
+bool xmp3_options_set_io_uring_entries_str(struct xmp3_options *options,
+                                           const char *str) {
+    long int entries;
+    if (!read_int(str, &entries) || entries > INT_MAX) {
+        return false;
+    }
+    return xmp3_options_set_io_uring_entries(options, entries);
+}
+
+int xmp3_options_get_io_uring_entries(const struct xmp3_options *options) {
+    return options->io_uring_entries;
+}
+
+bool xmp3_options_set_hibernate_timeout(struct xmp3_options *options,
+                                        long seconds) {
+    if (seconds < 0) {
+        return false;
+    }
+    options->hibernate_timeout = seconds;
+    return true;
+}
+
+bool xmp3_options_set_hibernate_timeout_str(struct xmp3_options *options,
+                                            const char *str) {
+    long int seconds;
+    if (!read_int(str, &seconds)) {
+        return false;
+    }
+    return xmp3_options_set_hibernate_timeout(options, seconds);
+}
+
+long xmp3_options_get_hibernate_timeout(const struct xmp3_options *options) {
+    return options->hibernate_timeout;
+}
+
+bool xmp3_options_set_idle_timeout(struct xmp3_options *options, long seconds) {
+    if (seconds < 0) {
+        return false;
+    }
+    options->idle_timeout = seconds;
+    return true;
+}
+
+bool xmp3_options_set_idle_timeout_str(struct xmp3_options *options,
+                                       const char *str) {
+    long int seconds;
+    if (!read_int(str, &seconds)) {
+        return false;
+    }
+    return xmp3_options_set_idle_timeout(options, seconds);
+}
+
+long xmp3_options_get_idle_timeout(const struct xmp3_options *options) {
+    return options->idle_timeout;
+}
+
+bool xmp3_options_set_ping_interval(struct xmp3_options *options,
+                                    long seconds) {
+    if (seconds < 0) {
+        return false;
+    }
+    options->ping_interval = seconds;
+    return true;
+}
+
+bool xmp3_options_set_ping_interval_str(struct xmp3_options *options,
+                                        const char *str) {
+    long int seconds;
+    if (!read_int(str, &seconds)) {
+        return false;
+    }
+    return xmp3_options_set_ping_interval(options, seconds);
+}
+
+long xmp3_options_get_ping_interval(const struct xmp3_options *options) {
+    return options->ping_interval;
+}
+
+bool xmp3_options_set_keepalive_interval(struct xmp3_options *options,
+                                         long seconds) {
+    if (seconds < 0) {
+        return false;
+    }
+    options->keepalive_interval = seconds;
+    return true;
+}
+
+bool xmp3_options_set_keepalive_interval_str(struct xmp3_options *options,
+                                             const char *str) {
+    long int seconds;
+    if (!read_int(str, &seconds)) {
+        return false;
+    }
+    return xmp3_options_set_keepalive_interval(options, seconds);
+}
+
+long xmp3_options_get_keepalive_interval(const struct xmp3_options *options) {
+    return options->keepalive_interval;
+}
+
+bool xmp3_options_set_outbound_high_watermark(struct xmp3_options *options,
+                                              size_t bytes) {
+    options->outbound_high_watermark = bytes;
+    return true;
+}
+
+bool xmp3_options_set_outbound_high_watermark_str(
+        struct xmp3_options *options, const char *str) {
+    long int bytes;
+    if (!read_int(str, &bytes) || bytes < 0) {
+        return false;
+    }
+    return xmp3_options_set_outbound_high_watermark(options, bytes);
+}
+
+size_t xmp3_options_get_outbound_high_watermark(
+        const struct xmp3_options *options) {
+    return options->outbound_high_watermark;
+}
+
+bool xmp3_options_set_outbound_low_watermark(struct xmp3_options *options,
+                                             size_t bytes) {
+    options->outbound_low_watermark = bytes;
+    return true;
+}
+
+bool xmp3_options_set_outbound_low_watermark_str(struct xmp3_options *options,
+                                                 const char *str) {
+    long int bytes;
+    if (!read_int(str, &bytes) || bytes < 0) {
+        return false;
+    }
+    return xmp3_options_set_outbound_low_watermark(options, bytes);
+}
+
+size_t xmp3_options_get_outbound_low_watermark(
+        const struct xmp3_options *options) {
+    return options->outbound_low_watermark;
+}
+
+/** Finds the overflow policy for a kind of stanza, NULL if there isn't one. */
+static enum xmp3_overflow_policy* overflow_policy(
+        const struct xmp3_options *options, const char *stanza) {
+    struct xmp3_options *mutable = (struct xmp3_options*)options;
+    if (strcmp(stanza, "presence") == 0) {
+        return &mutable->presence_overflow;
+    } else if (strcmp(stanza, "message") == 0) {
+        return &mutable->message_overflow;
+    } else if (strcmp(stanza, "iq") == 0) {
+        return &mutable->iq_overflow;
+    }
+    return NULL;
+}
+
+bool xmp3_options_set_overflow_policy(struct xmp3_options *options,
+                                      const char *stanza,
+                                      enum xmp3_overflow_policy policy) {
+    enum xmp3_overflow_policy *field = overflow_policy(options, stanza);
+    if (field == NULL) {
+        return false;
+    }
+    /* Only presence says everything there is to know about its sender, so
+     * a newer one can stand in for an older one. */
+    if (policy == XMP3_OVERFLOW_SUPERSEDE && strcmp(stanza, "presence") != 0) {
+        return false;
+    }
+    *field = policy;
+    return true;
+}
+
+bool xmp3_options_set_overflow_policy_str(struct xmp3_options *options,
+                                          const char *stanza,
+                                          const char *policy) {
+    if (strcmp(policy, "queue") == 0) {
+        return xmp3_options_set_overflow_policy(options, stanza,
+                                                XMP3_OVERFLOW_QUEUE);
+    } else if (strcmp(policy, "drop") == 0) {
+        return xmp3_options_set_overflow_policy(options, stanza,
+                                                XMP3_OVERFLOW_DROP);
+    } else if (strcmp(policy, "supersede") == 0) {
+        return xmp3_options_set_overflow_policy(options, stanza,
+                                                XMP3_OVERFLOW_SUPERSEDE);
+    }
+    return false;
+}
+
+enum xmp3_overflow_policy xmp3_options_get_overflow_policy(
+        const struct xmp3_options *options, const char *stanza) {
+    enum xmp3_overflow_policy *field = overflow_policy(options, stanza);
+    return field == NULL ? XMP3_OVERFLOW_QUEUE : *field;
+}
+
 bool xmp3_options_set_ssl(struct xmp3_options *options, bool use_ssl) {
     options->use_ssl = use_ssl;
     return true;
@@ -209,6 +858,81 @@ const char* xmp3_options_get_certificate(const struct xmp3_options *options) {
     return options->certfile;
 }
 
+bool xmp3_options_set_ssl_session_cache(struct xmp3_options *options,
+                                        long size) {
+    if (size < 0) {
+        return false;
+    }
+    options->ssl_session_cache = size;
+    return true;
+}
+
+bool xmp3_options_set_ssl_session_cache_str(struct xmp3_options *options,
+                                            const char *str) {
+    long int size;
+    if (!read_int(str, &size)) {
+        return false;
+    }
+    return xmp3_options_set_ssl_session_cache(options, size);
+}
+
+long xmp3_options_get_ssl_session_cache(const struct xmp3_options *options) {
+    return options->ssl_session_cache;
+}
+
+bool xmp3_options_set_ssl_session_timeout(struct xmp3_options *options,
+                                          long seconds) {
+    if (seconds < 1) {
+        return false;
+    }
+    options->ssl_session_timeout = seconds;
+    return true;
+}
+
+bool xmp3_options_set_ssl_session_timeout_str(struct xmp3_options *options,
+                                              const char *str) {
+    long int seconds;
+    if (!read_int(str, &seconds)) {
+        return false;
+    }
+    return xmp3_options_set_ssl_session_timeout(options, seconds);
+}
+
+long xmp3_options_get_ssl_session_timeout(const struct xmp3_options *options) {
+    return options->ssl_session_timeout;
+}
+
+bool xmp3_options_set_ssl_tickets(struct xmp3_options *options, bool tickets) {
+    options->ssl_tickets = tickets;
+    return true;
+}
+
+bool xmp3_options_get_ssl_tickets(const struct xmp3_options *options) {
+    return options->ssl_tickets;
+}
+
+bool xmp3_options_set_ssl_ticket_rotation(struct xmp3_options *options,
+                                          long seconds) {
+    if (seconds < 1) {
+        return false;
+    }
+    options->ssl_ticket_rotation = seconds;
+    return true;
+}
+
+bool xmp3_options_set_ssl_ticket_rotation_str(struct xmp3_options *options,
+                                              const char *str) {
+    long int seconds;
+    if (!read_int(str, &seconds)) {
+        return false;
+    }
+    return xmp3_options_set_ssl_ticket_rotation(options, seconds);
+}
+
+long xmp3_options_get_ssl_ticket_rotation(const struct xmp3_options *options) {
+    return options->ssl_ticket_rotation;
+}
+
 bool xmp3_options_set_server_name(struct xmp3_options *options,
                                   const char *name) {
     copy_string(&options->server_name, name);
@@ -253,6 +977,120 @@ static int ini_handler(void *data, const char *section, const char *name,
             return xmp3_options_set_port_str(options, value);
         }
 
+        if (strcmp(name, "backlog") == 0) {
+            return xmp3_options_set_backlog_str(options, value);
+        }
+
+        if (strcmp(name, "accept_budget") == 0) {
+            return xmp3_options_set_accept_budget_str(options, value);
+        }
+
+        if (strcmp(name, "defer_accept") == 0) {
+            return xmp3_options_set_defer_accept_str(options, value);
+        }
+
+        if (strcmp(name, "max_clients") == 0) {
+            return xmp3_options_set_max_clients_str(options, value);
+        }
+
+        if (strcmp(name, "workers") == 0) {
+            return xmp3_options_set_workers_str(options, value);
+        }
+
+        if (strcmp(name, "buffer_size") == 0) {
+            return xmp3_options_set_buffer_size_str(options, value);
+        }
+
+        if (strcmp(name, "max_buffer_size") == 0) {
+            return xmp3_options_set_max_buffer_size_str(options, value);
+        }
+
+        if (strcmp(name, "read_budget") == 0) {
+            return xmp3_options_set_read_budget_str(options, value);
+        }
+
+        if (strcmp(name, "read_stanza_budget") == 0) {
+            return xmp3_options_set_read_stanza_budget_str(options, value);
+        }
+
+        if (strcmp(name, "max_stanza_size") == 0) {
+            return xmp3_options_set_max_stanza_size_str(options, value);
+        }
+
+        if (strcmp(name, "max_stanza_depth") == 0) {
+            return xmp3_options_set_max_stanza_depth_str(options, value);
+        }
+
+        if (strcmp(name, "max_attributes") == 0) {
+            return xmp3_options_set_max_attributes_str(options, value);
+        }
+
+        if (strcmp(name, "max_namespaces") == 0) {
+            return xmp3_options_set_max_namespaces_str(options, value);
+        }
+
+        if (strcmp(name, "max_text_size") == 0) {
+            return xmp3_options_set_max_text_size_str(options, value);
+        }
+
+        if (strcmp(name, "xml_parser") == 0) {
+            return xmp3_options_set_xml_parser_str(options, value);
+        }
+
+        if (strcmp(name, "io_uring") == 0) {
+            if (strcmp(value, "true") == 0) {
+                return xmp3_options_set_io_uring(options, true);
+            } else if (strcmp(value, "false") == 0) {
+                return xmp3_options_set_io_uring(options, false);
+            } else {
+                log_err("Invalid value for io_uring option: '%s'", value);
+                return false;
+            }
+        }
+
+        if (strcmp(name, "io_uring_entries") == 0) {
+            return xmp3_options_set_io_uring_entries_str(options, value);
+        }
+
+        if (strcmp(name, "hibernate_timeout") == 0) {
+            return xmp3_options_set_hibernate_timeout_str(options, value);
+        }
+
+        if (strcmp(name, "idle_timeout") == 0) {
+            return xmp3_options_set_idle_timeout_str(options, value);
+        }
+
+        if (strcmp(name, "ping_interval") == 0) {
+            return xmp3_options_set_ping_interval_str(options, value);
+        }
+
+        if (strcmp(name, "keepalive_interval") == 0) {
+            return xmp3_options_set_keepalive_interval_str(options, value);
+        }
+
+        if (strcmp(name, "outbound_high_watermark") == 0) {
+            return xmp3_options_set_outbound_high_watermark_str(options,
+                                                                value);
+        }
+
+        if (strcmp(name, "outbound_low_watermark") == 0) {
+            return xmp3_options_set_outbound_low_watermark_str(options, value);
+        }
+
+        if (strcmp(name, "presence_overflow") == 0) {
+            return xmp3_options_set_overflow_policy_str(options, "presence",
+                                                        value);
+        }
+
+        if (strcmp(name, "message_overflow") == 0) {
+            return xmp3_options_set_overflow_policy_str(options, "message",
+                                                        value);
+        }
+
+        if (strcmp(name, "iq_overflow") == 0) {
+            return xmp3_options_set_overflow_policy_str(options, "iq", value);
+        }
+
         if (strcmp(name, "ssl") == 0) {
             if (strcmp(value, "true") == 0) {
                 return xmp3_options_set_ssl(options, true);
@@ -264,6 +1102,29 @@ static int ini_handler(void *data, const char *section, const char *name,
             }
         }
 
+        if (strcmp(name, "ssl_session_cache") == 0) {
+            return xmp3_options_set_ssl_session_cache_str(options, value);
+        }
+
+        if (strcmp(name, "ssl_session_timeout") == 0) {
+            return xmp3_options_set_ssl_session_timeout_str(options, value);
+        }
+
+        if (strcmp(name, "ssl_tickets") == 0) {
+            if (strcmp(value, "true") == 0) {
+                return xmp3_options_set_ssl_tickets(options, true);
+            } else if (strcmp(value, "false") == 0) {
+                return xmp3_options_set_ssl_tickets(options, false);
+            } else {
+                log_err("Invalid value for ssl_tickets option: '%s'", value);
+                return false;
+            }
+        }
+
+        if (strcmp(name, "ssl_ticket_rotation") == 0) {
+            return xmp3_options_set_ssl_ticket_rotation_str(options, value);
+        }
+
         if (strcmp(name, "keyfile") == 0) {
             return xmp3_options_set_keyfile(options, value);
         }
@@ -32,13 +32,56 @@
 #include <stdbool.h>
 #include <netinet/in.h>
 
+#include "xmpp_parser.h"
+
+/** What to do with a stanza for a client whose output is backed up. */
+enum xmp3_overflow_policy {
+    /** Queue it anyway. */
+    XMP3_OVERFLOW_QUEUE,
+
+    /** Drop it. */
+    XMP3_OVERFLOW_DROP,
+
+    /** Hold on to only the latest one from each sender until the client
+     * catches up (presence only). */
+    XMP3_OVERFLOW_SUPERSEDE,
+};
+
 extern const struct in_addr DEFAULT_ADDR;
 extern const uint16_t DEFAULT_PORT;
 extern const int DEFAULT_BACKLOG;
+extern const int DEFAULT_ACCEPT_BUDGET;
+extern const int DEFAULT_DEFER_ACCEPT;
+extern const int DEFAULT_MAX_CLIENTS;
+extern const int DEFAULT_WORKERS;
 extern const size_t DEFAULT_BUFFER_SIZE;
+extern const size_t DEFAULT_MAX_BUFFER_SIZE;
+extern const size_t DEFAULT_READ_BUDGET;
+extern const int DEFAULT_READ_STANZA_BUDGET;
+extern const size_t DEFAULT_MAX_STANZA_SIZE;
+extern const int DEFAULT_MAX_STANZA_DEPTH;
+extern const int DEFAULT_MAX_ATTRIBUTES;
+extern const int DEFAULT_MAX_NAMESPACES;
+extern const size_t DEFAULT_MAX_TEXT_SIZE;
+extern const enum xmpp_parser_backend DEFAULT_XML_PARSER;
+extern const bool DEFAULT_IO_URING;
+extern const int DEFAULT_IO_URING_ENTRIES;
+extern const long DEFAULT_HIBERNATE_TIMEOUT;
+extern const long DEFAULT_IDLE_TIMEOUT;
+extern const long DEFAULT_PING_INTERVAL;
+extern const long DEFAULT_KEEPALIVE_INTERVAL;
+extern const size_t DEFAULT_OUTBOUND_HIGH_WATERMARK;
+extern const size_t DEFAULT_OUTBOUND_LOW_WATERMARK;
+extern const enum xmp3_overflow_policy DEFAULT_PRESENCE_OVERFLOW;
+extern const enum xmp3_overflow_policy DEFAULT_MESSAGE_OVERFLOW;
+extern const enum xmp3_overflow_policy DEFAULT_IQ_OVERFLOW;
 extern const bool DEFAULT_USE_SSL;
 extern const char *DEFAULT_KEYFILE;
 extern const char *DEFAULT_CERTFILE;
+extern const long DEFAULT_SSL_SESSION_CACHE;
+extern const long DEFAULT_SSL_SESSION_TIMEOUT;
+extern const bool DEFAULT_SSL_TICKETS;
+extern const long DEFAULT_SSL_TICKET_ROTATION;
 extern const char *DEFAULT_SERVER_NAME;
 
 /** Opaque pointer maintaining the options for XMP3. */
@@ -95,19 +138,391 @@ uint16_t xmp3_options_get_port(const struct xmp3_options *options);
  */
 bool xmp3_options_set_backlog(struct xmp3_options *options, int backlog);
 
+/**
+ * Set the amount of pending connections using a string.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_backlog_str(struct xmp3_options *options,
+                                  const char *backlog);
+
 /** Get the amount of pending connections the server will support. */
 int xmp3_options_get_backlog(const struct xmp3_options *options);
 
+/**
+ * Set the most connections to accept each time the listening socket becomes
+ * readable, before giving other events a chance to run.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_accept_budget(struct xmp3_options *options,
+                                    int budget);
+
+/** Set the accept budget using a string. */
+bool xmp3_options_set_accept_budget_str(struct xmp3_options *options,
+                                        const char *budget);
+
+/** Get the most connections to accept per listening socket event. */
+int xmp3_options_get_accept_budget(const struct xmp3_options *options);
+
+/**
+ * Set how many seconds the kernel should hold a new connection until the
+ * client sends data (TCP_DEFER_ACCEPT).  0 disables this.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_defer_accept(struct xmp3_options *options,
+                                   int seconds);
+
+/** Set the TCP_DEFER_ACCEPT timeout using a string. */
+bool xmp3_options_set_defer_accept_str(struct xmp3_options *options,
+                                       const char *seconds);
+
+/** Get the TCP_DEFER_ACCEPT timeout in seconds, 0 if disabled. */
+int xmp3_options_get_defer_accept(const struct xmp3_options *options);
+
+/**
+ * Set the maximum number of concurrently connected clients.
+ *
+ * Clients connecting past this limit are sent a stream error and
+ * disconnected.  0 means no limit.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_max_clients(struct xmp3_options *options,
+                                  int max_clients);
+
+/** Set the maximum number of clients using a string. */
+bool xmp3_options_set_max_clients_str(struct xmp3_options *options,
+                                      const char *max_clients);
+
+/** Get the maximum number of concurrently connected clients (0 is none). */
+int xmp3_options_get_max_clients(const struct xmp3_options *options);
+
+/**
+ * Set the number of worker threads (event loops) to run.
+ *
+ * Each worker gets its own listening socket (using SO_REUSEPORT) and handles
+ * the clients that connect to it.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_workers(struct xmp3_options *options, int workers);
+
+/**
+ * Set the number of worker threads using a string.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_workers_str(struct xmp3_options *options,
+                                  const char *workers);
+
+/** Get the number of worker threads to run. */
+int xmp3_options_get_workers(const struct xmp3_options *options);
+
 /**
  * Set the size of the buffer used to receive incoming data.
  *
+ * This is the size of the first read from each client.  Each client's reads
+ * then grow (up to the max buffer size) while they keep filling the buffer,
+ * and shrink back towards this size when they don't.
+ *
  * @return true if successful, false if not.
  */
 bool xmp3_options_set_buffer_size(struct xmp3_options *options, size_t size);
 
+/** Set the size of the receive buffer using a string. */
+bool xmp3_options_set_buffer_size_str(struct xmp3_options *options,
+                                      const char *size);
+
 /** Get the size of the buffer used to receive incoming data. */
 size_t xmp3_options_get_buffer_size(const struct xmp3_options *options);
 
+/**
+ * Set the largest size a client's receive buffer can grow to.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_max_buffer_size(struct xmp3_options *options,
+                                      size_t size);
+
+/** Set the largest receive buffer size using a string. */
+bool xmp3_options_set_max_buffer_size_str(struct xmp3_options *options,
+                                          const char *size);
+
+/** Get the largest size a client's receive buffer can grow to. */
+size_t xmp3_options_get_max_buffer_size(const struct xmp3_options *options);
+
+/**
+ * Set the most bytes to read from a client each time its socket becomes
+ * readable, before giving other clients a chance.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_read_budget(struct xmp3_options *options,
+                                  size_t budget);
+
+/** Set the read budget in bytes using a string. */
+bool xmp3_options_set_read_budget_str(struct xmp3_options *options,
+                                      const char *budget);
+
+/** Get the most bytes to read from a client per readiness event. */
+size_t xmp3_options_get_read_budget(const struct xmp3_options *options);
+
+/**
+ * Set the most stanzas to handle from a client each time its socket becomes
+ * readable, before giving other clients a chance.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_read_stanza_budget(struct xmp3_options *options,
+                                         int budget);
+
+/** Set the read budget in stanzas using a string. */
+bool xmp3_options_set_read_stanza_budget_str(struct xmp3_options *options,
+                                             const char *budget);
+
+/** Get the most stanzas to handle from a client per readiness event. */
+int xmp3_options_get_read_stanza_budget(const struct xmp3_options *options);
+
+/**
+ * Set the most bytes a stanza from a client can have, start tag to end
+ * tag.  0 is unlimited.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_max_stanza_size(struct xmp3_options *options,
+                                      size_t size);
+
+/** Set the stanza size limit using a string. */
+bool xmp3_options_set_max_stanza_size_str(struct xmp3_options *options,
+                                          const char *str);
+
+/** Get the most bytes in a stanza from a client. */
+size_t xmp3_options_get_max_stanza_size(const struct xmp3_options *options);
+
+/**
+ * Set how deep elements can be nested in a stanza from a client (the
+ * stanza itself is one level).  0 is unlimited.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_max_stanza_depth(struct xmp3_options *options, int limit);
+
+/** Set the nesting limit using a string. */
+bool xmp3_options_set_max_stanza_depth_str(struct xmp3_options *options,
+                                           const char *str);
+
+/** Get the most levels of elements in a stanza from a client. */
+int xmp3_options_get_max_stanza_depth(const struct xmp3_options *options);
+
+/**
+ * Set the most attributes an element from a client can have.  0 is unlimited.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_max_attributes(struct xmp3_options *options, int limit);
+
+/** Set the attribute limit using a string. */
+bool xmp3_options_set_max_attributes_str(struct xmp3_options *options,
+                                         const char *str);
+
+/** Get the most attributes on an element from a client. */
+int xmp3_options_get_max_attributes(const struct xmp3_options *options);
+
+/**
+ * Set the most namespace declarations an element from a client can have.
+ * 0 is unlimited.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_max_namespaces(struct xmp3_options *options, int limit);
+
+/** Set the namespace declaration limit using a string. */
+bool xmp3_options_set_max_namespaces_str(struct xmp3_options *options,
+                                         const char *str);
+
+/** Get the most namespace declarations on an element from a client. */
+int xmp3_options_get_max_namespaces(const struct xmp3_options *options);
+
+/**
+ * Set the most bytes of character data a stanza from a client can have.
+ * 0 is unlimited.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_max_text_size(struct xmp3_options *options, size_t size);
+
+/** Set the text size limit using a string. */
+bool xmp3_options_set_max_text_size_str(struct xmp3_options *options,
+                                        const char *str);
+
+/** Get the most bytes of text in a stanza from a client. */
+size_t xmp3_options_get_max_text_size(const struct xmp3_options *options);
+
+/**
+ * Set the XML parser streams from clients are parsed with.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_xml_parser(struct xmp3_options *options,
+                                 enum xmpp_parser_backend backend);
+
+/** Set the XML parser by name, "expat" or "tokenizer". */
+bool xmp3_options_set_xml_parser_str(struct xmp3_options *options,
+                                     const char *str);
+
+/** Get the XML parser streams from clients are parsed with. */
+enum xmpp_parser_backend xmp3_options_get_xml_parser(
+        const struct xmp3_options *options);
+
+/**
+ * Enable/disable batching socket I/O through io_uring (Linux only).
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_io_uring(struct xmp3_options *options, bool io_uring);
+
+/** Get whether socket I/O is batched through io_uring. */
+bool xmp3_options_get_io_uring(const struct xmp3_options *options);
+
+/**
+ * Set the most socket operations to batch into one io_uring submission.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_io_uring_entries(struct xmp3_options *options,
+                                       int entries);
+
+/** Set the io_uring batch size using a string. */
+bool xmp3_options_set_io_uring_entries_str(struct xmp3_options *options,
+                                           const char *entries);
+
+/** Get the most socket operations batched into one io_uring submission. */
+int xmp3_options_get_io_uring_entries(const struct xmp3_options *options);
+
+/**
+ * Set how many seconds a client can go without sending anything before the
+ * server frees its parser and buffers.  0 disables hibernation.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_hibernate_timeout(struct xmp3_options *options,
+                                        long seconds);
+
+/** Set the hibernation timeout using a string. */
+bool xmp3_options_set_hibernate_timeout_str(struct xmp3_options *options,
+                                            const char *seconds);
+
+/** Get the seconds a client can be idle before it hibernates. */
+long xmp3_options_get_hibernate_timeout(const struct xmp3_options *options);
+
+/**
+ * Set how many seconds a client can go without sending anything before it's
+ * disconnected.  0 disables this.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_idle_timeout(struct xmp3_options *options,
+                                   long seconds);
+
+/** Set the idle timeout using a string. */
+bool xmp3_options_set_idle_timeout_str(struct xmp3_options *options,
+                                       const char *seconds);
+
+/** Get the seconds a client can be silent before it's disconnected. */
+long xmp3_options_get_idle_timeout(const struct xmp3_options *options);
+
+/**
+ * Set how many seconds a client can go without sending anything before the
+ * server sends it a ping (XEP-0199).  A client that doesn't answer (or send
+ * anything else) within another interval is disconnected.  0 disables
+ * pings.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_ping_interval(struct xmp3_options *options,
+                                    long seconds);
+
+/** Set the ping interval using a string. */
+bool xmp3_options_set_ping_interval_str(struct xmp3_options *options,
+                                        const char *seconds);
+
+/** Get the seconds a client can be silent before it's pinged. */
+long xmp3_options_get_ping_interval(const struct xmp3_options *options);
+
+/**
+ * Set how many seconds can pass without sending a client anything before the
+ * server sends it a single space, to keep NAT mappings open and notice dead
+ * connections.  0 disables this.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_keepalive_interval(struct xmp3_options *options,
+                                         long seconds);
+
+/** Set the keepalive interval using a string. */
+bool xmp3_options_set_keepalive_interval_str(struct xmp3_options *options,
+                                             const char *seconds);
+
+/** Get the seconds without output before a client is sent a space. */
+long xmp3_options_get_keepalive_interval(const struct xmp3_options *options);
+
+/**
+ * Set how much output can be queued for a client before the server stops
+ * reading from whoever is sending to it, and applies the overflow policies
+ * (see xmp3_options_set_overflow_policy()).  0 disables this.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_outbound_high_watermark(struct xmp3_options *options,
+                                              size_t bytes);
+
+/** Set the outbound high watermark using a string. */
+bool xmp3_options_set_outbound_high_watermark_str(
+        struct xmp3_options *options, const char *bytes);
+
+/** Get the outbound high watermark. */
+size_t xmp3_options_get_outbound_high_watermark(
+        const struct xmp3_options *options);
+
+/**
+ * Set how far a client's queued output has to drain before the senders that
+ * were paused on its account are read from again.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_outbound_low_watermark(struct xmp3_options *options,
+                                             size_t bytes);
+
+/** Set the outbound low watermark using a string. */
+bool xmp3_options_set_outbound_low_watermark_str(struct xmp3_options *options,
+                                                 const char *bytes);
+
+/** Get the outbound low watermark. */
+size_t xmp3_options_get_outbound_low_watermark(
+        const struct xmp3_options *options);
+
+/**
+ * Set what happens to one kind of stanza ("presence", "message" or "iq") sent
+ * to a client that's past its outbound high watermark.
+ *
+ * @return false if the stanza kind is unknown, or the policy doesn't make
+ *         sense for it (only presence can be superseded).
+ */
+bool xmp3_options_set_overflow_policy(struct xmp3_options *options,
+                                      const char *stanza,
+                                      enum xmp3_overflow_policy policy);
+
+/** Set an overflow policy using a string ("queue", "drop", "supersede"). */
+bool xmp3_options_set_overflow_policy_str(struct xmp3_options *options,
+                                          const char *stanza,
+                                          const char *policy);
+
+/** Get the overflow policy for a kind of stanza (queue if unknown). */
+enum xmp3_overflow_policy xmp3_options_get_overflow_policy(
+        const struct xmp3_options *options, const char *stanza);
+
 /**
  * Enable/disable SSL support for the XMPP server.
  *
@@ -132,6 +547,62 @@ bool xmp3_options_set_certificate(struct xmp3_options *options,
 /** Get the path to the OpenSSL certificate file. */
 const char* xmp3_options_get_certificate(const struct xmp3_options *options);
 
+/**
+ * Set how many TLS sessions the server caches for resumption (0 disables the
+ * cache).
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_ssl_session_cache(struct xmp3_options *options,
+                                        long size);
+
+/** Set the TLS session cache size using a string. */
+bool xmp3_options_set_ssl_session_cache_str(struct xmp3_options *options,
+                                            const char *size);
+
+/** Get how many TLS sessions the server caches. */
+long xmp3_options_get_ssl_session_cache(const struct xmp3_options *options);
+
+/**
+ * Set how many seconds a cached TLS session (or ticket) can be resumed for.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_ssl_session_timeout(struct xmp3_options *options,
+                                          long seconds);
+
+/** Set the TLS session timeout using a string. */
+bool xmp3_options_set_ssl_session_timeout_str(struct xmp3_options *options,
+                                              const char *seconds);
+
+/** Get how many seconds a TLS session can be resumed for. */
+long xmp3_options_get_ssl_session_timeout(const struct xmp3_options *options);
+
+/**
+ * Enable/disable TLS session tickets.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_ssl_tickets(struct xmp3_options *options, bool tickets);
+
+/** Get whether TLS session tickets are enabled. */
+bool xmp3_options_get_ssl_tickets(const struct xmp3_options *options);
+
+/**
+ * Set how many seconds between rotating the session ticket keys.
+ *
+ * @return true if successful, false if not.
+ */
+bool xmp3_options_set_ssl_ticket_rotation(struct xmp3_options *options,
+                                          long seconds);
+
+/** Set the ticket key rotation interval using a string. */
+bool xmp3_options_set_ssl_ticket_rotation_str(struct xmp3_options *options,
+                                              const char *seconds);
+
+/** Get how many seconds between rotating the session ticket keys. */
+long xmp3_options_get_ssl_ticket_rotation(const struct xmp3_options *options);
+
 /**
  * Set the name of the XMPP server (used for the domainpart).
  *
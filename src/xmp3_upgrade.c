@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file xmp3_upgrade.c
+ * Hands a running server over to a freshly started copy of itself.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utlist.h"
+
+#include "log.h"
+
+#include "client_socket.h"
+#include "jid.h"
+#include "tls_tickets.h"
+#include "xmp3_workers.h"
+#include "xmpp_client.h"
+#include "xmpp_parser.h"
+#include "xmpp_server.h"
+
+#include "xmp3_upgrade.h"
+
+/** Tells the new process which file descriptor leads to the old one. */
+#define UPGRADE_ENV "XMP3_UPGRADE_FD"
+
+/** Largest message sent between the processes. */
+#define UPGRADE_MSG_MAX 8192
+
+/** Milliseconds the old process waits for the new one to be ready. */
+#define UPGRADE_TIMEOUT 30000
+
+/** Types of message, the first byte of each one. */
+enum upgrade_msg {
+    /** Old to new: a listening socket (attached). */
+    UPGRADE_MSG_SOCKET = 'S',
+
+    /** Old to new: the session ticket keys. */
+    UPGRADE_MSG_TICKETS = 'T',
+
+    /** Old to new: a client's socket (attached), JID and stream header. */
+    UPGRADE_MSG_CLIENT = 'C',
+
+    /** Old to new: that's everything. */
+    UPGRADE_MSG_DONE = 'D',
+
+    /** New to old: ready to take over. */
+    UPGRADE_MSG_READY = 'R',
+
+    /** Old to new: go ahead, the old process is leaving. */
+    UPGRADE_MSG_GO = 'G',
+};
+
+/** A client being handed over. */
+struct handed_client {
+    /** The client, in the old process. */
+    struct xmpp_client *client;
+
+    /** The client's socket, in the new process. */
+    int fd;
+
+    /** @{ What the new process needs to carry on the client's stream. */
+    char *jid;
+    char *header;
+    /** @} */
+
+    struct handed_client *next;
+};
+
+/** What the new process got from the old one. */
+struct xmp3_upgrade {
+    /** Our end of the channel to the old process. */
+    int channel;
+
+    /** The old workers' listening sockets. */
+    int *sockets;
+    int num_sockets;
+
+    /** Whether the sockets were passed on by xmp3_upgrade_sockets(). */
+    bool sockets_taken;
+
+    /** The old process's ticket keys, if it had any. */
+    unsigned char tickets[TLS_TICKETS_EXPORT_LEN];
+    bool has_tickets;
+
+    /** The clients to adopt. */
+    struct handed_client *clients;
+};
+
+static const char MSG_SHUTDOWN[] =
+    "<stream:error>"
+    "<system-shutdown xmlns='urn:ietf:params:xml:ns:xmpp-streams'/>"
+    "</stream:error>"
+    "</stream:stream>";
+
+/* Forward declarations. */
+static pid_t spawn(int channel, const char *program, char *const argv[]);
+static bool send_state(int channel, struct xmp3_workers *workers,
+                       struct handed_client **handed);
+static bool send_client(int channel, struct xmpp_client *client,
+                        struct handed_client **handed);
+static void shut_down_clients(struct xmp3_workers *workers);
+static void handed_client_del(struct handed_client *handed);
+static bool send_msg(int channel, enum upgrade_msg type, const void *data,
+                     size_t len, int fd);
+static ssize_t recv_msg(int channel, char *buf, size_t len, int *fd);
+
+char* xmp3_upgrade_program(void) {
+    char *program = realpath("/proc/self/exe", NULL);
+    check(program != NULL, "Unable to find this program: %s",
+          strerror(errno));
+    return program;
+
+error:
+    return NULL;
+}
+
+bool xmp3_upgrade_start(struct xmp3_workers *workers, const char *program,
+                        char *const argv[]) {
+    int channel[2] = {-1, -1};
+    pid_t pid = -1;
+    struct handed_client *handed = NULL, *entry, *tmp;
+    char buf[UPGRADE_MSG_MAX];
+
+    log_info("Handing over to a new process...");
+
+    /* Nothing may change underneath us while the state is sent. */
+    xmp3_workers_stop(workers);
+
+    check(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channel) == 0,
+          "Unable to create upgrade channel: %s", strerror(errno));
+    pid = spawn(channel[1], program, argv);
+    close(channel[1]);
+    check(pid != -1, "Unable to start new process.");
+
+    /* Don't wait forever on a new process that isn't listening. */
+    struct timeval timeout = { .tv_sec = UPGRADE_TIMEOUT / 1000 };
+    check(setsockopt(channel[0], SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                     sizeof(timeout)) == 0,
+          "Unable to set upgrade channel timeout.");
+
+    check(send_state(channel[0], workers, &handed),
+          "Unable to send state to the new process.");
+
+    struct pollfd ready = { .fd = channel[0], .events = POLLIN };
+    int rv;
+    do {
+        rv = poll(&ready, 1, UPGRADE_TIMEOUT);
+    } while (rv == -1 && errno == EINTR);
+    check(rv == 1, "New process took too long to start.");
+    check(recv_msg(channel[0], buf, sizeof(buf), NULL) > 0
+          && buf[0] == UPGRADE_MSG_READY, "New process failed to start.");
+
+    /* Past this point the new process owns the clients we sent. */
+    check(send_msg(channel[0], UPGRADE_MSG_GO, NULL, 0, -1),
+          "Unable to tell the new process to go ahead.");
+    close(channel[0]);
+
+    int num_handed = 0;
+    LL_FOREACH_SAFE(handed, entry, tmp) {
+        xmpp_server_detach_client(entry->client);
+        handed_client_del(entry);
+        num_handed++;
+    }
+    shut_down_clients(workers);
+
+    log_info("Handed %d clients over to process %d", num_handed, pid);
+    return true;
+
+error:
+    /* The new process exits as soon as it notices we're gone. */
+    if (channel[0] != -1) {
+        close(channel[0]);
+    }
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    LL_FOREACH_SAFE(handed, entry, tmp) {
+        handed_client_del(entry);
+    }
+    if (!xmp3_workers_start(workers)) {
+        log_err("Unable to restart workers");
+    }
+    return false;
+}
+
+bool xmp3_upgrade_pending(void) {
+    return getenv(UPGRADE_ENV) != NULL;
+}
+
+struct xmp3_upgrade* xmp3_upgrade_receive(void) {
+    struct xmp3_upgrade *upgrade = calloc(1, sizeof(*upgrade));
+    check_mem(upgrade);
+    upgrade->channel = -1;
+
+    char *end;
+    const char *env = getenv(UPGRADE_ENV);
+    long channel = strtol(env, &end, 10);
+    check(*env != '\0' && *end == '\0' && channel > STDERR_FILENO,
+          "Invalid " UPGRADE_ENV " \"%s\"", env);
+    upgrade->channel = channel;
+    unsetenv(UPGRADE_ENV);
+
+    char buf[UPGRADE_MSG_MAX];
+    while (true) {
+        int fd = -1;
+        ssize_t len = recv_msg(upgrade->channel, buf, sizeof(buf), &fd);
+        check(len > 0, "Old process went away during the upgrade.");
+
+        if (buf[0] == UPGRADE_MSG_DONE) {
+            break;
+        } else if (buf[0] == UPGRADE_MSG_SOCKET && fd != -1) {
+            upgrade->sockets = realloc(upgrade->sockets,
+                (upgrade->num_sockets + 1) * sizeof(*upgrade->sockets));
+            check_mem(upgrade->sockets);
+            upgrade->sockets[upgrade->num_sockets++] = fd;
+        } else if (buf[0] == UPGRADE_MSG_TICKETS
+                   && len == 1 + TLS_TICKETS_EXPORT_LEN) {
+            memcpy(upgrade->tickets, buf + 1, TLS_TICKETS_EXPORT_LEN);
+            upgrade->has_tickets = true;
+        } else if (buf[0] == UPGRADE_MSG_CLIENT && fd != -1
+                   && buf[len - 1] == '\0'
+                   && (ssize_t)strlen(buf + 1) + 2 < len) {
+            /* The JID and header are back to back, each null terminated. */
+            struct handed_client *handed = calloc(1, sizeof(*handed));
+            check_mem(handed);
+            handed->fd = fd;
+            handed->jid = strdup(buf + 1);
+            handed->header = strdup(buf + 2 + strlen(buf + 1));
+            check_mem(handed->jid);
+            check_mem(handed->header);
+            LL_PREPEND(upgrade->clients, handed);
+        } else {
+            if (fd != -1) {
+                close(fd);
+            }
+            sentinel("Unexpected upgrade message '%c'", buf[0]);
+        }
+    }
+
+    log_info("Taking over %d sockets from the old process",
+             upgrade->num_sockets);
+    return upgrade;
+
+error:
+    xmp3_upgrade_del(upgrade);
+    return NULL;
+}
+
+void xmp3_upgrade_del(struct xmp3_upgrade *upgrade) {
+    if (upgrade->channel != -1) {
+        close(upgrade->channel);
+    }
+    if (!upgrade->sockets_taken) {
+        for (int i = 0; i < upgrade->num_sockets; i++) {
+            close(upgrade->sockets[i]);
+        }
+    }
+    free(upgrade->sockets);
+
+    /* Just our copies, the old process still has these clients. */
+    struct handed_client *handed, *tmp;
+    LL_FOREACH_SAFE(upgrade->clients, handed, tmp) {
+        close(handed->fd);
+        handed_client_del(handed);
+    }
+    OPENSSL_cleanse(upgrade->tickets, sizeof(upgrade->tickets));
+    free(upgrade);
+}
+
+const int* xmp3_upgrade_sockets(struct xmp3_upgrade *upgrade, int *num_fds) {
+    upgrade->sockets_taken = true;
+    *num_fds = upgrade->num_sockets;
+    return upgrade->sockets;
+}
+
+bool xmp3_upgrade_finish(struct xmp3_upgrade *upgrade,
+                         struct xmp3_workers *workers) {
+    struct tls_tickets *tickets =
+        xmpp_server_tickets(xmp3_workers_primary(workers));
+    if (upgrade->has_tickets && tickets != NULL) {
+        tls_tickets_import(tickets, upgrade->tickets);
+    }
+
+    char buf[UPGRADE_MSG_MAX];
+    check(send_msg(upgrade->channel, UPGRADE_MSG_READY, NULL, 0, -1),
+          "Unable to tell the old process we're ready.");
+    check(recv_msg(upgrade->channel, buf, sizeof(buf), NULL) > 0
+          && buf[0] == UPGRADE_MSG_GO, "Old process backed out of upgrade.");
+
+    int num_workers = xmp3_workers_count(workers);
+    int adopted = 0, failed = 0;
+    struct handed_client *handed, *tmp;
+    LL_FOREACH_SAFE(upgrade->clients, handed, tmp) {
+        LL_DELETE(upgrade->clients, handed);
+        struct xmpp_server *server =
+            xmp3_workers_server(workers, (adopted + failed) % num_workers);
+        if (xmpp_server_adopt_client(server, handed->fd, handed->jid,
+                                     handed->header) != NULL) {
+            adopted++;
+        } else {
+            failed++;
+        }
+        handed_client_del(handed);
+    }
+
+    log_info("Took over %d clients (%d failed)", adopted, failed);
+    return true;
+
+error:
+    return false;
+}
+
+/**
+ * Forks and executes a new copy of this program.
+ *
+ * The child only keeps stdio and its end of the channel open.  Anything else
+ * it inherited would keep connections alive after both processes meant to
+ * close them.
+ */
+static pid_t spawn(int channel, const char *program, char *const argv[]) {
+    char fd_str[16];
+    snprintf(fd_str, sizeof(fd_str), "%d", channel);
+    check(setenv(UPGRADE_ENV, fd_str, 1) == 0, "Unable to set " UPGRADE_ENV);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* libev may have blocked the signals it watches. */
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, 3, channel - 1, 0) == -1
+                || syscall(SYS_close_range, channel + 1, ~0U, 0) == -1)
+#endif
+        {
+            long max_fd = sysconf(_SC_OPEN_MAX);
+            for (int fd = 3; fd < max_fd; fd++) {
+                if (fd != channel) {
+                    close(fd);
+                }
+            }
+        }
+
+        execv(program, argv);
+        _exit(EXIT_FAILURE);
+    }
+
+    unsetenv(UPGRADE_ENV);
+    check(pid != -1, "Unable to fork: %s", strerror(errno));
+    return pid;
+
+error:
+    return -1;
+}
+
+/** Sends the sockets, ticket keys, and every client that can move. */
+static bool send_state(int channel, struct xmp3_workers *workers,
+                       struct handed_client **handed) {
+    int num_workers = xmp3_workers_count(workers);
+    for (int i = 0; i < num_workers; i++) {
+        int fd = xmpp_server_socket(xmp3_workers_server(workers, i));
+        check(send_msg(channel, UPGRADE_MSG_SOCKET, NULL, 0, fd),
+              "Unable to send listening socket.");
+    }
+
+    struct tls_tickets *tickets =
+        xmpp_server_tickets(xmp3_workers_primary(workers));
+    if (tickets != NULL) {
+        unsigned char keys[TLS_TICKETS_EXPORT_LEN];
+        tls_tickets_export(tickets, keys);
+        bool sent = send_msg(channel, UPGRADE_MSG_TICKETS, keys, sizeof(keys),
+                             -1);
+        OPENSSL_cleanse(keys, sizeof(keys));
+        check(sent, "Unable to send ticket keys.");
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        struct xmpp_client_iterator *iter = xmpp_client_iterator_new(
+                xmp3_workers_server(workers, i));
+        struct xmpp_client *client;
+        bool sent = true;
+        while (sent && (client = xmpp_client_iterator_next(iter)) != NULL) {
+            if (xmpp_server_freeze_client(client)) {
+                sent = send_client(channel, client, handed);
+            }
+        }
+        xmpp_client_iterator_del(iter);
+        check(sent, "Unable to send client.");
+    }
+
+    return send_msg(channel, UPGRADE_MSG_DONE, NULL, 0, -1);
+
+error:
+    return false;
+}
+
+/** Sends one (frozen) client, and remembers it was handed over. */
+static bool send_client(int channel, struct xmpp_client *client,
+                        struct handed_client **handed) {
+    char *jid = jid_to_str(xmpp_client_jid(client));
+    const char *header = xmpp_parser_stream_header(xmpp_client_parser(client));
+    size_t jid_len = strlen(jid) + 1;
+    size_t header_len = strlen(header) + 1;
+
+    /* Anything too big to go in one message stays behind. */
+    if (1 + jid_len + header_len > UPGRADE_MSG_MAX) {
+        free(jid);
+        return true;
+    }
+
+    char buf[UPGRADE_MSG_MAX];
+    memcpy(buf, jid, jid_len);
+    memcpy(buf + jid_len, header, header_len);
+    free(jid);
+
+    int fd = client_socket_fd(xmpp_client_socket(client));
+    if (!send_msg(channel, UPGRADE_MSG_CLIENT, buf, jid_len + header_len,
+                  fd)) {
+        return false;
+    }
+
+    struct handed_client *entry = calloc(1, sizeof(*entry));
+    check_mem(entry);
+    entry->client = client;
+    entry->fd = -1;
+    LL_PREPEND(*handed, entry);
+    return true;
+}
+
+/**
+ * Tells the clients that stayed behind that we're going away.
+ *
+ * RFC6120 Section 4.9.3.20, <system-shutdown/>.  They're disconnected when
+ * the servers are cleaned up, which gives this a chance to go out first.
+ */
+static void shut_down_clients(struct xmp3_workers *workers) {
+    int num_workers = xmp3_workers_count(workers);
+    for (int i = 0; i < num_workers; i++) {
+        struct xmpp_client_iterator *iter = xmpp_client_iterator_new(
+                xmp3_workers_server(workers, i));
+        struct xmpp_client *client;
+        while ((client = xmpp_client_iterator_next(iter)) != NULL) {
+            xmpp_client_send(client, MSG_SHUTDOWN, sizeof(MSG_SHUTDOWN) - 1);
+        }
+        xmpp_client_iterator_del(iter);
+    }
+}
+
+static void handed_client_del(struct handed_client *handed) {
+    free(handed->jid);
+    free(handed->header);
+    free(handed);
+}
+
+/** Sends a message, with a file descriptor attached if fd isn't -1. */
+static bool send_msg(int channel, enum upgrade_msg type, const void *data,
+                     size_t len, int fd) {
+    char msg_type = type;
+    struct iovec iov[2] = {
+        { .iov_base = &msg_type, .iov_len = 1 },
+        { .iov_base = (void*)data, .iov_len = len },
+    };
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = len > 0 ? 2 : 1,
+    };
+
+    if (fd != -1) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t rv;
+    do {
+        rv = sendmsg(channel, &msg, MSG_NOSIGNAL);
+    } while (rv == -1 && errno == EINTR);
+    check(rv == (ssize_t)(1 + len), "Upgrade channel send error: %s",
+          strerror(errno));
+    return true;
+
+error:
+    return false;
+}
+
+/**
+ * Receives a message, along with its file descriptor if there is one.
+ *
+ * @param fd Where to put the file descriptor (-1 if none), or NULL if none
+ *           is expected.
+ * @returns The message length, 0 if the other end went away, or -1.
+ */
+static ssize_t recv_msg(int channel, char *buf, size_t len, int *fd) {
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t rv;
+    do {
+        rv = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    } while (rv == -1 && errno == EINTR);
+    check(rv != -1, "Upgrade channel receive error: %s", strerror(errno));
+
+    int received = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET
+            && cmsg->cmsg_type == SCM_RIGHTS
+            && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (fd != NULL) {
+        *fd = received;
+    } else if (received != -1) {
+        close(received);
+    }
+
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        if (fd != NULL && *fd != -1) {
+            close(*fd);
+        }
+        sentinel("Upgrade message too long");
+    }
+    return rv;
+
+error:
+    return -1;
+}
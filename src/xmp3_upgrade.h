@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file xmp3_upgrade.h
+ * Hands a running server over to a freshly started copy of itself.
+ *
+ * The old process starts the new one with a Unix socket as its only open
+ * file (besides stdio), and sends it the listening sockets and bound client
+ * connections with SCM_RIGHTS.  Each client goes along with its full JID and
+ * stream header, which is everything needed to carry on its stream.  The
+ * TLS session ticket keys go too, so clients that can't move (TLS streams,
+ * which OpenSSL can't hand over, and ones in the middle of something) can
+ * resume their TLS session when they reconnect, instead of doing a full
+ * handshake.
+ *
+ * Once the new process is set up it says so, and the old one has the final
+ * say: only when it answers does the new process adopt the clients and start
+ * serving.  The old process then forgets the clients it handed over, tells
+ * the rest that it's shutting down, and exits.  If anything goes wrong
+ * before that, the old process keeps running as if nothing happened.
+ *
+ * Extension modules are started fresh in the new process, whatever state
+ * they had (e.g. MUC rooms) is lost.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/* Forward declarations. */
+struct xmp3_upgrade;
+struct xmp3_workers;
+
+/**
+ * Finds where this program's binary lives.
+ *
+ * Call this at startup, before the working directory or the binary can
+ * change.  A new binary installed at the same path is what an upgrade runs.
+ *
+ * @returns An absolute path the caller must free, or NULL on error.
+ */
+char* xmp3_upgrade_program(void);
+
+/**
+ * Starts a new copy of this program, and hands everything over to it.
+ *
+ * The secondary workers are stopped while this happens (and restarted if it
+ * fails).
+ *
+ * @param program The binary to run, from xmp3_upgrade_program().
+ * @param argv The arguments this process was started with.
+ * @returns true if the new process took over, in which case this one should
+ *          exit.
+ */
+bool xmp3_upgrade_start(struct xmp3_workers *workers, const char *program,
+                        char *const argv[]);
+
+/** Returns true if this process was started by xmp3_upgrade_start(). */
+bool xmp3_upgrade_pending(void);
+
+/**
+ * Receives everything the old process has to hand over.
+ *
+ * @returns NULL on failure, in which case the old process carries on and
+ *          this one should exit.
+ */
+struct xmp3_upgrade* xmp3_upgrade_receive(void);
+
+/** Closes anything from the old process that wasn't taken over. */
+void xmp3_upgrade_del(struct xmp3_upgrade *upgrade);
+
+/**
+ * Returns the listening sockets handed over, one per worker of the old
+ * process, for xmp3_workers_new_from_sockets().
+ *
+ * The caller takes them over, even if creating the workers fails.
+ */
+const int* xmp3_upgrade_sockets(struct xmp3_upgrade *upgrade, int *num_fds);
+
+/**
+ * Finishes taking over from the old process.
+ *
+ * Call this once the workers are set up, but before they (or the primary
+ * worker's loop) start running.  The clients are spread over the workers.
+ *
+ * @returns false if the old process backed out (it keeps its clients), in
+ *          which case this one should exit.
+ */
+bool xmp3_upgrade_finish(struct xmp3_upgrade *upgrade,
+                         struct xmp3_workers *workers);
@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file xmp3_uring.c
+ * A minimal io_uring submission/completion ring for batching socket I/O.
+ *
+ * This talks to the kernel directly (there are only two system calls and
+ * a few shared memory rings involved), so there is no dependency on liburing.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#include "xmp3_uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+/* Older headers may not have this yet (it is from Linux 6.10).  Kernels that
+ * don't know it fail the accept with -EINVAL instead of blocking. */
+#ifndef IORING_ACCEPT_DONTWAIT
+#define IORING_ACCEPT_DONTWAIT (1U << 1)
+#endif
+
+struct xmp3_uring {
+    /** The ring's file descriptor. */
+    int fd;
+
+    /** @{ The submission queue, shared with the kernel. */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    /** @} */
+
+    /** @{ The completion queue, shared with the kernel. */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    /** @} */
+
+    /** Our copy of the submission queue tail, published on submit. */
+    unsigned tail;
+
+    /** Number of operations queued since the last submit. */
+    unsigned queued;
+
+    /** @{ The mapped regions, to unmap them again. */
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+    /** @} */
+};
+
+static struct io_uring_sqe* get_sqe(struct xmp3_uring *ring);
+
+struct xmp3_uring* xmp3_uring_new(unsigned entries) {
+    struct xmp3_uring *ring = calloc(1, sizeof(*ring));
+    check_mem(ring);
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+#ifdef IORING_SETUP_CLAMP
+    params.flags |= IORING_SETUP_CLAMP;
+#endif
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    check(ring->fd != -1, "Unable to set up io_uring: %s", strerror(errno));
+
+    ring->sq_ring_len = params.sq_off.array
+                        + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = params.cq_off.cqes
+                        + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Newer kernels put both queues in one mapping. */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_len > ring->sq_ring_len) {
+            ring->sq_ring_len = ring->cq_ring_len;
+        }
+        ring->cq_ring_len = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    check(ring->sq_ring != MAP_FAILED, "Unable to map io_uring queue");
+
+    if (ring->cq_ring_len > 0) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        check(ring->cq_ring != MAP_FAILED,
+              "Unable to map io_uring completion queue");
+    } else {
+        ring->cq_ring = ring->sq_ring;
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    check(ring->sqes != MAP_FAILED, "Unable to map io_uring entries");
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->tail = *ring->sq_tail;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return ring;
+
+error:
+    if (ring != NULL) {
+        if (ring->sq_ring == MAP_FAILED) {
+            ring->sq_ring = NULL;
+        }
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+        }
+        if (ring->sqes == MAP_FAILED) {
+            ring->sqes = NULL;
+        }
+        xmp3_uring_del(ring);
+    }
+    return NULL;
+}
+
+void xmp3_uring_del(struct xmp3_uring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+unsigned xmp3_uring_space(const struct xmp3_uring *ring) {
+    return ring->sq_entries - ring->queued;
+}
+
+bool xmp3_uring_recv(struct xmp3_uring *ring, int fd, void *buf, size_t len,
+                     void *data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = (unsigned long)data;
+    return true;
+}
+
+bool xmp3_uring_send(struct xmp3_uring *ring, int fd, const void *buf,
+                     size_t len, void *data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)data;
+    return true;
+}
+
+bool xmp3_uring_accept(struct xmp3_uring *ring, int fd, struct sockaddr *addr,
+                       socklen_t *addrlen, int flags, void *data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->addr2 = (unsigned long)addrlen;
+    sqe->accept_flags = flags;
+    /* Otherwise the kernel waits for a connection instead of failing. */
+    sqe->ioprio = IORING_ACCEPT_DONTWAIT;
+    sqe->user_data = (unsigned long)data;
+    return true;
+}
+
+int xmp3_uring_submit(struct xmp3_uring *ring) {
+    unsigned queued = ring->queued;
+    ring->queued = 0;
+
+    /* Nothing is in flight between submits, so this is where the completion
+     * queue's tail will be once everything we queued is done. */
+    unsigned done = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) + queued;
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+    /* Every operation is non-blocking, so this only waits for the kernel to
+     * get through them.  A signal may interrupt us partway though, in which
+     * case we pick up wherever it left off. */
+    while (__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) != done) {
+        unsigned to_submit = ring->tail
+                             - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        int rv = syscall(__NR_io_uring_enter, ring->fd, to_submit,
+                         done - *ring->cq_head, IORING_ENTER_GETEVENTS,
+                         NULL, 0);
+        if (rv == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            log_err("Error submitting to io_uring: %s", strerror(errno));
+            return -1;
+        }
+    }
+    return queued;
+}
+
+bool xmp3_uring_next(struct xmp3_uring *ring, void **data, int *result) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *data = (void*)(unsigned long)cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/** Returns the next free submission entry, cleared, or NULL if full. */
+static struct io_uring_sqe* get_sqe(struct xmp3_uring *ring) {
+    if (ring->queued >= ring->sq_entries) {
+        return NULL;
+    }
+    unsigned index = ring->tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->tail++;
+    ring->queued++;
+    return sqe;
+}
+
+#else /* HAVE_IO_URING */
+
+struct xmp3_uring* xmp3_uring_new(unsigned entries) {
+    log_warn("This build does not support io_uring.");
+    return NULL;
+}
+
+void xmp3_uring_del(struct xmp3_uring *ring) {
+}
+
+unsigned xmp3_uring_space(const struct xmp3_uring *ring) {
+    return 0;
+}
+
+bool xmp3_uring_recv(struct xmp3_uring *ring, int fd, void *buf, size_t len,
+                     void *data) {
+    return false;
+}
+
+bool xmp3_uring_send(struct xmp3_uring *ring, int fd, const void *buf,
+                     size_t len, void *data) {
+    return false;
+}
+
+bool xmp3_uring_accept(struct xmp3_uring *ring, int fd, struct sockaddr *addr,
+                       socklen_t *addrlen, int flags, void *data) {
+    return false;
+}
+
+int xmp3_uring_submit(struct xmp3_uring *ring) {
+    return -1;
+}
+
+bool xmp3_uring_next(struct xmp3_uring *ring, void **data, int *result) {
+    return false;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file xmp3_uring.h
+ * A minimal io_uring submission/completion ring for batching socket I/O.
+ *
+ * Operations are queued up without any system calls, then all submitted
+ * together with xmp3_uring_submit().  Everything is issued non-blocking (a
+ * socket that isn't ready completes with -EAGAIN), so a submit always
+ * returns with every queued operation completed.  Nothing stays in flight
+ * between submits, so callers don't have to worry about buffers or sockets
+ * going away underneath the kernel.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+/* Forward declarations. */
+struct xmp3_uring;
+
+/**
+ * Sets up a new ring.
+ *
+ * @param entries The most operations that can be queued per submit.
+ * @returns NULL if io_uring is not supported here.
+ */
+struct xmp3_uring* xmp3_uring_new(unsigned entries);
+
+/** Closes the ring. */
+void xmp3_uring_del(struct xmp3_uring *ring);
+
+/** Returns how many more operations can be queued before submitting. */
+unsigned xmp3_uring_space(const struct xmp3_uring *ring);
+
+/**
+ * Queues a recv on a socket.
+ *
+ * @param data Handed back with the operation's result.
+ * @returns false if the ring is full.
+ */
+bool xmp3_uring_recv(struct xmp3_uring *ring, int fd, void *buf, size_t len,
+                     void *data);
+
+/** Queues a send on a socket (without raising SIGPIPE). */
+bool xmp3_uring_send(struct xmp3_uring *ring, int fd, const void *buf,
+                     size_t len, void *data);
+
+/**
+ * Queues an accept4 on a listening socket.
+ *
+ * @param flags Flags for the new socket, as for accept4.
+ */
+bool xmp3_uring_accept(struct xmp3_uring *ring, int fd, struct sockaddr *addr,
+                       socklen_t *addrlen, int flags, void *data);
+
+/**
+ * Submits all queued operations in one system call, and waits for them.
+ *
+ * @returns The number of completions to collect with xmp3_uring_next(), or
+ *          -1 on error (the queued operations are dropped).
+ */
+int xmp3_uring_submit(struct xmp3_uring *ring);
+
+/**
+ * Collects the next completed operation.
+ *
+ * @param data   Set to the data the operation was queued with.
+ * @param result Set to the operation's return value, or a negative errno.
+ * @returns false once there are no more completions.
+ */
+bool xmp3_uring_next(struct xmp3_uring *ring, void **data, int *result);
@@ -0,0 +1,713 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file xmp3_workers.c
+ * Runs the XMPP server on several event loops (one per thread).
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ev.h>
+
+#include "uthash.h"
+#include "utlist.h"
+
+#include "log.h"
+#include "utils.h"
+
+#include "expat_pool.h"
+#include "jid.h"
+#include "xmp3_options.h"
+#include "xmpp_parser.h"
+#include "xmpp_server.h"
+#include "xmpp_stanza.h"
+
+#include "xmp3_workers.h"
+
+/** A serialized stanza on its way to another worker. */
+struct handoff {
+    /** Next (newer) entry in the queue. */
+    struct handoff *next;
+
+    /** Length of the serialized stanza. */
+    size_t length;
+
+    /** The serialized stanza, allocated along with this structure. */
+    char *data;
+};
+
+/**
+ * Multiple-producer, single-consumer intrusive queue.
+ *
+ * Any thread may push (one atomic exchange), only the owning worker pops.
+ * The queue always contains at least the stub node, so producers never have
+ * to touch the tail.
+ */
+struct handoff_queue {
+    /** Most recently pushed entry, producers swap themselves in here. */
+    struct handoff *head;
+
+    /** Oldest entry, only touched by the consumer. */
+    struct handoff *tail;
+
+    /** Placeholder so the queue is never empty. */
+    struct handoff stub;
+};
+
+/** A bound client JID, and the worker it is connected to. */
+struct directory_entry {
+    struct jid *jid;
+    int worker;
+
+    /** The JID as a string, the directory is hashed on this. */
+    char *key;
+
+    /** @{ Entries with the same bare JID (or with wildcards) are kept in a
+     * doubly-linked list. */
+    struct directory_entry *prev;
+    struct directory_entry *next;
+    /** @} */
+
+    UT_hash_handle hh;
+};
+
+/** All the directory entries sharing a bare JID. */
+struct directory_bucket {
+    char *key;
+    struct directory_entry *entries;
+    UT_hash_handle hh;
+};
+
+/** One event loop, its server, and its incoming queue. */
+struct xmp3_worker {
+    /** Index of this worker, 0 is the primary. */
+    int id;
+
+    /** All the workers this one belongs to. */
+    struct xmp3_workers *workers;
+
+    /** The event loop this worker runs. */
+    struct ev_loop *loop;
+
+    /** The server instance handling this worker's clients. */
+    struct xmpp_server *server;
+
+    /** Stanzas handed to us by other workers. */
+    struct handoff_queue queue;
+
+    /** Signalled whenever something is pushed onto our queue. */
+    struct ev_async wakeup;
+
+    /** Signalled to make a secondary worker's loop exit. */
+    struct ev_async stop;
+
+    /** Parser used to turn handed off stanzas back into stanzas. */
+    struct xmpp_parser *parser;
+
+    /** The thread running this worker's loop (secondary workers only). */
+    pthread_t thread;
+    bool running;
+};
+
+struct xmp3_workers {
+    /** Number of workers. */
+    int count;
+
+    /** Array of all the workers, index 0 is the primary. */
+    struct xmp3_worker *workers;
+
+    /** Which worker each bound client JID lives on, by full JID. */
+    struct directory_entry *directory;
+
+    /** Entries without wildcards, by bare JID. */
+    struct directory_bucket *directory_bare;
+
+    /** Entries with wildcards, which can't be looked up by key. */
+    struct directory_entry *directory_wildcards;
+
+    /** Protects the directory. */
+    pthread_rwlock_t directory_lock;
+
+    /** Clients connected across all workers. */
+    int sessions;
+};
+
+/* Forward declarations. */
+static bool worker_init(struct xmp3_workers *workers, int id,
+                        struct ev_loop *loop,
+                        const struct xmp3_options *options, int fd);
+static void worker_cleanup(struct xmp3_worker *worker);
+static void* worker_run(void *data);
+static void worker_wakeup(struct ev_loop *loop, struct ev_async *w,
+                          int revents);
+static void worker_stop(struct ev_loop *loop, struct ev_async *w,
+                        int revents);
+static bool worker_route(struct xmpp_stanza *stanza,
+                         struct xmpp_parser *parser, void *data);
+static void worker_send(struct xmp3_worker *worker, const char *data,
+                        size_t length);
+
+static size_t directory_key(char *key, const struct jid *jid);
+static bool is_wildcard(const struct jid *jid);
+static void directory_target(const struct directory_entry *entry,
+                             int worker, bool *targets, bool *forward);
+
+static void queue_init(struct handoff_queue *queue);
+static void queue_push(struct handoff_queue *queue, struct handoff *entry);
+static struct handoff* queue_pop(struct handoff_queue *queue);
+
+struct xmp3_workers* xmp3_workers_new(struct ev_loop *loop,
+                                      const struct xmp3_options *options) {
+    return xmp3_workers_new_from_sockets(loop, options, NULL, 0);
+}
+
+struct xmp3_workers* xmp3_workers_new_from_sockets(struct ev_loop *loop,
+        const struct xmp3_options *options, const int *fds, int num_fds) {
+    struct xmp3_workers *workers = calloc(1, sizeof(*workers));
+    check_mem(workers);
+
+    check(pthread_rwlock_init(&workers->directory_lock, NULL) == 0,
+          "Unable to initialize worker directory lock.");
+
+    workers->count = xmp3_options_get_workers(options);
+    workers->workers = calloc(workers->count, sizeof(*workers->workers));
+    check_mem(workers->workers);
+
+    for (int i = 0; i < workers->count; i++) {
+        struct ev_loop *worker_loop = loop;
+        if (i > 0) {
+            worker_loop = ev_loop_new(EVFLAG_AUTO);
+            check(worker_loop != NULL, "Could not initialize libev.");
+        }
+        check(worker_init(workers, i, worker_loop, options,
+                          i < num_fds ? fds[i] : -1),
+              "Unable to initialize worker %d", i);
+    }
+
+    /* Connections waiting on sockets nobody took over are lost. */
+    for (int i = workers->count; i < num_fds; i++) {
+        log_warn("Closing inherited socket for missing worker %d", i);
+        close(fds[i]);
+    }
+
+    if (workers->count > 1) {
+        log_info("Running %d workers", workers->count);
+    }
+    return workers;
+
+error:
+    if (workers) {
+        xmp3_workers_del(workers);
+    }
+    return NULL;
+}
+
+void xmp3_workers_del(struct xmp3_workers *workers) {
+    xmp3_workers_stop(workers);
+
+    if (workers->workers) {
+        /* Servers go first, since disconnecting their clients updates the
+         * directory.  The primary goes last, the others share its SSL
+         * context. */
+        for (int i = workers->count - 1; i >= 0; i--) {
+            worker_cleanup(&workers->workers[i]);
+        }
+        free(workers->workers);
+    }
+
+    struct directory_entry *entry, *tmp;
+    HASH_ITER(hh, workers->directory, entry, tmp) {
+        HASH_DEL(workers->directory, entry);
+        jid_del(entry->jid);
+        free(entry->key);
+        free(entry);
+    }
+    struct directory_bucket *bucket, *btmp;
+    HASH_ITER(hh, workers->directory_bare, bucket, btmp) {
+        HASH_DEL(workers->directory_bare, bucket);
+        free(bucket->key);
+        free(bucket);
+    }
+    pthread_rwlock_destroy(&workers->directory_lock);
+    free(workers);
+}
+
+bool xmp3_workers_start(struct xmp3_workers *workers) {
+    /* Signals should only be handled by the primary (main) thread, so block
+     * them all while the secondary threads are spawned (they inherit the
+     * signal mask). */
+    sigset_t all, old;
+    sigfillset(&all);
+    check(pthread_sigmask(SIG_SETMASK, &all, &old) == 0,
+          "Unable to block signals for worker threads.");
+
+    bool rv = true;
+    for (int i = 1; i < workers->count; i++) {
+        struct xmp3_worker *worker = &workers->workers[i];
+        if (pthread_create(&worker->thread, NULL, worker_run, worker) != 0) {
+            log_err("Unable to start worker %d", i);
+            rv = false;
+            break;
+        }
+        worker->running = true;
+    }
+
+    check(pthread_sigmask(SIG_SETMASK, &old, NULL) == 0,
+          "Unable to restore signal mask.");
+    return rv;
+
+error:
+    return false;
+}
+
+void xmp3_workers_stop(struct xmp3_workers *workers) {
+    if (workers->workers == NULL) {
+        return;
+    }
+    for (int i = 1; i < workers->count; i++) {
+        struct xmp3_worker *worker = &workers->workers[i];
+        if (worker->running) {
+            ev_async_send(worker->loop, &worker->stop);
+            pthread_join(worker->thread, NULL);
+            worker->running = false;
+        }
+    }
+}
+
+struct xmpp_server* xmp3_workers_primary(const struct xmp3_workers *workers) {
+    return workers->workers[0].server;
+}
+
+int xmp3_workers_count(const struct xmp3_workers *workers) {
+    return workers->count;
+}
+
+struct xmpp_server* xmp3_workers_server(const struct xmp3_workers *workers,
+                                        int worker) {
+    return workers->workers[worker].server;
+}
+
+void xmp3_workers_log_stats(const struct xmp3_workers *workers) {
+    for (int i = 0; i < workers->count; i++) {
+        xmpp_server_log_stats(workers->workers[i].server);
+    }
+
+    struct expat_pool_stats stats;
+    expat_pool_stats(&stats);
+    log_info("Expat: parsers_created=%lu parsers_reused=%lu parsers_pooled=%lu"
+             " bytes_in_use=%zu bytes_cached=%zu",
+             stats.parsers_created, stats.parsers_reused, stats.parsers_pooled,
+             stats.bytes_in_use, stats.bytes_cached);
+}
+
+int* xmp3_workers_sessions(struct xmp3_workers *workers) {
+    return &workers->sessions;
+}
+
+bool xmp3_workers_add_jid(struct xmp3_workers *workers, int worker,
+                          const struct jid *jid) {
+    char key[jid_to_str_len(jid) + 1];
+    size_t bare_len = directory_key(key, jid);
+    struct directory_entry *entry = NULL;
+    bool rv = false;
+
+    pthread_rwlock_wrlock(&workers->directory_lock);
+    HASH_FIND_STR(workers->directory, key, entry);
+    if (entry != NULL) {
+        goto done;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    check_mem(entry);
+    entry->jid = jid_new_from_jid(jid);
+    entry->worker = worker;
+    STRDUP_CHECK(entry->key, key);
+    HASH_ADD_KEYPTR(hh, workers->directory, entry->key, strlen(entry->key),
+                    entry);
+
+    if (is_wildcard(jid)) {
+        DL_APPEND(workers->directory_wildcards, entry);
+    } else {
+        struct directory_bucket *bucket;
+        HASH_FIND(hh, workers->directory_bare, key, bare_len, bucket);
+        if (bucket == NULL) {
+            bucket = calloc(1, sizeof(*bucket));
+            check_mem(bucket);
+            STRNDUP_CHECK(bucket->key, key, bare_len);
+            HASH_ADD_KEYPTR(hh, workers->directory_bare, bucket->key,
+                            bare_len, bucket);
+        }
+        DL_APPEND(bucket->entries, entry);
+    }
+    rv = true;
+
+done:
+    pthread_rwlock_unlock(&workers->directory_lock);
+    return rv;
+}
+
+void xmp3_workers_del_jid(struct xmp3_workers *workers, int worker,
+                          const struct jid *jid) {
+    char key[jid_to_str_len(jid) + 1];
+    size_t bare_len = directory_key(key, jid);
+    struct directory_entry *entry = NULL;
+
+    pthread_rwlock_wrlock(&workers->directory_lock);
+    HASH_FIND_STR(workers->directory, key, entry);
+    if (entry == NULL || entry->worker != worker) {
+        goto done;
+    }
+    HASH_DEL(workers->directory, entry);
+
+    if (is_wildcard(jid)) {
+        DL_DELETE(workers->directory_wildcards, entry);
+    } else {
+        struct directory_bucket *bucket;
+        HASH_FIND(hh, workers->directory_bare, key, bare_len, bucket);
+        DL_DELETE(bucket->entries, entry);
+        if (bucket->entries == NULL) {
+            HASH_DEL(workers->directory_bare, bucket);
+            free(bucket->key);
+            free(bucket);
+        }
+    }
+    jid_del(entry->jid);
+    free(entry->key);
+    free(entry);
+
+done:
+    pthread_rwlock_unlock(&workers->directory_lock);
+}
+
+bool xmp3_workers_forward(struct xmp3_workers *workers, int worker,
+                          struct xmpp_stanza *stanza, bool was_handled) {
+    const char *to = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_TO);
+    if (to == NULL) {
+        return false;
+    }
+    struct jid *to_jid = jid_new_from_str(to);
+    if (to_jid == NULL) {
+        return false;
+    }
+
+    /* Figure out which workers to send to before serializing anything, most
+     * stanzas don't need to go anywhere. */
+    bool targets[workers->count];
+    memset(targets, 0, sizeof(targets));
+    bool forward = false;
+
+    size_t len = jid_to_str_len(to_jid);
+    char key[len + 1];
+    size_t bare_len = directory_key(key, to_jid);
+    struct directory_entry *entry = NULL;
+
+    pthread_rwlock_rdlock(&workers->directory_lock);
+    if (is_wildcard(to_jid)) {
+        /* Only modules address stanzas like this, check everyone. */
+        for (entry = workers->directory; entry != NULL;
+                entry = entry->hh.next) {
+            if (jid_cmp_wildcards(to_jid, entry->jid) == 0) {
+                directory_target(entry, worker, targets, &forward);
+            }
+        }
+    } else if (jid_resource(to_jid) == NULL) {
+        /* A bare JID goes to every resource. */
+        struct directory_bucket *bucket;
+        HASH_FIND(hh, workers->directory_bare, key, bare_len, bucket);
+        if (bucket != NULL) {
+            DL_FOREACH(bucket->entries, entry) {
+                directory_target(entry, worker, targets, &forward);
+            }
+        }
+    } else {
+        /* A full JID goes to that resource, or a client bound without
+         * one. */
+        HASH_FIND(hh, workers->directory, key, len, entry);
+        if (entry != NULL) {
+            directory_target(entry, worker, targets, &forward);
+        }
+        HASH_FIND(hh, workers->directory, key, bare_len, entry);
+        if (entry != NULL) {
+            directory_target(entry, worker, targets, &forward);
+        }
+    }
+    if (!is_wildcard(to_jid)) {
+        DL_FOREACH(workers->directory_wildcards, entry) {
+            if (jid_cmp_wildcards(to_jid, entry->jid) == 0) {
+                directory_target(entry, worker, targets, &forward);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&workers->directory_lock);
+    jid_del(to_jid);
+
+    if (!forward && !was_handled && worker != 0) {
+        targets[0] = true;
+        forward = true;
+    }
+    if (!forward) {
+        return false;
+    }
+
+    size_t length;
+    char *data = xmpp_stanza_string(stanza, &length, true);
+    for (int i = 0; i < workers->count; i++) {
+        if (targets[i]) {
+            worker_send(&workers->workers[i], data, length);
+        }
+    }
+    free(data);
+    return true;
+}
+
+/** Sets up a worker and its server on the given loop. */
+static bool worker_init(struct xmp3_workers *workers, int id,
+                        struct ev_loop *loop,
+                        const struct xmp3_options *options, int fd) {
+    struct xmp3_worker *worker = &workers->workers[id];
+    worker->id = id;
+    worker->workers = workers;
+    worker->loop = loop;
+
+    queue_init(&worker->queue);
+
+    worker->parser = xmpp_parser_new(false);
+    check(worker->parser != NULL, "Error creating XML parser");
+    xmpp_parser_set_handler(worker->parser, worker_route);
+    xmpp_parser_set_data(worker->parser, worker);
+
+    worker->server = xmpp_server_new_from_socket(loop, options, fd);
+    check(worker->server != NULL, "XMPP server initialization failed");
+
+    /* With only one worker, there is nobody to hand stanzas to, so leave the
+     * server on its own. */
+    if (workers->count > 1) {
+        xmpp_server_set_worker(worker->server, workers, id);
+    }
+
+    /* TLS sessions can be resumed on any worker. */
+    if (id > 0) {
+        xmpp_server_share_ssl_context(worker->server,
+                                      workers->workers[0].server);
+    }
+
+    ev_async_init(&worker->wakeup, worker_wakeup);
+    worker->wakeup.data = worker;
+    ev_async_start(loop, &worker->wakeup);
+
+    ev_async_init(&worker->stop, worker_stop);
+    worker->stop.data = worker;
+    ev_async_start(loop, &worker->stop);
+
+    return true;
+
+error:
+    return false;
+}
+
+/** Frees everything belonging to a (stopped) worker. */
+static void worker_cleanup(struct xmp3_worker *worker) {
+    if (worker->loop == NULL) {
+        return;
+    }
+
+    ev_async_stop(worker->loop, &worker->wakeup);
+    ev_async_stop(worker->loop, &worker->stop);
+
+    struct handoff *entry;
+    while ((entry = queue_pop(&worker->queue)) != NULL) {
+        free(entry);
+    }
+
+    if (worker->server) {
+        xmpp_server_del(worker->server);
+    }
+    if (worker->parser) {
+        xmpp_parser_del(worker->parser);
+    }
+
+    /* The primary's loop belongs to whoever created us. */
+    if (worker->id > 0) {
+        ev_loop_destroy(worker->loop);
+    }
+}
+
+/** Thread entry point for secondary workers. */
+static void* worker_run(void *data) {
+    struct xmp3_worker *worker = data;
+    debug("Worker %d starting event loop", worker->id);
+    ev_run(worker->loop, 0);
+    debug("Worker %d event loop exited", worker->id);
+    expat_pool_trim();
+    return NULL;
+}
+
+/** Routes everything other workers have pushed onto our queue. */
+static void worker_wakeup(struct ev_loop *loop, struct ev_async *w,
+                          int revents) {
+    struct xmp3_worker *worker = w->data;
+    struct handoff *entry;
+    while ((entry = queue_pop(&worker->queue)) != NULL) {
+        /* Reset the parser before to clear any state from previous
+         * stanzas. */
+        xmpp_parser_reset(worker->parser, false);
+        if (!xmpp_parser_parse(worker->parser, entry->data, entry->length)) {
+            log_err("Error parsing handed off stanza: %s",
+                    xmpp_parser_strerror(worker->parser));
+        }
+        free(entry);
+    }
+}
+
+static void worker_stop(struct ev_loop *loop, struct ev_async *w,
+                        int revents) {
+    ev_break(loop, EVBREAK_ALL);
+}
+
+/** Parser callback for stanzas handed to us by another worker. */
+static bool worker_route(struct xmpp_stanza *stanza,
+                         struct xmpp_parser *parser, void *data) {
+    struct xmp3_worker *worker = data;
+    xmpp_server_route_handoff(worker->server, stanza);
+    return true;
+}
+
+/** Copies a serialized stanza onto a worker's queue and wakes it up. */
+static void worker_send(struct xmp3_worker *worker, const char *data,
+                        size_t length) {
+    struct handoff *entry = malloc(sizeof(*entry) + length);
+    check_mem(entry);
+
+    entry->length = length;
+    entry->data = (char*)(entry + 1);
+    memcpy(entry->data, data, length);
+
+    queue_push(&worker->queue, entry);
+    ev_async_send(worker->loop, &worker->wakeup);
+}
+
+/**
+ * Writes a JID into key, the same way jid_to_str() would.
+ *
+ * Key needs room for jid_to_str_len() characters and the terminator.
+ *
+ * @return How much of the key is the bare JID.
+ */
+static size_t directory_key(char *key, const struct jid *jid) {
+    char *end = key;
+    const char *part = jid_local(jid);
+    if (part != NULL) {
+        end = stpcpy(end, part);
+        *end++ = '@';
+    }
+    end = stpcpy(end, jid_domain(jid));
+    size_t bare_len = end - key;
+
+    part = jid_resource(jid);
+    if (part != NULL) {
+        *end++ = '/';
+        stpcpy(end, part);
+    }
+    return bare_len;
+}
+
+static bool is_wildcard(const struct jid *jid) {
+    const char *parts[] = {jid_local(jid), jid_domain(jid),
+                           jid_resource(jid)};
+    for (int i = 0; i < 3; i++) {
+        if (parts[i] != NULL && strcmp(parts[i], "*") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Marks an entry's worker as needing a stanza, unless it is our own. */
+static void directory_target(const struct directory_entry *entry,
+                             int worker, bool *targets, bool *forward) {
+    if (entry->worker != worker) {
+        targets[entry->worker] = true;
+        *forward = true;
+    }
+}
+
+static void queue_init(struct handoff_queue *queue) {
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+/** Safe to call from any thread. */
+static void queue_push(struct handoff_queue *queue, struct handoff *entry) {
+    entry->next = NULL;
+    struct handoff *prev = __atomic_exchange_n(&queue->head, entry,
+                                               __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, entry, __ATOMIC_RELEASE);
+}
+
+/**
+ * Only the owning worker may call this.
+ *
+ * Returns NULL when the queue is empty, or when a producer is halfway through
+ * a push.  In the latter case, the producer's ev_async_send() will wake us up
+ * again once it is done.
+ */
+static struct handoff* queue_pop(struct handoff_queue *queue) {
+    struct handoff *tail = queue->tail;
+    struct handoff *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    struct handoff *head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail != head) {
+        return NULL;
+    }
+
+    /* Only one entry left, put the stub back behind it so it can be taken
+     * without racing producers. */
+    queue_push(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file xmp3_workers.h
+ * Runs the XMPP server on several event loops (one per thread).
+ *
+ * Each worker owns an event loop, an xmpp_server instance with its own
+ * SO_REUSEPORT listening socket, and the clients that the kernel handed to
+ * that socket.  Worker 0 (the primary) runs on the caller's loop and thread,
+ * and is the only worker that extension modules are started on.
+ *
+ * Workers share a directory of which worker each bound client JID lives on.
+ * Stanzas addressed to a client on another worker (or, from a secondary
+ * worker, stanzas nothing local could handle) are serialized and pushed onto
+ * the destination worker's lock-free queue, and that worker is woken with an
+ * ev_async watcher to route them.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/* Forward declarations. */
+struct ev_loop;
+
+struct jid;
+struct xmp3_options;
+struct xmp3_workers;
+struct xmpp_server;
+struct xmpp_stanza;
+
+/**
+ * Creates the configured number of workers, along with their servers.
+ *
+ * No threads are started until xmp3_workers_start() is called.
+ *
+ * @param loop    The loop the primary worker will use.  The caller remains
+ *                responsible for running it.
+ * @param options Options to configure the servers with.
+ */
+struct xmp3_workers* xmp3_workers_new(struct ev_loop *loop,
+                                      const struct xmp3_options *options);
+
+/**
+ * Works like xmp3_workers_new(), but the servers take over listening sockets
+ * from another process instead of opening their own.
+ *
+ * @param fds     Listening sockets, one per worker in order.  Workers past
+ *                the end open their own, extra sockets are closed.
+ * @param num_fds The length of fds.
+ */
+struct xmp3_workers* xmp3_workers_new_from_sockets(struct ev_loop *loop,
+        const struct xmp3_options *options, const int *fds, int num_fds);
+
+/** Stops all workers (if needed) and cleans up their servers. */
+void xmp3_workers_del(struct xmp3_workers *workers);
+
+/** Starts a thread running the event loop for each secondary worker. */
+bool xmp3_workers_start(struct xmp3_workers *workers);
+
+/** Stops the secondary workers' event loops, and waits for them to exit. */
+void xmp3_workers_stop(struct xmp3_workers *workers);
+
+/** Returns the server instance of the primary worker. */
+struct xmpp_server* xmp3_workers_primary(const struct xmp3_workers *workers);
+
+/** Returns the number of workers. */
+int xmp3_workers_count(const struct xmp3_workers *workers);
+
+/**
+ * Returns a worker's server instance.
+ *
+ * Only safe to use from another thread while the workers are stopped.
+ */
+struct xmpp_server* xmp3_workers_server(const struct xmp3_workers *workers,
+                                        int worker);
+
+/** Logs the accept counters of every worker's server. */
+void xmp3_workers_log_stats(const struct xmp3_workers *workers);
+
+/**
+ * Returns the number of clients connected to all workers.
+ *
+ * Servers share this (updating it atomically) to enforce max_clients.
+ */
+int* xmp3_workers_sessions(struct xmp3_workers *workers);
+
+/**
+ * Records that a client with this JID is bound on a worker.
+ *
+ * @returns false if the JID is already bound on some worker.
+ */
+bool xmp3_workers_add_jid(struct xmp3_workers *workers, int worker,
+                          const struct jid *jid);
+
+/** Removes a JID previously added by xmp3_workers_add_jid(). */
+void xmp3_workers_del_jid(struct xmp3_workers *workers, int worker,
+                          const struct jid *jid);
+
+/**
+ * Hands a stanza off to any other workers that should see it.
+ *
+ * The stanza is sent to every other worker with a bound client matching its
+ * "to" JID.  If there are none, the stanza was not handled locally, and this
+ * is not the primary worker, it is sent to the primary instead (which is
+ * where modules live).
+ *
+ * @param worker      The worker calling this function.
+ * @param was_handled Whether a local route already handled the stanza.
+ * @returns true if the stanza was given to at least one other worker.
+ */
+bool xmp3_workers_forward(struct xmp3_workers *workers, int worker,
+                          struct xmpp_stanza *stanza, bool was_handled);
@@ -41,7 +41,7 @@
 #include "log.h"
 #include "utils.h"
 
-#include "client_socket.h"
+#include "atom.h"
 #include "jid.h"
 #include "xmpp_client.h"
 #include "xmpp_core.h"
@@ -54,22 +54,10 @@
 /* authzid, authcid, passed can be 255 octets, plus 2 NULLs inbetween. */
 static const int PLAIN_AUTH_BUFFER_SIZE = (3 * 255 + 2);
 
-/* XML string constants. */
-static const char *STREAM_NS = "http://etherx.jabber.org/streams";
-static const char *STREAM_NAME = "stream";
-
-static const char *STARTTLS_NS = "urn:ietf:params:xml:ns:xmpp-tls";
-static const char *STARTTLS = "starttls";
-
-static const char *SASL_NS = "urn:ietf:params:xml:ns:xmpp-sasl";
-static const char *AUTH = "auth";
+/* XML string constants (names and namespaces are checked by atom). */
 static const char *AUTH_MECHANISM = "mechanism";
 static const char *AUTH_MECHANISM_PLAIN = "PLAIN";
 
-static const char *BIND_NS = "urn:ietf:params:xml:ns:xmpp-bind";
-static const char *BIND = "bind";
-static const char *RESOURCE = "resource";
-
 /* TODO: Technically, the id field should be unique per stream on the server,
  * but it doesn't seem to really matter. */
 static const char *MSG_STREAM_HEADER =
@@ -149,24 +137,22 @@ bool xmpp_auth_stream_start(struct xmpp_stanza *stanza,
 
     debug("New stream start");
 
-    /* name and attrs are guaranteed to be null terminated, so strcmp is OK. */
-    check(strcmp(xmpp_stanza_uri(stanza), STREAM_NS) == 0,
+    check(xmpp_stanza_uri_atom(stanza) == ATOM_NS_STREAM,
           "Unexpected stanza");
-    check(strcmp(xmpp_stanza_name(stanza), STREAM_NAME) == 0,
+    check(xmpp_stanza_name_atom(stanza) == ATOM_STREAM,
           "Unexpected stanza");
 
     /* Step 2: Server responds by sending a response stream header to
      * client. */
-    check(client_socket_sendall(xmpp_client_socket(client),
-                MSG_STREAM_HEADER, strlen(MSG_STREAM_HEADER)) > 0,
+    check(xmpp_client_send(client,
+                MSG_STREAM_HEADER, strlen(MSG_STREAM_HEADER)),
           "Error sending stream header to client");
 
     /* Step 3: Server sends stream features to client (only the STARTTLS
      * extension at this point, which is mandatory-to-negotiate) */
     if (xmpp_server_ssl_context(xmpp_client_server(client)) != NULL) {
-        check(client_socket_sendall(xmpp_client_socket(client),
-                                    MSG_STREAM_FEATURES_TLS,
-                                    strlen(MSG_STREAM_FEATURES_TLS)) > 0,
+        check(xmpp_client_send(client, MSG_STREAM_FEATURES_TLS,
+                               strlen(MSG_STREAM_FEATURES_TLS)),
               "Error sending TLS stream features to client");
 
         /* We expect to see a <starttls> tag from the client. */
@@ -174,9 +160,9 @@ bool xmpp_auth_stream_start(struct xmpp_stanza *stanza,
 
     } else {
         /* SSL is disabled, skip right to SASL. */
-        check(client_socket_sendall(xmpp_client_socket(client),
+        check(xmpp_client_send(client,
                     MSG_STREAM_FEATURES_SASL,
-                    strlen(MSG_STREAM_FEATURES_SASL)) > 0,
+                    strlen(MSG_STREAM_FEATURES_SASL)),
               "Error sending SASL stream features to client");
 
         /* We expect to see a SASL PLAIN <auth> tag next. */
@@ -196,19 +182,19 @@ static bool stream_sasl_start(struct xmpp_stanza *stanza,
 
     /* Step 7: If TLS negotiation is successful, client initiates a new stream
      * to server over the TLS-protected TCP connection. */
-    check(strcmp(xmpp_stanza_uri(stanza), STREAM_NS) == 0,
+    check(xmpp_stanza_uri_atom(stanza) == ATOM_NS_STREAM,
           "Unexpected stanza");
-    check(strcmp(xmpp_stanza_name(stanza), STREAM_NAME) == 0,
+    check(xmpp_stanza_name_atom(stanza) == ATOM_STREAM,
           "Unexpected stanza");
 
     /* Step 8: Server responds by sending a stream header to client along with
      * any available stream features. */
-    check(client_socket_sendall(xmpp_client_socket(client),
-                MSG_STREAM_HEADER, strlen(MSG_STREAM_HEADER)) > 0,
+    check(xmpp_client_send(client,
+                MSG_STREAM_HEADER, strlen(MSG_STREAM_HEADER)),
           "Error sending stream header to client");
-    check(client_socket_sendall(xmpp_client_socket(client),
+    check(xmpp_client_send(client,
                 MSG_STREAM_FEATURES_SASL,
-                strlen(MSG_STREAM_FEATURES_SASL)) > 0,
+                strlen(MSG_STREAM_FEATURES_SASL)),
           "Error sending SASL stream features to client");
 
     /* We expect to see a SASL PLAIN <auth> tag next. */
@@ -225,19 +211,19 @@ static bool stream_bind_start(struct xmpp_stanza *stanza,
 
     debug("Resource bind stream start");
 
-    check(strcmp(xmpp_stanza_uri(stanza), STREAM_NS) == 0,
+    check(xmpp_stanza_uri_atom(stanza) == ATOM_NS_STREAM,
           "Unexpected stanza");
-    check(strcmp(xmpp_stanza_name(stanza), STREAM_NAME) == 0,
+    check(xmpp_stanza_name_atom(stanza) == ATOM_STREAM,
           "Unexpected stanza");
 
     /* Step 14: Server responds by sending a stream header to client along
      * with supported features (in this case, resource binding) */
-    check(client_socket_sendall(xmpp_client_socket(client),
-                MSG_STREAM_HEADER, strlen(MSG_STREAM_HEADER)) > 0,
+    check(xmpp_client_send(client,
+                MSG_STREAM_HEADER, strlen(MSG_STREAM_HEADER)),
           "Error sending stream header to client");
-    check(client_socket_sendall(xmpp_client_socket(client),
+    check(xmpp_client_send(client,
                     MSG_STREAM_FEATURES_BIND,
-                    strlen(MSG_STREAM_FEATURES_BIND)) > 0,
+                    strlen(MSG_STREAM_FEATURES_BIND)),
           "Error sending bind stream features to client");
 
     /* We expect to see the resouce binding IQ stanza next. */
@@ -257,19 +243,19 @@ static bool handle_starttls(struct xmpp_stanza *stanza,
 
     debug("Start TLS");
 
-    check(strcmp(xmpp_stanza_uri(stanza), STARTTLS_NS) == 0,
+    check(xmpp_stanza_uri_atom(stanza) == ATOM_NS_TLS,
           "Unexpected stanza");
-    check(strcmp(xmpp_stanza_name(stanza), STARTTLS) == 0,
+    check(xmpp_stanza_name_atom(stanza) == ATOM_STARTTLS,
           "Unexpected stanza");
 
-    check(client_socket_sendall(xmpp_client_socket(client),
-                MSG_TLS_PROCEED, strlen(MSG_TLS_PROCEED)) > 0,
+    check(xmpp_client_send(client,
+                MSG_TLS_PROCEED, strlen(MSG_TLS_PROCEED)),
           "Error sending TLS proceed to client");
 
-    check(client_socket_ssl_new(
-          xmpp_client_socket(client),
-          xmpp_server_ssl_context(xmpp_client_server(client))) != NULL,
-          "Error initializing SSL socket.");
+    /* The socket switches over to TLS once the proceed has been written.
+     * The server then drives the handshake as the socket becomes readable or
+     * writable, and nothing reaches the parser again until it is done. */
+    check(xmpp_client_start_tls(client), "Error initializing SSL socket.");
 
     /* We expect a new stream from the client. */
     xmpp_parser_new_stream(parser);
@@ -292,9 +278,9 @@ static bool handle_sasl_plain(struct xmpp_stanza *stanza,
 
     debug("SASL plain authentication");
 
-    check(strcmp(xmpp_stanza_uri(stanza), SASL_NS) == 0,
+    check(xmpp_stanza_uri_atom(stanza) == ATOM_NS_SASL,
           "Unexpected stanza");
-    check(strcmp(xmpp_stanza_name(stanza), AUTH) == 0,
+    check(xmpp_stanza_name_atom(stanza) == ATOM_AUTH,
           "Unexpected stanza");
 
     const char *mechanism = xmpp_stanza_attr(stanza, AUTH_MECHANISM);
@@ -317,9 +303,8 @@ static bool handle_sasl_plain(struct xmpp_stanza *stanza,
     if (!xmpp_server_authenticate(xmpp_client_server(client), authzid, authcid,
                                   passwd)) {
         log_warn("User '%s' failed to authenticate, disconnecting.", authcid);
-        check(client_socket_sendall(xmpp_client_socket(client),
-                                    MSG_NOT_AUTHORIZED, 
-                                    strlen(MSG_NOT_AUTHORIZED)) > 0,
+        check(xmpp_client_send(client, MSG_NOT_AUTHORIZED,
+                               strlen(MSG_NOT_AUTHORIZED)),
               "Error sending not authorized message to client");
         goto error;
     }
@@ -331,8 +316,8 @@ static bool handle_sasl_plain(struct xmpp_stanza *stanza,
     xmpp_client_set_jid(client, jid);
 
     /* Success! */
-    check(client_socket_sendall(xmpp_client_socket(client),
-                MSG_SASL_SUCCESS, strlen(MSG_SASL_SUCCESS)) > 0,
+    check(xmpp_client_send(client,
+                MSG_SASL_SUCCESS, strlen(MSG_SASL_SUCCESS)),
           "Error sending SASL success to client");
 
     /* Go to step 7, the client needs to send us a new stream header. */
@@ -366,9 +351,9 @@ static bool handle_bind_iq(struct xmpp_stanza *stanza,
     UT_string success_msg;
     utstring_init(&success_msg);
 
-    check(strcmp(xmpp_stanza_uri(stanza), XMPP_STANZA_NS_CLIENT) == 0,
+    check(xmpp_stanza_uri_atom(stanza) == ATOM_NS_CLIENT,
           "Unexpected stanza");
-    check(strcmp(xmpp_stanza_name(stanza), XMPP_STANZA_IQ) == 0,
+    check(xmpp_stanza_name_atom(stanza) == ATOM_IQ,
           "Unexpected stanza");
 
     /* Validate the correct attributes set on the start tag. */
@@ -382,9 +367,9 @@ static bool handle_bind_iq(struct xmpp_stanza *stanza,
     /* Jump to the inner <bind> tag. */
     stanza = xmpp_stanza_children(stanza);
     check(stanza != NULL, "Bind iq has no child.");
-    check(strcmp(xmpp_stanza_uri(stanza), BIND_NS) == 0,
+    check(xmpp_stanza_uri_atom(stanza) == ATOM_NS_BIND,
           "Unexpected stanza");
-    check(strcmp(xmpp_stanza_name(stanza), BIND) == 0,
+    check(xmpp_stanza_name_atom(stanza) == ATOM_BIND,
           "Unexpected stanza");
 
     struct jid *new_jid = jid_new_from_jid(xmpp_client_jid(client));
@@ -397,18 +382,18 @@ static bool handle_bind_iq(struct xmpp_stanza *stanza,
         jid_set_resource(new_jid, uuid);
         free(uuid);
     } else {
-        check(strcmp(xmpp_stanza_uri(stanza), BIND_NS) == 0,
+        check(xmpp_stanza_uri_atom(stanza) == ATOM_NS_BIND,
               "Unexpected stanza");
-        check(strcmp(xmpp_stanza_name(stanza), RESOURCE) == 0,
+        check(xmpp_stanza_name_atom(stanza) == ATOM_RESOURCE,
               "Unexpected stanza");
 
         /* Copy the resource into the client information structure. */
         jid_set_resource(new_jid, xmpp_stanza_data(stanza));
     }
 
-    /* Search for locally connected clients with this JID.  If a duplicate is
-     * found, append a UUID until we get a unique resource. */
-    while (xmpp_server_find_client(server, new_jid) != NULL) {
+    /* Search for connected clients with this JID.  If a duplicate is found,
+     * append a UUID until we get a unique resource. */
+    while (!xmpp_server_claim_jid(server, client, new_jid)) {
 
 #ifndef NDEBUG
         char *strjid = jid_to_str(new_jid);
@@ -434,9 +419,8 @@ static bool handle_bind_iq(struct xmpp_stanza *stanza,
 
     /* Step 16: Server accepts submitted resourcepart and informs client of
      * successful resource binding */
-    check(client_socket_sendall(xmpp_client_socket(client),
-                                utstring_body(&success_msg),
-                                utstring_len(&success_msg)) > 0,
+    check(xmpp_client_send(client, utstring_body(&success_msg),
+                           utstring_len(&success_msg)),
           "Error sending resource binding success message.");
     utstring_done(&success_msg);
 
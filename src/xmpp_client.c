@@ -27,6 +27,12 @@
  * A connected XMPP server client.
  */
 
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <utstring.h>
+
 #include "log.h"
 
 #include "client_socket.h"
@@ -38,6 +44,9 @@
 
 #include "xmpp_client.h"
 
+/** Largest outbound queue kept around while a client is idle. */
+#define XMPP_CLIENT_IDLE_OUTBUF 1024
+
 /** Data on a connected client. */
 struct xmpp_client {
     /** The server this client is connected to. */
@@ -51,8 +60,35 @@ struct xmpp_client {
 
     /** The JID of this client. */
     struct jid *jid;
+
+    /** Set once the JID has been taken out of the server's routing. */
+    bool unrouted;
+
+    /** The server's connection bookkeeping (event watchers) for us. */
+    struct c_client *conn;
+
+    /** Data waiting to be written to the socket. */
+    UT_string outbuf;
+
+    /** How much of the outbound queue has already been written. */
+    size_t outbuf_sent;
+
+    /** Set once a write to the socket has failed. */
+    bool write_error;
+
+    /** Switch to TLS once the outbound queue is empty. */
+    bool starttls_pending;
+
+    /**
+     * Set once the socket is using TLS.  Output is then always queued until
+     * the server flushes the client, so a burst goes out in one record.
+     */
+    bool tls;
 };
 
+static ssize_t finish_flush(struct xmpp_client *client);
+static bool upgrade_socket(struct xmpp_client *client);
+
 struct xmpp_client* xmpp_client_new(struct xmpp_server *server,
                                     struct client_socket *socket) {
     struct xmpp_client *client = calloc(1, sizeof(*client));
@@ -60,10 +96,12 @@ struct xmpp_client* xmpp_client_new(struct xmpp_server *server,
 
     client->server = server;
     client->socket = socket;
+    utstring_init(&client->outbuf);
 
     /* Create the XML parser we'll use to parse stanzas from the client. */
     client->parser = xmpp_parser_new(true);
     check(client->parser != NULL, "Error creating XML parser");
+    xmpp_parser_set_limits(client->parser, xmpp_server_parser_limits(server));
 
     /* Set initial handlers to begin authentication. */
     xmpp_parser_set_handler(client->parser, xmpp_auth_stream_start);
@@ -78,12 +116,16 @@ error:
 
 void xmpp_client_del(struct xmpp_client *client) {
     if (client->jid) {
-        xmpp_server_del_stanza_route(client->server, client->jid,
-                xmpp_core_route_client, client);
+        xmpp_client_unroute(client);
         jid_del(client->jid);
     }
 
     if (client->socket) {
+        /* Give anything still queued (e.g. a stream error) a last chance to
+         * go out before the socket is closed. */
+        if (!client->write_error && xmpp_client_pending(client) > 0) {
+            xmpp_client_flush(client);
+        }
         client_socket_close(client->socket);
         client_socket_del(client->socket);
     }
@@ -92,9 +134,32 @@ void xmpp_client_del(struct xmpp_client *client) {
         xmpp_parser_del(client->parser);
     }
 
+    utstring_done(&client->outbuf);
     free(client);
 }
 
+void xmpp_client_unroute(struct xmpp_client *client) {
+    if (client->jid == NULL || client->unrouted) {
+        return;
+    }
+    xmpp_server_del_stanza_route(client->server, client->jid,
+            xmpp_core_route_client, client);
+    xmpp_server_release_jid(client->server, client->jid);
+    client->unrouted = true;
+}
+
+void xmpp_client_detach(struct xmpp_client *client) {
+    if (client->socket) {
+        int fd = client_socket_fd(client->socket);
+        client_socket_del(client->socket);
+        client->socket = NULL;
+        if (close(fd) == -1) {
+            log_err("Unable to close client socket");
+        }
+    }
+    xmpp_client_del(client);
+}
+
 struct xmpp_server* xmpp_client_server(struct xmpp_client *client) {
     return client->server;
 }
@@ -117,3 +182,195 @@ void xmpp_client_set_jid(struct xmpp_client *client, struct jid *jid) {
     }
     client->jid = jid;
 }
+
+struct c_client* xmpp_client_conn(const struct xmpp_client *client) {
+    return client->conn;
+}
+
+void xmpp_client_set_conn(struct xmpp_client *client, struct c_client *conn) {
+    client->conn = conn;
+}
+
+bool xmpp_client_send(struct xmpp_client *client, const void *buf,
+                      size_t len) {
+    struct iovec iov = { .iov_base = (void*)buf, .iov_len = len };
+    return xmpp_client_sendv(client, &iov, 1);
+}
+
+bool xmpp_client_sendv(struct xmpp_client *client, const struct iovec *iov,
+                       int iovcnt) {
+    if (client->write_error) {
+        return false;
+    }
+
+    /* The server flushes whatever we leave queued at the end of this loop
+     * iteration, and corks the socket until then. */
+    xmpp_server_schedule_flush(client);
+
+    /* Skip the copy if the socket can take the data right now (the queue
+     * must drain first though, to keep things in order).  Plain sockets are
+     * corked, so the kernel collects the burst into full segments for us.
+     * With io_uring, the server writes the queue out with everyone else's. */
+    size_t offset = 0;
+    if (!client->tls && xmpp_client_pending(client) == 0
+            && !xmpp_server_batches_io(client->server)
+            && !client_socket_handshaking(client->socket)) {
+        while (iovcnt > 0) {
+            ssize_t numsent = client_socket_sendv(client->socket, iov, iovcnt);
+            if (numsent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else if (numsent == -1 && errno == EINTR) {
+                continue;
+            } else if (numsent <= 0) {
+                /* The server disconnects us when it flushes. */
+                log_err("Error writing to client: %s", strerror(errno));
+                client->write_error = true;
+                return false;
+            }
+
+            /* Skip over the buffers that were completely written. */
+            size_t written = numsent;
+            while (iovcnt > 0 && written >= iov->iov_len) {
+                written -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (written > 0) {
+                /* The socket is full. */
+                offset = written;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        utstring_bincpy(&client->outbuf, (char*)iov[i].iov_base + offset,
+                        iov[i].iov_len - offset);
+        offset = 0;
+    }
+    return true;
+}
+
+ssize_t xmpp_client_flush(struct xmpp_client *client) {
+    if (client->write_error) {
+        return -1;
+    }
+
+    /* Nothing can be written until the TLS handshake is done, the server
+     * flushes the queue once it is. */
+    if (client_socket_handshaking(client->socket)) {
+        return xmpp_client_pending(client);
+    }
+
+    while (xmpp_client_pending(client) > 0) {
+        ssize_t numsent = client_socket_send(client->socket,
+                utstring_body(&client->outbuf) + client->outbuf_sent,
+                xmpp_client_pending(client));
+        if (numsent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (numsent == -1 && errno == EINTR) {
+            continue;
+        } else if (numsent <= 0) {
+            log_err("Error writing to client: %s", strerror(errno));
+            client->write_error = true;
+            return -1;
+        }
+        client->outbuf_sent += numsent;
+    }
+
+    return finish_flush(client);
+}
+
+const char* xmpp_client_pending_data(const struct xmpp_client *client) {
+    return utstring_body(&client->outbuf) + client->outbuf_sent;
+}
+
+ssize_t xmpp_client_flushed(struct xmpp_client *client, ssize_t result) {
+    if (client->write_error) {
+        return -1;
+    }
+
+    if (result > 0) {
+        client->outbuf_sent += result;
+    } else if (result != -EAGAIN && result != -EWOULDBLOCK
+               && result != -EINTR) {
+        errno = result < 0 ? -result : EPIPE;
+        log_err("Error writing to client: %s", strerror(errno));
+        client->write_error = true;
+        return -1;
+    }
+
+    return finish_flush(client);
+}
+
+/**
+ * Tidies up the outbound queue after (some of) it has been written.
+ *
+ * @returns The number of bytes still queued, or -1 if the socket failed.
+ */
+static ssize_t finish_flush(struct xmpp_client *client) {
+    if (xmpp_client_pending(client) == 0) {
+        utstring_clear(&client->outbuf);
+        client->outbuf_sent = 0;
+
+        if (client->starttls_pending && !upgrade_socket(client)) {
+            client->write_error = true;
+            return -1;
+        }
+    } else if (client->outbuf_sent > 0) {
+        /* Move the unsent tail to the front so the queue doesn't keep
+         * growing while the client is slow. */
+        size_t pending = xmpp_client_pending(client);
+        memmove(utstring_body(&client->outbuf),
+                utstring_body(&client->outbuf) + client->outbuf_sent, pending);
+        client->outbuf.i = pending;
+        client->outbuf.d[pending] = '\0';
+        client->outbuf_sent = 0;
+    }
+
+    return xmpp_client_pending(client);
+}
+
+size_t xmpp_client_pending(const struct xmpp_client *client) {
+    return utstring_len(&client->outbuf) - client->outbuf_sent;
+}
+
+bool xmpp_client_tls(const struct xmpp_client *client) {
+    return client->tls || client->starttls_pending;
+}
+
+bool xmpp_client_hibernate(struct xmpp_client *client) {
+    if (client->write_error || client->starttls_pending
+            || xmpp_client_pending(client) > 0
+            || client_socket_handshaking(client->socket)
+            || !xmpp_parser_hibernate(client->parser)) {
+        return false;
+    }
+
+    /* A burst of output can leave a large queue behind. */
+    if (utstring_len(&client->outbuf) == 0
+            && client->outbuf.n > XMPP_CLIENT_IDLE_OUTBUF) {
+        utstring_done(&client->outbuf);
+        utstring_init(&client->outbuf);
+        client->outbuf_sent = 0;
+    }
+
+    client_socket_release(client->socket);
+    return true;
+}
+
+bool xmpp_client_start_tls(struct xmpp_client *client) {
+    client->starttls_pending = true;
+    if (xmpp_client_pending(client) == 0) {
+        return upgrade_socket(client);
+    }
+    return true;
+}
+
+/** Replaces the client's plain socket with a TLS one. */
+static bool upgrade_socket(struct xmpp_client *client) {
+    client->starttls_pending = false;
+    client->tls = client_socket_ssl_new(client->socket,
+            xmpp_server_ssl_context(client->server)) != NULL;
+    return client->tls;
+}
@@ -29,8 +29,13 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <sys/types.h>
+
 /* Forward declarations. */
+struct c_client;
 struct client_socket;
+struct iovec;
 struct xmpp_client;
 struct xmpp_parser;
 struct xmpp_server;
@@ -40,6 +45,22 @@ struct xmpp_client* xmpp_client_new(struct xmpp_server *server,
 
 void xmpp_client_del(struct xmpp_client *client);
 
+/**
+ * Takes the client's JID out of the server's routing and releases it.
+ *
+ * The client keeps its JID, so whoever is told about a disconnect can still
+ * look it up.  Does nothing if it was already done.
+ */
+void xmpp_client_unroute(struct xmpp_client *client);
+
+/**
+ * Frees the client without ending its connection.
+ *
+ * Only our file descriptor is closed, for when the connection has been handed
+ * to another process.  Nothing queued is sent.
+ */
+void xmpp_client_detach(struct xmpp_client *client);
+
 /** Return the server this client is connected to. */
 struct xmpp_server* xmpp_client_server(struct xmpp_client *client);
 
@@ -56,3 +77,86 @@ struct jid* xmpp_client_jid(const struct xmpp_client *client);
  * Client takes ownership of JID.
  */
 void xmpp_client_set_jid(struct xmpp_client *client, struct jid *jid);
+
+/** Return the server's connection bookkeeping for this client. */
+struct c_client* xmpp_client_conn(const struct xmpp_client *client);
+
+/** Set by the server once the client has been registered with it. */
+void xmpp_client_set_conn(struct xmpp_client *client, struct c_client *conn);
+
+/**
+ * Queue data to be sent to the client.
+ *
+ * Nothing is sent until the end of the current event loop iteration, when
+ * the server flushes everything queued for the client at once.  Plain
+ * sockets are written to right away but kept corked until then, TLS sockets
+ * keep the data in the client's outbound queue so it becomes a single
+ * record.  Whatever the socket won't take is written by the server once it
+ * becomes writable again.  This never blocks.
+ *
+ * @returns false if the client's socket has failed, true otherwise.
+ */
+bool xmpp_client_send(struct xmpp_client *client, const void *buf,
+                      size_t len);
+
+/**
+ * Queue a list of buffers to be sent to the client.
+ *
+ * Works like xmpp_client_send(), but when the buffers can go straight to the
+ * socket they are sent in one gather write, and only what the socket didn't
+ * take is copied into the outbound queue.
+ *
+ * @returns false if the client's socket has failed, true otherwise.
+ */
+bool xmpp_client_sendv(struct xmpp_client *client, const struct iovec *iov,
+                       int iovcnt);
+
+/**
+ * Write as much of the outbound queue to the socket as it will take.
+ *
+ * @returns The number of bytes still queued, or -1 if the socket failed.
+ */
+ssize_t xmpp_client_flush(struct xmpp_client *client);
+
+/**
+ * Return the start of the data waiting in the outbound queue.
+ *
+ * This is for the server to write the queue out itself (e.g. batched with
+ * other clients), it must report back with xmpp_client_flushed().
+ */
+const char* xmpp_client_pending_data(const struct xmpp_client *client);
+
+/**
+ * Record the result of writing out the start of the outbound queue.
+ *
+ * @param result The number of bytes written, or a negative errno value.
+ * @returns As for xmpp_client_flush().
+ */
+ssize_t xmpp_client_flushed(struct xmpp_client *client, ssize_t result);
+
+/**
+ * Switch the client's socket over to TLS.
+ *
+ * This happens as soon as everything queued so far has been written, so
+ * a STARTTLS proceed can be sent first.  The handshake itself is driven by
+ * the server as the socket becomes ready.
+ *
+ * @returns false if the socket could not be set up for TLS.
+ */
+bool xmpp_client_start_tls(struct xmpp_client *client);
+
+/** Return the number of bytes waiting in the outbound queue. */
+size_t xmpp_client_pending(const struct xmpp_client *client);
+
+/** Returns true if the client's socket uses TLS (or is about to). */
+bool xmpp_client_tls(const struct xmpp_client *client);
+
+/**
+ * Frees what an idle client doesn't need: the XML parser, spare room in the
+ * outbound queue, and the socket's buffers.  Everything comes back as soon
+ * as the client reads or writes again.
+ *
+ * @returns false if the client is busy (mid-stanza, mid-handshake, or with
+ *          output still queued) and nothing was freed.
+ */
+bool xmpp_client_hibernate(struct xmpp_client *client);
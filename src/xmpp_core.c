@@ -46,12 +46,17 @@ bool xmpp_core_handle_stanza(struct xmpp_stanza *stanza,
     struct xmpp_client *client = (struct xmpp_client*)data;
     struct xmpp_server *server = xmpp_client_server(client);
 
+    /* Answers to the server's own pings go no further. */
+    if (xmpp_server_ping_reply(client, stanza)) {
+        return true;
+    }
+
     const char *to = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_TO);
     if (to == NULL) {
         /* RFC6120 Section 10, messages with no "to" are addressed to the bare
          * JID of the client, other stanzas are addressed to the server. */
         char *new_to;
-        if (strcmp(xmpp_stanza_name(stanza), XMPP_STANZA_MESSAGE) == 0) {
+        if (xmpp_stanza_kind(stanza) == XMPP_STANZA_KIND_MESSAGE) {
             struct jid *bare = jid_new_from_jid_bare(xmpp_client_jid(client));
             new_to = jid_to_str(bare);
             jid_del(bare);
@@ -77,7 +82,7 @@ bool xmpp_core_route_client(struct xmpp_stanza *stanza,
 
     /* If an IQ is addressed to a bare JID, it should be handled by the server
      * on behalf of the client. */
-    if (strcmp(xmpp_stanza_name(stanza), XMPP_STANZA_IQ) == 0) {
+    if (xmpp_stanza_kind(stanza) == XMPP_STANZA_KIND_IQ) {
         const char *to_jid_str = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_TO);
         struct jid* to_jid = jid_new_from_str(to_jid_str);
 
@@ -90,29 +95,34 @@ bool xmpp_core_route_client(struct xmpp_stanza *stanza,
     debug("Routing to local client '%s'", strjid);
     free(strjid);
 
-    size_t length;
-    char *msg = xmpp_stanza_string(stanza, &length, true);
-    if (client_socket_sendall(xmpp_client_socket(client), msg, length) <= 0) {
-        free(msg);
-        xmpp_server_disconnect_client(client);
-        return false;
+    /* A client that has fallen behind may not get everything. */
+    if (!xmpp_server_admit_stanza(client, stanza)) {
+        return true;
     }
-    free(msg);
-    return true;
+
+    /* The stanza goes to the socket straight from its own memory if it can,
+     * whatever doesn't fit is queued for the server to write out once the
+     * client's socket is writable.  If the write fails, the server takes care
+     * of disconnecting the client. */
+    struct xmpp_stanza_iov *iov = xmpp_server_stanza_iov(server);
+    xmpp_stanza_iov_build(iov, stanza, true);
+    return xmpp_client_sendv(client, xmpp_stanza_iov_vec(iov),
+                             xmpp_stanza_iov_count(iov));
 }
 
 bool xmpp_core_route_server(struct xmpp_stanza *stanza,
                             struct xmpp_server *server, void *data) {
-    if (strcmp(xmpp_stanza_name(stanza), XMPP_STANZA_MESSAGE) == 0) {
-        log_warn("Message addressed to server?");
-        return false;
-    } else if (strcmp(xmpp_stanza_name(stanza), XMPP_STANZA_PRESENCE) == 0) {
-        log_warn("Ignoring presence stanza.");
-        return true;
-    } else if (strcmp(xmpp_stanza_name(stanza), XMPP_STANZA_IQ) == 0) {
-        return xmpp_server_route_iq(server, stanza);
-    } else {
-        log_warn("Unknown stanza");
-        return false;
+    switch (xmpp_stanza_kind(stanza)) {
+        case XMPP_STANZA_KIND_MESSAGE:
+            log_warn("Message addressed to server?");
+            return false;
+        case XMPP_STANZA_KIND_PRESENCE:
+            log_warn("Ignoring presence stanza.");
+            return true;
+        case XMPP_STANZA_KIND_IQ:
+            return xmpp_server_route_iq(server, stanza);
+        default:
+            log_warn("Unknown stanza");
+            return false;
     }
 }
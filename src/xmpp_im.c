@@ -43,9 +43,6 @@ const char *XMPP_IQ_ROSTER_NS = "jabber:iq:roster";
 const char *XMPP_IQ_PING_NS = "urn:xmpp:ping";
 const char *XMPP_IQ_VCARD_TEMP_NS = "vcard-temp";
 
-static const char *IQ_SESSION = "session";
-static const char *IQ_QUERY = "query";
-
 static bool get_roster(struct xmpp_stanza *stanza, struct xmpp_server *server);
 
 bool xmpp_im_iq_session(struct xmpp_stanza *stanza, struct xmpp_server *server,
@@ -56,7 +53,7 @@ bool xmpp_im_iq_session(struct xmpp_stanza *stanza, struct xmpp_server *server,
                  XMPP_STANZA_TYPE_SET) == 0, "Session IQ type must be 'set'");
 
     struct xmpp_stanza *child = xmpp_stanza_children(stanza);
-    check(strcmp(xmpp_stanza_name(child), IQ_SESSION) == 0,
+    check(xmpp_stanza_name_atom(child) == ATOM_SESSION,
           "Unexpected stanza.");
 
     const char *id = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_ID);
@@ -84,7 +81,7 @@ bool xmpp_im_iq_disco_items(struct xmpp_stanza *stanza,
                  XMPP_STANZA_TYPE_GET) == 0, "Disco IQ type must be 'get'");
 
     struct xmpp_stanza *child = xmpp_stanza_children(stanza);
-    check(strcmp(xmpp_stanza_name(child), IQ_QUERY) == 0,
+    check(xmpp_stanza_name_atom(child) == ATOM_QUERY,
           "Unexpected stanza.");
 
     const char *id = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_ID);
@@ -118,7 +115,7 @@ bool xmpp_im_iq_disco_info(struct xmpp_stanza *stanza,
                  XMPP_STANZA_TYPE_GET) == 0, "Disco IQ type must be 'get'");
 
     struct xmpp_stanza *child = xmpp_stanza_children(stanza);
-    check(strcmp(xmpp_stanza_name(child), IQ_QUERY) == 0,
+    check(xmpp_stanza_name_atom(child) == ATOM_QUERY,
           "Unexpected stanza.");
 
     const char *id = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_ID);
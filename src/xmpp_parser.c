@@ -27,17 +27,36 @@
  * DOM-style XML parser for XMPP stanzas.
  */
 
-#include <expat.h>
-
 #include <utlist.h>
+#include <utstring.h>
 
+#include "arena.h"
 #include "log.h"
 #include "utils.h"
+#include "xml_backend.h"
 #include "xmpp_stanza.h"
 #include "xmpp_parser.h"
 
+/** Size of the blocks in a parser's arena, enough for most stanzas. */
+#define ARENA_BLOCK_SIZE 2048
+
 const char XMPP_PARSER_SEPARATOR = ' ';
 
+/** The backend new parsers use. */
+static enum xmpp_parser_backend default_backend = XMPP_PARSER_BACKEND_EXPAT;
+
+/** What the next start tag from the backend is. */
+enum start_tag {
+    /** The stream header. */
+    START_STREAM,
+
+    /** The stream header replayed after hibernating. */
+    START_RESUME,
+
+    /** A stanza, or one of its children. */
+    START_STANZA,
+};
+
 /** Structure representing an XML namespace. */
 struct xmpp_parser_namespace {
     char *prefix;
@@ -48,7 +67,12 @@ struct xmpp_parser_namespace {
 
 /** Structure holding state for the XML parser. */
 struct xmpp_parser {
-    XML_Parser parser;
+    /** The XML parser underneath, NULL while hibernating. */
+    struct xml_backend *backend;
+
+    /** Which kind of backend to create. */
+    enum xmpp_parser_backend backend_type;
+
     xmpp_parser_handler handler;
     void *data;
 
@@ -56,23 +80,126 @@ struct xmpp_parser {
     struct xmpp_stanza *cur_stanza;
     int depth;
     bool needs_reset;
+
+    /** What the next start tag is. */
+    enum start_tag next_start;
+
+    /** Number of stanzas passed to the handler so far. */
+    unsigned long stanzas;
+
+    /** Whether the first start tag is a stream start. */
+    bool is_stream_start;
+
+    /**
+     * The stream header, cut down to its name and namespace declarations.
+     * This is all a new backend needs to pick up the stream after
+     * hibernating.
+     */
+    char *stream_header;
+
+    /** Bytes given to the backend since the last reset. */
+    long long parsed;
+
+    /** Where the last stanza (or whitespace between them) ended. */
+    long long boundary;
+
+    /**
+     * Whether stanzas' children are left unparsed, to be loaded from the raw
+     * bytes only if somebody asks for them (see xmpp_stanza_set_raw()).
+     */
+    bool lazy;
+
+    /** The chunk of input being parsed. */
+    const char *input;
+
+    /** Offset of the chunk in the stream. */
+    long long input_start;
+
+    /** The buffer last handed out by xmpp_parser_buffer(). */
+    const char *buffer;
+
+    /** Where the current top-level stanza started. */
+    long long raw_start;
+
+    /** Length of the current top-level stanza's start tag. */
+    int raw_start_len;
+
+    /** Input from earlier chunks that a stanza still needs. */
+    UT_string raw;
+
+    /** Offset of the start of raw in the stream. */
+    long long raw_base;
+
+    /** Stanzas are built in here, and it is reset after each one. */
+    struct arena *arena;
+
+    /** Whether the arena belongs to somebody else (see xmpp_parser_load()). */
+    bool arena_borrowed;
+
+    /** What the parser will accept (zeros are unlimited). */
+    struct xmpp_parser_limits limits;
+
+    /** Bytes of character data in the current stanza. */
+    size_t text;
+
+    /** Namespaces declared on the element being started. */
+    int num_namespaces;
+
+    /** Which limit was hit, NULL if none. */
+    const char *limit_error;
 };
 
 static void init_parser(struct xmpp_parser *parser, bool is_stream_start);
-
-static void stream_start(void *data, const char *name, const char **attrs);
-static void start(void *data, const char *name, const char **attrs);
+static struct xml_backend* backend_new(struct xmpp_parser *parser);
+static void backend_del(struct xmpp_parser *parser);
+static void stop(struct xmpp_parser *parser);
+static long long event_end(struct xmpp_parser *parser);
+static bool wake(struct xmpp_parser *parser);
+static char* stream_header_new(const char *ns_name,
+                               struct xmpp_parser_namespace *namespaces);
+static void mark_boundary(struct xmpp_parser *parser);
+static void keep_raw(struct xmpp_parser *parser);
+static bool check_pending(struct xmpp_parser *parser);
+static bool check_size(struct xmpp_parser *parser);
+static bool check_attributes(struct xmpp_parser *parser, const char **attrs);
+static void over_limit(struct xmpp_parser *parser, const char *what);
+static void drop_stanza(struct xmpp_parser *parser);
+static void attach_raw(struct xmpp_parser *parser);
+static bool load_stream(struct xmpp_stanza *stanza, struct xmpp_parser *parser,
+                        void *data);
+static bool load_stanza(struct xmpp_stanza *stanza, struct xmpp_parser *parser,
+                        void *data);
+
+static void element_start(void *data, const char *name, const char **attrs);
+static void stream_start(struct xmpp_parser *parser, const char *name,
+                         const char **attrs);
+static void stream_resume(struct xmpp_parser *parser, const char *name,
+                          const char **attrs);
+static void start(struct xmpp_parser *parser, const char *name,
+                  const char **attrs);
 static void chardata(void *data, const char *s, int len);
 static void end(void *data, const char *name);
 static void ns_start(void *data, const char *prefix, const char *uri);
 
+/** What every backend calls back. */
+static const struct xml_backend_handlers HANDLERS = {
+    .start = element_start,
+    .end = end,
+    .chardata = chardata,
+    .ns_start = ns_start,
+};
+
 struct xmpp_parser* xmpp_parser_new(bool is_stream_start) {
     struct xmpp_parser *parser = calloc(1, sizeof(*parser));
     check_mem(parser);
 
-    parser->parser = XML_ParserCreateNS(NULL, XMPP_PARSER_SEPARATOR);
-    check(parser->parser != NULL, "Error creating XML parser");
+    parser->backend_type = default_backend;
+    parser->backend = backend_new(parser);
+    check(parser->backend != NULL, "Error creating XML parser");
 
+    parser->lazy = true;
+    parser->arena = arena_new(ARENA_BLOCK_SIZE);
+    utstring_init(&parser->raw);
     init_parser(parser, is_stream_start);
 
     return parser;
@@ -83,12 +210,24 @@ error:
 }
 
 void xmpp_parser_del(struct xmpp_parser *parser) {
-    XML_ParserFree(parser->parser);
+    backend_del(parser);
+    drop_stanza(parser);
+    free(parser->stream_header);
+    utstring_done(&parser->raw);
+    if (!parser->arena_borrowed) {
+        arena_del(parser->arena);
+    }
     free(parser);
 }
 
 const char* xmpp_parser_strerror(struct xmpp_parser *parser) {
-    return XML_ErrorString(XML_GetErrorCode(parser->parser));
+    if (parser->limit_error != NULL) {
+        return parser->limit_error;
+    }
+    if (parser->backend == NULL) {
+        return "out of memory";
+    }
+    return parser->backend->strerror_func(parser->backend);
 }
 
 void xmpp_parser_set_handler(struct xmpp_parser *parser,
@@ -101,14 +240,132 @@ void xmpp_parser_set_data(struct xmpp_parser *parser, void *data) {
 }
 
 bool xmpp_parser_parse(struct xmpp_parser *parser, const char *buf, int len) {
+    if (!wake(parser)) {
+        return false;
+    }
+    if (parser->needs_reset) {
+        xmpp_parser_reset(parser, true);
+    }
+    parser->input = buf;
+    parser->input_start = parser->parsed;
+    parser->parsed += len;
+    bool rv = parser->backend->parse_func(parser->backend, buf, len);
+    keep_raw(parser);
+    return rv && check_pending(parser);
+}
+
+void* xmpp_parser_buffer(struct xmpp_parser *parser, int len) {
+    if (!wake(parser)) {
+        return NULL;
+    }
+    /* Resetting throws away the backend's buffer, so it has to happen
+     * first. */
     if (parser->needs_reset) {
         xmpp_parser_reset(parser, true);
     }
-    return XML_Parse(parser->parser, buf, len, 0) == XML_STATUS_OK;
+    parser->buffer = parser->backend->buffer_func(parser->backend, len);
+    return (void*)parser->buffer;
+}
+
+bool xmpp_parser_parse_buffer(struct xmpp_parser *parser, int len) {
+    parser->input = parser->buffer;
+    parser->input_start = parser->parsed;
+    parser->parsed += len;
+    bool rv = parser->backend->parse_buffer_func(parser->backend, len);
+    keep_raw(parser);
+    return rv && check_pending(parser);
+}
+
+bool xmpp_parser_load(struct xmpp_stanza *stanza, const char *header,
+                      const char *raw, size_t len) {
+    struct xmpp_parser *parser = xmpp_parser_new(header != NULL);
+    check(parser != NULL, "Error creating XML parser");
+
+    /* The children have to last as long as the stanza they are added to. */
+    parser->lazy = false;
+    arena_del(parser->arena);
+    parser->arena = xmpp_stanza_arena(stanza);
+    parser->arena_borrowed = true;
+    xmpp_parser_set_handler(parser, header ? load_stream : load_stanza);
+    xmpp_parser_set_data(parser, stanza);
+
+    bool rv = (header == NULL
+               || xmpp_parser_parse(parser, header, strlen(header)))
+              && xmpp_parser_parse(parser, raw, len);
+    if (!rv) {
+        log_err("Error loading stanza: %s", xmpp_parser_strerror(parser));
+    }
+    xmpp_parser_del(parser);
+    return rv;
+
+error:
+    return false;
+}
+
+void xmpp_parser_set_limits(struct xmpp_parser *parser,
+                            const struct xmpp_parser_limits *limits) {
+    parser->limits = *limits;
+}
+
+bool xmpp_parser_over_limit(const struct xmpp_parser *parser) {
+    return parser->limit_error != NULL;
+}
+
+unsigned long xmpp_parser_stanzas(const struct xmpp_parser *parser) {
+    return parser->stanzas;
+}
+
+bool xmpp_parser_hibernate(struct xmpp_parser *parser) {
+    if (parser->backend == NULL) {
+        return true;
+    }
+
+    if (parser->needs_reset) {
+        /* The next stream starts from scratch anyway. */
+        free(parser->stream_header);
+        parser->stream_header = NULL;
+        parser->is_stream_start = true;
+        parser->needs_reset = false;
+    } else if (parser->depth != 0 || parser->cur_stanza != NULL
+               || parser->namespaces != NULL
+               || parser->parsed != parser->boundary) {
+        return false;
+    }
+
+    backend_del(parser);
+    utstring_done(&parser->raw);
+    utstring_init(&parser->raw);
+    arena_release(parser->arena);
+    return true;
+}
+
+bool xmpp_parser_hibernating(const struct xmpp_parser *parser) {
+    return parser->backend == NULL;
+}
+
+const char* xmpp_parser_stream_header(const struct xmpp_parser *parser) {
+    return parser->stream_header;
+}
+
+bool xmpp_parser_resume(struct xmpp_parser *parser, const char *header) {
+    char *copy = strdup(header);
+    check_mem(copy);
+
+    backend_del(parser);
+    free(parser->stream_header);
+    parser->stream_header = copy;
+    parser->is_stream_start = true;
+    parser->needs_reset = false;
+    return true;
 }
 
 bool xmpp_parser_reset(struct xmpp_parser *parser, bool is_stream_start) {
-    if (XML_ParserReset(parser->parser, NULL) != XML_TRUE) {
+    if (parser->backend == NULL) {
+        parser->backend = backend_new(parser);
+        if (parser->backend == NULL) {
+            return false;
+        }
+    } else if (!parser->backend->reset_func(parser->backend)) {
         return false;
     }
 
@@ -120,6 +377,14 @@ void xmpp_parser_new_stream(struct xmpp_parser *parser) {
     parser->needs_reset = true;
 }
 
+void xmpp_parser_set_default_backend(enum xmpp_parser_backend backend) {
+    default_backend = backend;
+}
+
+enum xmpp_parser_backend xmpp_parser_default_backend(void) {
+    return default_backend;
+}
+
 const char* xmpp_parser_namespace_uri(struct xmpp_parser_namespace *ns) {
     return ns->uri;
 }
@@ -147,25 +412,317 @@ void xmpp_parser_namespace_del(struct xmpp_parser_namespace *ns) {
 }
 
 static void init_parser(struct xmpp_parser *parser, bool is_stream_start) {
-    XML_SetReturnNSTriplet(parser->parser, true);
-    XML_SetElementHandler(parser->parser, start, end);
-    XML_SetCharacterDataHandler(parser->parser, chardata);
-    XML_SetUserData(parser->parser, parser);
-    XML_SetStartNamespaceDeclHandler(parser->parser, ns_start);
+    parser->needs_reset = false;
+    parser->is_stream_start = is_stream_start;
+    parser->depth = 0;
+    parser->parsed = 0;
+    parser->boundary = 0;
+    parser->input = NULL;
+    parser->buffer = NULL;
+    utstring_clear(&parser->raw);
+    parser->raw_base = 0;
+    parser->text = 0;
+    parser->num_namespaces = 0;
+    parser->limit_error = NULL;
+    drop_stanza(parser);
+    free(parser->stream_header);
+    parser->stream_header = NULL;
+    parser->next_start = is_stream_start ? START_STREAM : START_STANZA;
+}
 
-    /* Inhibit the expansion of any external entities. */
-    XML_SetParamEntityParsing(parser->parser, XML_PARAM_ENTITY_PARSING_NEVER);
+/** Creates the parser's kind of backend. */
+static struct xml_backend* backend_new(struct xmpp_parser *parser) {
+    switch (parser->backend_type) {
+        case XMPP_PARSER_BACKEND_TOKENIZER:
+            return xml_backend_tokenizer_new(&HANDLERS, parser);
+        case XMPP_PARSER_BACKEND_EXPAT:
+        default:
+            return xml_backend_expat_new(&HANDLERS, parser);
+    }
+}
 
-    parser->needs_reset = false;
+/** Frees the parser's backend, if it has one. */
+static void backend_del(struct xmpp_parser *parser) {
+    if (parser->backend != NULL) {
+        parser->backend->del_func(parser->backend);
+        parser->backend = NULL;
+    }
+}
+
+/** Stops the backend from inside one of its callbacks. */
+static void stop(struct xmpp_parser *parser) {
+    parser->backend->stop_func(parser->backend);
+}
+
+/** Returns where the event being called back for ends. */
+static long long event_end(struct xmpp_parser *parser) {
+    return parser->backend->index_func(parser->backend)
+           + parser->backend->count_func(parser->backend);
+}
+
+/**
+ * Brings back a hibernating parser.
+ *
+ * The new backend is fed the saved stream header, which puts it back inside
+ * the stream with the same namespaces in scope.
+ */
+static bool wake(struct xmpp_parser *parser) {
+    if (parser->backend != NULL) {
+        return true;
+    }
+
+    /* Resetting forgets the header. */
+    char *header = parser->stream_header;
+    parser->stream_header = NULL;
+    if (!xmpp_parser_reset(parser, parser->is_stream_start)) {
+        log_err("Error creating XML parser");
+        parser->stream_header = header;
+        return false;
+    }
+    if (header == NULL) {
+        return true;
+    }
+
+    parser->stream_header = header;
+    parser->next_start = START_RESUME;
+    parser->parsed = strlen(header);
+    check(parser->backend->parse_func(parser->backend, header, parser->parsed),
+          "Error resuming XML stream: %s", xmpp_parser_strerror(parser));
+    return true;
+
+error:
+    backend_del(parser);
+    return false;
+}
+
+/**
+ * Rebuilds a stream header with just what's needed to parse the rest of the
+ * stream: the element's name and the namespaces it declares.
+ */
+static char* stream_header_new(const char *ns_name,
+                               struct xmpp_parser_namespace *namespaces) {
+    UT_string header;
+    utstring_init(&header);
+
+    /* Names come as "uri local prefix" (see xml_backend.h), or just "local"
+     * if not in a namespace. */
+    const char *local = strchr(ns_name, XMPP_PARSER_SEPARATOR);
+    local = local == NULL ? ns_name : local + 1;
+    const char *prefix = strchr(local, XMPP_PARSER_SEPARATOR);
+    int local_len = prefix == NULL ? (int)strlen(local) : prefix - local;
+
+    utstring_printf(&header, "<");
+    if (prefix != NULL) {
+        utstring_printf(&header, "%s:", prefix + 1);
+    }
+    utstring_printf(&header, "%.*s", local_len, local);
 
-    if (is_stream_start) {
-        XML_SetStartElementHandler(parser->parser, stream_start);
+    for (struct xmpp_parser_namespace *ns = namespaces; ns != NULL;
+            ns = ns->next) {
+        if (ns->prefix) {
+            utstring_printf(&header, " xmlns:%s='", ns->prefix);
+        } else {
+            utstring_printf(&header, " xmlns='");
+        }
+        for (const char *c = ns->uri; *c != '\0'; c++) {
+            switch (*c) {
+                case '&':
+                    utstring_printf(&header, "&amp;");
+                    break;
+                case '<':
+                    utstring_printf(&header, "&lt;");
+                    break;
+                case '\'':
+                    utstring_printf(&header, "&apos;");
+                    break;
+                default:
+                    utstring_bincpy(&header, c, 1);
+            }
+        }
+        utstring_printf(&header, "'");
     }
+    utstring_printf(&header, ">");
+
+    /* The UT_string's buffer is handed over to the caller. */
+    return utstring_body(&header);
 }
 
-/** Expat callback for the start of an XMPP stream. */
-static void stream_start(void *data, const char *ns_name, const char **attrs) {
+/** Notes that everything the backend has been given so far was handled. */
+static void mark_boundary(struct xmpp_parser *parser) {
+    parser->boundary = event_end(parser);
+}
+
+/**
+ * Holds on to the end of a chunk that the next one may need.
+ *
+ * That is all of the current stanza so far, or anything after the last
+ * boundary (the backend may be sitting on part of a start tag).
+ */
+static void keep_raw(struct xmpp_parser *parser) {
+    if (!parser->lazy || parser->input == NULL) {
+        return;
+    }
+
+    long long keep = parser->cur_stanza ? parser->raw_start : parser->boundary;
+    if (keep >= parser->input_start) {
+        utstring_clear(&parser->raw);
+        parser->raw_base = keep;
+        if (keep < parser->parsed) {
+            utstring_bincpy(&parser->raw,
+                            parser->input + (keep - parser->input_start),
+                            parser->parsed - keep);
+        }
+    } else {
+        utstring_bincpy(&parser->raw, parser->input,
+                        parser->parsed - parser->input_start);
+    }
+    parser->input = NULL;
+}
+
+/** Gives the current top-level stanza the bytes it was parsed from. */
+static void attach_raw(struct xmpp_parser *parser) {
+    /* The end of an empty element tag has no bytes of its own. */
+    long long end = parser->backend->index_func(parser->backend);
+    int count = parser->backend->count_func(parser->backend);
+    if (count > 0) {
+        end += count;
+    } else {
+        end = parser->raw_start + parser->raw_start_len;
+    }
+
+    const char *raw;
+    if (parser->raw_start >= parser->input_start) {
+        raw = parser->input + (parser->raw_start - parser->input_start);
+    } else {
+        /* The stanza started in an earlier chunk, add on the rest of it. */
+        utstring_bincpy(&parser->raw, parser->input,
+                        end - parser->input_start);
+        raw = utstring_body(&parser->raw)
+              + (parser->raw_start - parser->raw_base);
+    }
+    xmpp_stanza_set_raw(parser->cur_stanza, raw, end - parser->raw_start,
+                        parser->raw_start_len, parser->stream_header);
+}
+
+/**
+ * Checks what the backend is holding on to between callbacks, after a chunk.
+ *
+ * A stanza (or start tag, or anything else) that keeps going without
+ * reaching a callback would otherwise get buffered without bound.
+ */
+static bool check_pending(struct xmpp_parser *parser) {
+    if (parser->limits.max_stanza_size == 0 || parser->limit_error) {
+        return parser->limit_error == NULL;
+    }
+
+    long long start = parser->depth > 0 ? parser->raw_start : parser->boundary;
+    if ((size_t)(parser->parsed - start) > parser->limits.max_stanza_size) {
+        parser->limit_error = "Stanza too big";
+        return false;
+    }
+    return true;
+}
+
+/** Checks the size of the current stanza, up to the end of this event. */
+static bool check_size(struct xmpp_parser *parser) {
+    if (parser->limits.max_stanza_size == 0) {
+        return true;
+    }
+
+    long long end = event_end(parser);
+    if ((size_t)(end - parser->raw_start) > parser->limits.max_stanza_size) {
+        over_limit(parser, "Stanza too big");
+        return false;
+    }
+    return true;
+}
+
+/** Checks the number of attributes on an element. */
+static bool check_attributes(struct xmpp_parser *parser, const char **attrs) {
+    if (parser->limits.max_attributes == 0) {
+        return true;
+    }
+
+    int count = 0;
+    while (attrs[count * 2] != NULL) {
+        count++;
+    }
+    if (count > parser->limits.max_attributes) {
+        over_limit(parser, "Too many attributes");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Stops the parser for going over a limit.
+ *
+ * The backend may still make a callback or two before it stops, they all
+ * check limit_error first and do nothing.
+ */
+static void over_limit(struct xmpp_parser *parser, const char *what) {
+    parser->limit_error = what;
+    stop(parser);
+}
+
+/** Frees a stanza the parser was in the middle of (and its namespaces). */
+static void drop_stanza(struct xmpp_parser *parser) {
+    xmpp_parser_namespace_del(parser->namespaces);
+    parser->namespaces = NULL;
+
+    struct xmpp_stanza *stanza = parser->cur_stanza;
+    if (stanza == NULL) {
+        return;
+    }
+    while (xmpp_stanza_parent(stanza) != NULL) {
+        stanza = xmpp_stanza_parent(stanza);
+    }
+    xmpp_stanza_del(stanza, true);
+    parser->cur_stanza = NULL;
+    if (!parser->arena_borrowed) {
+        arena_reset(parser->arena);
+    }
+}
+
+/** Handler for the stream header in front of a stanza being loaded. */
+static bool load_stream(struct xmpp_stanza *stanza, struct xmpp_parser *parser,
+                        void *data) {
+    xmpp_parser_set_handler(parser, load_stanza);
+    return true;
+}
+
+/** Handler for a stanza being loaded, gives its children to the original. */
+static bool load_stanza(struct xmpp_stanza *stanza, struct xmpp_parser *parser,
+                        void *data) {
+    xmpp_stanza_take_children(data, stanza);
+    return true;
+}
+
+/** Backend callback for start tags, passes them on by what they start. */
+static void element_start(void *data, const char *ns_name,
+                          const char **attrs) {
     struct xmpp_parser *parser = (struct xmpp_parser*)data;
+    switch (parser->next_start) {
+        case START_STREAM:
+            stream_start(parser, ns_name, attrs);
+            break;
+        case START_RESUME:
+            stream_resume(parser, ns_name, attrs);
+            break;
+        case START_STANZA:
+            start(parser, ns_name, attrs);
+            break;
+    }
+}
+
+/** Handles the start of an XMPP stream. */
+static void stream_start(struct xmpp_parser *parser, const char *ns_name,
+                         const char **attrs) {
+    if (parser->limit_error || !check_attributes(parser, attrs)) {
+        return;
+    }
+    parser->num_namespaces = 0;
+
     struct xmpp_stanza *stanza = xmpp_stanza_ns_new(ns_name, attrs,
                                                     parser->namespaces);
 
@@ -175,21 +732,68 @@ static void stream_start(void *data, const char *ns_name, const char **attrs) {
     free(str);
 #endif
 
+    free(parser->stream_header);
+    parser->stream_header = stream_header_new(ns_name, parser->namespaces);
+    mark_boundary(parser);
+
     parser->namespaces = NULL;
+    parser->stanzas++;
     if (!parser->handler(stanza, parser, parser->data)) {
-        XML_StopParser(parser->parser, false);
+        stop(parser);
     } else {
         parser->depth = 0;
-        XML_SetStartElementHandler(parser->parser, start);
+        parser->next_start = START_STANZA;
     }
     xmpp_stanza_del(stanza, false);
 }
 
-/** Expat callback for the start of any other element. */
-static void start(void *data, const char *ns_name, const char **attrs) {
-    struct xmpp_parser *parser = (struct xmpp_parser*)data;
-    struct xmpp_stanza *stanza = xmpp_stanza_ns_new(ns_name, attrs,
-                                                    parser->namespaces);
+/**
+ * Handles the replayed stream header, after hibernating.
+ *
+ * The handler already saw this header, so it isn't told about it again.
+ */
+static void stream_resume(struct xmpp_parser *parser, const char *ns_name,
+                          const char **attrs) {
+    xmpp_parser_namespace_del(parser->namespaces);
+    parser->namespaces = NULL;
+    parser->depth = 0;
+    mark_boundary(parser);
+    parser->next_start = START_STANZA;
+}
+
+/** Handles the start of any other element. */
+static void start(struct xmpp_parser *parser, const char *ns_name,
+                  const char **attrs) {
+    if (parser->limit_error) {
+        return;
+    }
+    parser->num_namespaces = 0;
+
+    if (parser->depth == 0) {
+        parser->raw_start = parser->backend->index_func(parser->backend);
+        parser->raw_start_len = parser->backend->count_func(parser->backend);
+        parser->text = 0;
+    }
+    if (parser->limits.max_depth > 0
+            && parser->depth >= parser->limits.max_depth) {
+        over_limit(parser, "Stanza nested too deeply");
+        return;
+    }
+    if (!check_attributes(parser, attrs) || !check_size(parser)) {
+        return;
+    }
+
+    if (parser->depth > 0 && parser->lazy) {
+        /* Children are only built if somebody asks for them. */
+        xmpp_parser_namespace_del(parser->namespaces);
+        parser->namespaces = NULL;
+        parser->depth++;
+        return;
+    }
+
+    struct xmpp_stanza *stanza = xmpp_stanza_arena_new(parser->arena, ns_name,
+                                                       attrs,
+                                                       parser->namespaces);
 
     parser->namespaces = NULL;
     if (parser->depth > 0) {
@@ -199,41 +803,80 @@ static void start(void *data, const char *ns_name, const char **attrs) {
     parser->depth++;
 }
 
-/** Expat callback for XML data. */
+/** Backend callback for XML data. */
 static void chardata(void *data, const char *s, int len) {
     struct xmpp_parser *parser = (struct xmpp_parser*)data;
-    if (parser->cur_stanza) {
+    if (parser->limit_error) {
+        return;
+    }
+
+    if (parser->depth == 0) {
+        /* Whitespace between stanzas (e.g. keepalives). */
+        mark_boundary(parser);
+        return;
+    }
+
+    parser->text += len;
+    if (parser->limits.max_text > 0
+            && parser->text > parser->limits.max_text) {
+        over_limit(parser, "Too much text in stanza");
+        return;
+    }
+    if (!check_size(parser)) {
+        return;
+    }
+    if (parser->cur_stanza && !parser->lazy) {
         xmpp_stanza_append_data(parser->cur_stanza, s, len);
     }
 }
 
-/** Expat callback for end elements. */
+/** Backend callback for end elements. */
 static void end(void *data, const char *name) {
     struct xmpp_parser *parser = (struct xmpp_parser*)data;
+    if (parser->limit_error || (parser->depth > 0 && !check_size(parser))) {
+        return;
+    }
     parser->depth--;
 
     if (parser->depth < 0) {
-        XML_StopParser(parser->parser, false);
+        stop(parser);
     } else if (parser->depth == 0) {
+        mark_boundary(parser);
+        if (parser->lazy) {
+            attach_raw(parser);
+        }
+
 #ifndef NDEBUG
-        char *stanza_str = xmpp_stanza_string(parser->cur_stanza, NULL, false);
+        char *stanza_str = xmpp_stanza_string(parser->cur_stanza, NULL, true);
         debug("Handling Stanza: %s", stanza_str);
         free(stanza_str);
 #endif
 
+        parser->stanzas++;
         if (!parser->handler(parser->cur_stanza, parser, parser->data)) {
-            XML_StopParser(parser->parser, false);
+            stop(parser);
         }
         xmpp_stanza_del(parser->cur_stanza, true);
         parser->cur_stanza = NULL;
-    } else {
+        if (!parser->arena_borrowed) {
+            arena_reset(parser->arena);
+        }
+    } else if (!parser->lazy) {
         parser->cur_stanza = xmpp_stanza_parent(parser->cur_stanza);
     }
 }
 
-/** Expat callback for namespace declarations. */
+/** Backend callback for namespace declarations. */
 static void ns_start(void *data, const char *prefix, const char *uri) {
     struct xmpp_parser *parser = (struct xmpp_parser*)data;
+    if (parser->limit_error) {
+        return;
+    }
+    if (parser->limits.max_namespaces > 0
+            && ++parser->num_namespaces > parser->limits.max_namespaces) {
+        over_limit(parser, "Too many namespace declarations");
+        return;
+    }
 
     struct xmpp_parser_namespace *ns = calloc(1, sizeof(*ns));
     check_mem(ns);
@@ -30,6 +30,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct xmpp_parser;
 struct xmpp_parser_namespace;
@@ -37,11 +38,48 @@ struct xmpp_stanza;
 
 extern const char XMPP_PARSER_SEPARATOR;
 
+/** The XML parsers stanzas can be parsed with. */
+enum xmpp_parser_backend {
+    /** Expat, a general purpose XML parser. */
+    XMPP_PARSER_BACKEND_EXPAT,
+
+    /**
+     * A tokenizer for just the subset of XML that XMPP allows (no DTDs or
+     * entities beyond the predefined ones, UTF-8 only), which scans for
+     * markup with SSE2/AVX2 where it can.
+     */
+    XMPP_PARSER_BACKEND_TOKENIZER,
+};
+
 /** Callback to be notified of new XMPP stanza. */
 typedef bool (*xmpp_parser_handler)(struct xmpp_stanza *stanza,
                                     struct xmpp_parser *parser,
                                     void *data);
 
+/**
+ * Limits on what a parser accepts from a stream, zeros are unlimited.
+ *
+ * They are checked as the data comes in, so a stanza that goes over is
+ * never fully buffered: parsing stops, and xmpp_parser_over_limit() says
+ * why it failed.
+ */
+struct xmpp_parser_limits {
+    /** Most bytes in a stanza, start tag to end tag. */
+    size_t max_stanza_size;
+
+    /** Most levels of elements in a stanza, counting the stanza itself. */
+    int max_depth;
+
+    /** Most attributes on one element. */
+    int max_attributes;
+
+    /** Most namespace declarations on one element. */
+    int max_namespaces;
+
+    /** Most bytes of character data in a stanza (after decoding). */
+    size_t max_text;
+};
+
 /**
  * @param stream_start Whether the first start tag is expected to be a stream
  *                     start.  When true, the callback will be called initially
@@ -49,6 +87,7 @@ typedef bool (*xmpp_parser_handler)(struct xmpp_stanza *stanza,
  */
 struct xmpp_parser* xmpp_parser_new(bool is_stream_start);
 
+/** Frees the parser (an Expat parser goes back to the pool for reuse). */
 void xmpp_parser_del(struct xmpp_parser *parser);
 
 const char* xmpp_parser_strerror(struct xmpp_parser *parser);
@@ -60,11 +99,95 @@ void xmpp_parser_set_data(struct xmpp_parser *parser, void *data);
 
 bool xmpp_parser_parse(struct xmpp_parser *parser, const char *buf, int len);
 
+/**
+ * Get a buffer inside the parser to receive data into.
+ *
+ * Filling this and calling xmpp_parser_parse_buffer() saves copying the data
+ * into the parser, as xmpp_parser_parse() has to.
+ *
+ * @param len The most bytes that will be put in the buffer.
+ * @returns The buffer, or NULL if it could not be allocated.
+ */
+void* xmpp_parser_buffer(struct xmpp_parser *parser, int len);
+
+/** Parse len bytes placed in the buffer from xmpp_parser_buffer(). */
+bool xmpp_parser_parse_buffer(struct xmpp_parser *parser, int len);
+
+/**
+ * Parses the children and data of a stanza from the bytes it came from.
+ *
+ * Parsers only build a stanza's start tag as it arrives, this fills in the
+ * rest when somebody asks for it (see xmpp_stanza_set_raw()).
+ *
+ * @param stanza The stanza to add the children and data to.
+ * @param header The stream header the stanza was sent in (see
+ *               xmpp_parser_stream_header()), or NULL if none.
+ * @param raw    The whole stanza, start tag to end tag.
+ */
+bool xmpp_parser_load(struct xmpp_stanza *stanza, const char *header,
+                      const char *raw, size_t len);
+
+/** Sets the limits the parser enforces (see struct xmpp_parser_limits). */
+void xmpp_parser_set_limits(struct xmpp_parser *parser,
+                            const struct xmpp_parser_limits *limits);
+
+/**
+ * Returns true if parsing failed because the stream went over a limit
+ * (xmpp_parser_strerror() says which).
+ */
+bool xmpp_parser_over_limit(const struct xmpp_parser *parser);
+
+/** Returns the number of stanzas handled since the parser was created. */
+unsigned long xmpp_parser_stanzas(const struct xmpp_parser *parser);
+
+/**
+ * Gives back the underlying XML parser while the stream is idle.
+ *
+ * The backend is freed (Expat parsers go back to the pool in expat_pool.h),
+ * and only the stream header's name and namespace declarations are kept.
+ * The next call to xmpp_parser_parse() or xmpp_parser_buffer() creates a new
+ * backend and replays the header into it, so parsing carries on as if
+ * nothing happened.
+ *
+ * @returns false if the parser is in the middle of a stanza (or holding on
+ *          to part of one), and can't hibernate.
+ */
+bool xmpp_parser_hibernate(struct xmpp_parser *parser);
+
+/** Returns true if the parser is hibernating. */
+bool xmpp_parser_hibernating(const struct xmpp_parser *parser);
+
+/**
+ * Returns the cut down stream header (see xmpp_parser_hibernate()), or NULL
+ * if the parser isn't inside a stream.
+ */
+const char* xmpp_parser_stream_header(const struct xmpp_parser *parser);
+
+/**
+ * Picks up a stream some other parser started, such as one handed over from
+ * another process.
+ *
+ * The parser hibernates, as if it had parsed the header itself.
+ *
+ * @param header A header from xmpp_parser_stream_header().
+ */
+bool xmpp_parser_resume(struct xmpp_parser *parser, const char *header);
+
 /** Reset the state of the parser as if it was just created. */
 bool xmpp_parser_reset(struct xmpp_parser *parser, bool is_stream_start);
 
 void xmpp_parser_new_stream(struct xmpp_parser *parser);
 
+/**
+ * Sets the backend that parsers created from now on use (Expat unless set).
+ *
+ * Meant to be set once, before any parsers are created.
+ */
+void xmpp_parser_set_default_backend(enum xmpp_parser_backend backend);
+
+/** Returns the backend new parsers use. */
+enum xmpp_parser_backend xmpp_parser_default_backend(void);
+
 const char* xmpp_parser_namespace_uri(struct xmpp_parser_namespace *ns);
 
 const char* xmpp_parser_namespace_prefix(struct xmpp_parser_namespace *ns);
@@ -27,8 +27,15 @@
  * Main XMPP server data/functions
  */
 
+/* For accept4(). */
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -43,10 +50,15 @@
 
 #include "log.h"
 
+#include "atom.h"
 #include "client_socket.h"
 #include "jid.h"
+#include "timer_wheel.h"
+#include "tls_tickets.h"
 #include "utils.h"
 #include "xmp3_options.h"
+#include "xmp3_uring.h"
+#include "xmp3_workers.h"
 #include "xmpp_client.h"
 #include "xmpp_core.h"
 #include "xmpp_im.h"
@@ -55,45 +67,6 @@
 
 #include "xmpp_server.h"
 
-/**
- * Generic shortcut to add a callback to one of the server's lists.
- *
- * @param type The type of the list (no struct keyword).
- * @param list A pointer to the head of the list to manipulate.
- * @param ...  The arguments to the corresponding type's new function.
- */
-#define ADD_CALLBACK(type, list, ...) do { \
-    struct type *add = type ## _new(__VA_ARGS__); \
-    struct type *match = NULL; \
-    DL_SEARCH(list, match, add, type ## _cmp); \
-    if (match != NULL) { \
-        log_warn("Attempted to add duplicate callback."); \
-        free(add); \
-    } else { \
-        DL_APPEND(list, add); \
-    } \
-} while (0)
-
-/**
- * Generic shortcut to remove a callback to one of the server's lists.
- *
- * @param type The type of the list (no struct keyword).
- * @param list A pointer to the head of the list to manipulate.
- * @param ...  The arguments to the corresponding type's new function.
- */
-#define DEL_CALLBACK(type, list, ...) do {\
-    struct type *search = type ## _new(__VA_ARGS__); \
-    struct type *match = NULL; \
-    DL_SEARCH(list, match, search, type ## _cmp); \
-    type ## _del(search); \
-    if (match == NULL) { \
-        log_warn("Attempted to remove non-existent callback."); \
-    } else { \
-        DL_DELETE(list, match); \
-        type ## _del(match); \
-    } \
-} while (0)
-
 /**
  * Convenience macro to delete one of the server's callback lists.
  *
@@ -112,6 +85,90 @@ struct c_client {
     /** The event object listening for incoming data. */
     struct ev_io fd_readable;
 
+    /** Active only while the client has queued output. */
+    struct ev_io fd_writable;
+
+    /** How much to ask for from this client's socket per read. */
+    size_t read_size;
+
+    /** Set when the read budget ran out before the socket was drained. */
+    bool read_backlogged;
+
+    /** Whether the client is on the server's flush list. */
+    bool flush_scheduled;
+
+    /** Whether the client's socket is corked until the next flush. */
+    bool corked;
+
+    /** Next client on the server's flush list. */
+    struct c_client *flush_next;
+
+    /** Whether the client is waiting on a batched (io_uring) read. */
+    bool read_scheduled;
+
+    /** Next client on the server's read list or read batch. */
+    struct c_client *read_next;
+
+    /** Where the client's batched read is going. */
+    char *read_buf;
+
+    /** Bytes asked for by the client's batched read. */
+    size_t read_len;
+
+    /** Result of the client's batched read, or a negative errno. */
+    int read_result;
+
+    /** Bytes read from the client since its socket became readable. */
+    size_t read_total;
+
+    /** The client's stanza count when its socket became readable. */
+    unsigned long read_first_stanza;
+
+    /** When the client last sent us anything. */
+    ev_tstamp last_read;
+
+    /** Set from passing the high watermark until back under the low one. */
+    bool backpressured;
+
+    /** Latest presence from each sender, held back while backpressured. */
+    struct held_stanza *held;
+
+    /** Whether the client's parser and buffers have been freed. */
+    bool hibernating;
+
+    /** When hibernating last failed because the client was busy. */
+    ev_tstamp hibernate_tried;
+
+    /** When the client was last sent anything. */
+    ev_tstamp last_write;
+
+    /** Checks the client's timeouts, NULL if there are none. */
+    struct timer_wheel_timer *timer;
+
+    /** Whether the client is on the server's reap list. */
+    bool reap_scheduled;
+
+    /** Next client on the server's reap list. */
+    struct c_client *reap_next;
+
+    /** Whether the client hasn't answered the last ping yet. */
+    bool ping_pending;
+
+    /** Number in the id of the last ping sent to the client. */
+    unsigned long ping_id;
+
+    /** When the last ping was sent. */
+    ev_tstamp ping_sent;
+
+    /** Round trip time of the last answered ping, negative if none. */
+    ev_tstamp ping_rtt;
+
+    /** Set once the client is being disconnected, nothing more goes to it. */
+    bool closing;
+
+    /** Called when the client disconnects, in the order they were added. */
+    struct client_listener *listeners;
+
     /** The connected client object. */
     //struct xmpp_client *client;
 
@@ -121,6 +178,9 @@ struct c_client {
     /** @} */
 };
 
+/** Routes a vector holds before it needs to allocate. */
+#define ROUTE_VEC_INLINE 4
+
 /** Holds data on how to send a stanza to a particular JID. */
 struct stanza_route {
     /** The JID to send to. */
@@ -132,12 +192,58 @@ struct stanza_route {
     /** Arbitrary data. */
     void *data;
 
+    /** The JID as a string, for looking the route up. */
+    char *key;
+
+    /** How much of key is the bare JID. */
+    size_t bare_len;
+
+    /** When the route was added, matching routes are called in this order. */
+    unsigned long seq;
+
+    /** Whether any part of the JID is "*", and which. */
+    bool wildcard;
+    bool any_local;
+    bool any_domain;
+    bool any_resource;
+
+    /** Set if the route was removed while a stanza was being routed. */
+    bool removed;
+
     /** @{ These are kept in a doubly-linked list. */
     struct stanza_route *prev;
     struct stanza_route *next;
     /** @} */
 };
 
+/** A small array of routes, in the order they were added. */
+struct route_vec {
+    struct stanza_route **routes;
+    int count;
+    int size;
+    struct stanza_route *inline_routes[ROUTE_VEC_INLINE];
+};
+
+/** The routes for one full or bare JID. */
+struct route_bucket {
+    /** The JID this bucket is for. */
+    char *key;
+
+    struct route_vec routes;
+
+    UT_hash_handle hh;
+};
+
+/** A client that has bound a resource. */
+struct bound_jid {
+    /** The client's full JID. */
+    char *key;
+
+    struct xmpp_client *client;
+
+    UT_hash_handle hh;
+};
+
 /**
  * Holds data on how to handle a particular iq stanza.
  *
@@ -145,36 +251,108 @@ struct stanza_route {
  * (the spec says there can only be one child).
  */
 struct iq_route {
-    /** The namespace + name of the tag to match. */
+    /** The namespace + name of the tag to match, as it was registered. */
     char *ns;
 
+    /** The namespace part of ns. */
+    char *uri;
+
+    /** The tag name part of ns, NULL to match any tag in the namespace. */
+    char *name;
+
+    /** The atoms for uri and name, if interned only these need comparing. */
+    enum atom ns_atom;
+    enum atom name_atom;
+
     /** The function that will deliver the stanza. */
     xmpp_server_stanza_callback cb;
 
     /** Arbitrary data that callbacks can use. */
     void *data;
 
+    /** The next route for the same namespace, in the order they were added. */
+    struct iq_route *ns_next;
+
     /** @{ These are kept in a doubly-linked list. */
     struct iq_route *prev;
     struct iq_route *next;
     /** @} */
 };
 
-/** Holds data on how to notify a component when a client disconnects. */
-struct client_listener {
-    /** The client to watch for disconnect events for. */
-    struct xmpp_client *client;
+/** The iq routes for a namespace that isn't an atom. */
+struct iq_bucket {
+    char *uri;
+
+    struct iq_route *routes;
+
+    UT_hash_handle hh;
+};
+
+/** An IQ the server sent, waiting for a reply. */
+struct pending_iq {
+    /** The IQ's id, which the reply will have too. */
+    char *id;
+
+    /** Who the IQ was sent to, only they can answer it. */
+    struct jid *to;
+
+    /** Who the IQ was sent from, the reply has to be addressed to them. */
+    struct jid *from;
+
+    xmpp_server_iq_callback cb;
+    void *data;
+
+    /** Gives up on the reply, NULL if it can wait forever. */
+    struct timer_wheel_timer *timer;
+
+    struct xmpp_server *server;
+
+    UT_hash_handle hh;
+};
 
+/** A stanza held back from a backed up client, keyed by its sender. */
+struct held_stanza {
+    /** The "from" attribute of the stanza. */
+    char *from;
+
+    /** The serialized stanza. */
+    char *data;
+
+    /** Length of data. */
+    size_t len;
+
+    UT_hash_handle hh;
+};
+
+/** A source of stanzas paused because a client it sent to is backed up. */
+struct paused_source {
+    /** The source's (stopped) watcher. */
+    struct ev_io *watcher;
+
+    /** The client it's waiting on. */
+    struct c_client *receiver;
+
+    /** @{ These are kept in a doubly-linked list. */
+    struct paused_source *prev;
+    struct paused_source *next;
+    /** @} */
+};
+
+/** What a client listener is registered (and hashed) by. */
+struct client_listener_key {
     /** Function that will be called when the client disconnects. */
     xmpp_server_client_callback cb;
 
     /** Arbitrary data that callbacks can use. */
     void *data;
+};
 
-    /** @{ These are kept in a doubly-linked list. */
-    struct client_listener *prev;
-    struct client_listener *next;
-    /** @} */
+/** Holds data on how to notify a component when a client disconnects. */
+struct client_listener {
+    struct client_listener_key key;
+
+    /** Kept in a hash table on the client, which keeps the order added. */
+    UT_hash_handle hh;
 };
 
 /** Holds data for items to report during a DISCO items query. */
@@ -203,6 +381,13 @@ struct auth_callback {
     void *data;
 };
 
+/** Where a batched accept writes its results. */
+struct accept_slot {
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    int result;
+};
+
 /** Simple structure to allow users to iterate over connected clients. */
 struct xmpp_client_iterator {
     struct c_client *client;
@@ -213,92 +398,393 @@ struct xmpp_server {
     /** The event struct for our listening server file descriptor. */
     struct ev_io fd_readable;
 
-    /** Buffer used to store incoming data. */
-    char *buffer;
+    /** Reused to serialize stanzas being written out to clients. */
+    struct xmpp_stanza_iov *iov;
+
+    /** Flushes client output once per loop iteration, after other events. */
+    struct ev_check flush;
+
+    /** Clients written to during this loop iteration. */
+    struct c_client *flush_list;
+
+    /** Clients that timed out, disconnected together once timers are run. */
+    struct c_client *reap_list;
+
+    /** Batches plain sockets' I/O, NULL unless io_uring is enabled. */
+    struct xmp3_uring *ring;
+
+    /** Reads from the clients on read_list in batches, before the flush. */
+    struct ev_check ring_reads;
+
+    /** Clients whose socket became readable during this loop iteration. */
+    struct c_client *read_list;
+
+    /** Clients whose reads are in the batch being handled. */
+    struct c_client *read_batch;
+
+    /** False once the kernel turned down a batched (non-blocking) accept. */
+    bool ring_accept;
+
+    /** Addresses and results for a batch of accepts. */
+    struct accept_slot *accept_slots;
+
+    /** Most accepts per batch (the length of accept_slots). */
+    int accept_batch;
+
+    /** The smallest (and first) read size for a client. */
+    size_t min_read_size;
+
+    /** The largest read size for a client. */
+    size_t max_read_size;
+
+    /** Most bytes to read from a client per readiness event. */
+    size_t read_budget;
+
+    /** Most stanzas to handle from a client per readiness event. */
+    unsigned long read_stanza_budget;
+
+    /** What clients' parsers will accept. */
+    struct xmpp_parser_limits parser_limits;
+
+    /** Goes back to clients whose read budget ran out, once idle. */
+    struct ev_idle read_backlog;
+
+    /** Number of clients waiting on read_backlog. */
+    int num_backlogged;
+
+    /** Runs the clients' (and IQs') timeouts, NULL until one is needed. */
+    struct timer_wheel *timers;
+
+    /** Advances the timer wheel once a second. */
+    struct ev_timer timers_tick;
+
+    /** Loop time of the wheel's tick 0. */
+    ev_tstamp timers_start;
+
+    /** Seconds a client can be idle before it hibernates. */
+    ev_tstamp hibernate_timeout;
+
+    /** Seconds a client can be silent before it's disconnected. */
+    ev_tstamp idle_timeout;
+
+    /** Seconds a client can be silent before it's pinged. */
+    ev_tstamp ping_interval;
+
+    /** Seconds without output before a client is sent a space. */
+    ev_tstamp keepalive_interval;
+
+    /** Number in the id of the last ping sent. */
+    unsigned long last_ping_id;
+
+    /** Number of hibernating clients. */
+    int num_hibernating;
+
+    /** Queued output past which a client pushes back, 0 for no limit. */
+    size_t high_watermark;
+
+    /** Queued output under which a client stops pushing back. */
+    size_t low_watermark;
+
+    /** @{ What to do with each kind of stanza for a backed up client. */
+    enum xmp3_overflow_policy presence_overflow;
+    enum xmp3_overflow_policy message_overflow;
+    enum xmp3_overflow_policy iq_overflow;
+    /** @} */
+
+    /** Where the stanzas being routed right now came from, if known. */
+    struct ev_io *source;
 
-    /** The size of the server's receive buffer. */
-    size_t buffer_size;
+    /** Sources paused until the clients they sent to catch up. */
+    struct paused_source *paused_sources;
 
+    /** Length of the listening socket's accept queue. */
     int backlog;
 
+    /** Most connections to accept per readiness event. */
+    int accept_budget;
+
+    /** Clients past this many are rejected, 0 for no limit. */
+    int max_clients;
+
+    /** Number of connected clients on this server. */
+    int num_clients;
+
+    /**
+     * The client count max_clients is checked against.  Points at num_clients
+     * unless this server is one of several workers sharing the limit.
+     */
+    int *sessions;
+
+    /** Restarts accepting after we ran out of file descriptors. */
+    struct ev_timer accept_pause;
+
+    /** Counters on the accept path. */
+    struct xmpp_server_stats stats;
+
     /** The event loop this server is registered on. */
     struct ev_loop *loop;
 
     /** OpenSSL context. */
     SSL_CTX *ssl_context;
 
+    /** Session ticket keys, if this server issues tickets. */
+    struct tls_tickets *tickets;
+
     /** The JID of this server. */
     struct jid *jid;
 
     /** Linked list of connected clients. */
     struct c_client *clients;
 
-    /** Linked list of stanza routes. */
+    /** Linked list of stanza routes, in the order they were added. */
     struct stanza_route *stanza_routes;
 
+    /** Routes without wildcards by their full JID (bare, if that's all they
+     * have). */
+    struct route_bucket *routes_full;
+
+    /** Routes without wildcards by their bare JID. */
+    struct route_bucket *routes_bare;
+
+    /** Routes with a "*" somewhere, checked against every stanza. */
+    struct route_vec wildcard_routes;
+
+    /** Numbers the routes as they are added. */
+    unsigned long route_seq;
+
+    /** How deep xmpp_server_route_stanza() is nested. */
+    int routing;
+
+    /** Routes removed while routing, freed once it finishes. */
+    struct stanza_route *removed_routes;
+
+    /** Bound clients by their full JID. */
+    struct bound_jid *bound_jids;
+
     /** Linked list of iq routes. */
     struct iq_route *iq_routes;
 
-    /** Linked list of client disconnect callbacks. */
-    struct client_listener *client_listeners;
+    /** The iq routes for each interned namespace, indexed by its atom. */
+    struct iq_route *iq_atom_routes[ATOM_COUNT];
+
+    /** The iq routes for any other namespace. */
+    struct iq_bucket *iq_buckets;
+
+    /** IQs sent with xmpp_server_send_iq() that haven't been answered. */
+    struct pending_iq *pending_iqs;
+
+    /** Numbers the IQs the server sends. */
+    unsigned long iq_seq;
 
     /** The list of items to report for a disco items query. */
     struct disco_item *disco_items;
 
     /** The currently configured authentication callback. */
     struct auth_callback auth_callback;
+
+    /** The other workers to hand stanzas off to, NULL if running alone. */
+    struct xmp3_workers *workers;
+
+    /** Our index among the workers. */
+    int worker_id;
+
+    /** A stanza handed to us by another worker that is being routed. */
+    struct xmpp_stanza *handoff;
 };
 
 /* Forward declarations. */
 static bool init_socket(struct xmpp_server *server,
-                        const struct xmp3_options *options);
+                        const struct xmp3_options *options, int fd);
+static int open_socket(struct xmpp_server *server,
+                       const struct xmp3_options *options);
 static bool init_ssl(struct xmpp_server *server,
                      const struct xmp3_options *options);
 
+static bool init_uring(struct xmpp_server *server,
+                       const struct xmp3_options *options);
+static void stop_uring(struct xmpp_server *server);
+static bool submit_ring(struct xmpp_server *server);
+
 static void connect_client(struct ev_loop *loop, struct ev_io *w, int revents);
+static void accept_batched(struct xmpp_server *server, int fd, int waiting);
+static bool accept_failed(struct xmpp_server *server, int error);
+static void accept_client(struct xmpp_server *server, int client_fd,
+                          struct sockaddr_in caddr);
+static struct c_client* add_client(struct xmpp_server *server,
+                                   struct xmpp_client *client, int fd);
+static void remove_client(struct xmpp_server *server, struct c_client *conn);
+static void reject_client(struct xmpp_server *server, int client_fd,
+                          struct sockaddr_in caddr);
+static int sample_accept_queue(struct xmpp_server *server, int fd);
+static void resume_accept(struct ev_loop *loop, struct ev_timer *w,
+                          int revents);
+static void advance_timers(struct ev_loop *loop, struct ev_timer *w,
+                           int revents);
+static void check_client(struct timer_wheel_timer *timer, void *data);
+static void hibernate_client(struct xmpp_server *server, struct c_client *conn);
+static void ping_client(struct xmpp_server *server, struct c_client *conn);
 static void read_client(struct ev_loop *loop, struct ev_io *w, int revents);
+static bool read_budget_left(struct xmpp_server *server, struct c_client *conn,
+                             size_t total, unsigned long first_stanza);
+static bool handle_read(struct xmpp_server *server, struct c_client *conn,
+                        const char *buffer, size_t numrecv);
+static void adapt_read_size(struct xmpp_server *server, struct c_client *conn,
+                            size_t numrecv);
+static void read_backlogged(struct ev_loop *loop, struct ev_idle *w,
+                            int revents);
+static void schedule_read(struct xmpp_server *server, struct c_client *conn,
+                          bool first);
+static void read_batched(struct ev_loop *loop, struct ev_check *w,
+                         int revents);
+static void finish_read(struct xmpp_server *server, struct c_client *conn);
+static void write_client(struct ev_loop *loop, struct ev_io *w, int revents);
+static void watch_writable(struct xmpp_server *server, struct c_client *conn);
+static void flush_clients(struct ev_loop *loop, struct ev_check *w,
+                          int revents);
+static void send_batched(struct xmpp_server *server);
+static void cork_client(struct xmpp_client *client, bool cork);
+static void pause_source(struct xmpp_server *server, struct c_client *conn);
+static void resume_sources(struct xmpp_server *server, struct c_client *conn);
+static void hold_stanza(struct xmpp_server *server, struct c_client *conn,
+                        struct xmpp_stanza *stanza);
+static void release_held(struct c_client *conn, bool send);
+static void check_drained(struct xmpp_server *server, struct c_client *conn,
+                          size_t pending);
+static bool unlink_read(struct c_client **list, struct c_client *conn);
+static void handshake_client(struct xmpp_client *client);
 
 static void send_service_unavailable(struct xmpp_server *server,
                                      struct xmpp_stanza *stanza);
 
-static struct client_listener* client_listener_new(struct xmpp_client *client,
+static void close_client(struct c_client *conn);
+static void notify_listeners(struct c_client *conn);
+static struct client_listener* find_listener(struct c_client *conn,
         xmpp_server_client_callback cb, void *data);
-static void client_listener_del(struct client_listener *listener);
-static int client_listener_cmp(const struct client_listener *a,
-                               const struct client_listener *b);
+static void del_listeners(struct c_client *conn);
 
 static struct stanza_route* stanza_route_new(const struct jid *jid,
         xmpp_server_stanza_callback cb, void *data);
 static void stanza_route_del(struct stanza_route *route);
 static int stanza_route_cmp(const struct stanza_route *a,
                             const struct stanza_route *b);
+static struct stanza_route* find_route(struct xmpp_server *server,
+                                       const struct stanza_route *search);
+static void find_routes(struct xmpp_server *server, const struct jid *jid,
+                        struct route_vec *found);
+static bool call_routes(struct xmpp_server *server, struct xmpp_stanza *stanza,
+                        const struct route_vec *found,
+                        const struct xmpp_client *skip);
+static bool wildcard_matches(const struct stanza_route *route,
+                             const struct jid *jid);
+static bool part_equal(const char *a, const char *b);
+static bool has_wildcard(const struct jid *jid);
+static size_t jid_key(char *key, const struct jid *jid);
+static void index_route(struct route_bucket **index, const char *key,
+                        size_t len, struct stanza_route *route);
+static void unindex_route(struct route_bucket **index, const char *key,
+                          size_t len, struct stanza_route *route);
+static void index_del(struct route_bucket **index);
+static void route_vec_push(struct route_vec *vec, struct stanza_route *route);
+static bool route_vec_remove(struct route_vec *vec,
+                             struct stanza_route *route);
+static void route_vec_done(struct route_vec *vec);
+static void add_bound(struct xmpp_server *server, struct xmpp_client *client,
+                      const char *key);
+static void remove_bound(struct xmpp_server *server, struct bound_jid *bound);
 
 static struct iq_route* iq_route_new(const char *ns,
         xmpp_server_stanza_callback cb, void *data);
 static void iq_route_del(struct iq_route *route);
 static int iq_route_cmp(const struct iq_route *a, const struct iq_route *b);
+static struct iq_route** iq_chain(struct xmpp_server *server, const char *uri,
+                                  enum atom ns_atom, bool create);
+static bool iq_route_matches(const struct iq_route *route,
+                             const struct xmpp_stanza *child);
+static bool complete_iq(struct xmpp_server *server,
+                        struct xmpp_stanza *stanza);
+static void iq_timeout(struct timer_wheel_timer *timer, void *data);
+static void pending_iq_del(struct pending_iq *pending);
+static void start_timers(struct xmpp_server *server);
 
 static void disco_item_del(struct disco_item *item);
 
 struct xmpp_server* xmpp_server_new(struct ev_loop *loop,
                                     const struct xmp3_options *options) {
+    return xmpp_server_new_from_socket(loop, options, -1);
+}
+
+struct xmpp_server* xmpp_server_new_from_socket(struct ev_loop *loop,
+        const struct xmp3_options *options, int fd) {
     struct xmpp_server *server = calloc(1, sizeof(*server));
     check_mem(server);
+    server->loop = loop;
+
+    server->min_read_size = xmp3_options_get_buffer_size(options);
+    server->max_read_size = xmp3_options_get_max_buffer_size(options);
+    if (server->max_read_size < server->min_read_size) {
+        server->max_read_size = server->min_read_size;
+    }
+    server->read_budget = xmp3_options_get_read_budget(options);
+    server->read_stanza_budget = xmp3_options_get_read_stanza_budget(options);
+    server->parser_limits = (struct xmpp_parser_limits){
+        .max_stanza_size = xmp3_options_get_max_stanza_size(options),
+        .max_depth = xmp3_options_get_max_stanza_depth(options),
+        .max_attributes = xmp3_options_get_max_attributes(options),
+        .max_namespaces = xmp3_options_get_max_namespaces(options),
+        .max_text = xmp3_options_get_max_text_size(options),
+    };
+    ev_idle_init(&server->read_backlog, read_backlogged);
+    server->read_backlog.data = server;
+
+    /* All of the clients' timeouts run on one wheel, with a one second
+     * tick. */
+    server->hibernate_timeout = xmp3_options_get_hibernate_timeout(options);
+    server->idle_timeout = xmp3_options_get_idle_timeout(options);
+    server->ping_interval = xmp3_options_get_ping_interval(options);
+    server->keepalive_interval = xmp3_options_get_keepalive_interval(options);
+    if (server->hibernate_timeout > 0 || server->idle_timeout > 0
+            || server->ping_interval > 0 || server->keepalive_interval > 0) {
+        start_timers(server);
+    }
 
-    server->buffer_size = xmp3_options_get_buffer_size(options);
-    server->buffer = calloc(server->buffer_size, sizeof(*server->buffer));
-    check_mem(server->buffer);
+    server->high_watermark = xmp3_options_get_outbound_high_watermark(options);
+    server->low_watermark = xmp3_options_get_outbound_low_watermark(options);
+    if (server->low_watermark > server->high_watermark) {
+        server->low_watermark = server->high_watermark;
+    }
+    server->presence_overflow = xmp3_options_get_overflow_policy(options,
+            XMPP_STANZA_PRESENCE);
+    server->message_overflow = xmp3_options_get_overflow_policy(options,
+            XMPP_STANZA_MESSAGE);
+    server->iq_overflow = xmp3_options_get_overflow_policy(options,
+            XMPP_STANZA_IQ);
+
+    server->iov = xmpp_stanza_iov_new();
+
+    /* Lowest priority, so the flush runs after the rest of this iteration's
+     * callbacks have had a chance to write.  It shouldn't keep the loop
+     * alive by itself though. */
+    ev_check_init(&server->flush, flush_clients);
+    ev_set_priority(&server->flush, EV_MINPRI);
+    server->flush.data = server;
+    ev_check_start(loop, &server->flush);
+    ev_unref(loop);
 
     server->backlog = xmp3_options_get_backlog(options);
+    server->accept_budget = xmp3_options_get_accept_budget(options);
+    server->max_clients = xmp3_options_get_max_clients(options);
+    server->sessions = &server->num_clients;
 
-    server->loop = loop;
+    if (xmp3_options_get_io_uring(options) && !init_uring(server, options)) {
+        log_warn("Unable to set up io_uring, using plain socket calls.");
+    }
     server->jid = jid_new_from_str(xmp3_options_get_server_name(options));
 
     if (xmp3_options_get_ssl(options)) {
         check(init_ssl(server, options), "Unable to initialize OpenSSL.");
     }
 
-    check(init_socket(server, options), "Unable to initialize socket.");
+    check(init_socket(server, options, fd), "Unable to initialize socket.");
 
     /* Set up inital stanza and IQ routes. */
     xmpp_server_add_stanza_route(server, server->jid,
@@ -328,24 +814,58 @@ error:
 }
 
 void xmpp_server_del(struct xmpp_server *server) {
-    struct c_client *connected_client = NULL;
-    struct c_client *connected_client_tmp = NULL;
+    /* Everyone listening hears about the clients going, all at once. */
+    int num_clients = 0;
+    struct c_client *conn;
+    DL_FOREACH(server->clients, conn) {
+        num_clients++;
+    }
+    if (num_clients > 0) {
+        struct xmpp_client **clients = malloc(num_clients * sizeof(*clients));
+        check_mem(clients);
+        int i = 0;
+        DL_FOREACH(server->clients, conn) {
+            clients[i++] = conn->fd_readable.data;
+        }
+        xmpp_server_disconnect_clients(server, clients, num_clients);
+        free(clients);
+    }
 
     if (server->auth_callback.data != NULL
             && server->auth_callback.del != NULL) {
         server->auth_callback.del(server->auth_callback.data);
     }
 
-    DL_FOREACH_SAFE(server->clients, connected_client, connected_client_tmp) {
-        DL_DELETE(server->clients, connected_client);
-        ev_io_stop(server->loop, &connected_client->fd_readable);
-        xmpp_client_del(connected_client->fd_readable.data);
-        free(connected_client);
+    struct paused_source *paused, *paused_tmp;
+    DL_FOREACH_SAFE(server->paused_sources, paused, paused_tmp) {
+        DL_DELETE(server->paused_sources, paused);
+        free(paused);
     }
 
     DELETE_LIST(stanza_route, server->stanza_routes);
+    index_del(&server->routes_full);
+    index_del(&server->routes_bare);
+    route_vec_done(&server->wildcard_routes);
+
+    /* Clients release their JIDs as they go, this is just in case. */
+    struct bound_jid *bound, *bound_tmp;
+    HASH_ITER(hh, server->bound_jids, bound, bound_tmp) {
+        remove_bound(server, bound);
+    }
     DELETE_LIST(iq_route, server->iq_routes);
-    DELETE_LIST(client_listener, server->client_listeners);
+    struct iq_bucket *iq_bucket, *iq_bucket_tmp;
+    HASH_ITER(hh, server->iq_buckets, iq_bucket, iq_bucket_tmp) {
+        HASH_DEL(server->iq_buckets, iq_bucket);
+        free(iq_bucket->uri);
+        free(iq_bucket);
+    }
+
+    /* Whoever sent these should have cancelled them when they stopped. */
+    struct pending_iq *pending, *pending_tmp;
+    HASH_ITER(hh, server->pending_iqs, pending, pending_tmp) {
+        pending_iq_del(pending);
+    }
+
     DELETE_LIST(disco_item, server->disco_items);
 
     if (server->jid) {
@@ -354,8 +874,31 @@ void xmpp_server_del(struct xmpp_server *server) {
     if (ev_is_active(&server->fd_readable)) {
         ev_io_stop(server->loop, &server->fd_readable);
     }
-    if (server->buffer) {
-        free(server->buffer);
+    if (ev_is_active(&server->accept_pause)) {
+        ev_timer_stop(server->loop, &server->accept_pause);
+    }
+    if (ev_is_active(&server->flush)) {
+        ev_ref(server->loop);
+        ev_check_stop(server->loop, &server->flush);
+    }
+    if (ev_is_active(&server->read_backlog)) {
+        ev_idle_stop(server->loop, &server->read_backlog);
+    }
+    if (ev_is_active(&server->timers_tick)) {
+        ev_ref(server->loop);
+        ev_timer_stop(server->loop, &server->timers_tick);
+    }
+    if (server->timers) {
+        timer_wheel_del(server->timers);
+    }
+    if (server->ring) {
+        stop_uring(server);
+    }
+    if (server->iov) {
+        xmpp_stanza_iov_del(server->iov);
+    }
+    if (server->tickets) {
+        tls_tickets_del(server->tickets);
     }
     if (server->ssl_context) {
         SSL_CTX_free(server->ssl_context);
@@ -367,14 +910,184 @@ struct ev_loop* xmpp_server_loop(const struct xmpp_server *server) {
     return server->loop;
 }
 
+int xmpp_server_socket(const struct xmpp_server *server) {
+    return server->fd_readable.fd;
+}
+
+struct tls_tickets* xmpp_server_tickets(const struct xmpp_server *server) {
+    return server->tickets;
+}
+
 const struct jid* xmpp_server_jid(const struct xmpp_server *server) {
     return server->jid;
 }
 
+struct xmpp_stanza_iov* xmpp_server_stanza_iov(struct xmpp_server *server) {
+    return server->iov;
+}
+
+const struct xmpp_parser_limits* xmpp_server_parser_limits(
+        const struct xmpp_server *server) {
+    return &server->parser_limits;
+}
+
 SSL_CTX* xmpp_server_ssl_context(const struct xmpp_server *server) {
     return server->ssl_context;
 }
 
+void xmpp_server_share_ssl_context(struct xmpp_server *server,
+                                   const struct xmpp_server *other) {
+    if (server->ssl_context == NULL || other->ssl_context == NULL) {
+        return;
+    }
+    if (server->tickets) {
+        tls_tickets_del(server->tickets);
+        server->tickets = NULL;
+    }
+    SSL_CTX_free(server->ssl_context);
+    SSL_CTX_up_ref(other->ssl_context);
+    server->ssl_context = other->ssl_context;
+}
+
+void xmpp_server_stats(const struct xmpp_server *server,
+                       struct xmpp_server_stats *stats) {
+    /* Other threads may ask for a worker's counters, so read each one
+     * atomically. */
+    stats->accepted = __atomic_load_n(&server->stats.accepted,
+                                      __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&server->stats.rejected,
+                                      __ATOMIC_RELAXED);
+    stats->accept_errors = __atomic_load_n(&server->stats.accept_errors,
+                                           __ATOMIC_RELAXED);
+    stats->budget_exhausted = __atomic_load_n(&server->stats.budget_exhausted,
+                                              __ATOMIC_RELAXED);
+    stats->queue_full = __atomic_load_n(&server->stats.queue_full,
+                                        __ATOMIC_RELAXED);
+    stats->queue_peak = __atomic_load_n(&server->stats.queue_peak,
+                                        __ATOMIC_RELAXED);
+    stats->tls_handshakes = __atomic_load_n(&server->stats.tls_handshakes,
+                                            __ATOMIC_RELAXED);
+    stats->tls_resumed = __atomic_load_n(&server->stats.tls_resumed,
+                                         __ATOMIC_RELAXED);
+    stats->read_budget_exhausted = __atomic_load_n(
+            &server->stats.read_budget_exhausted, __ATOMIC_RELAXED);
+    stats->uring_submits = __atomic_load_n(&server->stats.uring_submits,
+                                           __ATOMIC_RELAXED);
+    stats->uring_ops = __atomic_load_n(&server->stats.uring_ops,
+                                       __ATOMIC_RELAXED);
+    stats->hibernations = __atomic_load_n(&server->stats.hibernations,
+                                          __ATOMIC_RELAXED);
+    stats->sources_paused = __atomic_load_n(&server->stats.sources_paused,
+                                            __ATOMIC_RELAXED);
+    stats->stanzas_dropped = __atomic_load_n(&server->stats.stanzas_dropped,
+                                             __ATOMIC_RELAXED);
+    stats->stanzas_superseded = __atomic_load_n(
+            &server->stats.stanzas_superseded, __ATOMIC_RELAXED);
+    stats->idle_reaped = __atomic_load_n(&server->stats.idle_reaped,
+                                         __ATOMIC_RELAXED);
+    stats->pings_sent = __atomic_load_n(&server->stats.pings_sent,
+                                        __ATOMIC_RELAXED);
+    stats->pings_answered = __atomic_load_n(&server->stats.pings_answered,
+                                            __ATOMIC_RELAXED);
+    stats->ping_rtt_total = __atomic_load_n(&server->stats.ping_rtt_total,
+                                            __ATOMIC_RELAXED);
+    stats->keepalives_sent = __atomic_load_n(&server->stats.keepalives_sent,
+                                             __ATOMIC_RELAXED);
+
+    /* The session cache is kept (and counted) by OpenSSL itself. */
+    stats->tls_cache_hits = 0;
+    stats->tls_cache_misses = 0;
+    if (server->ssl_context != NULL) {
+        stats->tls_cache_hits = SSL_CTX_sess_hits(server->ssl_context);
+        stats->tls_cache_misses = SSL_CTX_sess_misses(server->ssl_context);
+    }
+}
+
+void xmpp_server_log_stats(const struct xmpp_server *server) {
+    struct xmpp_server_stats stats;
+    xmpp_server_stats(server, &stats);
+    log_info("Worker %d: clients=%d accepted=%lu rejected=%lu errors=%lu"
+             " budget_exhausted=%lu queue_full=%lu queue_peak=%lu"
+             " read_budget_exhausted=%lu",
+             server->worker_id,
+             __atomic_load_n(&server->num_clients, __ATOMIC_RELAXED),
+             stats.accepted, stats.rejected, stats.accept_errors,
+             stats.budget_exhausted, stats.queue_full, stats.queue_peak,
+             stats.read_budget_exhausted);
+    if (server->ring != NULL) {
+        log_info("Worker %d: uring_submits=%lu uring_ops=%lu",
+                 server->worker_id, stats.uring_submits, stats.uring_ops);
+    }
+    if (server->high_watermark > 0) {
+        log_info("Worker %d: sources_paused=%lu stanzas_dropped=%lu"
+                 " stanzas_superseded=%lu",
+                 server->worker_id, stats.sources_paused,
+                 stats.stanzas_dropped, stats.stanzas_superseded);
+    }
+    if (server->timers != NULL) {
+        double rtt = stats.pings_answered == 0 ? 0
+            : stats.ping_rtt_total / 1000.0 / stats.pings_answered;
+        log_info("Worker %d: idle_reaped=%lu pings_sent=%lu pings_answered=%lu"
+                 " ping_rtt_avg=%.1fms keepalives_sent=%lu",
+                 server->worker_id, stats.idle_reaped, stats.pings_sent,
+                 stats.pings_answered, rtt, stats.keepalives_sent);
+    }
+    if (server->hibernate_timeout > 0) {
+        log_info("Worker %d: hibernating=%d hibernations=%lu",
+                 server->worker_id,
+                 __atomic_load_n(&server->num_hibernating, __ATOMIC_RELAXED),
+                 stats.hibernations);
+    }
+    if (server->ssl_context != NULL) {
+        log_info("Worker %d: tls_handshakes=%lu tls_resumed=%lu"
+                 " session_cache_hits=%lu session_cache_misses=%lu",
+                 server->worker_id, stats.tls_handshakes, stats.tls_resumed,
+                 stats.tls_cache_hits, stats.tls_cache_misses);
+    }
+}
+
+void xmpp_server_set_worker(struct xmpp_server *server,
+                            struct xmp3_workers *workers, int id) {
+    server->workers = workers;
+    server->worker_id = id;
+    server->sessions = xmp3_workers_sessions(workers);
+}
+
+bool xmpp_server_claim_jid(struct xmpp_server *server,
+                           struct xmpp_client *client, const struct jid *jid) {
+    char key[jid_to_str_len(jid) + 1];
+    jid_key(key, jid);
+
+    struct bound_jid *bound;
+    HASH_FIND_STR(server->bound_jids, key, bound);
+    if (bound != NULL) {
+        return false;
+    }
+    if (server->workers != NULL
+            && !xmp3_workers_add_jid(server->workers, server->worker_id,
+                                     jid)) {
+        return false;
+    }
+    add_bound(server, client, key);
+    return true;
+}
+
+void xmpp_server_release_jid(struct xmpp_server *server,
+                             const struct jid *jid) {
+    if (server->workers != NULL) {
+        xmp3_workers_del_jid(server->workers, server->worker_id, jid);
+    }
+
+    /* Clients that never bound a resource have nothing to release. */
+    char key[jid_to_str_len(jid) + 1];
+    jid_key(key, jid);
+    struct bound_jid *bound;
+    HASH_FIND_STR(server->bound_jids, key, bound);
+    if (bound != NULL) {
+        remove_bound(server, bound);
+    }
+}
+
 void xmpp_server_set_auth_callback(struct xmpp_server *server,
                                    xmpp_server_auth_callback cb,
                                    void (*del)(void*),
@@ -401,72 +1114,364 @@ bool xmpp_server_authenticate(const struct xmpp_server *server,
 void xmpp_server_add_client_listener(struct xmpp_client *client,
                                      xmpp_server_client_callback cb,
                                      void *data) {
-    struct xmpp_server *server = xmpp_client_server(client);
+    struct c_client *conn = xmpp_client_conn(client);
+    if (conn == NULL || conn->closing) {
+        log_warn("Attempted to listen for a client that isn't connected.");
+        return;
+    }
+#ifndef NDEBUG
     char *strjid = jid_to_str(xmpp_client_jid(client));
     debug("Registering disconnect listener for '%s'", strjid);
     free(strjid);
-    ADD_CALLBACK(client_listener, server->client_listeners, client, cb, data);
+#endif
+    if (find_listener(conn, cb, data) != NULL) {
+        log_warn("Attempted to add duplicate callback.");
+        return;
+    }
+    struct client_listener *listener = calloc(1, sizeof(*listener));
+    check_mem(listener);
+    listener->key.cb = cb;
+    listener->key.data = data;
+    HASH_ADD(hh, conn->listeners, key, sizeof(listener->key), listener);
 }
 
-void xmpp_server_del_client_disconnect_cb(struct xmpp_client *client,
-                                          xmpp_server_client_callback cb,
-                                          void *data) {
-    struct xmpp_server *server = xmpp_client_server(client);
-    DEL_CALLBACK(client_listener, server->client_listeners, client, cb, data);
+void xmpp_server_del_client_listener(struct xmpp_client *client,
+                                     xmpp_server_client_callback cb,
+                                     void *data) {
+    struct c_client *conn = xmpp_client_conn(client);
+    struct client_listener *listener = NULL;
+    if (conn != NULL) {
+        listener = find_listener(conn, cb, data);
+    }
+    if (listener == NULL) {
+        log_warn("Attempted to remove non-existent callback.");
+        return;
+    }
+    HASH_DEL(conn->listeners, listener);
+    free(listener);
 }
 
 void xmpp_server_disconnect_client(struct xmpp_client *client) {
     struct xmpp_server *server = xmpp_client_server(client);
-
-    /* Sanity check that the client is registered with the server. */
-    struct c_client *search = NULL;
-    DL_FOREACH(server->clients, search) {
-        if (client == search->fd_readable.data) {
-            break;
-        }
-    }
-    if (search == NULL) {
+    struct c_client *conn = xmpp_client_conn(client);
+    if (conn == NULL) {
         log_warn("Attempted to disconnect non-registered client.");
         return;
     }
-
-    DL_DELETE(server->clients, search);
-    ev_io_stop(server->loop, &search->fd_readable);
-
-    struct client_listener *listener = NULL;
-    struct client_listener *tmp = NULL;
-    DL_FOREACH_SAFE(server->client_listeners, listener, tmp) {
-        if (listener->client == client) {
-            listener->cb(client, listener->data);
-            DL_DELETE(server->client_listeners, listener);
-            free(listener);
-        }
+    /* A listener may try to disconnect it again. */
+    if (conn->closing) {
+        return;
     }
-
-    xmpp_client_del(client);
-    free(search);
+    remove_client(server, conn);
+    notify_listeners(conn);
+    close_client(conn);
 }
 
-struct xmpp_client* xmpp_server_find_client(const struct xmpp_server *server,
-                                            const struct jid *jid) {
-    struct c_client *search = NULL;
-    DL_FOREACH(server->clients, search) {
-        struct jid *search_jid = xmpp_client_jid(search->fd_readable.data);
-        /* If jid is NULL, then we have a client that is still in the process
-         * of authenticating. */
-        if (search_jid == NULL) {
-            debug("Found non-authenticated client, skipping...");
+void xmpp_server_disconnect_clients(struct xmpp_server *server,
+                                    struct xmpp_client **clients,
+                                    size_t num_clients) {
+    if (num_clients == 0) {
+        return;
+    }
+    struct c_client **conns = malloc(num_clients * sizeof(*conns));
+    check_mem(conns);
+
+    /* Mark them all first, so nothing is sent to any of them from here on,
+     * and the server's lists can be cleaned up in one pass each. */
+    size_t num_conns = 0;
+    for (size_t i = 0; i < num_clients; i++) {
+        struct c_client *conn = xmpp_client_conn(clients[i]);
+        if (conn == NULL || conn->closing) {
             continue;
         }
+        conn->closing = true;
+        conns[num_conns++] = conn;
+    }
 
-        if (jid_cmp(jid, search_jid) == 0) {
-            return search->fd_readable.data;
+    struct c_client **link = &server->flush_list;
+    while (*link != NULL) {
+        if ((*link)->closing) {
+            (*link)->flush_scheduled = false;
+            *link = (*link)->flush_next;
+        } else {
+            link = &(*link)->flush_next;
+        }
+    }
+    link = &server->reap_list;
+    while (*link != NULL) {
+        if ((*link)->closing) {
+            (*link)->reap_scheduled = false;
+            *link = (*link)->reap_next;
+        } else {
+            link = &(*link)->reap_next;
+        }
+    }
+    struct c_client **lists[] = {&server->read_list, &server->read_batch};
+    for (int i = 0; i < 2; i++) {
+        link = lists[i];
+        while (*link != NULL) {
+            if ((*link)->closing) {
+                (*link)->read_scheduled = false;
+                *link = (*link)->read_next;
+            } else {
+                link = &(*link)->read_next;
+            }
         }
     }
-    return NULL;
-}
 
-struct xmpp_client_iterator* xmpp_client_iterator_new(
+    for (size_t i = 0; i < num_conns; i++) {
+        remove_client(server, conns[i]);
+    }
+    for (size_t i = 0; i < num_conns; i++) {
+        notify_listeners(conns[i]);
+    }
+    for (size_t i = 0; i < num_conns; i++) {
+        close_client(conns[i]);
+    }
+    free(conns);
+}
+
+bool xmpp_server_freeze_client(struct xmpp_client *client) {
+    struct xmpp_server *server = xmpp_client_server(client);
+    struct c_client *conn = xmpp_client_conn(client);
+    const struct jid *jid = xmpp_client_jid(client);
+
+    /* Only bound plain streams with nothing in flight can move.  OpenSSL
+     * can't hand a live TLS session over, and anything read or queued but
+     * not yet handled would be lost. */
+    if (conn == NULL || jid == NULL || jid_resource(jid) == NULL
+            || xmpp_client_tls(client) || conn->read_scheduled
+            || conn->read_backlogged || conn->backpressured
+            || conn->held != NULL || conn->flush_scheduled
+            || xmpp_parser_stream_header(xmpp_client_parser(client)) == NULL) {
+        return false;
+    }
+    if (!conn->hibernating) {
+        if (!xmpp_client_hibernate(client)) {
+            return false;
+        }
+        conn->hibernating = true;
+        __atomic_fetch_add(&server->num_hibernating, 1, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+void xmpp_server_detach_client(struct xmpp_client *client) {
+    struct xmpp_server *server = xmpp_client_server(client);
+    struct c_client *conn = xmpp_client_conn(client);
+    if (conn == NULL) {
+        log_warn("Attempted to detach non-registered client.");
+        return;
+    }
+    remove_client(server, conn);
+
+    /* The client hasn't gone anywhere as far as it knows, so nobody is told
+     * about a disconnect. */
+    del_listeners(conn);
+
+    xmpp_client_detach(client);
+    free(conn);
+}
+
+struct xmpp_client* xmpp_server_adopt_client(struct xmpp_server *server,
+                                             int fd, const char *jid,
+                                             const char *header) {
+    struct client_socket *socket = NULL;
+    struct xmpp_client *client = NULL;
+
+    struct sockaddr_in caddr;
+    socklen_t caddr_len = sizeof(caddr);
+    check(getpeername(fd, (struct sockaddr*)&caddr, &caddr_len) == 0,
+          "Unable to get the address of an adopted client");
+
+    socket = client_socket_new(fd, caddr);
+    client = xmpp_client_new(server, socket);
+    check(client != NULL, "Unable to create adopted client.");
+
+    /* The client is bound already, so carry on as if resource binding just
+     * finished (see xmpp_auth.c). */
+    struct jid *client_jid = jid_new_from_str(jid);
+    check(client_jid != NULL, "Adopted client has an invalid JID \"%s\"",
+          jid);
+
+    /* The client only gets the JID once it's ours, otherwise deleting it
+     * would release someone else's binding. */
+    if (jid_resource(client_jid) == NULL
+            || !xmpp_server_claim_jid(server, client, client_jid)) {
+        jid_del(client_jid);
+        sentinel("Adopted client JID \"%s\" has no resource or is already"
+                 " bound", jid);
+    }
+    xmpp_client_set_jid(client, client_jid);
+
+    struct xmpp_parser *parser = xmpp_client_parser(client);
+    check(xmpp_parser_resume(parser, header), "Unable to resume stream.");
+    xmpp_parser_set_handler(parser, xmpp_core_handle_stanza);
+    xmpp_server_add_stanza_route(server, client_jid, xmpp_core_route_client,
+                                 client);
+
+    __atomic_add_fetch(server->sessions, 1, __ATOMIC_RELAXED);
+    if (server->sessions != &server->num_clients) {
+        __atomic_fetch_add(&server->num_clients, 1, __ATOMIC_RELAXED);
+    }
+
+    struct c_client *conn = add_client(server, client, fd);
+    conn->hibernating = true;
+    __atomic_fetch_add(&server->num_hibernating, 1, __ATOMIC_RELAXED);
+
+    log_info("Adopted connection from %s:%d as %s",
+             inet_ntoa(caddr.sin_addr), caddr.sin_port, jid);
+    return client;
+
+error:
+    if (client) {
+        /* Also closes and frees the socket. */
+        xmpp_client_del(client);
+    } else {
+        if (socket) {
+            client_socket_del(socket);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+void xmpp_server_schedule_flush(struct xmpp_client *client) {
+    struct xmpp_server *server = xmpp_client_server(client);
+    struct c_client *conn = xmpp_client_conn(client);
+    if (conn == NULL || conn->closing) {
+        return;
+    }
+    conn->last_write = ev_now(server->loop);
+    if (conn->flush_scheduled) {
+        return;
+    }
+    conn->flush_scheduled = true;
+    conn->flush_next = server->flush_list;
+    server->flush_list = conn;
+
+    /* Batched sends already put all of a flush into one write. */
+    if (server->ring == NULL || xmpp_client_tls(client)) {
+        cork_client(client, true);
+    }
+}
+
+bool xmpp_server_batches_io(const struct xmpp_server *server) {
+    return server->ring != NULL;
+}
+
+void xmpp_server_set_source(struct xmpp_server *server, struct ev_io *source) {
+    server->source = source;
+}
+
+void xmpp_server_forget_source(struct xmpp_server *server,
+                               struct ev_io *source) {
+    struct paused_source *paused, *tmp;
+    DL_FOREACH_SAFE(server->paused_sources, paused, tmp) {
+        if (paused->watcher == source) {
+            DL_DELETE(server->paused_sources, paused);
+            free(paused);
+        }
+    }
+    if (server->source == source) {
+        server->source = NULL;
+    }
+}
+
+bool xmpp_server_ping_reply(struct xmpp_client *client,
+                            struct xmpp_stanza *stanza) {
+    struct c_client *conn = xmpp_client_conn(client);
+    if (conn == NULL || !conn->ping_pending
+            || xmpp_stanza_kind(stanza) != XMPP_STANZA_KIND_IQ) {
+        return false;
+    }
+
+    /* An error (e.g. a client without XEP-0199) is as good an answer. */
+    const char *type = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_TYPE);
+    const char *id = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_ID);
+    char ping_id[32];
+    snprintf(ping_id, sizeof(ping_id), "xmp3-ping-%lu", conn->ping_id);
+    if (type == NULL || id == NULL || strcmp(id, ping_id) != 0
+            || (strcmp(type, XMPP_STANZA_TYPE_RESULT) != 0
+                && strcmp(type, XMPP_STANZA_TYPE_ERROR) != 0)) {
+        return false;
+    }
+
+    struct xmpp_server *server = xmpp_client_server(client);
+    conn->ping_pending = false;
+    conn->ping_rtt = ev_now(server->loop) - conn->ping_sent;
+    __atomic_fetch_add(&server->stats.pings_answered, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&server->stats.ping_rtt_total,
+                       (unsigned long)(conn->ping_rtt * 1000000),
+                       __ATOMIC_RELAXED);
+    debug("Ping round trip %.1fms", conn->ping_rtt * 1000);
+    return true;
+}
+
+double xmpp_server_ping_rtt(const struct xmpp_client *client) {
+    struct c_client *conn = xmpp_client_conn(client);
+    return conn == NULL ? -1 : conn->ping_rtt;
+}
+
+bool xmpp_server_admit_stanza(struct xmpp_client *client,
+                              struct xmpp_stanza *stanza) {
+    struct xmpp_server *server = xmpp_client_server(client);
+    struct c_client *conn = xmpp_client_conn(client);
+    if (conn != NULL && conn->closing) {
+        return false;
+    }
+    if (server->high_watermark == 0 || conn == NULL) {
+        return true;
+    }
+
+    if (!conn->backpressured) {
+        if (xmpp_client_pending(client) < server->high_watermark) {
+            return true;
+        }
+        conn->backpressured = true;
+    }
+    pause_source(server, conn);
+
+    enum xmp3_overflow_policy policy = XMP3_OVERFLOW_QUEUE;
+    switch (xmpp_stanza_kind(stanza)) {
+        case XMPP_STANZA_KIND_PRESENCE:
+            policy = server->presence_overflow;
+            break;
+        case XMPP_STANZA_KIND_MESSAGE:
+            policy = server->message_overflow;
+            break;
+        case XMPP_STANZA_KIND_IQ:
+            policy = server->iq_overflow;
+            break;
+        default:
+            break;
+    }
+
+    switch (policy) {
+        case XMP3_OVERFLOW_QUEUE:
+            return true;
+        case XMP3_OVERFLOW_DROP:
+            __atomic_fetch_add(&server->stats.stanzas_dropped, 1,
+                               __ATOMIC_RELAXED);
+            return false;
+        case XMP3_OVERFLOW_SUPERSEDE:
+            hold_stanza(server, conn, stanza);
+            return false;
+    }
+    return true;
+}
+
+struct xmpp_client* xmpp_server_find_client(const struct xmpp_server *server,
+                                            const struct jid *jid) {
+    char key[jid_to_str_len(jid) + 1];
+    jid_key(key, jid);
+
+    struct bound_jid *bound;
+    HASH_FIND_STR(server->bound_jids, key, bound);
+    return bound ? bound->client : NULL;
+}
+
+struct xmpp_client_iterator* xmpp_client_iterator_new(
         const struct xmpp_server *server) {
     struct xmpp_client_iterator *iter = calloc(1, sizeof(*iter));
     check_mem(iter);
@@ -492,60 +1497,240 @@ void xmpp_client_iterator_del(struct xmpp_client_iterator *iter) {
 void xmpp_server_add_stanza_route(struct xmpp_server *server,
                                   const struct jid *jid,
                                   xmpp_server_stanza_callback cb, void *data) {
-    ADD_CALLBACK(stanza_route, server->stanza_routes, jid, cb, data);
+    struct stanza_route *add = stanza_route_new(jid, cb, data);
+    if (find_route(server, add) != NULL) {
+        log_warn("Attempted to add duplicate callback.");
+        stanza_route_del(add);
+        return;
+    }
+
+    add->seq = server->route_seq++;
+    DL_APPEND(server->stanza_routes, add);
+    if (add->wildcard) {
+        route_vec_push(&server->wildcard_routes, add);
+    } else {
+        index_route(&server->routes_full, add->key, strlen(add->key), add);
+        index_route(&server->routes_bare, add->key, add->bare_len, add);
+    }
 }
 
 void xmpp_server_del_stanza_route(struct xmpp_server *server,
                                   const struct jid *jid,
                                   xmpp_server_stanza_callback cb, void *data) {
-    DEL_CALLBACK(stanza_route, server->stanza_routes, jid, cb, data);
+    struct stanza_route *search = stanza_route_new(jid, cb, data);
+    struct stanza_route *match = find_route(server, search);
+    stanza_route_del(search);
+    if (match == NULL) {
+        log_warn("Attempted to remove non-existent callback.");
+        return;
+    }
+
+    if (match->wildcard) {
+        route_vec_remove(&server->wildcard_routes, match);
+    } else {
+        unindex_route(&server->routes_full, match->key, strlen(match->key),
+                      match);
+        unindex_route(&server->routes_bare, match->key, match->bare_len,
+                      match);
+    }
+    DL_DELETE(server->stanza_routes, match);
+
+    /* A stanza being routed may still have it in its list of matches. */
+    if (server->routing > 0) {
+        match->removed = true;
+        LL_PREPEND(server->removed_routes, match);
+    } else {
+        stanza_route_del(match);
+    }
 }
 
 bool xmpp_server_route_stanza(struct xmpp_server *server,
                               struct xmpp_stanza *stanza) {
-    struct jid *search_jid = jid_new_from_str(xmpp_stanza_attr(
-                stanza, XMPP_STANZA_ATTR_TO));
+    /* Replies to IQs sent with xmpp_server_send_iq() go to whoever sent
+     * them, whatever JID they were sent from. */
+    if (xmpp_stanza_kind(stanza) == XMPP_STANZA_KIND_IQ
+            && complete_iq(server, stanza)) {
+        return true;
+    }
 
-    char *strjid = jid_to_str(search_jid);
-    debug("Searching for route to: '%s'", strjid);
-    free(strjid);
+    const char *to = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_TO);
+    struct jid *search_jid = to ? jid_new_from_str(to) : NULL;
+    debug("Searching for route to: '%s'", to ? to : "");
 
-    bool was_handled = false;
-    struct stanza_route *route = NULL;
-    DL_FOREACH(server->stanza_routes, route) {
-        strjid = jid_to_str(route->jid);
-        debug("Is it '%s'", strjid);
-        free(strjid);
-        if (jid_cmp_wildcards(search_jid, route->jid) == 0) {
-            debug("Yes");
-            if (route->cb(stanza, server, route->data)) {
-                debug("Stanza handled");
-                was_handled = true;
-            } else {
-                debug("Stanza not yet handled");
-            }
-        } else {
-            debug("No");
+    struct route_vec found = {0};
+    if (search_jid != NULL) {
+        find_routes(server, search_jid, &found);
+    }
+    bool was_handled = call_routes(server, stanza, &found, NULL);
+    route_vec_done(&found);
+
+    /* Clients on other workers may need to see this too.  Stanzas another
+     * worker gave us are never passed on again, so they can't bounce. */
+    if (server->workers != NULL && stanza != server->handoff) {
+        if (xmp3_workers_forward(server->workers, server->worker_id, stanza,
+                                 was_handled)) {
+            debug("Stanza handed off to other workers");
+            was_handled = true;
         }
     }
+
     if (!was_handled) {
         log_info("No route for destination");
-        if (strcmp(xmpp_stanza_name(stanza), XMPP_STANZA_IQ) == 0) {
+        if (xmpp_stanza_kind(stanza) == XMPP_STANZA_KIND_IQ) {
             send_service_unavailable(server, stanza);
         }
     }
-    jid_del(search_jid);
+    if (search_jid != NULL) {
+        jid_del(search_jid);
+    }
     return was_handled;
 }
 
+bool xmpp_server_route_stanza_multi(struct xmpp_server *server,
+                                    struct xmpp_stanza *stanza,
+                                    const struct jid **to, size_t num_to) {
+    if (num_to == 0) {
+        return true;
+    }
+
+    const char *orig = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_TO);
+    char *saved_to = NULL;
+    if (orig != NULL) {
+        STRDUP_CHECK(saved_to, orig);
+    }
+
+    /* Recipients that need the full routing treatment, and the clients
+     * sent to directly (any other routes for them still have to be
+     * called). */
+    size_t num_slow = 0, num_fast = 0;
+    size_t *slow = malloc(num_to * sizeof(*slow));
+    check_mem(slow);
+    size_t *fast = malloc(num_to * sizeof(*fast));
+    check_mem(fast);
+
+    bool all_handled = true;
+    bool built = false;
+    struct xmpp_stanza_iov *iov = server->iov;
+    for (size_t i = 0; i < num_to; i++) {
+        char key[jid_to_str_len(to[i]) + 1];
+        jid_key(key, to[i]);
+
+        /* A full JID bound by a local client goes straight to its session. */
+        struct xmpp_client *client = NULL;
+        if (jid_resource(to[i]) != NULL && !has_wildcard(to[i])) {
+            struct bound_jid *bound;
+            HASH_FIND_STR(server->bound_jids, key, bound);
+            client = bound ? bound->client : NULL;
+        }
+
+        /* Clients that have fallen behind may need the stanza itself. */
+        struct c_client *conn = client ? xmpp_client_conn(client) : NULL;
+        if (conn == NULL || conn->closing || conn->backpressured
+                || (server->high_watermark > 0
+                    && xmpp_client_pending(client) >= server->high_watermark)) {
+            slow[num_slow++] = i;
+            continue;
+        }
+        fast[num_fast++] = i;
+
+        if (!built) {
+            xmpp_stanza_copy_attr(stanza, XMPP_STANZA_ATTR_TO, key);
+            xmpp_stanza_iov_build(iov, stanza, true);
+            built = true;
+        }
+        xmpp_stanza_iov_set_to(iov, key);
+        debug("Routing to local client '%s'", key);
+        if (!xmpp_client_sendv(client, xmpp_stanza_iov_vec(iov),
+                               xmpp_stanza_iov_count(iov))) {
+            all_handled = false;
+        }
+    }
+
+    /* Routes besides the clients' own (e.g. modules watching everything)
+     * only run once all the clients have been sent to, since they may reuse
+     * the iov. */
+    for (size_t i = 0; i < num_fast; i++) {
+        const struct jid *jid = to[fast[i]];
+        struct route_vec found = {0};
+        find_routes(server, jid, &found);
+        struct xmpp_client *client = xmpp_server_find_client(server, jid);
+        if (found.count > 1 || (found.count == 1
+                    && (found.routes[0]->cb != xmpp_core_route_client
+                        || found.routes[0]->data != client))) {
+            xmpp_stanza_set_attr(stanza, XMPP_STANZA_ATTR_TO, jid_to_str(jid));
+            call_routes(server, stanza, &found, client);
+        }
+        route_vec_done(&found);
+    }
+    free(fast);
+
+    for (size_t i = 0; i < num_slow; i++) {
+        xmpp_stanza_set_attr(stanza, XMPP_STANZA_ATTR_TO,
+                             jid_to_str(to[slow[i]]));
+        if (!xmpp_server_route_stanza(server, stanza)) {
+            all_handled = false;
+        }
+    }
+    free(slow);
+
+    /* Leave "to" as it was, a NULL takes it off again if it wasn't there. */
+    xmpp_stanza_set_attr(stanza, XMPP_STANZA_ATTR_TO, saved_to);
+    return all_handled;
+}
+
+bool xmpp_server_route_handoff(struct xmpp_server *server,
+                               struct xmpp_stanza *stanza) {
+    struct xmpp_stanza *prev = server->handoff;
+    server->handoff = stanza;
+    bool rv = xmpp_server_route_stanza(server, stanza);
+    server->handoff = prev;
+    return rv;
+}
+
 void xmpp_server_add_iq_route(struct xmpp_server *server, const char *ns,
                               xmpp_server_stanza_callback cb, void *data) {
-    ADD_CALLBACK(iq_route, server->iq_routes, ns, cb, data);
+    struct iq_route *add = iq_route_new(ns, cb, data);
+    struct iq_route **link = iq_chain(server, add->uri, add->ns_atom, true);
+    for (; *link != NULL; link = &(*link)->ns_next) {
+        if (iq_route_cmp(*link, add) == 0) {
+            log_warn("Attempted to add duplicate callback.");
+            iq_route_del(add);
+            return;
+        }
+    }
+    *link = add;
+    DL_APPEND(server->iq_routes, add);
 }
 
 void xmpp_server_del_iq_route(struct xmpp_server *server, const char *ns,
                               xmpp_server_stanza_callback cb, void *data) {
-    DEL_CALLBACK(iq_route, server->iq_routes, ns, cb, data);
+    struct iq_route *search = iq_route_new(ns, cb, data);
+    struct iq_route **link = iq_chain(server, search->uri, search->ns_atom,
+                                      false);
+    while (link != NULL && *link != NULL
+            && iq_route_cmp(*link, search) != 0) {
+        link = &(*link)->ns_next;
+    }
+    if (link == NULL || *link == NULL) {
+        log_warn("Attempted to remove non-existent callback.");
+        iq_route_del(search);
+        return;
+    }
+
+    struct iq_route *match = *link;
+    *link = match->ns_next;
+    if (search->ns_atom == ATOM_NONE) {
+        struct iq_bucket *bucket;
+        HASH_FIND_STR(server->iq_buckets, search->uri, bucket);
+        if (bucket->routes == NULL) {
+            HASH_DEL(server->iq_buckets, bucket);
+            free(bucket->uri);
+            free(bucket);
+        }
+    }
+    iq_route_del(search);
+    DL_DELETE(server->iq_routes, match);
+    iq_route_del(match);
 }
 
 bool xmpp_server_route_iq(struct xmpp_server *server,
@@ -567,14 +1752,17 @@ bool xmpp_server_route_iq(struct xmpp_server *server,
     }
 
     const char *search_uri = xmpp_stanza_uri(child);
+    enum atom search_atom = xmpp_stanza_uri_atom(child);
     debug("Searching for IQ namespace: %s", search_uri);
-
-    struct iq_route *route = NULL;
-    DL_FOREACH(server->iq_routes, route) {
-        debug("Is it '%s'?", route->ns);
-        /* These strings come from Expat, so they should be null-terminated. */
-        if (strcmp(search_uri, route->ns) == 0) {
-            debug("Yes");
+    check(search_uri != NULL, "IQ child without namespace");
+
+    struct iq_route **chain = iq_chain(server, search_uri, search_atom, false);
+    struct iq_route *route = chain != NULL ? *chain : NULL;
+    while (route != NULL) {
+        /* In case the callback removes its own route. */
+        struct iq_route *next = route->ns_next;
+        if (iq_route_matches(route, child)) {
+            debug("Matched IQ route '%s'", route->ns);
             if (route->cb(stanza, server, route->data)) {
                 debug("IQ handled");
                 was_handled = true;
@@ -582,6 +1770,7 @@ bool xmpp_server_route_iq(struct xmpp_server *server,
                 debug("IQ not yet handled");
             }
         }
+        route = next;
     }
 
 error:
@@ -592,6 +1781,74 @@ error:
     return was_handled;
 }
 
+bool xmpp_server_send_iq(struct xmpp_server *server, struct xmpp_stanza *iq,
+                         unsigned timeout, xmpp_server_iq_callback cb,
+                         void *data) {
+    const char *to = xmpp_stanza_attr(iq, XMPP_STANZA_ATTR_TO);
+    check(to != NULL, "IQ to send has no \"to\"");
+
+    if (xmpp_stanza_attr(iq, XMPP_STANZA_ATTR_ID) == NULL) {
+        char id[48];
+        snprintf(id, sizeof(id), "xmp3-iq-%d-%lu", server->worker_id,
+                 server->iq_seq++);
+        xmpp_stanza_copy_attr(iq, XMPP_STANZA_ATTR_ID, id);
+    }
+    if (xmpp_stanza_attr(iq, XMPP_STANZA_ATTR_FROM) == NULL) {
+        xmpp_stanza_set_attr(iq, XMPP_STANZA_ATTR_FROM,
+                             jid_to_str(server->jid));
+    }
+
+    const char *id = xmpp_stanza_attr(iq, XMPP_STANZA_ATTR_ID);
+    struct pending_iq *pending;
+    HASH_FIND_STR(server->pending_iqs, id, pending);
+    check(pending == NULL, "IQ \"%s\" is already waiting for a reply", id);
+
+    struct jid *to_jid = jid_new_from_str(to);
+    check(to_jid != NULL, "IQ to send has an invalid \"to\"");
+    struct jid *from_jid = jid_new_from_str(
+            xmpp_stanza_attr(iq, XMPP_STANZA_ATTR_FROM));
+    if (from_jid == NULL) {
+        jid_del(to_jid);
+        sentinel("IQ to send has an invalid \"from\"");
+    }
+
+    pending = calloc(1, sizeof(*pending));
+    check_mem(pending);
+    STRDUP_CHECK(pending->id, id);
+    pending->to = to_jid;
+    pending->from = from_jid;
+    pending->cb = cb;
+    pending->data = data;
+    pending->server = server;
+    HASH_ADD_KEYPTR(hh, server->pending_iqs, pending->id, strlen(pending->id),
+                    pending);
+
+    if (timeout > 0) {
+        start_timers(server);
+        pending->timer = timer_wheel_timer_new(server->timers, iq_timeout,
+                                               pending);
+        timer_wheel_start(pending->timer, timeout);
+    }
+
+    /* Nobody took it, so there won't be a reply. */
+    if (!xmpp_server_route_stanza(server, iq)) {
+        xmpp_server_cancel_iq(server, id);
+        return false;
+    }
+    return true;
+
+error:
+    return false;
+}
+
+void xmpp_server_cancel_iq(struct xmpp_server *server, const char *id) {
+    struct pending_iq *pending;
+    HASH_FIND_STR(server->pending_iqs, id, pending);
+    if (pending != NULL) {
+        pending_iq_del(pending);
+    }
+}
+
 void xmpp_server_add_disco_item(struct xmpp_server *server,
                                 const char *name, const struct jid *jid) {
     struct disco_item *item = calloc(1, sizeof(*item));
@@ -632,7 +1889,30 @@ void xmpp_server_append_disco_items(struct xmpp_server *server,
 
 /** Simple function to create and bind the server socket. */
 static bool init_socket(struct xmpp_server *server,
-                        const struct xmp3_options *options) {
+                        const struct xmp3_options *options, int fd) {
+    /* An inherited socket (from the process we're taking over from) is
+     * already bound and listening, maybe with connections waiting. */
+    if (fd == -1) {
+        fd = open_socket(server, options);
+        check(fd != -1, "Unable to open XMPP server socket");
+    }
+
+    ev_init(&server->accept_pause, resume_accept);
+    server->accept_pause.data = server;
+
+    /* Register the event handler so we can get notified of new connections. */
+    ev_io_init(&server->fd_readable, connect_client, fd, EV_READ);
+    server->fd_readable.data = server;
+    ev_io_start(server->loop, &server->fd_readable);
+
+    return true;
+error:
+    return false;
+}
+
+/** Creates, binds and listens on the server's socket. */
+static int open_socket(struct xmpp_server *server,
+                       const struct xmp3_options *options) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     check(fd != -1, "Error creating XMPP server socket");
 
@@ -642,6 +1922,18 @@ static bool init_socket(struct xmpp_server *server,
                      sizeof(on)) != -1,
           "Error setting SO_REUSEADDR on server socket");
 
+    /* With multiple workers, each one binds its own socket to the same port
+     * and the kernel spreads new connections between them. */
+    if (xmp3_options_get_workers(options) > 1) {
+#ifdef SO_REUSEPORT
+        check(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on,
+                         sizeof(on)) != -1,
+              "Error setting SO_REUSEPORT on server socket");
+#else
+        sentinel("Multiple workers need SO_REUSEPORT support");
+#endif
+    }
+
     /* Set non-blocking mode on the socket. */
     int flags = fcntl(fd, F_GETFL, 0);
     fcntl(fd, F_SETFL, O_NONBLOCK);
@@ -661,14 +1953,25 @@ static bool init_socket(struct xmpp_server *server,
     check(listen(fd, server->backlog) != -1,
           "XMPP server socket listen error");
 
-    /* Register the event handler so we can get notified of new connections. */
-    ev_io_init(&server->fd_readable, connect_client, fd, EV_READ);
-    server->fd_readable.data = server;
-    ev_io_start(server->loop, &server->fd_readable);
+    /* Clients talk first in XMPP, so there is no point in waking up for
+     * a connection until its stream header has arrived. */
+    int defer_accept = xmp3_options_get_defer_accept(options);
+    if (defer_accept > 0) {
+#ifdef TCP_DEFER_ACCEPT
+        check(setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept,
+                         sizeof(defer_accept)) != -1,
+              "Error setting TCP_DEFER_ACCEPT on server socket");
+#else
+        log_warn("TCP_DEFER_ACCEPT is not supported, ignoring.");
+#endif
+    }
 
-    return true;
+    return fd;
 error:
-    return false;
+    if (fd != -1) {
+        close(fd);
+    }
+    return -1;
 }
 
 /** Initializes the OpenSSL context, setting up the key and certificate. */
@@ -684,6 +1987,47 @@ static bool init_ssl(struct xmpp_server *server,
             "Cannot load SSL private key.");
     check(SSL_CTX_check_private_key(server->ssl_context) == 1,
             "Invalid certificate/private key combination.");
+
+    /* Client sockets are non-blocking, so writes may be retried from the
+     * outbound queue with a different buffer address and may be partial. */
+    SSL_CTX_set_mode(server->ssl_context, SSL_MODE_ENABLE_PARTIAL_WRITE
+                     | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    /* Let reconnecting clients resume their previous session instead of
+     * going through a full handshake, either from our cache or from
+     * a ticket they hold. */
+    static const unsigned char session_id_context[] = "xmp3";
+    check(SSL_CTX_set_session_id_context(server->ssl_context,
+                session_id_context, sizeof(session_id_context) - 1) == 1,
+            "Cannot set SSL session id context.");
+    SSL_CTX_set_timeout(server->ssl_context,
+                        xmp3_options_get_ssl_session_timeout(options));
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* Mobile clients often just drop the connection.  Treat that like
+     * a clean shutdown, otherwise OpenSSL throws their session away and the
+     * reconnect needs a full handshake.  XMPP streams have their own framing,
+     * so truncation is not a concern. */
+    SSL_CTX_set_options(server->ssl_context, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    long cache_size = xmp3_options_get_ssl_session_cache(options);
+    if (cache_size > 0) {
+        SSL_CTX_set_session_cache_mode(server->ssl_context,
+                                       SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(server->ssl_context, cache_size);
+    } else {
+        SSL_CTX_set_session_cache_mode(server->ssl_context,
+                                       SSL_SESS_CACHE_OFF);
+    }
+
+    if (xmp3_options_get_ssl_tickets(options)) {
+        server->tickets = tls_tickets_new(server->ssl_context, server->loop,
+                xmp3_options_get_ssl_ticket_rotation(options));
+        check(server->tickets != NULL, "Cannot set up session tickets.");
+    } else {
+        SSL_CTX_set_options(server->ssl_context, SSL_OP_NO_TICKET);
+    }
     return true;
 
 error:
@@ -696,93 +2040,1217 @@ error:
 }
 
 /**
- * Callback for new client connections.
+ * Sets up io_uring to batch the I/O of plain (non-TLS) client sockets.
  *
- * Handles accepting the connection, and setting up XMPP stream parsing.
+ * Reads are queued up as sockets become readable, and submitted together by
+ * a check watcher that runs just before the flush (which batches writes the
+ * same way).  Accepts are batched too.  TLS sockets can't take part, OpenSSL
+ * does their reads and writes itself.
  */
-static void connect_client(struct ev_loop *loop, struct ev_io *w,
-                           int revents) {
-    struct xmpp_server *server = (struct xmpp_server*)w->data;
-    struct client_socket *socket = NULL;
-    struct xmpp_client *client = NULL;
-    struct c_client *connected_client = NULL;
-
-    struct sockaddr_in caddr;
-    socklen_t caddrlen = sizeof(caddr);
-
-    int client_fd = accept(w->fd, (struct sockaddr*)&caddr, &caddrlen);
-    check(client_fd != -1, "Error accepting new client connection");
+static bool init_uring(struct xmpp_server *server,
+                       const struct xmp3_options *options) {
+    server->ring = xmp3_uring_new(xmp3_options_get_io_uring_entries(options));
+    if (server->ring == NULL) {
+        return false;
+    }
 
-    socket = client_socket_new(client_fd, caddr);
-    client = xmpp_client_new(server, socket);
+    /* The kernel may have given us a smaller ring than we asked for. */
+    int entries = xmp3_uring_space(server->ring);
+    server->accept_batch = server->accept_budget < entries
+                           ? server->accept_budget : entries;
+    server->accept_slots = calloc(server->accept_batch,
+                                  sizeof(*server->accept_slots));
+    check_mem(server->accept_slots);
+    server->ring_accept = true;
+
+    /* Just ahead of the flush, so whatever the reads produce goes out in the
+     * same loop iteration. */
+    ev_check_init(&server->ring_reads, read_batched);
+    ev_set_priority(&server->ring_reads, EV_MINPRI + 1);
+    server->ring_reads.data = server;
+    ev_check_start(server->loop, &server->ring_reads);
+    ev_unref(server->loop);
+
+    log_info("Batching socket I/O through io_uring (%d entries)", entries);
+    return true;
+}
 
-    connected_client = calloc(1, sizeof(*connected_client));
-    check_mem(connected_client);
+/** Stops using io_uring, everything goes back to plain socket calls. */
+static void stop_uring(struct xmpp_server *server) {
+    if (ev_is_active(&server->ring_reads)) {
+        ev_ref(server->loop);
+        ev_check_stop(server->loop, &server->ring_reads);
+    }
+    xmp3_uring_del(server->ring);
+    server->ring = NULL;
+    free(server->accept_slots);
+    server->accept_slots = NULL;
+}
 
-    ev_io_init(&connected_client->fd_readable, read_client, client_fd, EV_READ);
-    connected_client->fd_readable.data = client;
-    ev_io_start(server->loop, &connected_client->fd_readable);
+/**
+ * Submits everything queued on the ring in one system call.
+ *
+ * If that fails the ring is given up on, and the caller should carry on with
+ * plain socket calls.
+ */
+static bool submit_ring(struct xmpp_server *server) {
+    int count = xmp3_uring_submit(server->ring);
+    if (count == -1) {
+        log_err("io_uring failed, going back to plain socket calls.");
+        stop_uring(server);
+        return false;
+    }
+    __atomic_fetch_add(&server->stats.uring_submits, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&server->stats.uring_ops, count, __ATOMIC_RELAXED);
+    return true;
+}
 
-    log_info("New connection from %s:%d", inet_ntoa(caddr.sin_addr),
-             caddr.sin_port);
+/**
+ * Callback for new client connections.
+ *
+ * Accepts connections until the kernel's queue is empty, or until the accept
+ * budget for this event runs out (in which case the level-triggered watcher
+ * brings us back on the next loop iteration, after other clients got a turn).
+ */
+static void connect_client(struct ev_loop *loop, struct ev_io *w,
+                           int revents) {
+    struct xmpp_server *server = (struct xmpp_server*)w->data;
 
-    DL_APPEND(server->clients, connected_client);
-    return;
+    int waiting = sample_accept_queue(server, w->fd);
 
-error:
-    if (connected_client) {
-        free(connected_client);
-    }
-    if (client) {
-        xmpp_client_del(client);
-    }
-    if (socket) {
-        client_socket_del(socket);
+    if (server->ring != NULL && server->ring_accept) {
+        accept_batched(server, w->fd, waiting);
+        return;
     }
-    if (client_fd != -1) {
-        close(client_fd);
+
+    for (int i = 0; i < server->accept_budget; i++) {
+        struct sockaddr_in caddr;
+        socklen_t caddrlen = sizeof(caddr);
+
+        /* Writes to clients are queued and drained by the event loop, so
+         * a slow client must never be able to block the server. */
+        int client_fd = accept4(w->fd, (struct sockaddr*)&caddr, &caddrlen,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd != -1) {
+            accept_client(server, client_fd, caddr);
+        } else if (!accept_failed(server, errno)) {
+            return;
+        }
     }
+
+    debug("Accept budget exhausted, yielding to other events.");
+    __atomic_fetch_add(&server->stats.budget_exhausted, 1, __ATOMIC_RELAXED);
 }
 
 /**
- * Callback for new data from a client.
+ * Accepts new connections through io_uring.
  *
- * Handles feeding the data to the XML parser.
+ * Each submission asks for as many connections as the kernel said were
+ * waiting (at least one), within the accept budget.
  */
-static void read_client(struct ev_loop *loop, struct ev_io *w, int revents) {
-    struct xmpp_client *client = (struct xmpp_client*)w->data;
-    struct xmpp_server *server = xmpp_client_server(client);
+static void accept_batched(struct xmpp_server *server, int fd, int waiting) {
+    int budget = server->accept_budget;
 
-    ssize_t numrecv = client_socket_recv(xmpp_client_socket(client),
-                                         server->buffer, server->buffer_size);
-
-    if (numrecv == 0 || numrecv == -1) {
-        char *addrstr = client_socket_addr_str(xmpp_client_socket(client));
-        switch (numrecv) {
-            case 0:
-                log_info("%s disconnected", addrstr);
-                break;
-            case -1:
-                log_err("Error reading from %s %s", addrstr, strerror(errno));
-                break;
+    while (budget > 0) {
+        int batch = waiting > 1 ? waiting : 1;
+        if (batch > budget) {
+            batch = budget;
+        }
+        if (batch > server->accept_batch) {
+            batch = server->accept_batch;
+        }
+
+        for (int i = 0; i < batch; i++) {
+            struct accept_slot *slot = &server->accept_slots[i];
+            slot->addrlen = sizeof(slot->addr);
+            xmp3_uring_accept(server->ring, fd, (struct sockaddr*)&slot->addr,
+                              &slot->addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC,
+                              slot);
+        }
+        if (!submit_ring(server)) {
+            /* The watcher is level-triggered, the plain accept path picks up
+             * from here. */
+            return;
+        }
+
+        void *data;
+        int result;
+        while (xmp3_uring_next(server->ring, &data, &result)) {
+            ((struct accept_slot*)data)->result = result;
+        }
+
+        /* Every slot has to be looked at, even once one found the queue
+         * empty, as the others may have gotten a connection. */
+        bool more = true;
+        for (int i = 0; i < batch; i++) {
+            struct accept_slot *slot = &server->accept_slots[i];
+            if (slot->result >= 0) {
+                accept_client(server, slot->result, slot->addr);
+            } else if (slot->result == -EINVAL) {
+                /* Kernels before Linux 6.10 can't accept without blocking. */
+                log_info("Not batching accepts, io_uring would block.");
+                server->ring_accept = false;
+                more = false;
+            } else if (!accept_failed(server, -slot->result)) {
+                more = false;
+            }
+        }
+        if (!more) {
+            return;
+        }
+
+        budget -= batch;
+        waiting = batch * 2;
+    }
+
+    debug("Accept budget exhausted, yielding to other events.");
+    __atomic_fetch_add(&server->stats.budget_exhausted, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Deals with a failed accept.
+ *
+ * @param error The errno value the accept failed with.
+ * @returns true if there may be more connections to accept right now.
+ */
+static bool accept_failed(struct xmpp_server *server, int error) {
+    errno = error;
+    switch (error) {
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+            return false;
+
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+            /* The connection went away before we got to it. */
+            return true;
+
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            /* Nothing we accept now could be serviced anyway.  Stop
+             * listening for a moment instead of spinning on a readable
+             * socket we can't accept from. */
+            log_err("Unable to accept new clients, pausing.");
+            __atomic_fetch_add(&server->stats.accept_errors, 1,
+                               __ATOMIC_RELAXED);
+            if (!ev_is_active(&server->accept_pause)) {
+                ev_io_stop(server->loop, &server->fd_readable);
+                ev_timer_set(&server->accept_pause, 1., 0.);
+                ev_timer_start(server->loop, &server->accept_pause);
+            }
+            return false;
+
+        default:
+            log_err("Error accepting new client connection");
+            __atomic_fetch_add(&server->stats.accept_errors, 1,
+                               __ATOMIC_RELAXED);
+            return false;
+    }
+}
+
+/** Sets up XMPP stream parsing for a newly accepted connection. */
+static void accept_client(struct xmpp_server *server, int client_fd,
+                          struct sockaddr_in caddr) {
+    struct client_socket *socket = NULL;
+    struct xmpp_client *client = NULL;
+
+    int sessions = __atomic_add_fetch(server->sessions, 1, __ATOMIC_RELAXED);
+    if (server->max_clients > 0 && sessions > server->max_clients) {
+        __atomic_fetch_sub(server->sessions, 1, __ATOMIC_RELAXED);
+        reject_client(server, client_fd, caddr);
+        return;
+    }
+    if (server->sessions != &server->num_clients) {
+        __atomic_fetch_add(&server->num_clients, 1, __ATOMIC_RELAXED);
+    }
+
+    /* Output is coalesced by corking instead (see flush_clients()). */
+    int nodelay = 1;
+    if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                   sizeof(nodelay)) == -1) {
+        log_warn("Unable to set TCP_NODELAY on client socket");
+    }
+
+    socket = client_socket_new(client_fd, caddr);
+    client = xmpp_client_new(server, socket);
+    check(client != NULL, "Unable to create new client.");
+
+    log_info("New connection from %s:%d", inet_ntoa(caddr.sin_addr),
+             caddr.sin_port);
+
+    add_client(server, client, client_fd);
+    __atomic_fetch_add(&server->stats.accepted, 1, __ATOMIC_RELAXED);
+    return;
+
+error:
+    __atomic_fetch_sub(&server->num_clients, 1, __ATOMIC_RELAXED);
+    if (server->sessions != &server->num_clients) {
+        __atomic_fetch_sub(server->sessions, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&server->stats.accept_errors, 1, __ATOMIC_RELAXED);
+    if (client) {
+        /* Also closes and frees the socket. */
+        xmpp_client_del(client);
+    } else {
+        if (socket) {
+            client_socket_del(socket);
+        }
+        close(client_fd);
+    }
+}
+
+/** Sets up the server's bookkeeping and event watchers for a new client. */
+static struct c_client* add_client(struct xmpp_server *server,
+                                   struct xmpp_client *client, int fd) {
+    struct c_client *conn = calloc(1, sizeof(*conn));
+    check_mem(conn);
+    conn->read_size = server->min_read_size;
+    conn->last_read = ev_now(server->loop);
+    conn->last_write = conn->last_read;
+    conn->ping_rtt = -1;
+
+    ev_io_init(&conn->fd_readable, read_client, fd, EV_READ);
+    conn->fd_readable.data = client;
+    ev_io_start(server->loop, &conn->fd_readable);
+
+    ev_io_init(&conn->fd_writable, write_client, fd, EV_WRITE);
+    conn->fd_writable.data = client;
+    xmpp_client_set_conn(client, conn);
+
+    if (server->timers != NULL) {
+        conn->timer = timer_wheel_timer_new(server->timers, check_client,
+                                            conn);
+        check_client(conn->timer, conn);
+    }
+
+    DL_APPEND(server->clients, conn);
+    return conn;
+}
+
+/** Undoes add_client(), leaving the client object itself alone. */
+static void remove_client(struct xmpp_server *server, struct c_client *conn) {
+    conn->closing = true;
+    xmpp_client_unroute(conn->fd_readable.data);
+    DL_DELETE(server->clients, conn);
+    ev_io_stop(server->loop, &conn->fd_readable);
+    ev_io_stop(server->loop, &conn->fd_writable);
+    if (conn->read_backlogged) {
+        server->num_backlogged--;
+    }
+    if (conn->flush_scheduled) {
+        struct c_client **link = &server->flush_list;
+        while (*link != conn) {
+            link = &(*link)->flush_next;
+        }
+        *link = conn->flush_next;
+    }
+    if (conn->reap_scheduled) {
+        struct c_client **link = &server->reap_list;
+        while (*link != conn) {
+            link = &(*link)->reap_next;
+        }
+        *link = conn->reap_next;
+    }
+    if (conn->read_scheduled
+            && !unlink_read(&server->read_list, conn)) {
+        unlink_read(&server->read_batch, conn);
+    }
+    if (conn->hibernating) {
+        __atomic_fetch_sub(&server->num_hibernating, 1, __ATOMIC_RELAXED);
+    }
+    if (conn->timer) {
+        timer_wheel_timer_del(conn->timer);
+    }
+    resume_sources(server, conn);
+    xmpp_server_forget_source(server, &conn->fd_readable);
+    release_held(conn, false);
+    __atomic_fetch_sub(&server->num_clients, 1, __ATOMIC_RELAXED);
+    if (server->sessions != &server->num_clients) {
+        __atomic_fetch_sub(server->sessions, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Turns away a client when the server is full.
+ *
+ * RFC6120 Section 4.9.1.2, the server opens a stream, then sends
+ * a <resource-constraint/> stream error and closes it again.  This is only
+ * best effort, if the socket can't take it right away the client just sees
+ * the connection close.
+ */
+static void reject_client(struct xmpp_server *server, int client_fd,
+                          struct sockaddr_in caddr) {
+    static const char MSG_REJECT[] =
+        "<?xml version='1.0'?>"
+        "<stream:stream xmlns='jabber:client'"
+        " xmlns:stream='http://etherx.jabber.org/streams' version='1.0'>"
+        "<stream:error>"
+        "<resource-constraint xmlns='urn:ietf:params:xml:ns:xmpp-streams'/>"
+        "</stream:error>"
+        "</stream:stream>";
+
+    log_warn("Server full, rejecting connection from %s:%d",
+             inet_ntoa(caddr.sin_addr), caddr.sin_port);
+    __atomic_fetch_add(&server->stats.rejected, 1, __ATOMIC_RELAXED);
+
+    if (send(client_fd, MSG_REJECT, sizeof(MSG_REJECT) - 1,
+             MSG_NOSIGNAL) == -1) {
+        debug("Unable to send rejection: %s", strerror(errno));
+    }
+    shutdown(client_fd, SHUT_RDWR);
+    close(client_fd);
+}
+
+/**
+ * Keeps track of how full the kernel's accept queue is.
+ *
+ * For a listening socket, TCP_INFO reports the current length of the accept
+ * queue (tcpi_unacked) and its limit (tcpi_sacked).  If it is full, the
+ * kernel is dropping connection attempts.
+ *
+ * @returns The number of connections waiting, 0 if unknown.
+ */
+static int sample_accept_queue(struct xmpp_server *server, int fd) {
+#ifdef TCP_INFO
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+        return 0;
+    }
+
+    if (info.tcpi_unacked > server->stats.queue_peak) {
+        __atomic_store_n(&server->stats.queue_peak, info.tcpi_unacked,
+                         __ATOMIC_RELAXED);
+    }
+    if (info.tcpi_sacked > 0 && info.tcpi_unacked >= info.tcpi_sacked) {
+        log_warn("Accept queue overflowing (%u connections waiting)",
+                 info.tcpi_unacked);
+        __atomic_fetch_add(&server->stats.queue_full, 1, __ATOMIC_RELAXED);
+    }
+    return info.tcpi_unacked;
+#else
+    return 0;
+#endif
+}
+
+/** Starts accepting new clients again after running out of resources. */
+static void resume_accept(struct ev_loop *loop, struct ev_timer *w,
+                          int revents) {
+    struct xmpp_server *server = (struct xmpp_server*)w->data;
+    log_info("Resuming accepting new clients.");
+    ev_io_start(loop, &server->fd_readable);
+}
+
+/** Timer callback that moves the timer wheel up to the current second. */
+static void advance_timers(struct ev_loop *loop, struct ev_timer *w,
+                           int revents) {
+    struct xmpp_server *server = (struct xmpp_server*)w->data;
+    timer_wheel_advance(server->timers,
+                        (unsigned long)(ev_now(loop) - server->timers_start));
+
+    /* When a link goes down, every client behind it times out at once. */
+    if (server->reap_list == NULL) {
+        return;
+    }
+    int num_reaped = 0;
+    struct c_client *conn;
+    for (conn = server->reap_list; conn != NULL; conn = conn->reap_next) {
+        num_reaped++;
+    }
+    struct xmpp_client **reaped = malloc(num_reaped * sizeof(*reaped));
+    check_mem(reaped);
+    int i = 0;
+    while ((conn = server->reap_list) != NULL) {
+        server->reap_list = conn->reap_next;
+        conn->reap_scheduled = false;
+        reaped[i++] = conn->fd_readable.data;
+    }
+    xmpp_server_disconnect_clients(server, reaped, num_reaped);
+    free(reaped);
+}
+
+/** Keeps track of the soonest of a client's deadlines. */
+static void next_deadline(ev_tstamp *next, ev_tstamp deadline) {
+    if (*next == 0 || deadline < *next) {
+        *next = deadline;
+    }
+}
+
+/**
+ * Timer wheel callback that deals with whichever of a client's timeouts are
+ * due, and starts the timer again for the next one.
+ *
+ * Reads and writes only note the time, so the timer itself is never touched
+ * on the fast path.  When it fires early because of that, it just works out
+ * the new deadline.
+ */
+static void check_client(struct timer_wheel_timer *timer, void *data) {
+    struct c_client *conn = data;
+    struct xmpp_client *client = conn->fd_readable.data;
+    struct xmpp_server *server = xmpp_client_server(client);
+    ev_tstamp now = ev_now(server->loop);
+    ev_tstamp next = 0;
+
+    /* Once a ping is out, anything at all from the client will do. */
+    bool awaiting_ping = conn->ping_pending
+                         && conn->last_read <= conn->ping_sent;
+
+    if ((server->idle_timeout > 0
+                && now - conn->last_read >= server->idle_timeout)
+            || (awaiting_ping && server->ping_interval > 0
+                && now - conn->ping_sent >= server->ping_interval)) {
+        char *addrstr = client_socket_addr_str(xmpp_client_socket(client));
+        log_info("%s silent for %.0fs, disconnecting", addrstr,
+                 now - conn->last_read);
+        free(addrstr);
+        __atomic_fetch_add(&server->stats.idle_reaped, 1, __ATOMIC_RELAXED);
+
+        /* Disconnected along with any others once all the timers have run,
+         * see advance_timers(). */
+        conn->reap_next = server->reap_list;
+        server->reap_list = conn;
+        conn->reap_scheduled = true;
+        return;
+    }
+    if (server->idle_timeout > 0) {
+        next_deadline(&next, conn->last_read + server->idle_timeout);
+    }
+
+    /* Pings and keepalives need an established stream to go in. */
+    bool bound = xmpp_client_jid(client) != NULL;
+    if (server->ping_interval > 0 && !bound) {
+        next_deadline(&next, now + server->ping_interval);
+    } else if (server->ping_interval > 0) {
+        if (awaiting_ping) {
+            next_deadline(&next, conn->ping_sent + server->ping_interval);
+        } else if (now - conn->last_read >= server->ping_interval) {
+            ping_client(server, conn);
+            next_deadline(&next, conn->ping_sent + server->ping_interval);
+        } else {
+            next_deadline(&next, conn->last_read + server->ping_interval);
+        }
+    }
+
+    if (server->keepalive_interval > 0 && !bound) {
+        next_deadline(&next, now + server->keepalive_interval);
+    } else if (server->keepalive_interval > 0) {
+        if (now - conn->last_write >= server->keepalive_interval) {
+            xmpp_client_send(client, " ", 1);
+            __atomic_fetch_add(&server->stats.keepalives_sent, 1,
+                               __ATOMIC_RELAXED);
+        }
+        next_deadline(&next, conn->last_write + server->keepalive_interval);
+    }
+
+    if (server->hibernate_timeout > 0) {
+        ev_tstamp since = conn->last_read > conn->hibernate_tried
+                          ? conn->last_read : conn->hibernate_tried;
+        if (now - since >= server->hibernate_timeout) {
+            hibernate_client(server, conn);
+        }
+        /* Hibernating again later trims output queued in the meantime. */
+        since = conn->last_read > conn->hibernate_tried
+                ? conn->last_read : conn->hibernate_tried;
+        next_deadline(&next, (conn->hibernating ? now : since)
+                             + server->hibernate_timeout);
+    }
+
+    if (next > 0) {
+        timer_wheel_start(timer, (unsigned long)ceil(next - now));
+    }
+}
+
+/**
+ * Frees an idle client's parser and buffers, or notes that it was busy so
+ * it's tried again a timeout later.
+ */
+static void hibernate_client(struct xmpp_server *server, struct c_client *conn) {
+    /* Scheduled reads and the backlog hold on to the parser's buffer. */
+    if (conn->read_scheduled || conn->read_backlogged
+            || !xmpp_client_hibernate(conn->fd_readable.data)) {
+        conn->hibernate_tried = ev_now(server->loop);
+        return;
+    }
+    if (!conn->hibernating) {
+        conn->hibernating = true;
+        conn->read_size = server->min_read_size;
+        __atomic_fetch_add(&server->num_hibernating, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&server->stats.hibernations, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/** Sends a client a ping (XEP-0199), to see if it's still there. */
+static void ping_client(struct xmpp_server *server, struct c_client *conn) {
+    struct xmpp_client *client = conn->fd_readable.data;
+    char id[32];
+    conn->ping_id = ++server->last_ping_id;
+    snprintf(id, sizeof(id), "xmp3-ping-%lu", conn->ping_id);
+    char *from = jid_to_str(server->jid);
+    char *to = jid_to_str(xmpp_client_jid(client));
+
+    struct xmpp_stanza *ping = xmpp_stanza_new("iq", (const char*[]){
+            XMPP_STANZA_ATTR_ID, id,
+            XMPP_STANZA_ATTR_FROM, from,
+            XMPP_STANZA_ATTR_TO, to,
+            XMPP_STANZA_ATTR_TYPE, XMPP_STANZA_TYPE_GET,
+            NULL});
+    xmpp_stanza_append_child(ping, xmpp_stanza_new("ping", (const char*[]){
+            "xmlns", XMPP_IQ_PING_NS,
+            NULL}));
+
+    size_t len;
+    char *data = xmpp_stanza_string(ping, &len, true);
+    xmpp_client_send(client, data, len);
+    free(data);
+    xmpp_stanza_del(ping, true);
+    free(from);
+    free(to);
+
+    conn->ping_pending = true;
+    conn->ping_sent = ev_now(server->loop);
+    __atomic_fetch_add(&server->stats.pings_sent, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Callback for new data from a client.
+ *
+ * Keeps reading straight into the client's XML parser until the socket is
+ * drained, or the client has used up its read budget for this round.  In
+ * that case it's picked up again once the loop has nothing else to do.
+ */
+static void read_client(struct ev_loop *loop, struct ev_io *w, int revents) {
+    struct xmpp_client *client = (struct xmpp_client*)w->data;
+    struct xmpp_server *server = xmpp_client_server(client);
+    struct c_client *conn = xmpp_client_conn(client);
+    struct client_socket *socket = xmpp_client_socket(client);
+    struct xmpp_parser *parser = xmpp_client_parser(client);
+
+    /* With io_uring, plain sockets are read together with everyone else's
+     * once this loop iteration's other callbacks have run. */
+    if (server->ring != NULL && !xmpp_client_tls(client)) {
+        schedule_read(server, conn, true);
+        return;
+    }
+
+    size_t total = 0;
+    unsigned long first_stanza = xmpp_parser_stanzas(parser);
+
+    while (true) {
+        /* Also covers a STARTTLS handled by the previous read. */
+        if (client_socket_handshaking(socket)) {
+            handshake_client(client);
+            return;
+        }
+
+        if (!read_budget_left(server, conn, total, first_stanza)) {
+            return;
+        }
+
+        char *buffer = xmpp_parser_buffer(parser, conn->read_size);
+        check(buffer != NULL, "Unable to allocate parser buffer.");
+
+        ssize_t numrecv = client_socket_recv(socket, buffer, conn->read_size);
+        if (numrecv == -1 && errno == EINTR) {
+            continue;
+        } else if (numrecv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* Drained, or TLS needs more data for a full record. */
+            return;
+        } else if (numrecv == 0 || numrecv == -1) {
+            char *addrstr = client_socket_addr_str(socket);
+            if (numrecv == 0) {
+                log_info("%s disconnected", addrstr);
+            } else {
+                log_err("Error reading from %s %s", addrstr, strerror(errno));
+            }
+            free(addrstr);
+            goto error;
+        }
+
+        total += numrecv;
+        if (!handle_read(server, conn, buffer, numrecv)) {
+            goto error;
+        }
+
+        /* Paused, a client it sent to is backed up. */
+        if (!ev_is_active(w)) {
+            return;
+        }
+    }
+
+error:
+    xmpp_server_disconnect_client(client);
+}
+
+/**
+ * Checks whether a client can be read from some more this round.
+ *
+ * If not, it's put on the backlog to be picked up again once the loop has
+ * nothing else to do.
+ *
+ * @param total        Bytes read from the client so far this round.
+ * @param first_stanza The client's stanza count at the start of the round.
+ */
+static bool read_budget_left(struct xmpp_server *server, struct c_client *conn,
+                             size_t total, unsigned long first_stanza) {
+    struct xmpp_parser *parser = xmpp_client_parser(conn->fd_readable.data);
+    if (total < server->read_budget
+            && xmpp_parser_stanzas(parser) - first_stanza
+                < server->read_stanza_budget) {
+        return true;
+    }
+
+    __atomic_fetch_add(&server->stats.read_budget_exhausted, 1,
+                       __ATOMIC_RELAXED);
+    /* For a plain socket the watcher would fire again anyway, but TLS may
+     * already have the rest of the data buffered. */
+    if (!conn->read_backlogged) {
+        conn->read_backlogged = true;
+        server->num_backlogged++;
+        ev_idle_start(server->loop, &server->read_backlog);
+    }
+    return false;
+}
+
+/**
+ * Hands data just read from a client's socket (into its parser's buffer)
+ * over to the parser.
+ *
+ * @returns false if the data couldn't be parsed (a client that went over one
+ *          of the parser's limits is sent a <policy-violation/> first).
+ */
+static bool handle_read(struct xmpp_server *server, struct c_client *conn,
+                        const char *buffer, size_t numrecv) {
+    static const char MSG_POLICY_VIOLATION[] =
+        "<stream:error>"
+        "<policy-violation xmlns='urn:ietf:params:xml:ns:xmpp-streams'/>"
+        "</stream:error>"
+        "</stream:stream>";
+
+    struct xmpp_client *client = conn->fd_readable.data;
+    struct xmpp_parser *parser = xmpp_client_parser(client);
+
+#ifndef NDEBUG
+    char *addrstr = client_socket_addr_str(xmpp_client_socket(client));
+    /* On android, %zd is only for size_t, so do an explicit cast. */
+    debug("%s - Read %zd bytes", addrstr, (size_t)numrecv);
+    debug("%s: %.*s", addrstr, (int)numrecv, buffer);
+    free(addrstr);
+#endif
+
+    adapt_read_size(server, conn, numrecv);
+
+    /* Getting the parser's buffer woke it up if it was hibernating. */
+    conn->last_read = ev_now(server->loop);
+    if (conn->hibernating) {
+        conn->hibernating = false;
+        __atomic_fetch_sub(&server->num_hibernating, 1, __ATOMIC_RELAXED);
+    }
+
+    /* Whoever this client sends to can push back on it. */
+    server->source = &conn->fd_readable;
+    bool parsed = xmpp_parser_parse_buffer(parser, numrecv);
+    server->source = NULL;
+    if (!parsed && xmpp_parser_over_limit(parser)) {
+        /* RFC6120 Section 4.9.3.14, best effort like any other write. */
+        xmpp_client_send(client, MSG_POLICY_VIOLATION,
+                         sizeof(MSG_POLICY_VIOLATION) - 1);
+    }
+    check(parsed, "Error parsing XML: %s", xmpp_parser_strerror(parser));
+    return true;
+
+error:
+    return false;
+}
+
+/**
+ * Grows a client's read size while its reads keep filling the buffer, and
+ * shrinks it again when they come back mostly empty.
+ */
+static void adapt_read_size(struct xmpp_server *server, struct c_client *conn,
+                            size_t numrecv) {
+    if (numrecv == conn->read_size && conn->read_size < server->max_read_size) {
+        conn->read_size *= 2;
+        if (conn->read_size > server->max_read_size) {
+            conn->read_size = server->max_read_size;
+        }
+    } else if (numrecv < conn->read_size / 4
+               && conn->read_size > server->min_read_size) {
+        conn->read_size /= 2;
+        if (conn->read_size < server->min_read_size) {
+            conn->read_size = server->min_read_size;
+        }
+    }
+}
+
+/**
+ * Idle callback that gives clients whose read budget ran out another turn.
+ *
+ * Only runs once no other events are pending, so a busy client can't starve
+ * the others.
+ */
+static void read_backlogged(struct ev_loop *loop, struct ev_idle *w,
+                            int revents) {
+    struct xmpp_server *server = (struct xmpp_server*)w->data;
+
+    struct c_client *conn, *tmp;
+    DL_FOREACH_SAFE(server->clients, conn, tmp) {
+        if (!conn->read_backlogged) {
+            continue;
+        }
+        conn->read_backlogged = false;
+        server->num_backlogged--;
+        /* Resuming it gives it another turn. */
+        if (!ev_is_active(&conn->fd_readable)) {
+            continue;
+        }
+        /* This may put the client straight back on the backlog. */
+        read_client(loop, &conn->fd_readable, EV_READ);
+    }
+
+    if (server->num_backlogged == 0) {
+        ev_idle_stop(loop, w);
+    }
+}
+
+/**
+ * Puts a client on the list to be read from in the next batch.
+ *
+ * @param first Whether this starts a new round for the client (its socket
+ *              just became readable), which resets its read budget.
+ */
+static void schedule_read(struct xmpp_server *server, struct c_client *conn,
+                          bool first) {
+    if (conn->read_scheduled) {
+        return;
+    }
+    if (first) {
+        conn->read_total = 0;
+        conn->read_first_stanza = xmpp_parser_stanzas(
+                xmpp_client_parser(conn->fd_readable.data));
+    }
+    conn->read_scheduled = true;
+    conn->read_next = server->read_list;
+    server->read_list = conn;
+}
+
+/**
+ * Check callback that reads from every client whose socket became readable
+ * during this loop iteration.
+ *
+ * There is one recv per client in each submission.  A client whose read
+ * filled its buffer probably has more waiting, so it goes around again
+ * (within its read budget).  Otherwise its socket is taken to be drained, the
+ * level-triggered watcher tells us if it wasn't.
+ */
+static void read_batched(struct ev_loop *loop, struct ev_check *w,
+                         int revents) {
+    struct xmpp_server *server = (struct xmpp_server*)w->data;
+
+    while (server->read_list != NULL) {
+        while (server->read_list != NULL
+                && xmp3_uring_space(server->ring) > 0) {
+            struct c_client *conn = server->read_list;
+            struct xmpp_client *client = conn->fd_readable.data;
+            server->read_list = conn->read_next;
+            conn->read_next = server->read_batch;
+            server->read_batch = conn;
+
+            conn->read_len = conn->read_size;
+            conn->read_buf = xmpp_parser_buffer(xmpp_client_parser(client),
+                                                conn->read_len);
+            if (conn->read_buf == NULL) {
+                conn->read_result = -ENOMEM;
+                continue;
+            }
+            xmp3_uring_recv(server->ring,
+                            client_socket_fd(xmpp_client_socket(client)),
+                            conn->read_buf, conn->read_len, conn);
+        }
+
+        if (!submit_ring(server)) {
+            /* Read whoever is left the usual way. */
+            struct c_client *conn;
+            while ((conn = server->read_batch) != NULL
+                    || (conn = server->read_list) != NULL) {
+                unlink_read(conn == server->read_batch ? &server->read_batch
+                                                       : &server->read_list,
+                            conn);
+                conn->read_scheduled = false;
+                read_client(loop, &conn->fd_readable, EV_READ);
+            }
+            return;
+        }
+
+        void *data;
+        int result;
+        while (xmp3_uring_next(server->ring, &data, &result)) {
+            ((struct c_client*)data)->read_result = result;
+        }
+
+        /* Handling one client's data may disconnect others in the batch, so
+         * always take from the head. */
+        struct c_client *conn;
+        while ((conn = server->read_batch) != NULL) {
+            server->read_batch = conn->read_next;
+            conn->read_scheduled = false;
+            finish_read(server, conn);
+        }
+    }
+}
+
+/** Handles the result of a client's batched read. */
+static void finish_read(struct xmpp_server *server, struct c_client *conn) {
+    struct xmpp_client *client = conn->fd_readable.data;
+    int numrecv = conn->read_result;
+
+    if (numrecv == -EAGAIN || numrecv == -EWOULDBLOCK) {
+        return;
+    } else if (numrecv == -EINTR) {
+        schedule_read(server, conn, false);
+        return;
+    } else if (numrecv <= 0) {
+        char *addrstr = client_socket_addr_str(xmpp_client_socket(client));
+        if (numrecv == 0) {
+            log_info("%s disconnected", addrstr);
+        } else {
+            errno = -numrecv;
+            log_err("Error reading from %s %s", addrstr, strerror(errno));
         }
         free(addrstr);
         goto error;
     }
 
-    char *addrstr = client_socket_addr_str(xmpp_client_socket(client));
-    /* On android, %zd is only for size_t, so do an explicit cast. */
-    debug("%s - Read %zd bytes", addrstr, (size_t)numrecv);
-    debug("%s: %.*s", addrstr, (int)numrecv, server->buffer);
-    free(addrstr);
+    conn->read_total += numrecv;
+    if (!handle_read(server, conn, conn->read_buf, numrecv)) {
+        goto error;
+    }
+
+    /* If the client just asked for STARTTLS, the rest is for the handshake,
+     * which the read watcher takes care of. */
+    if ((size_t)numrecv == conn->read_len && !xmpp_client_tls(client)
+            && ev_is_active(&conn->fd_readable)
+            && read_budget_left(server, conn, conn->read_total,
+                                conn->read_first_stanza)) {
+        schedule_read(server, conn, false);
+    }
+    return;
+
+error:
+    xmpp_server_disconnect_client(client);
+}
+
+/**
+ * Callback for when a client with queued output can be written to again.
+ *
+ * Drains as much of the queue as the socket takes, and stops watching once
+ * everything has been written.
+ */
+static void write_client(struct ev_loop *loop, struct ev_io *w, int revents) {
+    struct xmpp_client *client = (struct xmpp_client*)w->data;
+
+    /* Let the flush write it out with everyone else's. */
+    if (xmpp_server_batches_io(xmpp_client_server(client))
+            && !xmpp_client_tls(client)) {
+        ev_io_stop(loop, w);
+        xmpp_server_schedule_flush(client);
+        return;
+    }
+
+    if (client_socket_handshaking(xmpp_client_socket(client))) {
+        handshake_client(client);
+        return;
+    }
+
+    ssize_t pending = xmpp_client_flush(client);
+    if (pending == -1) {
+        xmpp_server_disconnect_client(client);
+        return;
+    } else if (pending == 0) {
+        ev_io_stop(loop, w);
+    }
+    check_drained(xmpp_client_server(client), xmpp_client_conn(client),
+                  pending);
+}
+
+/** Start draining a client's outbound queue once its socket is writable. */
+static void watch_writable(struct xmpp_server *server, struct c_client *conn) {
+    if (!ev_is_active(&conn->fd_writable)) {
+        ev_io_start(server->loop, &conn->fd_writable);
+    }
+}
+
+/**
+ * Callback run once per loop iteration to write out client output.
+ *
+ * Every client written to since the last run gets its queue flushed in one
+ * go and its socket uncorked, which pushes out any partial segment.
+ */
+static void flush_clients(struct ev_loop *loop, struct ev_check *w,
+                          int revents) {
+    struct xmpp_server *server = (struct xmpp_server*)w->data;
+
+    /* This leaves nothing (or only what the sockets wouldn't take) for the
+     * loop below to write. */
+    if (server->ring != NULL) {
+        send_batched(server);
+    }
+
+    /* Always take from the head, flushing one client may disconnect another
+     * or schedule more output. */
+    struct c_client *conn;
+    while ((conn = server->flush_list) != NULL) {
+        server->flush_list = conn->flush_next;
+        conn->flush_scheduled = false;
+
+        struct xmpp_client *client = conn->fd_readable.data;
+        ssize_t pending = xmpp_client_flush(client);
+        if (pending == -1) {
+            xmpp_server_disconnect_client(client);
+            continue;
+        }
+        if (conn->corked) {
+            cork_client(client, false);
+        }
+        if (pending > 0) {
+            watch_writable(server, conn);
+        }
+        check_drained(server, conn, pending);
+    }
+}
+
+/**
+ * Writes out the queues of the plain clients on the flush list through
+ * io_uring, in as few submissions as the ring allows.
+ *
+ * Nobody is disconnected here, flush_clients() finds any failures.
+ */
+static void send_batched(struct xmpp_server *server) {
+    struct c_client *conn = server->flush_list;
+    while (conn != NULL) {
+        int queued = 0;
+        for (; conn != NULL && xmp3_uring_space(server->ring) > 0;
+                conn = conn->flush_next) {
+            struct xmpp_client *client = conn->fd_readable.data;
+            size_t pending = xmpp_client_pending(client);
+            if (pending == 0 || xmpp_client_tls(client)) {
+                continue;
+            }
+            xmp3_uring_send(server->ring,
+                            client_socket_fd(xmpp_client_socket(client)),
+                            xmpp_client_pending_data(client), pending, client);
+            queued++;
+        }
+
+        if (queued == 0) {
+            return;
+        }
+        if (!submit_ring(server)) {
+            return;
+        }
+
+        void *data;
+        int result;
+        while (xmp3_uring_next(server->ring, &data, &result)) {
+            xmpp_client_flushed(data, result);
+        }
+    }
+}
+
+/**
+ * Sets TCP_CORK on a client's socket.
+ *
+ * Clients are accepted with TCP_NODELAY, so uncorking sends whatever is left
+ * straight away instead of waiting on an ACK.
+ */
+static void cork_client(struct xmpp_client *client, bool cork) {
+    xmpp_client_conn(client)->corked = cork;
+    int fd = client_socket_fd(xmpp_client_socket(client));
+    int value = cork;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) == -1) {
+        debug("Unable to set TCP_CORK on client socket");
+    }
+}
 
-    struct xmpp_parser *parser = xmpp_client_parser(client);
-    check(xmpp_parser_parse(parser, server->buffer, numrecv),
-          "Error parsing XML: %s", xmpp_parser_strerror(parser));
-    return;
+/**
+ * Stops reading from the current source, until the (backed up) client it
+ * sent to catches up.
+ */
+static void pause_source(struct xmpp_server *server, struct c_client *conn) {
+    struct ev_io *source = server->source;
+    if (source == NULL) {
+        return;
+    }
 
-error:
-    xmpp_server_disconnect_client(client);
+    bool paused = false;
+    struct paused_source *search;
+    DL_FOREACH(server->paused_sources, search) {
+        if (search->watcher == source) {
+            if (search->receiver == conn) {
+                return;
+            }
+            paused = true;
+        }
+    }
+
+    struct paused_source *entry = calloc(1, sizeof(*entry));
+    check_mem(entry);
+    entry->watcher = source;
+    entry->receiver = conn;
+    DL_APPEND(server->paused_sources, entry);
+
+    if (!paused) {
+        ev_io_stop(server->loop, source);
+        __atomic_fetch_add(&server->stats.sources_paused, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Starts reading again from the sources paused on a client's account, unless
+ * they are also waiting on someone else.
+ */
+static void resume_sources(struct xmpp_server *server, struct c_client *conn) {
+    struct paused_source *entry, *tmp;
+    DL_FOREACH_SAFE(server->paused_sources, entry, tmp) {
+        if (entry->receiver != conn) {
+            continue;
+        }
+        struct ev_io *watcher = entry->watcher;
+        DL_DELETE(server->paused_sources, entry);
+        free(entry);
+
+        struct paused_source *search;
+        DL_FOREACH(server->paused_sources, search) {
+            if (search->watcher == watcher) {
+                break;
+            }
+        }
+        if (search != NULL) {
+            continue;
+        }
+
+        ev_io_start(server->loop, watcher);
+        /* TLS may be holding data that won't make the socket readable. */
+        if (watcher->cb == read_client) {
+            ev_feed_event(server->loop, watcher, EV_READ);
+        }
+    }
+}
+
+/** Holds on to a presence for a backed up client, replacing any older one
+ * from the same sender. */
+static void hold_stanza(struct xmpp_server *server, struct c_client *conn,
+                        struct xmpp_stanza *stanza) {
+    const char *from = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_FROM);
+    if (from == NULL) {
+        from = "";
+    }
+
+    struct held_stanza *held = NULL;
+    HASH_FIND_STR(conn->held, from, held);
+    if (held != NULL) {
+        free(held->data);
+        __atomic_fetch_add(&server->stats.stanzas_superseded, 1,
+                           __ATOMIC_RELAXED);
+    } else {
+        held = calloc(1, sizeof(*held));
+        check_mem(held);
+        STRDUP_CHECK(held->from, from);
+        HASH_ADD_KEYPTR(hh, conn->held, held->from, strlen(held->from), held);
+    }
+    held->data = xmpp_stanza_string(stanza, &held->len, true);
+}
+
+/** Sends (or just frees) the stanzas held back from a client. */
+static void release_held(struct c_client *conn, bool send) {
+    struct held_stanza *held, *tmp;
+    HASH_ITER(hh, conn->held, held, tmp) {
+        if (send) {
+            xmpp_client_send(conn->fd_readable.data, held->data, held->len);
+        }
+        HASH_DEL(conn->held, held);
+        free(held->from);
+        free(held->data);
+        free(held);
+    }
+}
+
+/**
+ * Called after writing to a client, lets go of a backed up client once its
+ * queue is under the low watermark.
+ */
+static void check_drained(struct xmpp_server *server, struct c_client *conn,
+                          size_t pending) {
+    if (!conn->backpressured || pending > server->low_watermark) {
+        return;
+    }
+    conn->backpressured = false;
+    release_held(conn, true);
+    resume_sources(server, conn);
+}
+
+/** Takes a client off one of the server's read lists, if it's on it. */
+static bool unlink_read(struct c_client **list, struct c_client *conn) {
+    for (; *list != NULL; list = &(*list)->read_next) {
+        if (*list == conn) {
+            *list = conn->read_next;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Makes progress on a client's TLS handshake.
+ *
+ * Called from both the read and write watchers until the handshake is done.
+ * The write watcher is only left running while OpenSSL is waiting to write,
+ * the read watcher is always active anyway.
+ */
+static void handshake_client(struct xmpp_client *client) {
+    struct xmpp_server *server = xmpp_client_server(client);
+    struct c_client *conn = xmpp_client_conn(client);
+    char *addrstr = NULL;
+
+    switch (client_socket_handshake(xmpp_client_socket(client))) {
+        case CLIENT_SOCKET_HANDSHAKE_DONE:
+            addrstr = client_socket_addr_str(xmpp_client_socket(client));
+            __atomic_fetch_add(&server->stats.tls_handshakes, 1,
+                               __ATOMIC_RELAXED);
+            if (client_socket_resumed(xmpp_client_socket(client))) {
+                __atomic_fetch_add(&server->stats.tls_resumed, 1,
+                                   __ATOMIC_RELAXED);
+                log_info("TLS session with %s resumed", addrstr);
+            } else {
+                log_info("TLS handshake with %s complete", addrstr);
+            }
+            free(addrstr);
+
+            ev_io_stop(server->loop, &conn->fd_writable);
+            if (xmpp_client_pending(client) > 0) {
+                watch_writable(server, conn);
+            }
+            break;
+
+        case CLIENT_SOCKET_HANDSHAKE_WANT_READ:
+            ev_io_stop(server->loop, &conn->fd_writable);
+            break;
+
+        case CLIENT_SOCKET_HANDSHAKE_WANT_WRITE:
+            watch_writable(server, conn);
+            break;
+
+        case CLIENT_SOCKET_HANDSHAKE_ERROR:
+            addrstr = client_socket_addr_str(xmpp_client_socket(client));
+            log_err("TLS handshake with %s failed", addrstr);
+            free(addrstr);
+            xmpp_server_disconnect_client(client);
+            break;
+    }
 }
 
 /**
@@ -792,6 +3260,15 @@ error:
  */
 static void send_service_unavailable(struct xmpp_server *server,
                                      struct xmpp_stanza *stanza) {
+    /* RFC6120 Section 8.2.3, results and errors never get an error back
+     * (which could go back and forth forever). */
+    const char *type = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_TYPE);
+    if (type != NULL && (strcmp(type, XMPP_STANZA_TYPE_RESULT) == 0
+                         || strcmp(type, XMPP_STANZA_TYPE_ERROR) == 0)) {
+        debug("Not answering an IQ %s with an error", type);
+        return;
+    }
+
     log_info("Sending service unavailable.");
 
     const char *id = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_ID);
@@ -823,34 +3300,44 @@ error:
     return;
 }
 
-static struct client_listener* client_listener_new(struct xmpp_client *client,
-        xmpp_server_client_callback cb, void *data) {
-    struct client_listener *listener = calloc(1, sizeof(*listener));
-    check_mem(listener);
+/** Frees a client that remove_client() has already been called on. */
+static void close_client(struct c_client *conn) {
+    xmpp_client_del(conn->fd_readable.data);
+    free(conn);
+}
 
-    listener->client = client;
-    listener->cb = cb;
-    listener->data = data;
+/** Tells everyone listening that a client has disconnected. */
+static void notify_listeners(struct c_client *conn) {
+    struct xmpp_client *client = conn->fd_readable.data;
 
-    return listener;
+    /* Always take the first, a listener may remove others. */
+    struct client_listener *listener;
+    while ((listener = conn->listeners) != NULL) {
+        HASH_DEL(conn->listeners, listener);
+        listener->key.cb(client, listener->key.data);
+        free(listener);
+    }
 }
 
-static void client_listener_del(struct client_listener *listener) {
-    free(listener);
+static struct client_listener* find_listener(struct c_client *conn,
+        xmpp_server_client_callback cb, void *data) {
+    struct client_listener_key key;
+    memset(&key, 0, sizeof(key));
+    key.cb = cb;
+    key.data = data;
+
+    struct client_listener *listener;
+    HASH_FIND(hh, conn->listeners, &key, sizeof(key), listener);
+    return listener;
 }
 
-static int client_listener_cmp(const struct client_listener *a,
-                               const struct client_listener *b) {
-    if (a->client != b->client) {
-        return a - b;
-    }
-    if (a->cb != b->cb) {
-        return a->cb - b->cb;
-    }
-    if (a->data != b->data) {
-        return a->data - b->data;
+/** Drops a client's listeners without calling them. */
+static void del_listeners(struct c_client *conn) {
+    struct client_listener *listener, *tmp;
+    HASH_ITER(hh, conn->listeners, listener, tmp) {
+        HASH_DEL(conn->listeners, listener);
+        free(listener);
     }
-    return 0;
 }
 
 static struct stanza_route* stanza_route_new(const struct jid *jid,
@@ -862,11 +3349,22 @@ static struct stanza_route* stanza_route_new(const struct jid *jid,
     route->cb = cb;
     route->data = data;
 
+    route->any_local = part_equal(jid_local(jid), "*");
+    route->any_domain = part_equal(jid_domain(jid), "*");
+    route->any_resource = part_equal(jid_resource(jid), "*");
+    route->wildcard = route->any_local || route->any_domain
+                      || route->any_resource;
+
+    route->key = malloc(jid_to_str_len(jid) + 1);
+    check_mem(route->key);
+    route->bare_len = jid_key(route->key, jid);
+
     return route;
 }
 
 static void stanza_route_del(struct stanza_route *route) {
     jid_del(route->jid);
+    free(route->key);
     free(route);
 }
 
@@ -885,12 +3383,305 @@ static int stanza_route_cmp(const struct stanza_route *a,
     return 0;
 }
 
+/** Finds a route with the same JID, callback, and data as search. */
+static struct stanza_route* find_route(struct xmpp_server *server,
+                                       const struct stanza_route *search) {
+    const struct route_vec *vec;
+    if (search->wildcard) {
+        vec = &server->wildcard_routes;
+    } else {
+        struct route_bucket *bucket;
+        HASH_FIND(hh, server->routes_full, search->key, strlen(search->key),
+                  bucket);
+        if (bucket == NULL) {
+            return NULL;
+        }
+        vec = &bucket->routes;
+    }
+
+    for (int i = 0; i < vec->count; i++) {
+        if (stanza_route_cmp(vec->routes[i], search) == 0) {
+            return vec->routes[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Collects the routes matching a JID, in the order they were added.
+ *
+ * This gives the same routes jid_cmp_wildcards() would, but only the
+ * buckets for the JID and the wildcard routes are looked at.  A route
+ * without a resource gets stanzas for any of that JID's resources, and a
+ * stanza to a bare JID goes to all of them.
+ */
+static void find_routes(struct xmpp_server *server, const struct jid *jid,
+                        struct route_vec *found) {
+    /* Stanzas addressed to a wildcard are rare, just check everything. */
+    if (has_wildcard(jid)) {
+        struct stanza_route *route;
+        DL_FOREACH(server->stanza_routes, route) {
+            if (jid_cmp_wildcards(jid, route->jid) == 0) {
+                route_vec_push(found, route);
+            }
+        }
+        return;
+    }
+
+    size_t len = jid_to_str_len(jid);
+    char key[len + 1];
+    size_t bare_len = jid_key(key, jid);
+    struct route_bucket *buckets[2] = {NULL, NULL};
+    if (jid_resource(jid) == NULL) {
+        HASH_FIND(hh, server->routes_bare, key, bare_len, buckets[0]);
+    } else {
+        HASH_FIND(hh, server->routes_full, key, len, buckets[0]);
+        HASH_FIND(hh, server->routes_full, key, bare_len, buckets[1]);
+    }
+    for (int b = 0; b < 2; b++) {
+        if (buckets[b] == NULL) {
+            continue;
+        }
+        for (int i = 0; i < buckets[b]->routes.count; i++) {
+            route_vec_push(found, buckets[b]->routes.routes[i]);
+        }
+    }
+
+    const struct route_vec *wildcards = &server->wildcard_routes;
+    for (int i = 0; i < wildcards->count; i++) {
+        if (wildcard_matches(wildcards->routes[i], jid)) {
+            route_vec_push(found, wildcards->routes[i]);
+        }
+    }
+
+    /* Each source is already in order, so this is only a few swaps. */
+    for (int i = 1; i < found->count; i++) {
+        struct stanza_route *route = found->routes[i];
+        int j = i;
+        for (; j > 0 && found->routes[j - 1]->seq > route->seq; j--) {
+            found->routes[j] = found->routes[j - 1];
+        }
+        found->routes[j] = route;
+    }
+}
+
+/**
+ * Calls each of the routes found for a stanza, skipping any removed along
+ * the way.
+ *
+ * @param skip A client whose own route shouldn't be called (it has been
+ *             sent the stanza already), or NULL.
+ * @return true if any of the routes handled the stanza.
+ */
+static bool call_routes(struct xmpp_server *server, struct xmpp_stanza *stanza,
+                        const struct route_vec *found,
+                        const struct xmpp_client *skip) {
+    bool was_handled = false;
+    server->routing++;
+    for (int i = 0; i < found->count; i++) {
+        struct stanza_route *route = found->routes[i];
+        if (route->removed || (skip != NULL
+                    && route->cb == xmpp_core_route_client
+                    && route->data == skip)) {
+            continue;
+        }
+#ifndef NDEBUG
+        char *strjid = jid_to_str(route->jid);
+        debug("Matched route '%s'", strjid);
+        free(strjid);
+#endif
+        if (route->cb(stanza, server, route->data)) {
+            debug("Stanza handled");
+            was_handled = true;
+        } else {
+            debug("Stanza not yet handled");
+        }
+    }
+
+    if (--server->routing == 0) {
+        struct stanza_route *route, *tmp;
+        LL_FOREACH_SAFE(server->removed_routes, route, tmp) {
+            stanza_route_del(route);
+        }
+        server->removed_routes = NULL;
+    }
+    return was_handled;
+}
+
+/** Checks a JID without wildcards against a wildcard route. */
+static bool wildcard_matches(const struct stanza_route *route,
+                             const struct jid *jid) {
+    if (!route->any_local
+            && !part_equal(jid_local(route->jid), jid_local(jid))) {
+        return false;
+    }
+    if (!route->any_domain
+            && !part_equal(jid_domain(route->jid), jid_domain(jid))) {
+        return false;
+    }
+
+    /* A missing resource on either side matches any resource. */
+    const char *resource = jid_resource(route->jid);
+    return route->any_resource || resource == NULL
+           || jid_resource(jid) == NULL
+           || strcmp(resource, jid_resource(jid)) == 0;
+}
+
+/** Compares two parts of a JID, either of which may be NULL. */
+static bool part_equal(const char *a, const char *b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+static bool has_wildcard(const struct jid *jid) {
+    return part_equal(jid_local(jid), "*") || part_equal(jid_domain(jid), "*")
+           || part_equal(jid_resource(jid), "*");
+}
+
+/**
+ * Writes a JID into key, the same way jid_to_str() would.
+ *
+ * Key needs room for jid_to_str_len() characters and the terminator.
+ *
+ * @return How much of the key is the bare JID.
+ */
+static size_t jid_key(char *key, const struct jid *jid) {
+    char *end = key;
+    const char *part = jid_local(jid);
+    if (part != NULL) {
+        end = stpcpy(end, part);
+        *end++ = '@';
+    }
+    end = stpcpy(end, jid_domain(jid));
+    size_t bare_len = end - key;
+
+    part = jid_resource(jid);
+    if (part != NULL) {
+        *end++ = '/';
+        stpcpy(end, part);
+    }
+    return bare_len;
+}
+
+/** Adds a route to the bucket for key in an index. */
+static void index_route(struct route_bucket **index, const char *key,
+                        size_t len, struct stanza_route *route) {
+    struct route_bucket *bucket;
+    HASH_FIND(hh, *index, key, len, bucket);
+    if (bucket == NULL) {
+        bucket = calloc(1, sizeof(*bucket));
+        check_mem(bucket);
+        STRNDUP_CHECK(bucket->key, key, len);
+        HASH_ADD_KEYPTR(hh, *index, bucket->key, len, bucket);
+    }
+    route_vec_push(&bucket->routes, route);
+}
+
+/** Takes a route out of an index, dropping its bucket if it's empty. */
+static void unindex_route(struct route_bucket **index, const char *key,
+                          size_t len, struct stanza_route *route) {
+    struct route_bucket *bucket;
+    HASH_FIND(hh, *index, key, len, bucket);
+    if (bucket == NULL || !route_vec_remove(&bucket->routes, route)) {
+        log_err("Route missing from index, this shouldn't happen!");
+        return;
+    }
+    if (bucket->routes.count == 0) {
+        HASH_DEL(*index, bucket);
+        route_vec_done(&bucket->routes);
+        free(bucket->key);
+        free(bucket);
+    }
+}
+
+/** Frees an index, but not the routes in it. */
+static void index_del(struct route_bucket **index) {
+    struct route_bucket *bucket, *tmp;
+    HASH_ITER(hh, *index, bucket, tmp) {
+        HASH_DEL(*index, bucket);
+        route_vec_done(&bucket->routes);
+        free(bucket->key);
+        free(bucket);
+    }
+}
+
+static void route_vec_push(struct route_vec *vec, struct stanza_route *route) {
+    if (vec->routes == NULL) {
+        vec->routes = vec->inline_routes;
+        vec->size = ROUTE_VEC_INLINE;
+    }
+    if (vec->count == vec->size) {
+        int size = vec->size * 2;
+        struct stanza_route **routes;
+        if (vec->routes == vec->inline_routes) {
+            routes = malloc(size * sizeof(*routes));
+            check_mem(routes);
+            memcpy(routes, vec->routes, vec->count * sizeof(*routes));
+        } else {
+            routes = realloc(vec->routes, size * sizeof(*routes));
+            check_mem(routes);
+        }
+        vec->routes = routes;
+        vec->size = size;
+    }
+    vec->routes[vec->count++] = route;
+}
+
+/** Removes a route, keeping the rest in order. */
+static bool route_vec_remove(struct route_vec *vec,
+                             struct stanza_route *route) {
+    for (int i = 0; i < vec->count; i++) {
+        if (vec->routes[i] == route) {
+            memmove(&vec->routes[i], &vec->routes[i + 1],
+                    (vec->count - i - 1) * sizeof(*vec->routes));
+            vec->count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void route_vec_done(struct route_vec *vec) {
+    if (vec->routes != vec->inline_routes) {
+        free(vec->routes);
+    }
+}
+
+/** Registers a client under its full JID. */
+static void add_bound(struct xmpp_server *server, struct xmpp_client *client,
+                      const char *key) {
+    struct bound_jid *bound = calloc(1, sizeof(*bound));
+    check_mem(bound);
+    STRDUP_CHECK(bound->key, key);
+    bound->client = client;
+    HASH_ADD_KEYPTR(hh, server->bound_jids, bound->key, strlen(bound->key),
+                    bound);
+}
+
+/** Undoes add_bound(). */
+static void remove_bound(struct xmpp_server *server, struct bound_jid *bound) {
+    HASH_DEL(server->bound_jids, bound);
+    free(bound->key);
+    free(bound);
+}
+
 static struct iq_route* iq_route_new(const char *ns,
         xmpp_server_stanza_callback cb, void *data) {
     struct iq_route *route = calloc(1, sizeof(*route));
     check_mem(route);
 
     STRDUP_CHECK(route->ns, ns);
+    const char *sep = strchr(ns, XMPP_PARSER_SEPARATOR);
+    if (sep == NULL) {
+        STRDUP_CHECK(route->uri, ns);
+    } else {
+        STRNDUP_CHECK(route->uri, ns, (size_t)(sep - ns));
+        STRDUP_CHECK(route->name, sep + 1);
+        route->name_atom = atom_lookup(route->name);
+    }
+    route->ns_atom = atom_lookup(route->uri);
     route->cb = cb;
     route->data = data;
 
@@ -899,6 +3690,8 @@ static struct iq_route* iq_route_new(const char *ns,
 
 static void iq_route_del(struct iq_route *route) {
     free(route->ns);
+    free(route->uri);
+    free(route->name);
     free(route);
 }
 
@@ -917,6 +3710,146 @@ static int iq_route_cmp(const struct iq_route *a, const struct iq_route *b) {
     return 0;
 }
 
+/**
+ * Finds the list of iq routes for a namespace.
+ *
+ * Namespaces that are atoms (which covers everything the server handles
+ * itself) index straight into a table, with no hashing or comparing at all.
+ * Any others are looked up by string.
+ *
+ * @return The head of the list, NULL if create is false and there isn't one.
+ */
+static struct iq_route** iq_chain(struct xmpp_server *server, const char *uri,
+                                  enum atom ns_atom, bool create) {
+    if (ns_atom != ATOM_NONE) {
+        return &server->iq_atom_routes[ns_atom];
+    }
+
+    struct iq_bucket *bucket;
+    HASH_FIND_STR(server->iq_buckets, uri, bucket);
+    if (bucket == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        bucket = calloc(1, sizeof(*bucket));
+        check_mem(bucket);
+        STRDUP_CHECK(bucket->uri, uri);
+        HASH_ADD_KEYPTR(hh, server->iq_buckets, bucket->uri,
+                        strlen(bucket->uri), bucket);
+    }
+    return &bucket->routes;
+}
+
+/** Checks the tag name of an IQ's child against a route in its namespace. */
+static bool iq_route_matches(const struct iq_route *route,
+                             const struct xmpp_stanza *child) {
+    if (route->name == NULL) {
+        return true;
+    }
+    if (route->name_atom != ATOM_NONE) {
+        return route->name_atom == xmpp_stanza_name_atom(child);
+    }
+    return strcmp(route->name, xmpp_stanza_name(child)) == 0;
+}
+
+/**
+ * Hands a reply to an IQ the server sent to whoever sent it.
+ *
+ * @return false if the stanza isn't a reply to one of those.
+ */
+static bool complete_iq(struct xmpp_server *server,
+                        struct xmpp_stanza *stanza) {
+    if (server->pending_iqs == NULL) {
+        return false;
+    }
+    const char *type = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_TYPE);
+    const char *id = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_ID);
+    const char *from_str = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_FROM);
+    if (type == NULL || id == NULL || from_str == NULL
+            || (strcmp(type, XMPP_STANZA_TYPE_RESULT) != 0
+                && strcmp(type, XMPP_STANZA_TYPE_ERROR) != 0)) {
+        return false;
+    }
+
+    struct pending_iq *pending;
+    HASH_FIND_STR(server->pending_iqs, id, pending);
+    if (pending == NULL) {
+        return false;
+    }
+
+    /* Only a reply to whoever sent the IQ counts, anything else with the
+     * same id (e.g. an IQ a client's bare JID is answering on its own
+     * behalf) is none of our business. */
+    const char *to_str = xmpp_stanza_attr(stanza, XMPP_STANZA_ATTR_TO);
+    struct jid *to = to_str ? jid_new_from_str(to_str) : NULL;
+    bool match = to != NULL && jid_cmp(to, pending->from) == 0;
+    if (to != NULL) {
+        jid_del(to);
+    }
+    if (!match) {
+        return false;
+    }
+
+    /* Anyone could send a reply with the right id.  The answer to an IQ
+     * sent to a bare JID comes from one of its resources. */
+    struct jid *from = jid_new_from_str(from_str);
+    match = from != NULL && (jid_cmp(from, pending->to) == 0
+        || (jid_resource(pending->to) == NULL
+            && part_equal(jid_local(from), jid_local(pending->to))
+            && part_equal(jid_domain(from), jid_domain(pending->to))));
+    if (from != NULL) {
+        jid_del(from);
+    }
+    if (!match) {
+        log_warn("IQ reply from the wrong JID, ignoring.");
+        return false;
+    }
+
+    /* Out of the table first, the callback may send another with the same
+     * id. */
+    xmpp_server_iq_callback cb = pending->cb;
+    void *data = pending->data;
+    pending_iq_del(pending);
+    cb(server, stanza, data);
+    return true;
+}
+
+/** Timer callback for an IQ that has waited too long for its reply. */
+static void iq_timeout(struct timer_wheel_timer *timer, void *data) {
+    struct pending_iq *pending = data;
+    struct xmpp_server *server = pending->server;
+    debug("IQ '%s' timed out", pending->id);
+
+    xmpp_server_iq_callback cb = pending->cb;
+    void *cb_data = pending->data;
+    pending_iq_del(pending);
+    cb(server, NULL, cb_data);
+}
+
+static void pending_iq_del(struct pending_iq *pending) {
+    HASH_DEL(pending->server->pending_iqs, pending);
+    if (pending->timer != NULL) {
+        timer_wheel_timer_del(pending->timer);
+    }
+    jid_del(pending->to);
+    jid_del(pending->from);
+    free(pending->id);
+    free(pending);
+}
+
+/** Sets up the timer wheel, if it isn't already. */
+static void start_timers(struct xmpp_server *server) {
+    if (server->timers != NULL) {
+        return;
+    }
+    server->timers = timer_wheel_new();
+    server->timers_start = ev_now(server->loop);
+    ev_timer_init(&server->timers_tick, advance_timers, 1, 1);
+    server->timers_tick.data = server;
+    ev_timer_start(server->loop, &server->timers_tick);
+    ev_unref(server->loop);
+}
+
 static void disco_item_del(struct disco_item *item) {
     jid_del(item->jid);
     free(item->name);
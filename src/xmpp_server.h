@@ -34,13 +34,87 @@
 #include <openssl/ssl.h>
 
 /* Forward declarations. */
+struct ev_io;
 struct ev_loop;
 
 struct xmp3_options;
+struct xmp3_workers;
 struct xmpp_client;
 struct xmpp_server;
 struct xmpp_stanza;
+struct xmpp_stanza_iov;
 struct xmpp_client_iterator;
+struct tls_tickets;
+struct xmpp_parser_limits;
+
+/** Counters kept on how new connections are accepted. */
+struct xmpp_server_stats {
+    /** Connections accepted and set up as clients. */
+    unsigned long accepted;
+
+    /** Connections turned away because max_clients was reached. */
+    unsigned long rejected;
+
+    /** Failed accepts (including running out of file descriptors). */
+    unsigned long accept_errors;
+
+    /** Times the accept budget ran out with connections still waiting. */
+    unsigned long budget_exhausted;
+
+    /** Times the kernel's accept queue was seen full (it drops SYNs). */
+    unsigned long queue_full;
+
+    /** The longest accept queue seen. */
+    unsigned long queue_peak;
+
+    /** TLS handshakes completed. */
+    unsigned long tls_handshakes;
+
+    /** TLS handshakes that resumed a session (from the cache or a ticket). */
+    unsigned long tls_resumed;
+
+    /** Session cache lookups that found a session (shared by workers). */
+    unsigned long tls_cache_hits;
+
+    /** Session cache lookups that didn't (shared by workers). */
+    unsigned long tls_cache_misses;
+
+    /** Times a client's read budget ran out with data still waiting. */
+    unsigned long read_budget_exhausted;
+
+    /** io_uring submissions (each one a single system call). */
+    unsigned long uring_submits;
+
+    /** Socket operations done through io_uring. */
+    unsigned long uring_ops;
+
+    /** Times an idle client's parser and buffers were freed. */
+    unsigned long hibernations;
+
+    /** Times a source was paused for sending to a backed up client. */
+    unsigned long sources_paused;
+
+    /** Stanzas for backed up clients that were dropped. */
+    unsigned long stanzas_dropped;
+
+    /** Presence stanzas for backed up clients replaced by a newer one. */
+    unsigned long stanzas_superseded;
+
+    /** Clients disconnected for being silent too long. */
+    unsigned long idle_reaped;
+
+    /** Pings (XEP-0199) sent to clients. */
+    unsigned long pings_sent;
+
+    /** Pings that were answered. */
+    unsigned long pings_answered;
+
+    /** Sum of the answered pings' round trip times, in microseconds. */
+    unsigned long ping_rtt_total;
+
+    /** Whitespace keepalives sent to clients. */
+    unsigned long keepalives_sent;
+};
 
 /**
  * Callback to deliver an XMPP stanza.
@@ -53,6 +127,16 @@ typedef bool (*xmpp_server_stanza_callback)(struct xmpp_stanza *stanza,
                                             struct xmpp_server *server,
                                             void *data);
 
+/**
+ * Callback for the reply to an IQ sent with xmpp_server_send_iq().
+ *
+ * @param reply The result or error IQ, NULL if the IQ timed out.
+ * @param data  Data from when the IQ was sent.
+ */
+typedef void (*xmpp_server_iq_callback)(struct xmpp_server *server,
+                                        struct xmpp_stanza *reply,
+                                        void *data);
+
 /**
  * Callback to notify components of a client disconnecting.
  *
@@ -85,9 +169,22 @@ typedef bool (*xmpp_server_auth_callback)(const char *authzid,
 struct xmpp_server* xmpp_server_new(struct ev_loop *loop,
                                     const struct xmp3_options *options);
 
+/**
+ * Works like xmpp_server_new(), but accepts connections on a socket that is
+ * already bound and listening (e.g. one inherited from another process).
+ *
+ * @param fd The listening socket, or -1 to open one as usual.
+ */
+struct xmpp_server* xmpp_server_new_from_socket(struct ev_loop *loop,
+        const struct xmp3_options *options, int fd);
+
 /**
  * Cleans up an XMPP server instance.
  *
+ * Any clients still connected are disconnected with
+ * xmpp_server_disconnect_clients(), so anything listening for them has to
+ * still be around.
+ *
  * @param server The server instance to destroy.
  */
 void xmpp_server_del(struct xmpp_server *server);
@@ -95,12 +192,73 @@ void xmpp_server_del(struct xmpp_server *server);
 /** Gets the event loop instance this server is using. */
 struct ev_loop* xmpp_server_loop(const struct xmpp_server *server);
 
+/** Gets the server's listening socket. */
+int xmpp_server_socket(const struct xmpp_server *server);
+
+/** Gets the server's session ticket keys, NULL if it doesn't issue any. */
+struct tls_tickets* xmpp_server_tickets(const struct xmpp_server *server);
+
 /** Gets the JID of this server. */
 const struct jid* xmpp_server_jid(const struct xmpp_server *server);
 
+/**
+ * Gets an iovec list for serializing a stanza into just before writing it.
+ *
+ * Its contents are only good until the next call on this server's loop.
+ */
+struct xmpp_stanza_iov* xmpp_server_stanza_iov(struct xmpp_server *server);
+
+/** Gets the limits every client's parser enforces. */
+const struct xmpp_parser_limits* xmpp_server_parser_limits(
+        const struct xmpp_server *server);
+
 /** Gets the SSL context if there is one, else NULL. */
 SSL_CTX* xmpp_server_ssl_context(const struct xmpp_server *server);
 
+/**
+ * Makes this server use another server's SSL context.
+ *
+ * Workers share one context, so that a session cached (or a ticket issued)
+ * by one worker can be resumed on any of them.
+ */
+void xmpp_server_share_ssl_context(struct xmpp_server *server,
+                                   const struct xmpp_server *other);
+
+/** Copies the server's accept counters into stats. */
+void xmpp_server_stats(const struct xmpp_server *server,
+                       struct xmpp_server_stats *stats);
+
+/** Logs the server's accept counters. */
+void xmpp_server_log_stats(const struct xmpp_server *server);
+
+/**
+ * Makes this server one of several workers (see xmp3_workers.h).
+ *
+ * Stanzas for clients on other workers will be handed off to them, and bound
+ * JIDs are kept unique across all workers.
+ *
+ * @param workers The workers this server belongs to.
+ * @param id      This server's index among the workers.
+ */
+void xmpp_server_set_worker(struct xmpp_server *server,
+                            struct xmp3_workers *workers, int id);
+
+/**
+ * Reserves a full JID for a client that is binding a resource.
+ *
+ * The client can be found by the JID with xmpp_server_find_client() until it
+ * is released.
+ *
+ * @returns false if a client with this JID is already bound (on this or any
+ *          other worker).
+ */
+bool xmpp_server_claim_jid(struct xmpp_server *server,
+                           struct xmpp_client *client, const struct jid *jid);
+
+/** Releases a JID previously reserved with xmpp_server_claim_jid(). */
+void xmpp_server_release_jid(struct xmpp_server *server,
+                             const struct jid *jid);
+
 /**
  * Set the current authentication callback.
  *
@@ -156,7 +314,117 @@ void xmpp_server_del_client_listener(struct xmpp_client *client,
 void xmpp_server_disconnect_client(struct xmpp_client *client);
 
 /**
- * Find a locally connected client by JID.
+ * Disconnects a lot of clients at once (e.g. when a link goes down).
+ *
+ * This is the same as calling xmpp_server_disconnect_client() for each, but
+ * the server's lists are only walked once, and all of them are unrouted (and
+ * their JIDs released) before any disconnect listeners run, so nothing is
+ * sent to a client that is about to go.  Clients that are already
+ * disconnecting, or appear twice, are skipped.
+ *
+ * @param clients     The clients, you still own the array.
+ * @param num_clients How many clients are in the array.
+ */
+void xmpp_server_disconnect_clients(struct xmpp_server *server,
+                                    struct xmpp_client **clients,
+                                    size_t num_clients);
+
+/**
+ * Gets a client ready to be handed over to another process.
+ *
+ * Only bound clients on a plain socket can move, and only while there is
+ * nothing read or queued for them that hasn't been dealt with.  Their
+ * parser is hibernated, so the stream header is all the state there is.
+ *
+ * @returns false if the client can't be handed over right now.
+ */
+bool xmpp_server_freeze_client(struct xmpp_client *client);
+
+/**
+ * Forgets a client that was handed over to another process, without ending
+ * its connection or telling anyone it went away.
+ */
+void xmpp_server_detach_client(struct xmpp_client *client);
+
+/**
+ * Takes over a bound client from another process.
+ *
+ * @param fd     The client's socket.
+ * @param jid    The full JID the client was bound to.
+ * @param header The client's stream header, from
+ *               xmpp_parser_stream_header().
+ * @returns The new client, or NULL if it couldn't be set up (in which case
+ *          the socket is closed).
+ */
+struct xmpp_client* xmpp_server_adopt_client(struct xmpp_server *server,
+                                             int fd, const char *jid,
+                                             const char *header);
+
+/**
+ * Flush a client's output at the end of this event loop iteration.
+ *
+ * Called by xmpp_client_send() for every write.  The first call in an
+ * iteration corks the client's socket, so that everything sent to it in the
+ * meantime goes out in as few segments as possible.  After the flush the
+ * socket is uncorked, and if anything is left queued it is drained once the
+ * socket is writable.  A client whose socket failed is disconnected then.
+ */
+void xmpp_server_schedule_flush(struct xmpp_client *client);
+
+/**
+ * Returns true if the server writes plain clients' output through io_uring.
+ *
+ * Their output should then always be queued, so the server can hand all of
+ * it to the kernel at once when it flushes.
+ */
+bool xmpp_server_batches_io(const struct xmpp_server *server);
+
+/**
+ * Sets where the stanzas routed from now on come from, NULL once done.
+ *
+ * If one of them is for a client whose output has backed up past the high
+ * watermark, the source's watcher is stopped until that client has caught
+ * up.  The server does this for its own clients, modules that read stanzas
+ * from their own sockets should do the same.
+ */
+void xmpp_server_set_source(struct xmpp_server *server, struct ev_io *source);
+
+/**
+ * Forgets about a source that's going away (e.g. a module stopping), so the
+ * server doesn't start its watcher again.
+ */
+void xmpp_server_forget_source(struct xmpp_server *server,
+                               struct ev_io *source);
+
+/**
+ * Checks a stanza for a client against the client's outbound watermarks.
+ *
+ * Once the client is backed up, whoever is sending to it is paused, and the
+ * overflow policy for the kind of stanza decides whether it's still sent.
+ *
+ * @returns true if the stanza should be sent, false if it was dropped or is
+ *          being held back.
+ */
+bool xmpp_server_admit_stanza(struct xmpp_client *client,
+                              struct xmpp_stanza *stanza);
+
+/**
+ * Checks whether a stanza from a client answers the server's last ping to
+ * it, and if so records the round trip time.
+ *
+ * @returns true if it was the answer, and needs no further handling.
+ */
+bool xmpp_server_ping_reply(struct xmpp_client *client,
+                            struct xmpp_stanza *stanza);
+
+/**
+ * Returns the round trip time (in seconds) of the last ping a client
+ * answered, or a negative number if it hasn't answered any.
+ */
+double xmpp_server_ping_rtt(const struct xmpp_client *client);
+
+/**
+ * Find a locally connected client by the full JID it has bound.
  *
  * @returns The connected client instance if found, NULL if not.
  */
@@ -223,6 +491,39 @@ void xmpp_server_del_stanza_route(struct xmpp_server *server,
 bool xmpp_server_route_stanza(struct xmpp_server *server,
                               struct xmpp_stanza *stanza);
 
+/**
+ * Deliver one stanza to many recipients, as if it were routed to each in turn
+ * with its "to" attribute set to that recipient.
+ *
+ * Full JIDs bound by a local client get the stanza serialized once, with
+ * only the "to" patched in for each of them, and any other routes matching
+ * them (e.g. wildcards) are called afterwards.  Anything else (components,
+ * bare JIDs, clients that have fallen behind) goes through
+ * xmpp_server_route_stanza() as usual.  The order of stanzas sent to any one
+ * recipient is kept, but recipients may not be sent to in array order.
+ *
+ * The stanza's "to" is left just as it was, so if it had none it still has
+ * none afterwards.
+ *
+ * @param server  The server to process the stanza.
+ * @param stanza  The XMPP stanza to route.
+ * @param to      The JIDs to send the stanza to.
+ * @param num_to  The number of JIDs in the array.
+ * @return True if every recipient was handled, false if not.
+ */
+bool xmpp_server_route_stanza_multi(struct xmpp_server *server,
+                                    struct xmpp_stanza *stanza,
+                                    const struct jid **to, size_t num_to);
+
+/**
+ * Deliver a stanza that another worker handed off to this server.
+ *
+ * Behaves like xmpp_server_route_stanza(), except the stanza will not be
+ * handed off to any other worker again.
+ */
+bool xmpp_server_route_handoff(struct xmpp_server *server,
+                               struct xmpp_stanza *stanza);
+
 /**
  * Add a callback to handle IQ stanza to a particular namespace+tag name.
  *
@@ -230,8 +531,10 @@ bool xmpp_server_route_stanza(struct xmpp_server *server,
  * be called in the order they are registered.
  *
  * @param server An XMPP server instance.
- * @param ns     The namespace string to receive IQs for.  This string will be
- *               copied, you own the original.
+ * @param ns     The namespace string to receive IQs for, optionally followed
+ *               by a space and a tag name to only receive that element (e.g.
+ *               "urn:xmpp:ping ping").  This string will be copied, you own
+ *               the original.
  * @param cb     The callback to call when the server receives a iq stanza for
  *               this namespace.
  * @param data   Arbitrary data to be passed to the callback function.
@@ -257,6 +560,30 @@ void xmpp_server_del_iq_route(struct xmpp_server *server, const char *ns,
 bool xmpp_server_route_iq(struct xmpp_server *server,
                           struct xmpp_stanza *stanza);
 
+/**
+ * Sends an IQ from the server, and calls cb with the reply.
+ *
+ * The IQ gets an id if it has none, and the server's JID as "from" if it has
+ * none.  Replies are matched by id, have to come from the JID the IQ went to
+ * (or one of its resources), and have to be addressed to the IQ's "from".
+ * xmpp_server_route_stanza() takes them before any route sees them, so the
+ * IQ can be sent from any JID (e.g. a module's), but only replies routed on
+ * this worker are seen.  You still own the stanza.
+ *
+ * Pending IQs aren't answered when the server is deleted, so cancel any that
+ * are still waiting before then (e.g. when a module stops).
+ *
+ * @param timeout Seconds before cb is called with no reply, 0 to wait
+ *                forever.
+ * @return False if the IQ couldn't be sent, cb won't be called.
+ */
+bool xmpp_server_send_iq(struct xmpp_server *server, struct xmpp_stanza *iq,
+                         unsigned timeout, xmpp_server_iq_callback cb,
+                         void *data);
+
+/** Stops waiting for the reply to an IQ, its callback won't be called. */
+void xmpp_server_cancel_iq(struct xmpp_server *server, const char *id);
+
 /** Add an item to the response for disco item queries. */
 void xmpp_server_add_disco_item(struct xmpp_server *server,
                                 const char *name, const struct jid *jid);
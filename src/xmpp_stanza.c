@@ -28,11 +28,14 @@
  */
 
 #include <stdlib.h>
+#include <sys/uio.h>
 
 #include <uthash.h>
 #include <utlist.h>
 #include <utstring.h>
 
+#include "arena.h"
+#include "atom.h"
 #include "log.h"
 #include "utils.h"
 #include "xmpp_parser.h"
@@ -56,14 +59,20 @@ const char *XMPP_STANZA_TYPE_GET = "get";
 const char *XMPP_STANZA_TYPE_RESULT = "result";
 const char *XMPP_STANZA_TYPE_ERROR = "error";
 
+/** Attributes kept inside the stanza itself, few stanzas have more. */
+#define INLINE_ATTRS 6
+
+/** Stanzas with more attributes than this index them in a hash table. */
+#define ATTR_INDEX_MIN 16
+
 /** Structure to store a stanza attribute. */
 struct attribute {
-    /** Key for use in the hash table. */
-    char *key;
-
-    /** The name of this attribute. */
+    /** The name of this attribute (may be an atom's string). */
     char *name;
 
+    /** The atom for name, ATOM_NONE if it isn't interned. */
+    enum atom name_atom;
+
     /** The namespace URI of this attribute (may be NULL). */
     char *uri;
 
@@ -72,34 +81,131 @@ struct attribute {
 
     /** The value of this attribute. */
     char *value;
+};
+
+/** Finds a stanza's attributes by key, once it has a lot of them. */
+struct attr_index {
+    /** The attribute's key, "uri name" or just its name. */
+    char *key;
+
+    /** Where the attribute is in the stanza's list. */
+    int pos;
 
-    /** These are stored in a hash table. */
     UT_hash_handle hh;
 };
 
-static void parse_ns(const char *ns_name, char **name, char **prefix, char **uri);
-static void stanza_tostr(struct xmpp_stanza *stanza, UT_string *str,
-                         bool encode);
+struct xmpp_stanza_iov {
+    /** The fragments making up the serialized stanza. */
+    struct iovec *vec;
+
+    /** Number of fragments in use. */
+    int count;
+
+    /** Number of fragments allocated. */
+    int size;
+
+    /** Total number of bytes in all fragments. */
+    size_t length;
+
+    /** Whether the values in the list were escaped. */
+    bool encode;
+
+    /**
+     * Fragment holding the opening quote of the top-level "to" attribute
+     * (the value and closing quote follow it), or -1 if there isn't one.
+     */
+    int to_pos;
+
+    /** Backing storage for a "to" value that had to be escaped. */
+    UT_string patched;
+
+    /**
+     * Backing storage for fragments that had to be escaped.  Those fragments
+     * have a NULL iov_base until the list is complete (since this buffer may
+     * move as it grows), then they are pointed in here in order.
+     */
+    UT_string escaped;
+};
+
+/* Characters that have to be escaped in attribute values and in data. */
+static const char *ATTR_SPECIAL = "&<>\"\t\n\r\001";
+static const char *DATA_SPECIAL = "&<>\"\t\n\r";
+
+static void parse_ns(struct arena *arena, const char *ns_name, char **name,
+                     char **prefix, char **uri, enum atom *name_atom,
+                     enum atom *uri_atom);
+static void stanza_toiov(struct xmpp_stanza_iov *iov,
+                         struct xmpp_stanza *stanza, bool encode);
+static void iov_append(struct xmpp_stanza_iov *iov, const char *buf,
+                       size_t len);
+static void iov_append_str(struct xmpp_stanza_iov *iov, const char *str);
+static void iov_append_escaped(struct xmpp_stanza_iov *iov, const char *value,
+                               bool attr);
 static void attr_value_tostr(UT_string *str, const char *value);
-static void data_tostr(UT_string *str, const UT_string *value);
-static void attribute_del(struct attribute *attr);
+static void data_tostr(UT_string *str, const char *value);
+static struct attribute* attr_add(struct xmpp_stanza *stanza);
+static void attr_added(struct xmpp_stanza *stanza);
+static void attr_reserve(struct xmpp_stanza *stanza, int size);
+static struct attribute* attr_find(const struct xmpp_stanza *stanza,
+                                   const char *key);
+static struct attribute* attr_find_ns(const struct xmpp_stanza *stanza,
+                                      const char *name, const char *uri);
+static bool attr_matches(const struct attribute *attr, const char *key,
+                         size_t len);
+static void attr_remove(struct xmpp_stanza *stanza, struct attribute *attr);
+static void attr_index_add(struct xmpp_stanza *stanza, int pos);
+static void attr_index_del(struct xmpp_stanza *stanza);
+static void attribute_del(struct arena *arena, struct attribute *attr);
 static char* make_key(const char *name, const char *uri);
+static char* str_dup(struct arena *arena, const char *str, size_t len);
+static char* str_intern(struct arena *arena, const char *str, size_t len,
+                        enum atom *atom);
+static void str_copy(struct arena *arena, char **dest, const char *src);
+static void mem_free(struct arena *arena, void *ptr);
+static void data_append(struct xmpp_stanza *stanza, const char *buf,
+                        size_t len);
+static void load(const struct xmpp_stanza *stanza);
+static void changed(struct xmpp_stanza *stanza, bool start_tag);
+static void set_kind(struct xmpp_stanza *stanza);
 
 struct xmpp_stanza {
-    /** The name of this tag. */
+    /** The name of this tag (may be an atom's string). */
     char *name;
 
-    /** The namespace URI of this tag. */
+    /** The namespace URI of this tag (may be an atom's string). */
     char *uri;
 
+    /** The atoms for name and uri, ATOM_NONE if they aren't interned. */
+    enum atom name_atom;
+    enum atom uri_atom;
+
+    /** What kind of stanza this is, worked out from name_atom. */
+    enum xmpp_stanza_kind kind;
+
     /** The namespace prefix of this tag. */
     char *prefix;
 
-    /** A hash table of stanza attributes. */
-    struct attribute *attributes;
+    /** The attributes in order, in inline_attrs until they don't fit. */
+    struct attribute *attrs;
+    int num_attrs;
+    int attrs_size;
+    struct attribute inline_attrs[INLINE_ATTRS];
+
+    /** Index of attrs, once there are more than ATTR_INDEX_MIN. */
+    struct attr_index *attr_index;
 
-    /** The data inside this node */
-    UT_string data;
+    /**
+     * The arena this stanza, its strings and its data were allocated from,
+     * NULL if they came from malloc.
+     */
+    struct arena *arena;
+
+    /** The data inside this node (NULL until there is some). */
+    char *data;
+    size_t data_len;
+
+    /** Bytes allocated for data. */
+    size_t data_size;
 
     /** A linked list of child nodes. */
     struct xmpp_stanza *children;
@@ -113,57 +219,93 @@ struct xmpp_stanza {
     /** Stanzas are kept in a linked list. */
     struct xmpp_stanza *prev;
     struct xmpp_stanza *next;
+
+    /**
+     * The bytes a top-level stanza was parsed from, start tag to end tag.
+     * Only valid while the parser's handler runs, and dropped as soon as
+     * anything but the start tag's attributes is changed.
+     */
+    const char *raw;
+    size_t raw_len;
+
+    /** Length of the start tag at the front of raw. */
+    size_t raw_start_len;
+
+    /** The stream header raw was sent in (may be NULL). */
+    const char *raw_header;
+
+    /** Whether the children and data still have to be parsed from raw. */
+    bool unloaded;
 };
 
 struct xmpp_stanza* xmpp_stanza_new(const char *ns_name, const char **attrs) {
-    struct xmpp_stanza *stanza = calloc(1, sizeof(*stanza));
-    check_mem(stanza);
+    return xmpp_stanza_arena_new(NULL, ns_name, attrs, NULL);
+}
 
-    parse_ns(ns_name, &stanza->name, &stanza->prefix, &stanza->uri);
-    utstring_init(&stanza->data);
+struct xmpp_stanza* xmpp_stanza_ns_new(const char *ns_name, const char **attrs,
+                                    struct xmpp_parser_namespace *namespaces) {
+    return xmpp_stanza_arena_new(NULL, ns_name, attrs, namespaces);
+}
 
-    if (attrs != NULL) {
-        for (int i = 0; attrs[i] != NULL; i += 2) {
-            struct attribute *attr = calloc(1, sizeof(*attr));
-            check_mem(attr);
+struct xmpp_stanza* xmpp_stanza_arena_new(struct arena *arena,
+                                    const char *ns_name, const char **attrs,
+                                    struct xmpp_parser_namespace *namespaces) {
+    struct xmpp_stanza *stanza;
+    if (arena) {
+        stanza = arena_calloc(arena, sizeof(*stanza));
+    } else {
+        stanza = calloc(1, sizeof(*stanza));
+        check_mem(stanza);
+    }
+    stanza->arena = arena;
+    stanza->namespaces = namespaces;
+    stanza->attrs = stanza->inline_attrs;
+    stanza->attrs_size = INLINE_ATTRS;
 
-            parse_ns(attrs[i], &attr->name, &attr->prefix, &attr->uri);
-            STRDUP_CHECK(attr->value, attrs[i + 1]);
+    parse_ns(arena, ns_name, &stanza->name, &stanza->prefix, &stanza->uri,
+             &stanza->name_atom, &stanza->uri_atom);
+    set_kind(stanza);
 
-            attr->key = make_key(attr->name, attr->uri);
-            HASH_ADD_KEYPTR(hh, stanza->attributes, attr->key,
-                            strlen(attr->key), attr);
+    if (attrs != NULL) {
+        int num_attrs = 0;
+        while (attrs[num_attrs * 2] != NULL) {
+            num_attrs++;
+        }
+        attr_reserve(stanza, num_attrs);
+
+        for (int i = 0; attrs[i] != NULL; i += 2) {
+            struct attribute *attr = attr_add(stanza);
+            parse_ns(arena, attrs[i], &attr->name, &attr->prefix, &attr->uri,
+                     &attr->name_atom, NULL);
+            attr->value = str_dup(arena, attrs[i + 1], strlen(attrs[i + 1]));
+            attr_added(stanza);
         }
     }
     return stanza;
 }
 
-struct xmpp_stanza* xmpp_stanza_ns_new(const char *ns_name, const char **attrs,
-                                    struct xmpp_parser_namespace *namespaces) {
-    struct xmpp_stanza *stanza = xmpp_stanza_new(ns_name, attrs);
-    stanza->namespaces = namespaces;
-    return stanza;
+struct arena* xmpp_stanza_arena(const struct xmpp_stanza *stanza) {
+    return stanza->arena;
 }
 
 void xmpp_stanza_del(struct xmpp_stanza *stanza, bool recursive) {
-    if (stanza->uri) {
-        free(stanza->uri);
-    }
-    if (stanza->prefix) {
-        free(stanza->prefix);
-    }
-    free(stanza->name);
+    struct arena *arena = stanza->arena;
+    mem_free(arena, stanza->uri);
+    mem_free(arena, stanza->prefix);
+    mem_free(arena, stanza->name);
 
-    struct attribute *attr, *tmp;
-    HASH_ITER(hh, stanza->attributes, attr, tmp) {
-        HASH_DEL(stanza->attributes, attr);
-        attribute_del(attr);
+    for (int i = 0; i < stanza->num_attrs; i++) {
+        attribute_del(arena, &stanza->attrs[i]);
+    }
+    if (arena == NULL && stanza->attrs != stanza->inline_attrs) {
+        free(stanza->attrs);
     }
+    attr_index_del(stanza);
 
     if (stanza->namespaces) {
         xmpp_parser_namespace_del(stanza->namespaces);
     }
-    utstring_done(&stanza->data);
+    mem_free(arena, stanza->data);
 
     if (recursive) {
         struct xmpp_stanza *s, *tmp;
@@ -173,26 +315,112 @@ void xmpp_stanza_del(struct xmpp_stanza *stanza, bool recursive) {
         }
     }
 
-    free(stanza);
+    mem_free(arena, stanza);
 }
 
 char* xmpp_stanza_string(struct xmpp_stanza *stanza, size_t *len,
                          bool encode) {
+    struct xmpp_stanza_iov *iov = xmpp_stanza_iov_new();
+    xmpp_stanza_iov_build(iov, stanza, encode);
+
     UT_string str;
     utstring_init(&str);
-    stanza_tostr(stanza, &str, encode);
+    utstring_reserve(&str, iov->length + 1);
+    for (int i = 0; i < iov->count; i++) {
+        utstring_bincpy(&str, iov->vec[i].iov_base, iov->vec[i].iov_len);
+    }
+    xmpp_stanza_iov_del(iov);
+
     if (len != NULL) {
         *len = utstring_len(&str);
     }
     return utstring_body(&str);
 }
 
+struct xmpp_stanza_iov* xmpp_stanza_iov_new(void) {
+    struct xmpp_stanza_iov *iov = calloc(1, sizeof(*iov));
+    check_mem(iov);
+    utstring_init(&iov->escaped);
+    utstring_init(&iov->patched);
+    return iov;
+}
+
+void xmpp_stanza_iov_del(struct xmpp_stanza_iov *iov) {
+    utstring_done(&iov->escaped);
+    utstring_done(&iov->patched);
+    free(iov->vec);
+    free(iov);
+}
+
+void xmpp_stanza_iov_build(struct xmpp_stanza_iov *iov,
+                           struct xmpp_stanza *stanza, bool encode) {
+    iov->count = 0;
+    iov->length = 0;
+    iov->encode = encode;
+    iov->to_pos = -1;
+    utstring_clear(&iov->escaped);
+
+    stanza_toiov(iov, stanza, encode);
+
+    /* Now that the escaped buffer won't move anymore, fill in the fragments
+     * that live in it. */
+    char *escaped = utstring_body(&iov->escaped);
+    for (int i = 0; i < iov->count; i++) {
+        if (iov->vec[i].iov_base == NULL) {
+            iov->vec[i].iov_base = escaped;
+            escaped += iov->vec[i].iov_len;
+        }
+    }
+}
+
+const struct iovec* xmpp_stanza_iov_vec(const struct xmpp_stanza_iov *iov) {
+    return iov->vec;
+}
+
+int xmpp_stanza_iov_count(const struct xmpp_stanza_iov *iov) {
+    return iov->count;
+}
+
+size_t xmpp_stanza_iov_length(const struct xmpp_stanza_iov *iov) {
+    return iov->length;
+}
+
+bool xmpp_stanza_iov_set_to(struct xmpp_stanza_iov *iov, const char *to) {
+    if (iov->to_pos < 0 || to[0] == '\0') {
+        return false;
+    }
+
+    const char *value = to;
+    size_t len = strlen(to);
+    if (iov->encode && strpbrk(to, ATTR_SPECIAL) != NULL) {
+        utstring_clear(&iov->patched);
+        attr_value_tostr(&iov->patched, to);
+        value = utstring_body(&iov->patched);
+        len = utstring_len(&iov->patched);
+    }
+
+    struct iovec *vec = &iov->vec[iov->to_pos];
+    const char *quot = strchr(to, '\'') != NULL ? "\"" : "'";
+    vec[0].iov_base = (void*)quot;
+    vec[2].iov_base = (void*)quot;
+    iov->length += len - vec[1].iov_len;
+    vec[1].iov_base = (void*)value;
+    vec[1].iov_len = len;
+    return true;
+}
+
 const char* xmpp_stanza_uri(const struct xmpp_stanza *stanza) {
     return stanza->uri;
 }
 
 void xmpp_stanza_copy_uri(struct xmpp_stanza *stanza, const char *uri) {
-    copy_string(&stanza->uri, uri);
+    changed(stanza, true);
+    str_copy(stanza->arena, &stanza->uri, uri);
+    stanza->uri_atom = uri ? atom_lookup(uri) : ATOM_NONE;
+}
+
+enum atom xmpp_stanza_uri_atom(const struct xmpp_stanza *stanza) {
+    return stanza->uri_atom;
 }
 
 const char* xmpp_stanza_prefix(const struct xmpp_stanza *stanza) {
@@ -200,7 +428,8 @@ const char* xmpp_stanza_prefix(const struct xmpp_stanza *stanza) {
 }
 
 void xmpp_stanza_copy_prefix(struct xmpp_stanza *stanza, const char *prefix) {
-    copy_string(&stanza->prefix, prefix);
+    changed(stanza, false);
+    str_copy(stanza->arena, &stanza->prefix, prefix);
 }
 
 const char* xmpp_stanza_name(const struct xmpp_stanza *stanza) {
@@ -208,32 +437,45 @@ const char* xmpp_stanza_name(const struct xmpp_stanza *stanza) {
 }
 
 void xmpp_stanza_copy_name(struct xmpp_stanza *stanza, const char *name) {
-    copy_string(&stanza->name, name);
+    changed(stanza, false);
+    str_copy(stanza->arena, &stanza->name, name);
+    stanza->name_atom = name ? atom_lookup(name) : ATOM_NONE;
+    set_kind(stanza);
+}
+
+enum atom xmpp_stanza_name_atom(const struct xmpp_stanza *stanza) {
+    return stanza->name_atom;
+}
+
+enum xmpp_stanza_kind xmpp_stanza_kind(const struct xmpp_stanza *stanza) {
+    return stanza->kind;
 }
 
 const char* xmpp_stanza_attr(const struct xmpp_stanza *stanza,
                              const char *name) {
-    struct attribute *attr;
-    HASH_FIND_STR(stanza->attributes, name, attr);
-    if (attr == NULL) {
-        return NULL;
-    } else {
-        return attr->value;
-    }
+    struct attribute *attr = attr_find(stanza, name);
+    return attr ? attr->value : NULL;
 }
 
 const char* xmpp_stanza_ns_attr(const struct xmpp_stanza *stanza,
                                 const char *name, const char *uri) {
-    char *key = make_key(name, uri);
-    const char *value = xmpp_stanza_attr(stanza, key);
-    free(key);
-    return value;
+    struct attribute *attr = attr_find_ns(stanza, name, uri);
+    return attr ? attr->value : NULL;
 }
 
 void xmpp_stanza_set_attr(struct xmpp_stanza *stanza, const char *name,
                           char *value) {
-    struct attribute *attr;
-    HASH_FIND_STR(stanza->attributes, name, attr);
+    changed(stanza, true);
+
+    struct arena *arena = stanza->arena;
+    if (arena && value != NULL) {
+        /* Everything in an arena stanza lives in the arena. */
+        char *copy = arena_strndup(arena, value, strlen(value));
+        free(value);
+        value = copy;
+    }
+
+    struct attribute *attr = attr_find(stanza, name);
 
     if (attr == NULL) {
         /* If value is NULL, we want to delete an attribute that is already
@@ -241,42 +483,56 @@ void xmpp_stanza_set_attr(struct xmpp_stanza *stanza, const char *name,
         if (value == NULL) {
             return;
         }
-        attr = calloc(1, sizeof(*attr));
-        check_mem(attr);
-        STRDUP_CHECK(attr->name, name);
-        HASH_ADD_KEYPTR(hh, stanza->attributes, name, strlen(name), attr);
-    } else {
+        attr = attr_add(stanza);
+        attr->name = str_intern(arena, name, strlen(name), &attr->name_atom);
+        attr->value = value;
+        attr_added(stanza);
+    } else if (value == NULL) {
         /* If value is NULL, we want to delete this attribute. */
-        if (value == NULL) {
-            HASH_DEL(stanza->attributes, attr);
-            attribute_del(attr);
-            return;
-        }
-        free(attr->value);
+        attr_remove(stanza, attr);
+    } else {
+        mem_free(arena, attr->value);
+        attr->value = value;
     }
-    attr->value = value;
 }
 
 void xmpp_stanza_set_ns_attr(struct xmpp_stanza *stanza, const char *name,
                             const char *uri, const char *prefix, char *value) {
-    char *key = make_key(name, uri);
-    xmpp_stanza_set_attr(stanza, key, value);
-    if (value != NULL) {
-        struct attribute *attr;
-        HASH_FIND_STR(stanza->attributes, key, attr);
-        if (attr == NULL) {
-            log_err("Setting uri/prefix of nonexistant attribute, this shouldn't happen!");
-            goto done;
-        }
-        if (uri) {
-            STRDUP_CHECK(attr->uri, uri);
-        }
-        if (prefix) {
-            STRDUP_CHECK(attr->prefix, prefix);
+    if (uri == NULL) {
+        xmpp_stanza_set_attr(stanza, name, value);
+        return;
+    }
+    changed(stanza, true);
+
+    struct arena *arena = stanza->arena;
+    if (arena && value != NULL) {
+        char *copy = arena_strndup(arena, value, strlen(value));
+        free(value);
+        value = copy;
+    }
+
+    struct attribute *attr = attr_find_ns(stanza, name, uri);
+    if (value == NULL) {
+        if (attr != NULL) {
+            attr_remove(stanza, attr);
         }
+        return;
+    }
+
+    if (attr == NULL) {
+        attr = attr_add(stanza);
+        attr->name = str_intern(arena, name, strlen(name), &attr->name_atom);
+        attr->uri = str_dup(arena, uri, strlen(uri));
+        attr_added(stanza);
+    } else {
+        mem_free(arena, attr->value);
+        mem_free(arena, attr->prefix);
+        attr->prefix = NULL;
+    }
+    attr->value = value;
+    if (prefix) {
+        attr->prefix = str_dup(arena, prefix, strlen(prefix));
     }
-done:
-    free(key);
 }
 
 void xmpp_stanza_copy_attr(struct xmpp_stanza *stanza, const char *name,
@@ -303,19 +559,23 @@ void xmpp_stanza_copy_ns_attr(struct xmpp_stanza *stanza, const char *name,
 }
 
 const char* xmpp_stanza_data(const struct xmpp_stanza *stanza) {
-    return utstring_body(&stanza->data);
+    load(stanza);
+    return stanza->data ? stanza->data : "";
 }
 
 unsigned int xmpp_stanza_data_length(const struct xmpp_stanza *stanza) {
-    return utstring_len(&stanza->data);
+    load(stanza);
+    return stanza->data_len;
 }
 
 void xmpp_stanza_append_data(struct xmpp_stanza *stanza, const char *buf,
                              int len) {
-    utstring_bincpy(&stanza->data, buf, len);
+    changed(stanza, false);
+    data_append(stanza, buf, len);
 }
 
 int xmpp_stanza_children_length(const struct xmpp_stanza *stanza) {
+    load(stanza);
     int count = 0;
     struct xmpp_stanza *s;
     DL_FOREACH(stanza->children, s) {
@@ -325,6 +585,7 @@ int xmpp_stanza_children_length(const struct xmpp_stanza *stanza) {
 }
 
 struct xmpp_stanza* xmpp_stanza_children(struct xmpp_stanza *stanza) {
+    load(stanza);
     return stanza->children;
 }
 
@@ -342,6 +603,7 @@ struct xmpp_stanza* xmpp_stanza_prev(struct xmpp_stanza *stanza) {
 
 void xmpp_stanza_append_child(struct xmpp_stanza *stanza,
                               struct xmpp_stanza *child) {
+    changed(stanza, false);
     if (child->parent != NULL) {
         xmpp_stanza_remove_child(child->parent, child);
     }
@@ -351,107 +613,277 @@ void xmpp_stanza_append_child(struct xmpp_stanza *stanza,
 
 void xmpp_stanza_remove_child(struct xmpp_stanza *stanza,
                               struct xmpp_stanza *child) {
+    changed(stanza, false);
     DL_DELETE(stanza->children, child);
     child->parent = NULL;
 }
 
+void xmpp_stanza_set_raw(struct xmpp_stanza *stanza, const char *raw,
+                         size_t len, size_t start_len, const char *header) {
+    stanza->raw = raw;
+    stanza->raw_len = len;
+    stanza->raw_start_len = start_len;
+    stanza->raw_header = header;
+    stanza->unloaded = len > start_len;
+}
+
+void xmpp_stanza_take_children(struct xmpp_stanza *stanza,
+                               struct xmpp_stanza *from) {
+    struct xmpp_stanza *child, *tmp;
+    DL_FOREACH_SAFE(from->children, child, tmp) {
+        DL_DELETE(from->children, child);
+        DL_APPEND(stanza->children, child);
+        child->parent = stanza;
+    }
+    if (from->data_len > 0) {
+        data_append(stanza, from->data, from->data_len);
+    }
+}
+
+/** Adds to a stanza's data, growing it in its arena if it has one. */
+static void data_append(struct xmpp_stanza *stanza, const char *buf,
+                        size_t len) {
+    size_t needed = stanza->data_len + len + 1;
+    if (needed > stanza->data_size) {
+        size_t size = stanza->data_size ? stanza->data_size * 2 : 64;
+        while (size < needed) {
+            size *= 2;
+        }
+        if (stanza->arena) {
+            stanza->data = arena_grow(stanza->arena, stanza->data,
+                                      stanza->data_size, size);
+        } else {
+            stanza->data = realloc(stanza->data, size);
+            check_mem(stanza->data);
+        }
+        stanza->data_size = size;
+    }
+    memcpy(stanza->data + stanza->data_len, buf, len);
+    stanza->data_len += len;
+    stanza->data[stanza->data_len] = '\0';
+}
+
+/** Parses the children and data of a stanza if that hasn't happened yet. */
+static void load(const struct xmpp_stanza *stanza) {
+    if (!stanza->unloaded) {
+        return;
+    }
+    struct xmpp_stanza *s = (struct xmpp_stanza*)stanza;
+    s->unloaded = false;
+    xmpp_parser_load(s, s->raw_header, s->raw, s->raw_len);
+}
+
+/**
+ * Drops the raw bytes of the stanza's root once they no longer match it.
+ *
+ * The root's start tag is always written out fresh, so changes to its
+ * attributes alone don't count.
+ */
+static void changed(struct xmpp_stanza *stanza, bool start_tag) {
+    struct xmpp_stanza *root = stanza;
+    while (root->parent != NULL) {
+        root = root->parent;
+    }
+    if (root->raw == NULL || (start_tag && root == stanza)) {
+        return;
+    }
+    load(root);
+    root->raw = NULL;
+}
+
+/** Works out the stanza's kind from its name. */
+static void set_kind(struct xmpp_stanza *stanza) {
+    switch (stanza->name_atom) {
+        case ATOM_MESSAGE:
+            stanza->kind = XMPP_STANZA_KIND_MESSAGE;
+            break;
+        case ATOM_PRESENCE:
+            stanza->kind = XMPP_STANZA_KIND_PRESENCE;
+            break;
+        case ATOM_IQ:
+            stanza->kind = XMPP_STANZA_KIND_IQ;
+            break;
+        default:
+            stanza->kind = XMPP_STANZA_KIND_OTHER;
+            break;
+    }
+}
+
 /**
  * Parse the namespace triple that Expat gives us.
  *
  * Format is <URI> <NAME> <PREFIX>
+ *
+ * Names and URIs in the atom table aren't copied, name_atom and uri_atom (if
+ * not NULL) are set to their atoms.
  */
-static void parse_ns(const char *ns_name, char **name, char **prefix,
-                     char **uri) {
+static void parse_ns(struct arena *arena, const char *ns_name, char **name,
+                     char **prefix, char **uri, enum atom *name_atom,
+                     enum atom *uri_atom) {
     char *separator = strchr(ns_name, XMPP_PARSER_SEPARATOR);
     if (separator == NULL) {
         /* No namespace or prefix. */
-        STRDUP_CHECK(*name, ns_name);
+        *name = str_intern(arena, ns_name, strlen(ns_name), name_atom);
 
     } else {
         /* There is a namespace URI. */
-        STRNDUP_CHECK(*uri, ns_name, separator - ns_name);
+        *uri = str_intern(arena, ns_name, separator - ns_name, uri_atom);
 
         char *tmp = separator + 1;
         separator = strchr(tmp, XMPP_PARSER_SEPARATOR);
         if (separator == NULL) {
             /* There is no namespace prefix. */
-            STRDUP_CHECK(*name, tmp);
+            *name = str_intern(arena, tmp, strlen(tmp), name_atom);
         } else {
             /* There is a namespace prefix. */
-            STRNDUP_CHECK(*name, tmp, separator - tmp);
-            STRDUP_CHECK(*prefix, separator + 1);
+            *name = str_intern(arena, tmp, separator - tmp, name_atom);
+            *prefix = str_dup(arena, separator + 1, strlen(separator + 1));
         }
     }
 }
 
 /**
- * Function that gets called recursively to convert a stanza to a string.
+ * Function that gets called recursively to convert a stanza to a list of
+ * fragments.
  *
- * Also prints child stanzas.
+ * Also adds child stanzas.
  */
-static void stanza_tostr(struct xmpp_stanza *stanza, UT_string *str,
-                         bool encode) {
+static void stanza_toiov(struct xmpp_stanza_iov *iov,
+                         struct xmpp_stanza *stanza, bool encode) {
+    bool top = iov->count == 0;
+
+    /* An untouched stanza's children go out just as they came in. */
+    bool pass_through = encode && stanza->raw != NULL
+                        && stanza->raw_len > stanza->raw_start_len;
+    if (!pass_through) {
+        load(stanza);
+    }
+
+    iov_append(iov, "<", 1);
     if (stanza->prefix) {
-        utstring_printf(str, "<%s:%s", stanza->prefix, stanza->name);
-    } else {
-        utstring_printf(str, "<%s", stanza->name);
+        iov_append_str(iov, stanza->prefix);
+        iov_append(iov, ":", 1);
     }
+    iov_append_str(iov, stanza->name);
 
     struct xmpp_parser_namespace *ns = stanza->namespaces;
     while (ns != NULL) {
         const char *prefix = xmpp_parser_namespace_prefix(ns);
-        const char *uri = xmpp_parser_namespace_uri(ns);
         if (prefix) {
-            utstring_printf(str, " xmlns:%s='%s'", prefix, uri);
+            iov_append(iov, " xmlns:", 7);
+            iov_append_str(iov, prefix);
+            iov_append(iov, "='", 2);
         } else {
-            utstring_printf(str, " xmlns='%s'", uri);
+            iov_append(iov, " xmlns='", 8);
         }
+        iov_append_str(iov, xmpp_parser_namespace_uri(ns));
+        iov_append(iov, "'", 1);
         ns = xmpp_parser_namespace_next(ns);
     }
 
-    struct attribute *attr, *tmp;
-    HASH_ITER(hh, stanza->attributes, attr, tmp) {
-        char quot;
+    for (int i = 0; i < stanza->num_attrs; i++) {
+        struct attribute *attr = &stanza->attrs[i];
+        const char *quot;
         if (strchr(attr->value, '\'') != NULL) {
-            quot = '"';
+            quot = "\"";
         } else {
-            quot = '\'';
+            quot = "'";
         }
+        iov_append(iov, " ", 1);
         if (attr->prefix) {
-            utstring_printf(str, " %s:%s=%c", attr->prefix, attr->name,
-                            quot);
-        } else {
-            utstring_printf(str, " %s=%c", attr->name, quot);
+            iov_append_str(iov, attr->prefix);
+            iov_append(iov, ":", 1);
+        }
+        iov_append_str(iov, attr->name);
+        iov_append(iov, "=", 1);
+        if (top && attr->uri == NULL && attr->value[0] != '\0'
+                && strcmp(attr->name, XMPP_STANZA_ATTR_TO) == 0) {
+            iov->to_pos = iov->count;
         }
+        iov_append(iov, quot, 1);
         if (encode) {
-            attr_value_tostr(str, attr->value);
+            iov_append_escaped(iov, attr->value, true);
         } else {
-            utstring_printf(str, "%s", attr->value);
+            iov_append_str(iov, attr->value);
         }
-        utstring_printf(str, "%c", quot);
+        iov_append(iov, quot, 1);
     }
 
-    if (stanza->children != NULL || utstring_len(&stanza->data) > 0) {
-        utstring_printf(str, ">");
-        if (encode) {
-            data_tostr(str, &stanza->data);
+    if (pass_through) {
+        iov_append(iov, ">", 1);
+        iov_append(iov, stanza->raw + stanza->raw_start_len,
+                   stanza->raw_len - stanza->raw_start_len);
+    } else if (stanza->children != NULL || stanza->data_len > 0) {
+        iov_append(iov, ">", 1);
+        if (stanza->data_len == 0) {
+            /* Nothing to write. */
+        } else if (encode) {
+            iov_append_escaped(iov, stanza->data, false);
         } else {
-            utstring_concat(str, &stanza->data);
+            iov_append(iov, stanza->data, stanza->data_len);
         }
         struct xmpp_stanza *child;
         DL_FOREACH(stanza->children, child) {
-            stanza_tostr(child, str, encode);
+            stanza_toiov(iov, child, encode);
         }
+        iov_append(iov, "</", 2);
         if (stanza->prefix) {
-            utstring_printf(str, "</%s:%s>", stanza->prefix, stanza->name);
-        } else {
-            utstring_printf(str, "</%s>", stanza->name);
+            iov_append_str(iov, stanza->prefix);
+            iov_append(iov, ":", 1);
         }
+        iov_append_str(iov, stanza->name);
+        iov_append(iov, ">", 1);
     } else {
-        utstring_printf(str, "/>");
+        iov_append(iov, "/>", 2);
     }
 }
 
+/**
+ * Adds a fragment pointing at existing memory to an iovec list.
+ *
+ * A NULL buf marks a fragment at the end of the escaped buffer.
+ */
+static void iov_append(struct xmpp_stanza_iov *iov, const char *buf,
+                       size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (iov->count == iov->size) {
+        iov->size = iov->size == 0 ? 32 : iov->size * 2;
+        iov->vec = realloc(iov->vec, iov->size * sizeof(*iov->vec));
+        check_mem(iov->vec);
+    }
+    iov->vec[iov->count].iov_base = (void*)buf;
+    iov->vec[iov->count].iov_len = len;
+    iov->count++;
+    iov->length += len;
+}
+
+static void iov_append_str(struct xmpp_stanza_iov *iov, const char *str) {
+    iov_append(iov, str, strlen(str));
+}
+
+/**
+ * Adds an attribute value or character data, escaping it if needed.
+ *
+ * Values with nothing to escape (the usual case) are not copied.
+ */
+static void iov_append_escaped(struct xmpp_stanza_iov *iov, const char *value,
+                               bool attr) {
+    if (strpbrk(value, attr ? ATTR_SPECIAL : DATA_SPECIAL) == NULL) {
+        iov_append_str(iov, value);
+        return;
+    }
+
+    size_t start = utstring_len(&iov->escaped);
+    if (attr) {
+        attr_value_tostr(&iov->escaped, value);
+    } else {
+        data_tostr(&iov->escaped, value);
+    }
+    iov_append(iov, NULL, utstring_len(&iov->escaped) - start);
+}
+
 /** Handles properly encoding XML attribute values. */
 static void attr_value_tostr(UT_string *str, const char *value) {
     /* Adapted from Expat: xmlwf/xmlwf.c */
@@ -486,10 +918,9 @@ static void attr_value_tostr(UT_string *str, const char *value) {
 }
 
 /** Handles propertly encoding XML data. */
-static void data_tostr(UT_string *str, const UT_string *value) {
-    char *str_value = utstring_body(value);
+static void data_tostr(UT_string *str, const char *value) {
     /* Adapted from Expat: xmlwf/xmlwf.c */
-    for (const char *c = str_value; *c != '\0'; c++) {
+    for (const char *c = value; *c != '\0'; c++) {
         switch (*c) {
             case '&':
                 utstring_printf(str, "&amp;");
@@ -506,7 +937,7 @@ static void data_tostr(UT_string *str, const UT_string *value) {
             case 9:  /* Explicit fallthrough */
             case 10: /* Explicit fallthrough */
             case 13: /* Explicit fallthrough */
-                utstring_printf(str, "&#%d;", &c);
+                utstring_printf(str, "&#%d;", *c);
                 break;
             default:
                 utstring_printf(str, "%c", *c);
@@ -516,7 +947,159 @@ static void data_tostr(UT_string *str, const UT_string *value) {
 }
 
 /**
- * Convenience function to build a key for the attribute hash table.
+ * Adds an empty attribute to the end of a stanza's list.
+ *
+ * Call attr_added() once its name (and URI) are filled in.
+ */
+static struct attribute* attr_add(struct xmpp_stanza *stanza) {
+    if (stanza->num_attrs == stanza->attrs_size) {
+        attr_reserve(stanza, stanza->attrs_size * 2);
+    }
+    struct attribute *attr = &stanza->attrs[stanza->num_attrs++];
+    memset(attr, 0, sizeof(*attr));
+    return attr;
+}
+
+/** Indexes the last attribute added, if the stanza has enough for that. */
+static void attr_added(struct xmpp_stanza *stanza) {
+    if (stanza->num_attrs <= ATTR_INDEX_MIN) {
+        return;
+    }
+    if (stanza->attr_index == NULL) {
+        for (int i = 0; i < stanza->num_attrs - 1; i++) {
+            attr_index_add(stanza, i);
+        }
+    }
+    attr_index_add(stanza, stanza->num_attrs - 1);
+}
+
+/** Makes room for at least size attributes. */
+static void attr_reserve(struct xmpp_stanza *stanza, int size) {
+    if (size <= stanza->attrs_size) {
+        return;
+    }
+
+    struct attribute *attrs;
+    if (stanza->arena) {
+        /* The old array goes when the arena is reset. */
+        attrs = arena_alloc(stanza->arena, size * sizeof(*attrs));
+        memcpy(attrs, stanza->attrs, stanza->num_attrs * sizeof(*attrs));
+    } else if (stanza->attrs == stanza->inline_attrs) {
+        attrs = malloc(size * sizeof(*attrs));
+        check_mem(attrs);
+        memcpy(attrs, stanza->attrs, stanza->num_attrs * sizeof(*attrs));
+    } else {
+        attrs = realloc(stanza->attrs, size * sizeof(*attrs));
+        check_mem(attrs);
+    }
+    stanza->attrs = attrs;
+    stanza->attrs_size = size;
+}
+
+/**
+ * Finds an attribute by key, "uri name" for attributes with a namespace.
+ *
+ * Names that are atoms are matched by atom, which is most of them.
+ */
+static struct attribute* attr_find(const struct xmpp_stanza *stanza,
+                                   const char *key) {
+    size_t len = strlen(key);
+    if (stanza->attr_index != NULL) {
+        struct attr_index *found;
+        HASH_FIND(hh, stanza->attr_index, key, len, found);
+        return found ? &stanza->attrs[found->pos] : NULL;
+    }
+
+    enum atom atom = atom_find(key, len);
+    for (int i = 0; i < stanza->num_attrs; i++) {
+        struct attribute *attr = &stanza->attrs[i];
+        if (atom != ATOM_NONE) {
+            if (attr->name_atom == atom && attr->uri == NULL) {
+                return attr;
+            }
+        } else if (attr_matches(attr, key, len)) {
+            return attr;
+        }
+    }
+    return NULL;
+}
+
+/** Finds an attribute by name and namespace URI (which may be NULL). */
+static struct attribute* attr_find_ns(const struct xmpp_stanza *stanza,
+                                      const char *name, const char *uri) {
+    if (uri == NULL) {
+        return attr_find(stanza, name);
+    }
+    if (stanza->attr_index != NULL) {
+        char *key = make_key(name, uri);
+        struct attribute *attr = attr_find(stanza, key);
+        free(key);
+        return attr;
+    }
+
+    for (int i = 0; i < stanza->num_attrs; i++) {
+        struct attribute *attr = &stanza->attrs[i];
+        if (attr->uri != NULL && strcmp(attr->uri, uri) == 0
+                && strcmp(attr->name, name) == 0) {
+            return attr;
+        }
+    }
+    return NULL;
+}
+
+/** Whether an attribute has a key, "uri name" or just its name. */
+static bool attr_matches(const struct attribute *attr, const char *key,
+                         size_t len) {
+    if (attr->uri == NULL) {
+        return strcmp(attr->name, key) == 0;
+    }
+    size_t uri_len = strlen(attr->uri);
+    return len > uri_len && key[uri_len] == XMPP_PARSER_SEPARATOR
+           && memcmp(key, attr->uri, uri_len) == 0
+           && strcmp(key + uri_len + 1, attr->name) == 0;
+}
+
+/** Deletes an attribute, keeping the rest in order. */
+static void attr_remove(struct xmpp_stanza *stanza, struct attribute *attr) {
+    int pos = attr - stanza->attrs;
+    attribute_del(stanza->arena, attr);
+    memmove(attr, attr + 1, (stanza->num_attrs - pos - 1) * sizeof(*attr));
+    stanza->num_attrs--;
+
+    /* Everything after it moved, so the index starts over. */
+    if (stanza->attr_index != NULL) {
+        attr_index_del(stanza);
+        if (stanza->num_attrs > ATTR_INDEX_MIN) {
+            for (int i = 0; i < stanza->num_attrs; i++) {
+                attr_index_add(stanza, i);
+            }
+        }
+    }
+}
+
+/** Adds an attribute to the stanza's index. */
+static void attr_index_add(struct xmpp_stanza *stanza, int pos) {
+    struct attribute *attr = &stanza->attrs[pos];
+    struct attr_index *entry = malloc(sizeof(*entry));
+    check_mem(entry);
+    entry->key = make_key(attr->name, attr->uri);
+    entry->pos = pos;
+    HASH_ADD_KEYPTR(hh, stanza->attr_index, entry->key, strlen(entry->key),
+                    entry);
+}
+
+/** Drops the stanza's attribute index (which always comes from malloc). */
+static void attr_index_del(struct xmpp_stanza *stanza) {
+    struct attr_index *entry, *tmp;
+    HASH_ITER(hh, stanza->attr_index, entry, tmp) {
+        HASH_DEL(stanza->attr_index, entry);
+        free(entry->key);
+        free(entry);
+    }
+}
+
+/**
+ * Convenience function to build an attribute's key.
  *
  * This is to take care of attributes that have namespace qualifiers.
  */
@@ -547,15 +1130,63 @@ static char* make_key(const char *name, const char *uri) {
     return key;
 }
 
-static void attribute_del(struct attribute *attr) {
-    if (attr->uri) {
-        free(attr->uri);
+static void attribute_del(struct arena *arena, struct attribute *attr) {
+    mem_free(arena, attr->uri);
+    mem_free(arena, attr->prefix);
+    mem_free(arena, attr->name);
+    mem_free(arena, attr->value);
+}
+
+/** Copies a string, into the arena if there is one. */
+static char* str_dup(struct arena *arena, const char *str, size_t len) {
+    if (arena) {
+        return arena_strndup(arena, str, len);
     }
-    if (attr->prefix) {
-        free(attr->prefix);
+    char *copy;
+    STRNDUP_CHECK(copy, str, len);
+    return copy;
+}
+
+/**
+ * Returns the atom table's copy of a string if it has one, otherwise copies
+ * it like str_dup().
+ *
+ * @param atom If not NULL, set to the string's atom (or ATOM_NONE).
+ */
+static char* str_intern(struct arena *arena, const char *str, size_t len,
+                        enum atom *atom) {
+    enum atom found = atom_find(str, len);
+    if (atom != NULL) {
+        *atom = found;
+    }
+    if (found != ATOM_NONE) {
+        /* The table's strings are never written to or freed. */
+        return (char*)atom_str(found);
+    }
+    return str_dup(arena, str, len);
+}
+
+/** Like copy_string(), into the arena if there is one. */
+static void str_copy(struct arena *arena, char **dest, const char *src) {
+    if (atom_owns(*dest)) {
+        /* Not ours to reuse. */
+        *dest = NULL;
+    }
+    if (arena == NULL) {
+        copy_string(dest, src);
+    } else if (src == NULL) {
+        *dest = NULL;
+    } else {
+        *dest = arena_strndup(arena, src, strlen(src));
+    }
+}
+
+/**
+ * Frees memory, unless it is in an arena (where it goes all at once) or is an
+ * atom's string.
+ */
+static void mem_free(struct arena *arena, void *ptr) {
+    if (arena == NULL && !atom_owns(ptr)) {
+        free(ptr);
     }
-    free(attr->name);
-    free(attr->value);
-    free(attr->key);
-    free(attr);
 }
@@ -30,9 +30,15 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+
+#include "atom.h"
 
 /* Forward declarations. */
+struct arena;
+struct iovec;
 struct xmpp_stanza;
+struct xmpp_stanza_iov;
 struct xmpp_parser_namespace;
 
 extern const char *XMPP_STANZA_NS_CLIENT;
@@ -52,6 +58,14 @@ extern const char *XMPP_STANZA_TYPE_GET;
 extern const char *XMPP_STANZA_TYPE_RESULT;
 extern const char *XMPP_STANZA_TYPE_ERROR;
 
+/** The top-level stanza kinds, worked out once when the stanza is made. */
+enum xmpp_stanza_kind {
+    XMPP_STANZA_KIND_OTHER,
+    XMPP_STANZA_KIND_MESSAGE,
+    XMPP_STANZA_KIND_PRESENCE,
+    XMPP_STANZA_KIND_IQ,
+};
+
 /**
  * Allocate and initialize a new XMPP stanza structure.
  *
@@ -66,6 +80,22 @@ struct xmpp_stanza* xmpp_stanza_new(const char *ns_name, const char **attrs);
 struct xmpp_stanza* xmpp_stanza_ns_new(const char *ns_name, const char **attrs,
                                      struct xmpp_parser_namespace *namespaces);
 
+/**
+ * Allocate a stanza, and everything it holds, from an arena.
+ *
+ * Deleting it frees next to nothing, the memory goes back when the arena is
+ * reset, so the stanza must not outlive that (nor be added under a stanza
+ * that will).  Stanzas from malloc can be added under it though.
+ *
+ * @param arena The arena to use, or NULL for malloc.
+ */
+struct xmpp_stanza* xmpp_stanza_arena_new(struct arena *arena,
+                                    const char *ns_name, const char **attrs,
+                                    struct xmpp_parser_namespace *namespaces);
+
+/** Returns the arena a stanza was allocated from (NULL if none). */
+struct arena* xmpp_stanza_arena(const struct xmpp_stanza *stanza);
+
 /** Cleans up and frees an XMPP stanza. */
 void xmpp_stanza_del(struct xmpp_stanza *stanza, bool recursive);
 
@@ -78,6 +108,54 @@ void xmpp_stanza_del(struct xmpp_stanza *stanza, bool recursive);
  */
 char* xmpp_stanza_string(struct xmpp_stanza *stanza, size_t *len, bool encode);
 
+/**
+ * Allocates an empty iovec list to serialize stanzas into.
+ *
+ * A list can be rebuilt for any number of stanzas, its memory is reused.
+ */
+struct xmpp_stanza_iov* xmpp_stanza_iov_new(void);
+
+/** Cleans up and frees an iovec list. */
+void xmpp_stanza_iov_del(struct xmpp_stanza_iov *iov);
+
+/**
+ * Serializes a stanza (and its children) into a list of fragments.
+ *
+ * Tag names, attribute names and values, and data point directly into the
+ * stanza, only values that need escaping are copied.  The list is only valid
+ * until the stanza is modified or freed, or the list is rebuilt.  Joining the
+ * fragments gives the same text as xmpp_stanza_string().
+ *
+ * @param iov    The list to fill in, any previous contents are dropped.
+ * @param stanza The stanza to convert.
+ * @param encode Encode special characters (i.e. & -> &amp;).
+ */
+void xmpp_stanza_iov_build(struct xmpp_stanza_iov *iov,
+                           struct xmpp_stanza *stanza, bool encode);
+
+/** Returns the fragments, suitable for passing to writev. */
+const struct iovec* xmpp_stanza_iov_vec(const struct xmpp_stanza_iov *iov);
+
+/** Returns the number of fragments. */
+int xmpp_stanza_iov_count(const struct xmpp_stanza_iov *iov);
+
+/** Returns the total length of all fragments. */
+size_t xmpp_stanza_iov_length(const struct xmpp_stanza_iov *iov);
+
+/**
+ * Replaces the top-level "to" attribute in a list that is already built.
+ *
+ * Lets one serialized stanza go out to many recipients.  The value is only
+ * copied if it needs escaping, otherwise the list points at it until it is
+ * rebuilt or patched again.
+ *
+ * @param iov The list to patch.
+ * @param to  The new value, must not be empty.
+ * @returns false if the stanza had no (or an empty) "to" when the list was
+ *          built, the list is left alone then.
+ */
+bool xmpp_stanza_iov_set_to(struct xmpp_stanza_iov *iov, const char *to);
+
 /**
  * Returns the namespace URI of this stanza.
  *
@@ -91,6 +169,9 @@ const char* xmpp_stanza_uri(const struct xmpp_stanza *stanza);
 /** Set the URI of the stanza, copy the URI. */
 void xmpp_stanza_copy_uri(struct xmpp_stanza *stanza, const char *uri);
 
+/** Returns the atom for the stanza's URI, ATOM_NONE if it isn't interned. */
+enum atom xmpp_stanza_uri_atom(const struct xmpp_stanza *stanza);
+
 /**
  * Returns the namespace prefix of this stanza.
  *
@@ -117,6 +198,12 @@ const char* xmpp_stanza_name(const struct xmpp_stanza *stanza);
 /** Set the name of the stanza, copy the name. */
 void xmpp_stanza_copy_name(struct xmpp_stanza *stanza, const char *name);
 
+/** Returns the atom for the stanza's name, ATOM_NONE if it isn't interned. */
+enum atom xmpp_stanza_name_atom(const struct xmpp_stanza *stanza);
+
+/** Returns whether this is a message, presence, IQ, or something else. */
+enum xmpp_stanza_kind xmpp_stanza_kind(const struct xmpp_stanza *stanza);
+
 /**
  * Returns the value of an attribute of this stanza.
  *
@@ -202,3 +289,23 @@ void xmpp_stanza_append_child(struct xmpp_stanza *stanza,
 /** Removes a child stanza. */
 void xmpp_stanza_remove_child(struct xmpp_stanza *stanza,
                               struct xmpp_stanza *child);
+
+/**
+ * Records the bytes a top-level stanza was parsed from.
+ *
+ * Until somebody asks for them, the stanza's children and data are left
+ * unparsed, and as long as only the attributes on its start tag change, the
+ * stanza is serialized (encoded) by writing a fresh start tag followed by the
+ * original bytes.  The bytes are not copied, so this only holds while the
+ * parser's handler runs.
+ *
+ * @param raw       The whole stanza, start tag to end tag.
+ * @param start_len Length of the start tag at the front of raw.
+ * @param header    The stream header the stanza was sent in (may be NULL).
+ */
+void xmpp_stanza_set_raw(struct xmpp_stanza *stanza, const char *raw,
+                         size_t len, size_t start_len, const char *header);
+
+/** Moves the children and data of one stanza onto the end of another's. */
+void xmpp_stanza_take_children(struct xmpp_stanza *stanza,
+                               struct xmpp_stanza *from);
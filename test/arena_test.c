@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file arena_test.c
+ * Unit tests for the arena allocator.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmockery.h>
+
+#include "arena.c"
+
+/** Tests that allocations are aligned and don't overlap. */
+void test_alloc(void **state) {
+    struct arena *arena = arena_new(64);
+    char *a = arena_alloc(arena, 3);
+    char *b = arena_alloc(arena, 5);
+    assert_int_equal((size_t)a % ARENA_ALIGN, 0);
+    assert_int_equal((size_t)b % ARENA_ALIGN, 0);
+    assert_true(b >= a + 3);
+
+    /* Bigger than a block gets a block of its own. */
+    char *big = arena_calloc(arena, 1000);
+    assert_int_equal(big[999], 0);
+
+    assert_string_equal(arena_strndup(arena, "hello", 4), "hell");
+    arena_del(arena);
+}
+
+/** Tests growing the last allocation in place, and anything else by copying. */
+void test_grow(void **state) {
+    struct arena *arena = arena_new(64);
+    char *a = arena_strndup(arena, "abc", 3);
+    a = arena_grow(arena, a, 4, 16);
+    char *b = arena_alloc(arena, 8);
+    assert_true(b >= a + 16);
+
+    char *moved = arena_grow(arena, a, 16, 32);
+    assert_true(moved != a);
+    assert_string_equal(moved, "abc");
+    arena_del(arena);
+}
+
+/** Tests that a reset arena starts over in its first block. */
+void test_reset(void **state) {
+    struct arena *arena = arena_new(64);
+    char *a = arena_alloc(arena, 8);
+    arena_alloc(arena, 200);
+    arena_alloc(arena, 60);
+    arena_reset(arena);
+    assert_true(arena->blocks->next == NULL);
+    assert_true(arena_alloc(arena, 8) == a);
+
+    arena_release(arena);
+    assert_true(arena->blocks == NULL);
+    arena_del(arena);
+}
+
+int main(void) {
+    const UnitTest tests[] = {
+        unit_test(test_alloc),
+        unit_test(test_grow),
+        unit_test(test_reset),
+    };
+    return run_tests(tests);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file atom_test.c
+ * Unit tests for the atom table.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmockery.h>
+
+#include "atom.c"
+
+/** Tests that every atom can be found by its own string. */
+void test_find(void **state) {
+    for (int atom = ATOM_NONE + 1; atom < ATOM_COUNT; atom++) {
+        const char *str = atom_str(atom);
+        assert_int_equal(atom_lookup(str), atom);
+        assert_int_equal(atom_len(atom), strlen(str));
+        assert_true(atom_owns(str));
+    }
+    assert_string_equal(atom_str(ATOM_IQ), "iq");
+    assert_string_equal(atom_str(ATOM_NS_CLIENT), "jabber:client");
+}
+
+/** Tests strings that aren't in the table, or only partly match one. */
+void test_not_found(void **state) {
+    assert_int_equal(atom_lookup("bogus"), ATOM_NONE);
+    assert_int_equal(atom_lookup(""), ATOM_NONE);
+    assert_int_equal(atom_find("iqq", 3), ATOM_NONE);
+    assert_int_equal(atom_find("iqq", 2), ATOM_IQ);
+    assert_int_equal(atom_find("messages", 7), ATOM_MESSAGE);
+    assert_true(atom_str(ATOM_NONE) == NULL);
+
+    char copy[] = "message";
+    assert_false(atom_owns(copy));
+}
+
+int main(void) {
+    const UnitTest tests[] = {
+        unit_test(test_find),
+        unit_test(test_not_found),
+    };
+    return run_tests(tests);
+}
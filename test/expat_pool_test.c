@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file expat_pool_test.c
+ * Unit tests for the Expat parser pool.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmockery.h>
+
+#include "expat_pool.c"
+
+static const char *XML = "<a xmlns='urn:test'><b c='d'>text</b></a>";
+
+/** Tests that a parser handed back is the next one handed out. */
+void test_reuse(void **state) {
+    XML_Parser parser = expat_pool_get(' ');
+    assert_true(parser != NULL);
+    assert_int_equal(XML_Parse(parser, XML, strlen(XML), 1), XML_STATUS_OK);
+    expat_pool_put(parser);
+
+    struct expat_pool_stats stats;
+    expat_pool_stats(&stats);
+    assert_int_equal(stats.parsers_pooled, 1);
+
+    /* It was reset, so it can parse a whole new document. */
+    XML_Parser again = expat_pool_get(' ');
+    assert_true(again == parser);
+    assert_int_equal(XML_Parse(again, XML, strlen(XML), 1), XML_STATUS_OK);
+    expat_pool_put(again);
+    expat_pool_trim();
+}
+
+/** Tests that memory is counted, and all of it given back. */
+void test_accounting(void **state) {
+    XML_Parser parser = expat_pool_get(' ');
+    struct expat_pool_stats stats;
+    expat_pool_stats(&stats);
+    assert_true(stats.bytes_in_use > 0);
+
+    XML_ParserFree(parser);
+    expat_pool_stats(&stats);
+    assert_int_equal(stats.bytes_in_use, 0);
+    assert_true(stats.bytes_cached > 0);
+
+    expat_pool_trim();
+    expat_pool_stats(&stats);
+    assert_int_equal(stats.bytes_cached, 0);
+}
+
+int main(void) {
+    const UnitTest tests[] = {
+        unit_test(test_reuse),
+        unit_test(test_accounting),
+    };
+    return run_tests(tests);
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file timer_wheel_test.c
+ * Unit tests for the timing wheel.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmockery.h>
+
+#include "timer_wheel.c"
+
+/** Records when a timer fired. */
+struct fired {
+    int count;
+    unsigned long tick;
+};
+
+static void record(struct timer_wheel_timer *timer, void *data) {
+    struct fired *fired = data;
+    fired->count++;
+    fired->tick = timer_wheel_now(timer->wheel);
+}
+
+/** Starts a timer, runs the wheel past it and checks when it fired. */
+static void check_expiry(unsigned long start, unsigned long ticks) {
+    struct timer_wheel *wheel = timer_wheel_new();
+    struct fired fired = {0, 0};
+    struct timer_wheel_timer *timer = timer_wheel_timer_new(wheel, record,
+                                                            &fired);
+
+    timer_wheel_advance(wheel, start);
+    timer_wheel_start(timer, ticks);
+    timer_wheel_advance(wheel, start + ticks - 1);
+    assert_int_equal(fired.count, 0);
+    assert_true(timer_wheel_pending(timer));
+    timer_wheel_advance(wheel, start + ticks + 100);
+    assert_int_equal(fired.count, 1);
+    assert_int_equal(fired.tick, start + ticks);
+    assert_false(timer_wheel_pending(timer));
+
+    timer_wheel_timer_del(timer);
+    timer_wheel_del(wheel);
+}
+
+/** Tests timers that stay in the first level of the wheel. */
+void test_expire_short(void **unused) {
+    check_expiry(0, 1);
+    check_expiry(0, 63);
+    check_expiry(10, 60);
+}
+
+/** Tests timers that have to cascade down from the coarser levels. */
+void test_expire_long(void **unused) {
+    check_expiry(0, 64);
+    check_expiry(5, 64);
+    check_expiry(63, 4096);
+    check_expiry(1000, 5000);
+    check_expiry(4095, 300000);
+}
+
+/** Tests that restarting and stopping a timer take effect. */
+void test_restart_stop(void **unused) {
+    struct timer_wheel *wheel = timer_wheel_new();
+    struct fired fired = {0, 0};
+    struct timer_wheel_timer *timer = timer_wheel_timer_new(wheel, record,
+                                                            &fired);
+
+    timer_wheel_start(timer, 10);
+    timer_wheel_advance(wheel, 5);
+    timer_wheel_start(timer, 100);
+    timer_wheel_advance(wheel, 50);
+    assert_int_equal(fired.count, 0);
+    timer_wheel_advance(wheel, 105);
+    assert_int_equal(fired.count, 1);
+    assert_int_equal(fired.tick, 105);
+
+    timer_wheel_start(timer, 10);
+    timer_wheel_stop(timer);
+    timer_wheel_advance(wheel, 200);
+    assert_int_equal(fired.count, 1);
+
+    timer_wheel_timer_del(timer);
+    timer_wheel_del(wheel);
+}
+
+static void delete_other(struct timer_wheel_timer *timer, void *data) {
+    struct timer_wheel_timer **other = data;
+    timer_wheel_timer_del(*other);
+    *other = NULL;
+    timer_wheel_timer_del(timer);
+}
+
+/** Tests a callback deleting itself and another timer due on the same tick. */
+void test_delete_in_callback(void **unused) {
+    struct timer_wheel *wheel = timer_wheel_new();
+    struct fired fired = {0, 0};
+    struct timer_wheel_timer *other = timer_wheel_timer_new(wheel, record,
+                                                            &fired);
+    struct timer_wheel_timer *timer = timer_wheel_timer_new(wheel,
+                                                            delete_other,
+                                                            &other);
+
+    timer_wheel_start(timer, 3);
+    timer_wheel_start(other, 3);
+    timer_wheel_advance(wheel, 10);
+    assert_true(other == NULL);
+    assert_int_equal(fired.count, 0);
+
+    timer_wheel_del(wheel);
+}
+
+int main(void) {
+    const UnitTest tests[] = {
+        unit_test(test_expire_short),
+        unit_test(test_expire_long),
+        unit_test(test_restart_stop),
+        unit_test(test_delete_in_callback),
+    };
+    return run_tests(tests);
+}
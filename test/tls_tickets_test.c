@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * @file tls_tickets_test.c
+ * Unit tests for TLS session ticket key rotation.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmockery.h>
+
+#include "tls_tickets.c"
+
+/** Everything the key callback needs to be called directly. */
+struct callback_state {
+    SSL_CTX *ssl_context;
+    SSL *ssl;
+    struct tls_tickets *tickets;
+    EVP_CIPHER_CTX *cipher;
+    ticket_mac_ctx *mac;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MAC *hmac;
+#endif
+};
+
+static void state_init(struct callback_state *state) {
+    state->ssl_context = SSL_CTX_new(SSLv23_server_method());
+    assert_true(state->ssl_context != NULL);
+    state->tickets = tls_tickets_new(state->ssl_context, NULL, 0);
+    assert_true(state->tickets != NULL);
+    state->ssl = SSL_new(state->ssl_context);
+    assert_true(state->ssl != NULL);
+    state->cipher = EVP_CIPHER_CTX_new();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    state->hmac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    assert_true(state->hmac != NULL);
+    state->mac = EVP_MAC_CTX_new(state->hmac);
+#else
+    state->mac = HMAC_CTX_new();
+#endif
+    assert_true(state->mac != NULL);
+}
+
+static void state_cleanup(struct callback_state *state) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MAC_CTX_free(state->mac);
+    EVP_MAC_free(state->hmac);
+#else
+    HMAC_CTX_free(state->mac);
+#endif
+    EVP_CIPHER_CTX_free(state->cipher);
+    SSL_free(state->ssl);
+    tls_tickets_del(state->tickets);
+    SSL_CTX_free(state->ssl_context);
+}
+
+/** Has the callback pick a key for a new ticket, returns its name. */
+static void issue_ticket(struct callback_state *state,
+                         unsigned char name[TICKET_NAME_LEN]) {
+    unsigned char iv[EVP_MAX_IV_LENGTH];
+    assert_int_equal(key_callback(state->ssl, name, iv, state->cipher,
+                                  state->mac, 1), 1);
+}
+
+/** Has the callback look up the key for a ticket by name. */
+static int accept_ticket(struct callback_state *state,
+                         unsigned char name[TICKET_NAME_LEN]) {
+    unsigned char iv[EVP_MAX_IV_LENGTH] = {0};
+    return key_callback(state->ssl, name, iv, state->cipher, state->mac, 0);
+}
+
+/** Tickets issued with the current key are accepted as is. */
+void test_current_key(void **unused) {
+    struct callback_state state;
+    state_init(&state);
+
+    unsigned char name[TICKET_NAME_LEN];
+    issue_ticket(&state, name);
+    assert_int_equal(accept_ticket(&state, name), 1);
+
+    state_cleanup(&state);
+}
+
+/** Tickets from before one rotation are accepted, but renewed. */
+void test_previous_key(void **unused) {
+    struct callback_state state;
+    state_init(&state);
+
+    unsigned char name[TICKET_NAME_LEN];
+    issue_ticket(&state, name);
+    assert_true(tls_tickets_rotate(state.tickets));
+    assert_int_equal(accept_ticket(&state, name), 2);
+
+    unsigned char new_name[TICKET_NAME_LEN];
+    issue_ticket(&state, new_name);
+    assert_true(memcmp(name, new_name, TICKET_NAME_LEN) != 0);
+    assert_int_equal(accept_ticket(&state, new_name), 1);
+
+    state_cleanup(&state);
+}
+
+/** Tickets from before two rotations fall back to a full handshake. */
+void test_expired_key(void **unused) {
+    struct callback_state state;
+    state_init(&state);
+
+    unsigned char name[TICKET_NAME_LEN];
+    issue_ticket(&state, name);
+    assert_true(tls_tickets_rotate(state.tickets));
+    assert_true(tls_tickets_rotate(state.tickets));
+    assert_int_equal(accept_ticket(&state, name), 0);
+
+    state_cleanup(&state);
+}
+
+/** Tickets with a key we never had fall back to a full handshake. */
+void test_unknown_key(void **unused) {
+    struct callback_state state;
+    state_init(&state);
+
+    unsigned char name[TICKET_NAME_LEN];
+    memset(name, 0xAB, sizeof(name));
+    assert_int_equal(accept_ticket(&state, name), 0);
+
+    state_cleanup(&state);
+}
+
+/** Imported keys accept the tickets the exporter issued, old and new. */
+void test_export_import(void **unused) {
+    struct callback_state old, new;
+    state_init(&old);
+    state_init(&new);
+
+    unsigned char previous[TICKET_NAME_LEN];
+    issue_ticket(&old, previous);
+    assert_true(tls_tickets_rotate(old.tickets));
+    unsigned char current[TICKET_NAME_LEN];
+    issue_ticket(&old, current);
+    assert_int_equal(accept_ticket(&new, current), 0);
+
+    unsigned char buf[TLS_TICKETS_EXPORT_LEN];
+    tls_tickets_export(old.tickets, buf);
+    tls_tickets_import(new.tickets, buf);
+    assert_int_equal(accept_ticket(&new, current), 1);
+    assert_int_equal(accept_ticket(&new, previous), 2);
+
+    state_cleanup(&old);
+    state_cleanup(&new);
+}
+
+int main(void) {
+    const UnitTest tests[] = {
+        unit_test(test_current_key),
+        unit_test(test_previous_key),
+        unit_test(test_expired_key),
+        unit_test(test_unknown_key),
+        unit_test(test_export_import),
+    };
+    return run_tests(tests);
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file xmpp_parser_bench.c
+ * Measures how fast each XML backend gets through a recorded client stream.
+ *
+ * The first line of the recording is the stream header, the rest is stanzas
+ * which are fed to the parser over and over, a read sized chunk at a time.
+ *
+ * Usage: xmpp_parser_bench [recording] [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xmpp_parser.h"
+
+/** The size of the reads a client's stream usually comes in. */
+static const size_t CHUNK_SIZE = 2000;
+
+static bool count_stanza(struct xmpp_stanza *stanza,
+                         struct xmpp_parser *parser, void *data) {
+    (*(long*)data)++;
+    return true;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char* read_file(const char *path, size_t *len) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *buf = malloc(*len + 1);
+    if (buf == NULL || fread(buf, 1, *len, file) != *len) {
+        free(buf);
+        fclose(file);
+        return NULL;
+    }
+    buf[*len] = '\0';
+    fclose(file);
+    return buf;
+}
+
+static bool run(enum xmpp_parser_backend backend, const char *name,
+                const char *header, size_t header_len, const char *body,
+                size_t body_len, size_t total) {
+    long stanzas = 0;
+    xmpp_parser_set_default_backend(backend);
+    struct xmpp_parser *parser = xmpp_parser_new(true);
+    xmpp_parser_set_handler(parser, count_stanza);
+    xmpp_parser_set_data(parser, &stanzas);
+
+    if (!xmpp_parser_parse(parser, header, header_len)) {
+        fprintf(stderr, "%s: %s\n", name, xmpp_parser_strerror(parser));
+        xmpp_parser_del(parser);
+        return false;
+    }
+
+    double start = now();
+    size_t done = 0;
+    while (done < total) {
+        for (size_t i = 0; i < body_len; i += CHUNK_SIZE) {
+            size_t len = body_len - i < CHUNK_SIZE ? body_len - i : CHUNK_SIZE;
+            if (!xmpp_parser_parse(parser, body + i, len)) {
+                fprintf(stderr, "%s: %s\n", name,
+                        xmpp_parser_strerror(parser));
+                xmpp_parser_del(parser);
+                return false;
+            }
+        }
+        done += body_len;
+    }
+    double elapsed = now() - start;
+    xmpp_parser_del(parser);
+
+    printf("%-10s %8.1f MB/s %12.0f stanzas/s\n", name,
+           done / elapsed / 1e6, stanzas / elapsed);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "test/parser_bench.xml";
+    size_t total = (argc > 2 ? atol(argv[2]) : 200) * 1000 * 1000;
+
+    size_t len;
+    char *recording = read_file(path, &len);
+    if (recording == NULL) {
+        fprintf(stderr, "Could not read %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    char *body = strchr(recording, '\n');
+    if (body == NULL) {
+        fprintf(stderr, "No stream header line in %s\n", path);
+        free(recording);
+        return EXIT_FAILURE;
+    }
+    body++;
+    size_t header_len = body - recording;
+
+    /* Chunks made up of many copies of the recording, as a busy client's
+     * reads would be. */
+    size_t body_len = len - header_len;
+    size_t copies = CHUNK_SIZE * 64 / body_len + 1;
+    char *bodies = malloc(body_len * copies);
+    for (size_t i = 0; i < copies; i++) {
+        memcpy(bodies + i * body_len, body, body_len);
+    }
+
+    bool ok = run(XMPP_PARSER_BACKEND_EXPAT, "expat", recording, header_len,
+                  bodies, body_len * copies, total)
+              && run(XMPP_PARSER_BACKEND_TOKENIZER, "tokenizer", recording,
+                     header_len, bodies, body_len * copies, total);
+
+    free(bodies);
+    free(recording);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
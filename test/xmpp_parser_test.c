@@ -37,6 +37,9 @@
 struct test_data {
     struct xmpp_parser *parser;
     int called;
+    char uri[64];
+    char out[512];
+    int children;
 };
 
 static bool cb1(struct xmpp_stanza *stanza, struct xmpp_parser *parser,
@@ -44,6 +47,47 @@ static bool cb1(struct xmpp_stanza *stanza, struct xmpp_parser *parser,
     struct test_data *data = state;
     debug("adsf");
     data->called++;
+    snprintf(data->uri, sizeof(data->uri), "%s",
+             xmpp_stanza_uri(stanza) ? xmpp_stanza_uri(stanza) : "");
+    return true;
+}
+
+/** Serializes each stanza first, then counts its children. */
+static bool cb_lazy(struct xmpp_stanza *stanza, struct xmpp_parser *parser,
+                    void *state) {
+    struct test_data *data = state;
+    data->called++;
+    xmpp_stanza_copy_attr(stanza, "from", "b@localhost/c");
+    char *str = xmpp_stanza_string(stanza, NULL, true);
+    snprintf(data->out, sizeof(data->out), "%s", str);
+    free(str);
+    data->children = xmpp_stanza_children_length(stanza);
+    return true;
+}
+
+/** Writes out a stanza and everything in it, as parsed. */
+static void dump(struct xmpp_stanza *stanza, char *out, size_t size) {
+    size_t len = strlen(out);
+    const char *uri = xmpp_stanza_uri(stanza);
+    const char *a = xmpp_stanza_attr(stanza, "a");
+    const char *text = xmpp_stanza_data(stanza);
+    snprintf(out + len, size - len, "(%s|%s|%s|%.*s", uri ? uri : "",
+             xmpp_stanza_name(stanza), a ? a : "",
+             (int)xmpp_stanza_data_length(stanza), text ? text : "");
+    xmpp_stanza_children_length(stanza);
+    for (struct xmpp_stanza *child = xmpp_stanza_children(stanza);
+         child != NULL; child = xmpp_stanza_next(child)) {
+        dump(child, out, size);
+    }
+    len = strlen(out);
+    snprintf(out + len, size - len, ")");
+}
+
+static bool cb_dump(struct xmpp_stanza *stanza, struct xmpp_parser *parser,
+                    void *state) {
+    struct test_data *data = state;
+    data->called++;
+    dump(stanza, data->out, sizeof(data->out));
     return true;
 }
 
@@ -106,12 +150,209 @@ void test_handler4(void **state) {
     assert_int_equal(data->called, 4);
 }
 
+/** Tests parsing data received directly into the parser's buffer. */
+void test_parse_buffer1(void **state) {
+    struct test_data *data = *state;
+    static const char *XML1 = "<stream><a/><b>";
+    static const char *XML2 = "</b><c/>";
+
+    char *buf = xmpp_parser_buffer(data->parser, strlen(XML1));
+    assert_true(buf != NULL);
+    memcpy(buf, XML1, strlen(XML1));
+    assert_true(xmpp_parser_parse_buffer(data->parser, strlen(XML1)));
+    assert_int_equal(data->called, 2);
+
+    buf = xmpp_parser_buffer(data->parser, strlen(XML2));
+    assert_true(buf != NULL);
+    memcpy(buf, XML2, strlen(XML2));
+    assert_true(xmpp_parser_parse_buffer(data->parser, strlen(XML2)));
+    assert_int_equal(data->called, 4);
+    assert_int_equal(xmpp_parser_stanzas(data->parser), 4);
+}
+
+/** Tests that a hibernating parser picks up where it left off. */
+void test_hibernate1(void **state) {
+    struct test_data *data = *state;
+    static const char *XML1 = "<s:stream xmlns='jabber:client' "
+                              "xmlns:s='http://etherx.jabber.org/streams' "
+                              "to='localhost'><a/>\n";
+    static const char *XML2 = "<b/>";
+
+    assert_true(xmpp_parser_parse(data->parser, XML1, strlen(XML1)));
+    assert_int_equal(data->called, 2);
+    assert_true(xmpp_parser_hibernate(data->parser));
+    assert_true(xmpp_parser_hibernating(data->parser));
+
+    assert_true(xmpp_parser_parse(data->parser, XML2, strlen(XML2)));
+    assert_false(xmpp_parser_hibernating(data->parser));
+    assert_int_equal(data->called, 3);
+    assert_string_equal(data->uri, "jabber:client");
+}
+
+/** Tests that the parser won't hibernate in the middle of a stanza. */
+void test_hibernate2(void **state) {
+    struct test_data *data = *state;
+    static const char *XML1 = "<stream><a><b/>";
+    static const char *XML2 = "</a>";
+
+    assert_true(xmpp_parser_parse(data->parser, XML1, strlen(XML1)));
+    assert_false(xmpp_parser_hibernate(data->parser));
+    assert_true(xmpp_parser_parse(data->parser, XML2, strlen(XML2)));
+    assert_int_equal(data->called, 2);
+    assert_true(xmpp_parser_hibernate(data->parser));
+}
+
+/** Tests that a stanza split across chunks goes out in its original bytes. */
+void test_lazy1(void **state) {
+    struct test_data *data = *state;
+    static const char *XML1 = "<s:stream xmlns='jabber:client' "
+                              "xmlns:s='http://etherx.jabber.org/streams'>"
+                              "<message from='x'><body a=\"1\">x&amp;";
+    static const char *XML2 = "y</body><s:b/></message>";
+
+    xmpp_parser_set_handler(data->parser, cb_lazy);
+    assert_true(xmpp_parser_parse(data->parser, XML1, strlen(XML1)));
+    assert_true(xmpp_parser_parse(data->parser, XML2, strlen(XML2)));
+    assert_int_equal(data->called, 2);
+    assert_string_equal(data->out, "<message from='b@localhost/c'>"
+                        "<body a=\"1\">x&amp;y</body><s:b/></message>");
+    assert_int_equal(data->children, 2);
+}
+
+/** Tests that nesting too deep stops the parser before the handler runs. */
+void test_limit_depth(void **state) {
+    struct test_data *data = *state;
+    static const char *XML = "<stream><a><b><c/></b></a>";
+    struct xmpp_parser_limits limits = { .max_depth = 2 };
+
+    xmpp_parser_set_limits(data->parser, &limits);
+    assert_false(xmpp_parser_parse(data->parser, XML, strlen(XML)));
+    assert_true(xmpp_parser_over_limit(data->parser));
+    assert_int_equal(data->called, 1);
+}
+
+/** Tests that a big stanza is caught while it is still coming in. */
+void test_limit_size(void **state) {
+    struct test_data *data = *state;
+    static const char *XML1 = "<stream><a/><b>0123456789";
+    static const char *XML2 = "0123456789";
+    struct xmpp_parser_limits limits = { .max_stanza_size = 16 };
+
+    xmpp_parser_set_limits(data->parser, &limits);
+    assert_true(xmpp_parser_parse(data->parser, XML1, strlen(XML1)));
+    assert_int_equal(data->called, 2);
+    assert_false(xmpp_parser_parse(data->parser, XML2, strlen(XML2)));
+    assert_true(xmpp_parser_over_limit(data->parser));
+    assert_string_equal(xmpp_parser_strerror(data->parser), "Stanza too big");
+}
+
+/** Tests the limits on attributes and namespace declarations. */
+void test_limit_attributes(void **state) {
+    struct test_data *data = *state;
+    static const char *XML1 = "<stream><a x='1' y='2'/>";
+    static const char *XML2 = "<b xmlns:p='urn:p' xmlns:q='urn:q' z='3'/>";
+    struct xmpp_parser_limits limits = { .max_attributes = 2,
+                                         .max_namespaces = 1 };
+
+    xmpp_parser_set_limits(data->parser, &limits);
+    assert_true(xmpp_parser_parse(data->parser, XML1, strlen(XML1)));
+    assert_false(xmpp_parser_parse(data->parser, XML2, strlen(XML2)));
+    assert_true(xmpp_parser_over_limit(data->parser));
+    assert_int_equal(data->called, 2);
+}
+
+/** Parses XML with a backend, in chunks, and returns what was parsed. */
+static struct test_data* parse_with(enum xmpp_parser_backend backend,
+                                    const char *xml, size_t chunk) {
+    enum xmpp_parser_backend saved = xmpp_parser_default_backend();
+    xmpp_parser_set_default_backend(backend);
+    struct test_data *data = test_data_new(true);
+    xmpp_parser_set_default_backend(saved);
+
+    xmpp_parser_set_handler(data->parser, cb_dump);
+    size_t len = strlen(xml);
+    for (size_t i = 0; i < len; i += chunk) {
+        size_t n = len - i < chunk ? len - i : chunk;
+        if (!xmpp_parser_parse(data->parser, xml + i, n)) {
+            break;
+        }
+    }
+    return data;
+}
+
+/** Tests that the backends parse the same, however the input is split. */
+void test_backends_agree(void **state) {
+    static const char *XML =
+        "<s:stream xmlns='jabber:client' "
+        "xmlns:s='http://etherx.jabber.org/streams'>"
+        "<message a='x&amp;y\n&#x41;'><body>caf\xc3\xa9 &lt;3 &#233;\r\n"
+        "ok</body><p:x xmlns:p='urn:p' p:a='1'><![CDATA[<raw>]]></p:x>"
+        "<!-- c --></message>\n<iq a=\"2\"><q xmlns='urn:q'/></iq>";
+    static const size_t CHUNKS[] = { 1, 3, 7, 64, 1024 };
+
+    struct test_data *expected = parse_with(XMPP_PARSER_BACKEND_EXPAT,
+                                            XML, 1024);
+    assert_int_equal(expected->called, 3);
+
+    for (size_t i = 0; i < sizeof(CHUNKS) / sizeof(CHUNKS[0]); i++) {
+        struct test_data *data = parse_with(XMPP_PARSER_BACKEND_TOKENIZER,
+                                            XML, CHUNKS[i]);
+        assert_int_equal(data->called, 3);
+        assert_string_equal(data->out, expected->out);
+        teardown((void**)&data);
+    }
+    teardown((void**)&expected);
+}
+
+/** Tests that the tokenizer turns down what XMPP doesn't allow. */
+void test_tokenizer_errors(void **state) {
+    static const char *STREAM = "<stream>";
+    static const char *BAD[] = {
+        "<!DOCTYPE a>",
+        "<a></b>",
+        "<a>&foo;</a>",
+        "<a>&#0;</a>",
+        "<a b='1' b='2'/>",
+        "<a b='' c='' d='' e='' f='' g='' h='' i='' j='' k='' c=''/>",
+        "<p:a/>",
+        "<a b='<'/>",
+        "</stream><a/>",
+    };
+
+    for (size_t i = 0; i < sizeof(BAD) / sizeof(BAD[0]); i++) {
+        char xml[128];
+        snprintf(xml, sizeof(xml), "%s%s", STREAM, BAD[i]);
+        struct test_data *data = parse_with(XMPP_PARSER_BACKEND_TOKENIZER,
+                                            xml, 1);
+        assert_true(xmpp_parser_strerror(data->parser) != NULL);
+        assert_false(xmpp_parser_parse(data->parser, "<a/>", 4));
+        teardown((void**)&data);
+    }
+}
+
 int main(int argc, char *argv[]) {
     const UnitTest tests[] = {
         unit_test_setup_teardown(test_handler1, setup, teardown),
         unit_test_setup_teardown(test_handler2, setup_stream_start, teardown),
         unit_test_setup_teardown(test_handler3, setup_stream_start, teardown),
         unit_test_setup_teardown(test_handler4, setup_stream_start, teardown),
+        unit_test_setup_teardown(test_parse_buffer1, setup_stream_start,
+                                 teardown),
+        unit_test_setup_teardown(test_hibernate1, setup_stream_start, teardown),
+        unit_test_setup_teardown(test_hibernate2, setup_stream_start, teardown),
+        unit_test_setup_teardown(test_lazy1, setup_stream_start, teardown),
+        unit_test_setup_teardown(test_limit_depth, setup_stream_start,
+                                 teardown),
+        unit_test_setup_teardown(test_limit_size, setup_stream_start, teardown),
+        unit_test_setup_teardown(test_limit_attributes, setup_stream_start,
+                                 teardown),
+        unit_test(test_backends_agree),
+        unit_test(test_tokenizer_errors),
     };
-    return run_tests(tests);
+
+    /* Everything should work the same with either backend. */
+    xmpp_parser_set_default_backend(XMPP_PARSER_BACKEND_EXPAT);
+    int failed = run_tests(tests);
+    xmpp_parser_set_default_backend(XMPP_PARSER_BACKEND_TOKENIZER);
+    return failed + run_tests(tests);
 }
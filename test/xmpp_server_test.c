@@ -0,0 +1,816 @@
+/*
+ * Copyright (c) 2012 Tom Wambold <tom5760@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/**
+ * @file xmpp_server_test.c
+ * Unit tests for stanza routing and the server's client bookkeeping.
+ */
+
+/* xmpp_server.c needs this before any system header. */
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmockery.h>
+
+#include "xmpp_stanza.h"
+
+/** How many times the server has serialized a stanza itself. */
+static int iov_builds;
+
+static void count_iov_build(struct xmpp_stanza_iov *iov,
+                            struct xmpp_stanza *stanza, bool encode) {
+    iov_builds++;
+    xmpp_stanza_iov_build(iov, stanza, encode);
+}
+
+#define xmpp_stanza_iov_build count_iov_build
+#include "xmpp_server.c"
+#undef xmpp_stanza_iov_build
+
+#define MAX_HITS 32
+
+/** The order routes were called in. */
+struct hits {
+    int ids[MAX_HITS];
+    int count;
+};
+
+/** What a test route callback is registered with. */
+struct probe {
+    int id;
+    struct hits *hits;
+
+    /** Routes to remove when this one is called, if not NULL. */
+    struct probe *remove[2];
+};
+
+static struct jid *PROBE_JIDS[MAX_HITS];
+
+static bool record_route(struct xmpp_stanza *stanza,
+                         struct xmpp_server *server, void *data) {
+    struct probe *probe = data;
+    assert_true(probe->hits->count < MAX_HITS);
+    probe->hits->ids[probe->hits->count++] = probe->id;
+    for (int i = 0; i < 2; i++) {
+        struct probe *remove = probe->remove[i];
+        if (remove != NULL) {
+            xmpp_server_del_stanza_route(server, PROBE_JIDS[remove->id],
+                                         record_route, remove);
+        }
+    }
+    return true;
+}
+
+/** Connects a client over a socket pair and binds it to a JID. */
+static struct xmpp_client* new_client(struct xmpp_server *server,
+                                      const char *jid_str, int *peer) {
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    accept_client(server, fds[0], (struct sockaddr_in){0});
+    struct xmpp_client *client = server->clients->prev->fd_readable.data;
+
+    /* The same as resource binding does (see xmpp_auth.c). */
+    struct jid *jid = jid_new_from_str(jid_str);
+    xmpp_client_set_jid(client, jid);
+    assert_true(xmpp_server_claim_jid(server, client, jid));
+    xmpp_server_add_stanza_route(server, jid, xmpp_core_route_client, client);
+
+    *peer = fds[1];
+    return client;
+}
+
+/** Checks whether the server has closed its end of a client's socket. */
+static bool peer_closed(int peer) {
+    char buf[4096];
+    ssize_t len;
+    while ((len = recv(peer, buf, sizeof(buf), 0)) > 0) {
+        /* Skip whatever was sent before. */
+    }
+    return len == 0;
+}
+
+/** Reads whatever the server has sent to a client so far. */
+static void read_peer(int peer, char *buf, size_t size) {
+    ssize_t len = recv(peer, buf, size - 1, 0);
+    buf[len > 0 ? len : 0] = '\0';
+}
+
+/** Starts a server on a free port, without TLS. */
+static struct xmpp_server* new_server(struct ev_loop *loop) {
+    struct xmp3_options *options = xmp3_options_new();
+    xmp3_options_set_addr_str(options, "127.0.0.1");
+    xmp3_options_set_port(options, 0);
+    xmp3_options_set_ssl(options, false);
+    struct xmpp_server *server = xmpp_server_new(loop, options);
+    xmp3_options_del(options);
+    assert_true(server != NULL);
+    return server;
+}
+
+/** Adds a route for each JID, in order, with ids counting up from 0. */
+static void add_probes(struct xmpp_server *server, const char **jids,
+                       struct probe *probes, struct hits *hits) {
+    for (int i = 0; jids[i] != NULL; i++) {
+        PROBE_JIDS[i] = jid_new_from_str(jids[i]);
+        probes[i] = (struct probe){.id = i, .hits = hits};
+        xmpp_server_add_stanza_route(server, PROBE_JIDS[i], record_route,
+                                     &probes[i]);
+    }
+}
+
+static void del_probes(const char **jids) {
+    for (int i = 0; jids[i] != NULL; i++) {
+        jid_del(PROBE_JIDS[i]);
+        PROBE_JIDS[i] = NULL;
+    }
+}
+
+/** Routes a message, filling in the ids of the routes that got it. */
+static void route_message(struct xmpp_server *server, const char *to,
+                          struct hits *hits) {
+    struct xmpp_stanza *message = xmpp_stanza_new("message", (const char*[]){
+            XMPP_STANZA_ATTR_TO, to,
+            NULL});
+    hits->count = 0;
+    xmpp_server_route_stanza(server, message);
+    xmpp_stanza_del(message, true);
+}
+
+/**
+ * Works out which probes should get a stanza the way the server used to,
+ * by checking every route in the order it was added.
+ */
+static void scan_routes(struct xmpp_server *server, const char *to,
+                        struct hits *expected) {
+    struct jid *jid = jid_new_from_str(to);
+    expected->count = 0;
+    struct stanza_route *route;
+    DL_FOREACH(server->stanza_routes, route) {
+        if (route->cb == record_route
+                && jid_cmp_wildcards(jid, route->jid) == 0) {
+            struct probe *probe = route->data;
+            expected->ids[expected->count++] = probe->id;
+        }
+    }
+    jid_del(jid);
+}
+
+static void assert_hits_equal(const struct hits *a, const struct hits *b) {
+    assert_int_equal(a->count, b->count);
+    for (int i = 0; i < a->count; i++) {
+        assert_int_equal(a->ids[i], b->ids[i]);
+    }
+}
+
+static const char *ROUTE_JIDS[] = {
+    "*@localhost/*",
+    "a@localhost/r",
+    "a@localhost",
+    "*@*/*",
+    "b@localhost/r",
+    "a@other/r",
+    "a@localhost/s",
+    "localhost/*",
+    "*@localhost",
+    NULL,
+};
+
+/** Tests that the indexes find the same routes as checking every route. */
+void test_route_order(void **state) {
+    struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+    struct xmpp_server *server = new_server(loop);
+    struct hits hits = {{0}, 0};
+    struct hits expected = {{0}, 0};
+    struct probe probes[MAX_HITS];
+    add_probes(server, ROUTE_JIDS, probes, &hits);
+
+    static const char *TARGETS[] = {
+        "a@localhost/r",
+        "a@localhost",
+        "a@localhost/other",
+        "b@localhost/r",
+        "b@localhost",
+        "a@other/r",
+        "c@other",
+        "localhost/x",
+        "*@localhost/r",
+        "a@*",
+        NULL,
+    };
+    for (int i = 0; TARGETS[i] != NULL; i++) {
+        route_message(server, TARGETS[i], &hits);
+        scan_routes(server, TARGETS[i], &expected);
+        assert_hits_equal(&hits, &expected);
+    }
+
+    /* A route without a resource gets stanzas for any of its resources,
+     * after the wildcard added before it and the full JID route. */
+    route_message(server, "a@localhost/r", &hits);
+    assert_int_equal(hits.count, 5);
+    assert_int_equal(hits.ids[0], 0);
+    assert_int_equal(hits.ids[1], 1);
+    assert_int_equal(hits.ids[2], 2);
+    assert_int_equal(hits.ids[3], 3);
+    assert_int_equal(hits.ids[4], 8);
+
+    /* Removing and adding a route back moves it to the end. */
+    xmpp_server_del_stanza_route(server, PROBE_JIDS[0], record_route,
+                                 &probes[0]);
+    xmpp_server_add_stanza_route(server, PROBE_JIDS[0], record_route,
+                                 &probes[0]);
+    route_message(server, "a@localhost/r", &hits);
+    scan_routes(server, "a@localhost/r", &expected);
+    assert_hits_equal(&hits, &expected);
+    assert_int_equal(hits.ids[hits.count - 1], 0);
+
+    xmpp_server_del(server);
+    del_probes(ROUTE_JIDS);
+    ev_loop_destroy(loop);
+}
+
+/** Tests a callback removing its own route and a later matching one. */
+void test_route_removed_while_routing(void **state) {
+    struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+    struct xmpp_server *server = new_server(loop);
+    struct hits hits = {{0}, 0};
+    struct probe probes[MAX_HITS];
+    add_probes(server, ROUTE_JIDS, probes, &hits);
+
+    /* "a@localhost" removes itself and the catch-all route after it, which
+     * hasn't been called yet. */
+    probes[2].remove[0] = &probes[2];
+    probes[2].remove[1] = &probes[3];
+    route_message(server, "a@localhost/r", &hits);
+    assert_int_equal(hits.count, 4);
+    assert_int_equal(hits.ids[0], 0);
+    assert_int_equal(hits.ids[1], 1);
+    assert_int_equal(hits.ids[2], 2);
+    assert_int_equal(hits.ids[3], 8);
+    assert_true(server->removed_routes == NULL);
+
+    /* Both are gone for good. */
+    route_message(server, "a@localhost/r", &hits);
+    assert_int_equal(hits.count, 3);
+    assert_int_equal(hits.ids[2], 8);
+    route_message(server, "b@other/r", &hits);
+    assert_int_equal(hits.count, 0);
+
+    xmpp_server_del(server);
+    del_probes(ROUTE_JIDS);
+    ev_loop_destroy(loop);
+}
+
+/** What an IQ callback was called with. */
+struct iq_reply {
+    int count;
+
+    /** The "type" of the reply, or "" if the IQ timed out. */
+    char type[16];
+};
+
+static void record_reply(struct xmpp_server *server,
+                         struct xmpp_stanza *reply, void *data) {
+    struct iq_reply *iq_reply = data;
+    iq_reply->count++;
+    snprintf(iq_reply->type, sizeof(iq_reply->type), "%s",
+             reply ? xmpp_stanza_attr(reply, XMPP_STANZA_ATTR_TYPE) : "");
+}
+
+static struct xmpp_stanza* new_iq(const char *to, const char *id) {
+    struct xmpp_stanza *iq = xmpp_stanza_new("iq", (const char*[]){
+            XMPP_STANZA_ATTR_TO, to,
+            XMPP_STANZA_ATTR_TYPE, XMPP_STANZA_TYPE_GET,
+            NULL});
+    if (id != NULL) {
+        xmpp_stanza_copy_attr(iq, XMPP_STANZA_ATTR_ID, id);
+    }
+    xmpp_stanza_append_child(iq, xmpp_stanza_new("ping", (const char*[]){
+            "xmlns", "urn:xmpp:ping",
+            NULL}));
+    return iq;
+}
+
+static struct xmpp_stanza* new_reply(const char *id, const char *from,
+                                     const char *to) {
+    return xmpp_stanza_new("iq", (const char*[]){
+            XMPP_STANZA_ATTR_ID, id,
+            XMPP_STANZA_ATTR_FROM, from,
+            XMPP_STANZA_ATTR_TO, to,
+            XMPP_STANZA_ATTR_TYPE, XMPP_STANZA_TYPE_RESULT,
+            NULL});
+}
+
+static const char *IQ_JIDS[] = {
+    "c@localhost/r",
+    "conference.localhost",
+    NULL,
+};
+
+/** Tests sending an IQ and getting its reply back. */
+void test_send_iq(void **state) {
+    struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+    struct xmpp_server *server = new_server(loop);
+    struct hits hits = {{0}, 0};
+    struct probe probes[MAX_HITS];
+    add_probes(server, IQ_JIDS, probes, &hits);
+    struct iq_reply reply = {0, ""};
+
+    /* An IQ without an id gets one, and the server's JID as "from". */
+    struct xmpp_stanza *iq = new_iq("c@localhost/r", NULL);
+    assert_true(xmpp_server_send_iq(server, iq, 0, record_reply, &reply));
+    assert_int_equal(hits.count, 1);
+    const char *id = xmpp_stanza_attr(iq, XMPP_STANZA_ATTR_ID);
+    assert_true(id != NULL);
+    assert_true(strncmp(id, "xmp3-iq-", 8) == 0);
+    assert_string_equal(xmpp_stanza_attr(iq, XMPP_STANZA_ATTR_FROM),
+                        "localhost");
+
+    /* The next one gets a different id. */
+    struct xmpp_stanza *iq2 = new_iq("c@localhost/r", NULL);
+    assert_true(xmpp_server_send_iq(server, iq2, 0, record_reply, &reply));
+    assert_string_not_equal(xmpp_stanza_attr(iq2, XMPP_STANZA_ATTR_ID), id);
+    xmpp_server_cancel_iq(server, xmpp_stanza_attr(iq2, XMPP_STANZA_ATTR_ID));
+    xmpp_stanza_del(iq2, true);
+
+    /* Only one IQ can wait on an id at a time. */
+    struct xmpp_stanza *dup = new_iq("c@localhost/r", id);
+    assert_false(xmpp_server_send_iq(server, dup, 0, record_reply, &reply));
+    assert_int_equal(HASH_COUNT(server->pending_iqs), 1);
+    xmpp_stanza_del(dup, true);
+
+    /* The reply goes through the server's routing like any other. */
+    struct xmpp_stanza *result = new_reply(id, "c@localhost/r", "localhost");
+    assert_true(xmpp_server_route_stanza(server, result));
+    assert_int_equal(reply.count, 1);
+    assert_string_equal(reply.type, XMPP_STANZA_TYPE_RESULT);
+    assert_true(server->pending_iqs == NULL);
+
+    /* It's only answered once. */
+    assert_false(complete_iq(server, result));
+    assert_int_equal(reply.count, 1);
+
+    xmpp_stanza_del(result, true);
+    xmpp_stanza_del(iq, true);
+    xmpp_server_del(server);
+    del_probes(IQ_JIDS);
+    ev_loop_destroy(loop);
+}
+
+/** Tests the checks on who a reply comes from, and who it goes to. */
+void test_send_iq_reply_jids(void **state) {
+    struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+    struct xmpp_server *server = new_server(loop);
+    struct hits hits = {{0}, 0};
+    struct probe probes[MAX_HITS];
+    add_probes(server, IQ_JIDS, probes, &hits);
+    struct iq_reply reply = {0, ""};
+
+    struct xmpp_stanza *iq = new_iq("c@localhost/r", "full");
+    assert_true(xmpp_server_send_iq(server, iq, 0, record_reply, &reply));
+    xmpp_stanza_del(iq, true);
+
+    /* Someone else can't answer for it, not even another resource. */
+    struct xmpp_stanza *result = new_reply("full", "d@localhost/r",
+                                           "localhost");
+    assert_false(complete_iq(server, result));
+    xmpp_stanza_del(result, true);
+    result = new_reply("full", "c@localhost/s", "localhost");
+    assert_false(complete_iq(server, result));
+    xmpp_stanza_del(result, true);
+
+    /* An IQ with the same id that isn't addressed to the server (like one
+     * sent to a client's bare JID) isn't a reply. */
+    result = new_reply("full", "c@localhost/r", "c@localhost");
+    assert_false(complete_iq(server, result));
+    xmpp_stanza_del(result, true);
+    assert_int_equal(reply.count, 0);
+
+    result = new_reply("full", "c@localhost/r", "localhost");
+    assert_true(complete_iq(server, result));
+    xmpp_stanza_del(result, true);
+    assert_int_equal(reply.count, 1);
+
+    /* An IQ to a bare JID is answered by one of its resources. */
+    iq = new_iq("conference.localhost", "bare");
+    xmpp_stanza_copy_attr(iq, XMPP_STANZA_ATTR_FROM, "a@localhost/r");
+    assert_true(xmpp_server_send_iq(server, iq, 0, record_reply, &reply));
+    xmpp_stanza_del(iq, true);
+    result = new_reply("bare", "other.localhost/x", "a@localhost/r");
+    assert_false(complete_iq(server, result));
+    xmpp_stanza_del(result, true);
+    result = new_reply("bare", "conference.localhost/x", "localhost");
+    assert_false(complete_iq(server, result));
+    xmpp_stanza_del(result, true);
+    result = new_reply("bare", "conference.localhost/x", "a@localhost/r");
+    assert_true(complete_iq(server, result));
+    xmpp_stanza_del(result, true);
+    assert_int_equal(reply.count, 2);
+    assert_true(server->pending_iqs == NULL);
+
+    xmpp_server_del(server);
+    del_probes(IQ_JIDS);
+    ev_loop_destroy(loop);
+}
+
+/** Tests an IQ sent from a module's JID, rather than the server's. */
+void test_send_iq_module_from(void **state) {
+    struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+    struct xmpp_server *server = new_server(loop);
+    struct hits hits = {{0}, 0};
+    struct probe probes[MAX_HITS];
+    add_probes(server, IQ_JIDS, probes, &hits);
+    struct iq_reply reply = {0, ""};
+
+    struct xmpp_stanza *iq = new_iq("c@localhost/r", "muc");
+    xmpp_stanza_copy_attr(iq, XMPP_STANZA_ATTR_FROM, "conference.localhost");
+    assert_true(xmpp_server_send_iq(server, iq, 0, record_reply, &reply));
+    xmpp_stanza_del(iq, true);
+    assert_int_equal(hits.count, 1);
+
+    /* The reply never reaches the module's own route. */
+    hits.count = 0;
+    struct xmpp_stanza *result = new_reply("muc", "c@localhost/r",
+                                           "conference.localhost");
+    assert_true(xmpp_server_route_stanza(server, result));
+    xmpp_stanza_del(result, true);
+    assert_int_equal(reply.count, 1);
+    assert_string_equal(reply.type, XMPP_STANZA_TYPE_RESULT);
+    assert_int_equal(hits.count, 0);
+    assert_true(server->pending_iqs == NULL);
+
+    /* Once it's answered, the same id is routed like anything else. */
+    result = new_reply("muc", "c@localhost/r", "conference.localhost");
+    assert_true(xmpp_server_route_stanza(server, result));
+    xmpp_stanza_del(result, true);
+    assert_int_equal(reply.count, 1);
+    assert_int_equal(hits.count, 1);
+    assert_int_equal(hits.ids[0], 1);
+
+    xmpp_server_del(server);
+    del_probes(IQ_JIDS);
+    ev_loop_destroy(loop);
+}
+
+/** Tests IQs that time out, are cancelled, or can't be sent at all. */
+void test_send_iq_no_reply(void **state) {
+    struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+    struct xmpp_server *server = new_server(loop);
+    struct hits hits = {{0}, 0};
+    struct probe probes[MAX_HITS];
+    add_probes(server, IQ_JIDS, probes, &hits);
+    struct iq_reply reply = {0, "x"};
+
+    struct xmpp_stanza *iq = new_iq("c@localhost/r", "slow");
+    assert_true(xmpp_server_send_iq(server, iq, 5, record_reply, &reply));
+    xmpp_stanza_del(iq, true);
+    unsigned long now = timer_wheel_now(server->timers);
+    timer_wheel_advance(server->timers, now + 4);
+    assert_int_equal(reply.count, 0);
+    timer_wheel_advance(server->timers, now + 5);
+    assert_int_equal(reply.count, 1);
+    assert_string_equal(reply.type, "");
+    assert_true(server->pending_iqs == NULL);
+
+    /* A late reply is ignored. */
+    struct xmpp_stanza *result = new_reply("slow", "c@localhost/r",
+                                           "localhost");
+    assert_false(complete_iq(server, result));
+    xmpp_stanza_del(result, true);
+
+    /* Cancelling stops the timer too. */
+    iq = new_iq("c@localhost/r", "cancelled");
+    assert_true(xmpp_server_send_iq(server, iq, 5, record_reply, &reply));
+    xmpp_stanza_del(iq, true);
+    xmpp_server_cancel_iq(server, "cancelled");
+    assert_true(server->pending_iqs == NULL);
+    timer_wheel_advance(server->timers, now + 20);
+    result = new_reply("cancelled", "c@localhost/r", "localhost");
+    assert_false(complete_iq(server, result));
+    xmpp_stanza_del(result, true);
+    assert_int_equal(reply.count, 1);
+
+    /* Nowhere to send it, so nothing to wait for. */
+    iq = new_iq("nobody@nowhere/r", "lost");
+    assert_false(xmpp_server_send_iq(server, iq, 5, record_reply, &reply));
+    xmpp_stanza_del(iq, true);
+    assert_true(server->pending_iqs == NULL);
+    timer_wheel_advance(server->timers, now + 40);
+    assert_int_equal(reply.count, 1);
+
+    xmpp_server_del(server);
+    del_probes(IQ_JIDS);
+    ev_loop_destroy(loop);
+}
+
+/** Records disconnects, and pokes at the server while it is told. */
+struct watcher {
+    int count;
+    struct xmpp_server *server;
+
+    /** A client to try to disconnect again, and a JID to look up. */
+    struct xmpp_client *other;
+    const struct jid *lookup;
+    bool found;
+};
+
+static void watch_disconnect(struct xmpp_client *client, void *data) {
+    struct watcher *watcher = data;
+    watcher->count++;
+    if (watcher->other != NULL) {
+        xmpp_server_disconnect_client(watcher->other);
+    }
+    if (watcher->lookup != NULL) {
+        watcher->found = xmpp_server_find_client(watcher->server,
+                                                 watcher->lookup) != NULL;
+    }
+}
+
+/** Tests disconnecting several clients, with one listed twice. */
+void test_disconnect_clients(void **state) {
+    struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+    struct xmpp_server *server = new_server(loop);
+
+    static const char *JIDS[] = {
+        "a@localhost/r", "b@localhost/r", "c@localhost/r", "d@localhost/r",
+    };
+    struct xmpp_client *clients[4];
+    int peers[4];
+    struct jid *jids[4];
+    struct watcher watchers[4];
+    for (int i = 0; i < 4; i++) {
+        clients[i] = new_client(server, JIDS[i], &peers[i]);
+        jids[i] = jid_new_from_str(JIDS[i]);
+        watchers[i] = (struct watcher){.server = server};
+        xmpp_server_add_client_listener(clients[i], watch_disconnect,
+                                        &watchers[i]);
+    }
+
+    /* a's listener disconnects b (already on its way out), and looks for c,
+     * whose listener hasn't run yet.  d's looks for itself. */
+    watchers[0].other = clients[1];
+    watchers[0].lookup = jids[2];
+    watchers[3].lookup = jids[3];
+
+    /* Everyone has a flush due, some have reads waiting. */
+    for (int i = 0; i < 4; i++) {
+        assert_true(xmpp_client_send(clients[i], "x", 1));
+    }
+    struct c_client *conns[4];
+    for (int i = 0; i < 4; i++) {
+        conns[i] = xmpp_client_conn(clients[i]);
+    }
+    schedule_read(server, conns[0], true);
+    schedule_read(server, conns[3], true);
+    conns[2]->read_scheduled = true;
+    conns[2]->read_next = server->read_batch;
+    server->read_batch = conns[2];
+
+    struct xmpp_client *batch[] = {clients[0], clients[1], clients[0],
+                                   clients[2]};
+    xmpp_server_disconnect_clients(server, batch, 4);
+
+    /* Each listener ran once, and by then the whole batch was unrouted. */
+    for (int i = 0; i < 3; i++) {
+        assert_int_equal(watchers[i].count, 1);
+    }
+    assert_false(watchers[0].found);
+    assert_int_equal(watchers[3].count, 0);
+    for (int i = 0; i < 3; i++) {
+        assert_true(xmpp_server_find_client(server, jids[i]) == NULL);
+    }
+
+    /* Only d is left on the server's lists. */
+    assert_true(server->flush_list == conns[3]);
+    assert_true(conns[3]->flush_next == NULL);
+    assert_true(server->read_list == conns[3]);
+    assert_true(conns[3]->read_next == NULL);
+    assert_true(server->read_batch == NULL);
+    assert_true(server->clients == conns[3]);
+    assert_int_equal(server->num_clients, 1);
+
+    for (int i = 0; i < 3; i++) {
+        assert_true(peer_closed(peers[i]));
+    }
+    assert_false(peer_closed(peers[3]));
+    assert_true(xmpp_server_find_client(server, jids[3]) == clients[3]);
+
+    /* Nothing left to disconnect. */
+    xmpp_server_disconnect_clients(server, batch, 0);
+
+    xmpp_server_disconnect_client(clients[3]);
+    assert_int_equal(watchers[3].count, 1);
+    assert_false(watchers[3].found);
+    assert_true(server->flush_list == NULL);
+    assert_true(server->read_list == NULL);
+
+    for (int i = 0; i < 4; i++) {
+        close(peers[i]);
+        jid_del(jids[i]);
+    }
+    xmpp_server_del(server);
+    ev_loop_destroy(loop);
+}
+
+/** Tests adding and removing listeners, and who gets told when. */
+void test_client_listeners(void **state) {
+    struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+    struct xmpp_server *server = new_server(loop);
+
+    int peers[3];
+    struct xmpp_client *a = new_client(server, "a@localhost/r", &peers[0]);
+    struct xmpp_client *b = new_client(server, "b@localhost/r", &peers[1]);
+    struct xmpp_client *c = new_client(server, "c@localhost/r", &peers[2]);
+    struct watcher watchers[4];
+    for (int i = 0; i < 4; i++) {
+        watchers[i] = (struct watcher){.server = server};
+    }
+
+    /* The same callback and data only count once. */
+    xmpp_server_add_client_listener(a, watch_disconnect, &watchers[0]);
+    xmpp_server_add_client_listener(a, watch_disconnect, &watchers[0]);
+    xmpp_server_add_client_listener(a, watch_disconnect, &watchers[1]);
+    xmpp_server_del_client_listener(a, watch_disconnect, &watchers[1]);
+    xmpp_server_del_client_listener(a, watch_disconnect, &watchers[1]);
+    xmpp_server_add_client_listener(b, watch_disconnect, &watchers[2]);
+    xmpp_server_add_client_listener(c, watch_disconnect, &watchers[3]);
+
+    /* Clients that time out are disconnected together, once the timers are
+     * done. */
+    server->idle_timeout = 10;
+    struct xmpp_client *idle[] = {a, b};
+    for (int i = 0; i < 2; i++) {
+        struct c_client *conn = xmpp_client_conn(idle[i]);
+        conn->last_read = ev_now(loop) - 20;
+        check_client(NULL, conn);
+        assert_true(conn->reap_scheduled);
+    }
+    assert_int_equal(watchers[0].count, 0);
+    assert_false(peer_closed(peers[0]));
+
+    start_timers(server);
+    advance_timers(loop, &server->timers_tick, 0);
+    assert_true(server->reap_list == NULL);
+    assert_int_equal(server->stats.idle_reaped, 2);
+    assert_int_equal(watchers[0].count, 1);
+    assert_int_equal(watchers[1].count, 0);
+    assert_int_equal(watchers[2].count, 1);
+    assert_true(peer_closed(peers[0]));
+    assert_true(peer_closed(peers[1]));
+
+    /* Whoever is left is disconnected along with the server. */
+    assert_int_equal(watchers[3].count, 0);
+    xmpp_server_del(server);
+    assert_int_equal(watchers[3].count, 1);
+    assert_true(peer_closed(peers[2]));
+
+    for (int i = 0; i < 3; i++) {
+        close(peers[i]);
+    }
+    ev_loop_destroy(loop);
+}
+
+/** Tests sending one stanza to local clients and to a component. */
+void test_route_stanza_multi(void **state) {
+    struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+    struct xmpp_server *server = new_server(loop);
+    struct hits hits = {{0}, 0};
+    struct probe probes[MAX_HITS];
+    add_probes(server, IQ_JIDS, probes, &hits);
+
+    int peers[2];
+    struct xmpp_client *a = new_client(server, "a@localhost/r", &peers[0]);
+    struct xmpp_client *b = new_client(server, "b@localhost/it's", &peers[1]);
+    const struct jid *to[] = {
+        xmpp_client_jid(a),
+        PROBE_JIDS[1],
+        xmpp_client_jid(b),
+    };
+
+    /* A stanza with no "to" still has none afterwards. */
+    struct xmpp_stanza *message = xmpp_stanza_new("message", (const char*[]){
+            XMPP_STANZA_ATTR_FROM, "room@conference.localhost/n",
+            NULL});
+    assert_true(xmpp_server_route_stanza_multi(server, message, to, 3));
+    assert_true(xmpp_stanza_attr(message, XMPP_STANZA_ATTR_TO) == NULL);
+    assert_int_equal(hits.count, 1);
+    assert_int_equal(hits.ids[0], 1);
+
+    char buf[512];
+    read_peer(peers[0], buf, sizeof(buf));
+    assert_string_equal(buf, "<message from='room@conference.localhost/n'"
+                             " to='a@localhost/r'/>");
+    read_peer(peers[1], buf, sizeof(buf));
+    assert_string_equal(buf, "<message from='room@conference.localhost/n'"
+                             " to=\"b@localhost/it's\"/>");
+
+    /* One that had a "to" gets it back. */
+    xmpp_stanza_copy_attr(message, XMPP_STANZA_ATTR_TO,
+                          "room@conference.localhost");
+    hits.count = 0;
+    assert_true(xmpp_server_route_stanza_multi(server, message, to, 3));
+    assert_string_equal(xmpp_stanza_attr(message, XMPP_STANZA_ATTR_TO),
+                        "room@conference.localhost");
+    assert_int_equal(hits.count, 1);
+    read_peer(peers[0], buf, sizeof(buf));
+    assert_string_equal(buf, "<message from='room@conference.localhost/n'"
+                             " to='a@localhost/r'/>");
+
+    /* Recipients nobody is routing for aren't handled. */
+    struct jid *nobody = jid_new_from_str("nobody@nowhere/r");
+    const struct jid *lost[] = {xmpp_client_jid(a), nobody};
+    assert_false(xmpp_server_route_stanza_multi(server, message, lost, 2));
+    assert_string_equal(xmpp_stanza_attr(message, XMPP_STANZA_ATTR_TO),
+                        "room@conference.localhost");
+    jid_del(nobody);
+
+    xmpp_stanza_del(message, true);
+    close(peers[0]);
+    close(peers[1]);
+    xmpp_server_del(server);
+    del_probes(IQ_JIDS);
+    ev_loop_destroy(loop);
+}
+
+/** Tests that a route watching every JID doesn't stop the stanza from being
+ * serialized just once for all the local clients. */
+void test_route_stanza_multi_wildcard(void **state) {
+    struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+    struct xmpp_server *server = new_server(loop);
+    struct hits hits = {{0}, 0};
+    struct probe probes[MAX_HITS];
+    const char *wildcard[] = {"*@*/*", NULL};
+    add_probes(server, wildcard, probes, &hits);
+
+    int peers[2];
+    struct xmpp_client *a = new_client(server, "a@localhost/r", &peers[0]);
+    struct xmpp_client *b = new_client(server, "b@localhost/r", &peers[1]);
+    const struct jid *to[] = {xmpp_client_jid(a), xmpp_client_jid(b)};
+
+    struct xmpp_stanza *message = xmpp_stanza_new("message", (const char*[]){
+            XMPP_STANZA_ATTR_FROM, "room@conference.localhost/n",
+            NULL});
+    iov_builds = 0;
+    assert_true(xmpp_server_route_stanza_multi(server, message, to, 2));
+    assert_int_equal(iov_builds, 1);
+    assert_true(xmpp_stanza_attr(message, XMPP_STANZA_ATTR_TO) == NULL);
+
+    /* The wildcard route still sees each of them. */
+    assert_int_equal(hits.count, 2);
+
+    char buf[512];
+    read_peer(peers[0], buf, sizeof(buf));
+    assert_string_equal(buf, "<message from='room@conference.localhost/n'"
+                             " to='a@localhost/r'/>");
+    read_peer(peers[1], buf, sizeof(buf));
+    assert_string_equal(buf, "<message from='room@conference.localhost/n'"
+                             " to='b@localhost/r'/>");
+
+    xmpp_stanza_del(message, true);
+    close(peers[0]);
+    close(peers[1]);
+    xmpp_server_del(server);
+    del_probes(wildcard);
+    ev_loop_destroy(loop);
+}
+
+int main(void) {
+    const UnitTest tests[] = {
+        unit_test(test_route_order),
+        unit_test(test_route_removed_while_routing),
+        unit_test(test_send_iq),
+        unit_test(test_send_iq_reply_jids),
+        unit_test(test_send_iq_module_from),
+        unit_test(test_send_iq_no_reply),
+        unit_test(test_disconnect_clients),
+        unit_test(test_client_listeners),
+        unit_test(test_route_stanza_multi),
+        unit_test(test_route_stanza_multi_wildcard),
+    };
+    return run_tests(tests);
+}
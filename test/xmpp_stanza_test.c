@@ -55,6 +55,28 @@ void test_name3(void **state) {
     xmpp_stanza_del(a, true);
 }
 
+/** Tests that known names and URIs are interned, and the stanza's kind. */
+void test_atoms(void **state) {
+    struct xmpp_stanza *a = xmpp_stanza_new("jabber:client iq", (const char*[]){
+            "type", "get", "bogus", "x", NULL});
+    assert_int_equal(xmpp_stanza_name_atom(a), ATOM_IQ);
+    assert_int_equal(xmpp_stanza_uri_atom(a), ATOM_NS_CLIENT);
+    assert_int_equal(xmpp_stanza_kind(a), XMPP_STANZA_KIND_IQ);
+    assert_true(xmpp_stanza_name(a) == atom_str(ATOM_IQ));
+    assert_string_equal(xmpp_stanza_attr(a, "type"), "get");
+    assert_string_equal(xmpp_stanza_attr(a, "bogus"), "x");
+
+    /* Renaming it makes it something else, and the old name isn't freed. */
+    xmpp_stanza_copy_name(a, "frob");
+    assert_int_equal(xmpp_stanza_name_atom(a), ATOM_NONE);
+    assert_int_equal(xmpp_stanza_kind(a), XMPP_STANZA_KIND_OTHER);
+    xmpp_stanza_copy_name(a, "message");
+    assert_int_equal(xmpp_stanza_kind(a), XMPP_STANZA_KIND_MESSAGE);
+    xmpp_stanza_copy_uri(a, "uri");
+    assert_int_equal(xmpp_stanza_uri_atom(a), ATOM_NONE);
+    xmpp_stanza_del(a, true);
+}
+
 /** Tests getting the namespace uri of a stanza. */
 void test_uri1(void **state) {
     struct xmpp_stanza *a = xmpp_stanza_new("message", NULL);
@@ -306,6 +328,44 @@ void test_set_ns_attr5(void **state) {
     xmpp_stanza_del(a, true);
 }
 
+/** Tests a stanza with enough attributes to be indexed, and removing some. */
+void test_many_attrs(void **state) {
+    struct xmpp_stanza *a = xmpp_stanza_new("message", NULL);
+    char name[16];
+    for (int i = 0; i < 40; i++) {
+        snprintf(name, sizeof(name), "a%d", i);
+        xmpp_stanza_copy_attr(a, name, name);
+    }
+    xmpp_stanza_copy_ns_attr(a, "a1", "uri", "p", "ns");
+    xmpp_stanza_copy_attr(a, "to", "b@localhost");
+
+    for (int i = 0; i < 40; i += 2) {
+        snprintf(name, sizeof(name), "a%d", i);
+        xmpp_stanza_set_attr(a, name, NULL);
+    }
+    for (int i = 0; i < 40; i++) {
+        snprintf(name, sizeof(name), "a%d", i);
+        if (i % 2 == 0) {
+            assert_true(xmpp_stanza_attr(a, name) == NULL);
+        } else {
+            assert_string_equal(xmpp_stanza_attr(a, name), name);
+        }
+    }
+    assert_string_equal(xmpp_stanza_ns_attr(a, "a1", "uri"), "ns");
+    assert_string_equal(xmpp_stanza_attr(a, "uri a1"), "ns");
+    assert_string_equal(xmpp_stanza_attr(a, "to"), "b@localhost");
+
+    /* Down to a few, the rest still in order. */
+    for (int i = 1; i < 40; i += 2) {
+        snprintf(name, sizeof(name), "a%d", i);
+        xmpp_stanza_set_attr(a, name, NULL);
+    }
+    assert_true(xmpp_stanza_attr(a, "a1") == NULL);
+    assert_string_equal(xmpp_stanza_ns_attr(a, "a1", "uri"), "ns");
+    assert_string_equal(xmpp_stanza_attr(a, "to"), "b@localhost");
+    xmpp_stanza_del(a, true);
+}
+
 /** Tests copying an attribute with a namespace on a stanza. */
 void test_copy_ns_attr1(void **state) {
     struct xmpp_stanza *a = xmpp_stanza_new("message", NULL);
@@ -617,6 +677,146 @@ void test_string_encode1(void **state) {
     xmpp_stanza_del(parent, true);
 }
 
+/** Tests encoding character references in data. */
+void test_string_encode2(void **state) {
+    struct xmpp_stanza *a = xmpp_stanza_new("a", NULL);
+    static const char *DATA = "hello\nworld";
+    xmpp_stanza_append_data(a, DATA, strlen(DATA));
+
+    static const char *XML = "<a>hello&#10;world</a>";
+
+    size_t len = 0;
+    char *str = xmpp_stanza_string(a, &len, true);
+    assert_int_equal(len, strlen(XML));
+    assert_string_equal(str, XML);
+
+    free(str);
+    xmpp_stanza_del(a, true);
+}
+
+/** Joins up the fragments of an iovec list into a string. */
+static char* join_iov(struct xmpp_stanza_iov *iov) {
+    const struct iovec *vec = xmpp_stanza_iov_vec(iov);
+    char *str = calloc(xmpp_stanza_iov_length(iov) + 1, sizeof(*str));
+    size_t len = 0;
+    for (int i = 0; i < xmpp_stanza_iov_count(iov); i++) {
+        memcpy(str + len, vec[i].iov_base, vec[i].iov_len);
+        len += vec[i].iov_len;
+    }
+    assert_int_equal(len, xmpp_stanza_iov_length(iov));
+    return str;
+}
+
+/** Tests that an iovec list matches the string version of a stanza. */
+void test_iov1(void **state) {
+    struct xmpp_stanza *parent = xmpp_stanza_new("uri parent p", (const char*[]){
+            "foo", "bar",
+            "bin", "a<b",
+            NULL,
+    });
+    struct xmpp_stanza *child = xmpp_stanza_new("child", (const char*[]){
+            "bin", "baz'",
+            NULL,
+    });
+    xmpp_stanza_append_child(parent, child);
+    static const char *DATA = "hello & world";
+    xmpp_stanza_append_data(parent, DATA, strlen(DATA));
+    xmpp_stanza_append_data(child, DATA, strlen(DATA) - 6);
+
+    struct xmpp_stanza_iov *iov = xmpp_stanza_iov_new();
+    for (int encode = 0; encode < 2; encode++) {
+        xmpp_stanza_iov_build(iov, parent, encode);
+        char *joined = join_iov(iov);
+        char *str = xmpp_stanza_string(parent, NULL, encode);
+        assert_string_equal(joined, str);
+        free(joined);
+        free(str);
+    }
+    xmpp_stanza_iov_del(iov);
+    xmpp_stanza_del(parent, true);
+}
+
+/** Tests that values with nothing to escape are not copied. */
+void test_iov2(void **state) {
+    struct xmpp_stanza *a = xmpp_stanza_new("a", (const char*[]){
+            "foo", "bar",
+            NULL,
+    });
+    static const char *DATA = "hello world";
+    xmpp_stanza_append_data(a, DATA, strlen(DATA));
+
+    struct xmpp_stanza_iov *iov = xmpp_stanza_iov_new();
+    xmpp_stanza_iov_build(iov, a, true);
+
+    const struct iovec *vec = xmpp_stanza_iov_vec(iov);
+    bool found_attr = false;
+    bool found_data = false;
+    for (int i = 0; i < xmpp_stanza_iov_count(iov); i++) {
+        found_attr |= vec[i].iov_base == xmpp_stanza_attr(a, "foo");
+        found_data |= vec[i].iov_base == xmpp_stanza_data(a);
+    }
+    assert_true(found_attr);
+    assert_true(found_data);
+
+    /* Rebuilding drops the old contents. */
+    xmpp_stanza_iov_build(iov, a, true);
+    char *joined = join_iov(iov);
+    assert_string_equal(joined, "<a foo='bar'>hello world</a>");
+
+    free(joined);
+    xmpp_stanza_iov_del(iov);
+    xmpp_stanza_del(a, true);
+}
+
+/** Tests patching the "to" of a built list for another recipient. */
+void test_iov_set_to(void **state) {
+    struct xmpp_stanza *a = xmpp_stanza_new("a", (const char*[]){
+            "to", "x@y/z",
+            "from", "f",
+            NULL,
+    });
+    struct xmpp_stanza *b = xmpp_stanza_new("b", (const char*[]){
+            "to", "child",
+            NULL,
+    });
+    xmpp_stanza_append_child(a, b);
+
+    struct xmpp_stanza_iov *iov = xmpp_stanza_iov_new();
+    xmpp_stanza_iov_build(iov, a, true);
+
+    assert_true(xmpp_stanza_iov_set_to(iov, "u@v/w"));
+    char *joined = join_iov(iov);
+    assert_string_equal(joined,
+                        "<a to='u@v/w' from='f'><b to='child'/></a>");
+    free(joined);
+
+    assert_true(xmpp_stanza_iov_set_to(iov, "it's <me>"));
+    joined = join_iov(iov);
+    assert_string_equal(joined, "<a to=\"it's &lt;me&gt;\" from='f'>"
+                                "<b to='child'/></a>");
+    free(joined);
+    assert_false(xmpp_stanza_iov_set_to(iov, ""));
+
+    /* Only the top-level "to" is patched. */
+    xmpp_stanza_iov_build(iov, b, true);
+    assert_true(xmpp_stanza_iov_set_to(iov, "q"));
+    joined = join_iov(iov);
+    assert_string_equal(joined, "<b to='q'/>");
+    free(joined);
+
+    struct xmpp_stanza *c = xmpp_stanza_new("c", (const char*[]){NULL});
+    xmpp_stanza_append_child(c, xmpp_stanza_new("b", (const char*[]){
+            "to", "child",
+            NULL,
+    }));
+    xmpp_stanza_iov_build(iov, c, true);
+    assert_false(xmpp_stanza_iov_set_to(iov, "q"));
+
+    xmpp_stanza_iov_del(iov);
+    xmpp_stanza_del(a, true);
+    xmpp_stanza_del(c, true);
+}
+
 int main(int argc, char *argv[]) {
     const UnitTest tests[] = {
         unit_test(test_name1),
@@ -648,6 +848,7 @@ int main(int argc, char *argv[]) {
         unit_test(test_set_ns_attr3),
         unit_test(test_set_ns_attr4),
         unit_test(test_set_ns_attr5),
+        unit_test(test_many_attrs),
         unit_test(test_copy_ns_attr1),
         unit_test(test_copy_ns_attr2),
         unit_test(test_append_data1),
@@ -666,6 +867,11 @@ int main(int argc, char *argv[]) {
         unit_test(test_string6),
         unit_test(test_string7),
         unit_test(test_string_encode1),
+        unit_test(test_string_encode2),
+        unit_test(test_iov1),
+        unit_test(test_iov2),
+        unit_test(test_iov_set_to),
+        unit_test(test_atoms),
     };
     return run_tests(tests);
 }